@@ -0,0 +1,105 @@
+//! Times decoding a batch in the wire format against the previous layout
+//! (13-byte header per record, payload copied into its own Vec, clock
+//! delta as text).
+//!
+//!     cargo run --release -p consensus --example wire_decode [records] [rounds]
+
+use std::hint::black_box;
+use std::time::Instant;
+
+use consensus::wire::{self, Record, Records};
+
+fn legacy_batch(records: usize, data: &[u8]) -> Vec<u8> {
+    let mut out = Vec::new();
+    let mut push = |out: &mut Vec<u8>, msg_type: u8, pid: u64, payload: &[u8]| {
+        out.push(msg_type);
+        out.extend_from_slice(&pid.to_le_bytes());
+        out.extend_from_slice(&(payload.len() as u32).to_le_bytes());
+        out.extend_from_slice(payload);
+    };
+    for i in 0..records {
+        let mut payload = (8080u16).to_le_bytes().to_vec();
+        payload.extend_from_slice(data);
+        push(&mut out, 3, i as u64 % 16 + 1, &payload);
+    }
+    push(&mut out, 0, 0, b"clock:15000000");
+    out
+}
+
+fn wire_batch(records: usize, data: &[u8]) -> Vec<u8> {
+    let mut out = Vec::new();
+    wire::start_batch(&mut out);
+    for i in 0..records {
+        Record::NetworkIn { pid: i as u64 % 16 + 1, port: 8080, data }.encode(&mut out);
+    }
+    Record::Clock { delta: 15_000_000 }.encode(&mut out);
+    out
+}
+
+/// The old runtime loop: read the header, copy the payload out, parse.
+fn decode_legacy(batch: &[u8]) -> u64 {
+    let mut pos = 0;
+    let mut sum = 0u64;
+    while pos + 13 <= batch.len() {
+        let msg_type = batch[pos];
+        let pid = u64::from_le_bytes(batch[pos + 1..pos + 9].try_into().unwrap());
+        let len = u32::from_le_bytes(batch[pos + 9..pos + 13].try_into().unwrap()) as usize;
+        pos += 13;
+        let payload = batch[pos..pos + len].to_vec();
+        pos += len;
+        match msg_type {
+            0 => {
+                let text = String::from_utf8_lossy(&payload);
+                sum += text.strip_prefix("clock:").and_then(|d| d.parse::<u64>().ok()).unwrap_or(0);
+            }
+            3 => {
+                let port = u16::from_le_bytes([payload[0], payload[1]]);
+                sum += pid + port as u64 + payload[2..].len() as u64;
+            }
+            _ => {}
+        }
+    }
+    sum
+}
+
+fn decode_wire(batch: &[u8]) -> u64 {
+    let mut sum = 0u64;
+    for record in Records::new(batch).unwrap() {
+        match record.unwrap() {
+            Record::Clock { delta } => sum += delta,
+            Record::NetworkIn { pid, port, data } => sum += pid + port as u64 + data.len() as u64,
+            _ => {}
+        }
+    }
+    sum
+}
+
+fn time(name: &str, batch: &[u8], rounds: usize, decode: fn(&[u8]) -> u64) -> u64 {
+    let start = Instant::now();
+    let mut sum = 0;
+    for _ in 0..rounds {
+        sum = decode(black_box(batch));
+    }
+    let elapsed = start.elapsed();
+    println!(
+        "{:<7} {:>8} bytes/batch  {:>10.0} ns/batch",
+        name,
+        batch.len(),
+        elapsed.as_nanos() as f64 / rounds as f64
+    );
+    sum
+}
+
+fn main() {
+    let mut args = std::env::args().skip(1);
+    let records: usize = args.next().and_then(|a| a.parse().ok()).unwrap_or(256);
+    let rounds: usize = args.next().and_then(|a| a.parse().ok()).unwrap_or(10_000);
+    let data = vec![b'x'; 64];
+
+    let legacy = legacy_batch(records, &data);
+    let wire = wire_batch(records, &data);
+    println!("{} NetworkIn records of {} bytes plus a clock record, {} rounds", records, data.len(), rounds);
+    let a = time("legacy", &legacy, rounds, decode_legacy);
+    let b = time("wire", &wire, rounds, decode_wire);
+    assert_eq!(a, b, "both decoders must see the same records");
+}
@@ -0,0 +1,134 @@
+//! Ahead-of-time compilation of the modules in Init records.
+//!
+//! With `REPLICODE_AOT_TARGET` set, and consensus built with the `aot`
+//! feature, each module is precompiled once here and its artifact travels
+//! in the Init payload ahead of the wasm:
+//!
+//! ```text
+//! aot:<sha256 of the wasm, hex>:<artifact length>\0<artifact><wasm>
+//! ```
+//!
+//! Runtimes deserialize the artifact instead of compiling, which matters
+//! most when a replica replays history full of Inits. The wasm stays in the
+//! record so a runtime whose engine does not accept the artifact still
+//! compiles the same module, and so the hash can be checked against it.
+
+use std::sync::OnceLock;
+
+use log::info;
+
+use crate::batch_buffer::env_parse;
+
+/// What to precompile Init modules for. The engine settings mirror the
+/// runtime's (see its `REPLICODE_EXECUTOR` and `REPLICODE_FUEL_QUANTUM`),
+/// read from the same variables, since wasmtime only loads artifacts built
+/// with matching ones.
+#[derive(Debug, Clone, Default)]
+#[cfg_attr(not(feature = "aot"), allow(dead_code))]
+pub struct AotPolicy {
+    /// Target triple to compile for, `host` for this machine's; `None`
+    /// sends plain wasm.
+    pub target: Option<String>,
+    /// Runtimes use the pooled executor, which runs guests asynchronously.
+    pub async_support: bool,
+    /// Runtimes count fuel to preempt pooled guests.
+    pub consume_fuel: bool,
+}
+
+impl AotPolicy {
+    pub fn from_env() -> Self {
+        let pooled = std::env::var("REPLICODE_EXECUTOR").as_deref() == Ok("pooled");
+        let fuel_quantum: u64 = env_parse("REPLICODE_FUEL_QUANTUM").unwrap_or(10_000_000);
+        let policy = Self {
+            target: std::env::var("REPLICODE_AOT_TARGET").ok().filter(|v| !v.is_empty()),
+            async_support: pooled,
+            consume_fuel: pooled && fuel_quantum > 0,
+        };
+        info!("AOT policy: {:?}", policy);
+        policy
+    }
+}
+
+fn policy() -> &'static AotPolicy {
+    static POLICY: OnceLock<AotPolicy> = OnceLock::new();
+    POLICY.get_or_init(AotPolicy::from_env)
+}
+
+/// Appends the `aot:` prefix and artifact for `wasm_bytes` to an Init
+/// payload, if modules are being precompiled. The wasm itself follows.
+#[cfg(feature = "aot")]
+pub fn push_prefix(payload: &mut Vec<u8>, wasm_bytes: &[u8]) {
+    use std::collections::HashMap;
+    use std::fmt::Write;
+    use std::sync::{Arc, Mutex};
+
+    use log::error;
+    use sha2::{Digest, Sha256};
+    use wasmtime::{Config, Engine};
+
+    static ENGINE: OnceLock<Option<Engine>> = OnceLock::new();
+    static ARTIFACTS: OnceLock<Mutex<HashMap<[u8; 32], Arc<Vec<u8>>>>> = OnceLock::new();
+
+    let engine = ENGINE.get_or_init(|| {
+        let policy = policy();
+        let target = policy.target.as_deref()?;
+        let mut config = Config::new();
+        if target != "host" {
+            if let Err(e) = config.target(target) {
+                error!("Unsupported REPLICODE_AOT_TARGET '{}', sending plain wasm: {}", target, e);
+                return None;
+            }
+        }
+        config.async_support(policy.async_support);
+        config.consume_fuel(policy.consume_fuel);
+        match Engine::new(&config) {
+            Ok(engine) => Some(engine),
+            Err(e) => {
+                error!("Failed to create the engine for AOT compilation, sending plain wasm: {}", e);
+                None
+            }
+        }
+    });
+    let Some(engine) = engine else {
+        return;
+    };
+
+    let hash: [u8; 32] = Sha256::digest(wasm_bytes).into();
+    let artifacts = ARTIFACTS.get_or_init(|| Mutex::new(HashMap::new()));
+    let cached = artifacts.lock().unwrap().get(&hash).cloned();
+    let artifact = match cached {
+        Some(artifact) => artifact,
+        None => match engine.precompile_module(wasm_bytes) {
+            Ok(artifact) => {
+                info!("Precompiled module ({} bytes of wasm, {} of artifact)", wasm_bytes.len(), artifact.len());
+                let artifact = Arc::new(artifact);
+                artifacts.lock().unwrap().insert(hash, artifact.clone());
+                artifact
+            }
+            Err(e) => {
+                // Invalid modules go out as wasm; every runtime rejects them alike.
+                error!("Failed to precompile module, sending plain wasm: {}", e);
+                return;
+            }
+        },
+    };
+
+    let mut prefix = String::from("aot:");
+    for b in hash {
+        let _ = write!(prefix, "{:02x}", b);
+    }
+    let _ = write!(prefix, ":{}", artifact.len());
+    payload.extend(prefix.as_bytes());
+    payload.push(0);
+    payload.extend_from_slice(&artifact);
+}
+
+#[cfg(not(feature = "aot"))]
+pub fn push_prefix(_payload: &mut Vec<u8>, _wasm_bytes: &[u8]) {
+    use log::warn;
+
+    static WARNED: OnceLock<()> = OnceLock::new();
+    if policy().target.is_some() {
+        WARNED.get_or_init(|| warn!("REPLICODE_AOT_TARGET is set but consensus was built without the `aot` feature"));
+    }
+}
@@ -1,6 +1,8 @@
+use std::io;
+use log::error;
 use serde::{Serialize, Deserialize};
 
-#[derive(Debug, Clone, Serialize, Deserialize, PartialEq, Eq)]
+#[derive(Debug, Clone, Copy, Serialize, Deserialize, PartialEq, Eq)]
 pub enum BatchDirection {
     Incoming, // Consensus -> Runtime
     Outgoing, // Runtime -> Consensus
@@ -11,4 +13,141 @@ pub struct Batch {
     pub number: u64,
     pub direction: BatchDirection,
     pub data: Vec<u8>,
-} 
\ No newline at end of file
+    /// `data` is zstd-compressed; see `Batch::compress`.
+    pub compressed: bool,
+}
+
+/// Set in the direction byte of a frame (and history entry) whose payload
+/// is zstd-compressed.
+pub const COMPRESSED_FLAG: u8 = 0x80;
+/// zstd level for batch payloads; low levels keep up with the batch cadence.
+const COMPRESSION_LEVEL: i32 = 3;
+
+impl Batch {
+    pub fn new(number: u64, direction: BatchDirection, data: Vec<u8>) -> Self {
+        Self { number, direction, data, compressed: false }
+    }
+
+    /// Compresses the payload if it is at least `min_bytes` long (0 never
+    /// compresses) and compression saves at least an eighth of it. Small
+    /// clock-only batches and already-compressed data such as JPEGs stay as
+    /// they are. Returns whether the payload was compressed.
+    pub fn compress(&mut self, min_bytes: usize) -> bool {
+        if self.compressed || min_bytes == 0 || self.data.len() < min_bytes {
+            return false;
+        }
+        match zstd::bulk::compress(&self.data, COMPRESSION_LEVEL) {
+            Ok(packed) if packed.len() <= self.data.len() - self.data.len() / 8 => {
+                self.data = packed;
+                self.compressed = true;
+                true
+            }
+            Ok(_) => false,
+            Err(e) => {
+                error!("Failed to compress batch {}: {}", self.number, e);
+                false
+            }
+        }
+    }
+
+    pub fn direction_byte(&self) -> u8 {
+        direction_byte(&self.direction, self.compressed)
+    }
+}
+
+/// The direction byte of a frame: 0 Incoming, 1 Outgoing, plus
+/// `COMPRESSED_FLAG` for a compressed payload.
+pub fn direction_byte(direction: &BatchDirection, compressed: bool) -> u8 {
+    let byte = match direction {
+        BatchDirection::Incoming => 0,
+        BatchDirection::Outgoing => 1,
+    };
+    if compressed { byte | COMPRESSED_FLAG } else { byte }
+}
+
+/// Splits a frame's direction byte into the direction and whether the
+/// payload is compressed.
+pub fn split_direction(byte: u8) -> (u8, bool) {
+    (byte & !COMPRESSED_FLAG, byte & COMPRESSED_FLAG != 0)
+}
+
+/// Restores a payload compressed by `Batch::compress`.
+pub fn decompress(data: &[u8]) -> io::Result<Vec<u8>> {
+    zstd::stream::decode_all(data)
+}
+
+/// Set in the direction byte of an Outgoing frame whose payload starts
+/// with the sending runtime's state digest; see `split_digest`.
+pub const DIGEST_FLAG: u8 = 0x40;
+
+/// Set, with `DIGEST_FLAG`, on an Outgoing frame from a follower: the
+/// payload is only the digest, the records having been left out.
+pub const SUMMARY_FLAG: u8 = 0x20;
+
+/// Prefixes an Outgoing payload with `digest`, the runtime's state digest
+/// after producing the batch.
+pub fn with_digest(digest: u64, records: &[u8]) -> Vec<u8> {
+    let mut payload = Vec::with_capacity(8 + records.len());
+    payload.extend_from_slice(&digest.to_le_bytes());
+    payload.extend_from_slice(records);
+    payload
+}
+
+/// Splits an Outgoing frame's direction byte into the direction and the
+/// state digest at the start of its payload, if it has one. The payload is
+/// left holding only the records.
+pub fn split_digest(byte: u8, payload: &mut Vec<u8>) -> io::Result<(u8, Option<u64>)> {
+    if byte & DIGEST_FLAG == 0 {
+        return Ok((byte, None));
+    }
+    if payload.len() < 8 {
+        return Err(io::Error::new(io::ErrorKind::InvalidData, "frame too short for its digest"));
+    }
+    let digest = u64::from_le_bytes(payload[..8].try_into().unwrap());
+    payload.drain(..8);
+    Ok((byte & !(DIGEST_FLAG | SUMMARY_FLAG), Some(digest)))
+}
+
+/// Whether an Outgoing frame's direction byte marks a digest-only summary.
+pub fn is_summary(byte: u8) -> bool {
+    byte & SUMMARY_FLAG != 0
+}
+
+/// Direction byte of a checkpoint frame. Its batch number is the last
+/// Incoming batch whose effects the checkpoint includes.
+pub const CHECKPOINT_DIRECTION: u8 = 2;
+
+/// Runtime-global state at an Incoming batch boundary: enough for a fresh
+/// runtime to skip every batch up to `batch` and replay only the rest.
+#[derive(Debug, Clone, Copy, Serialize, Deserialize, PartialEq, Eq)]
+pub struct Checkpoint {
+    pub batch: u64,
+    pub clock: u64,
+    pub next_pid: u64,
+    pub outgoing_batch: u64,
+    /// State digest at the boundary, so a resumed runtime keeps reporting
+    /// the same digests as the replicas that replayed everything.
+    pub digest: u64,
+}
+
+/// Direction byte of a control frame, sent by consensus to one runtime
+/// only and never saved to the history.
+pub const CONTROL_DIRECTION: u8 = 3;
+
+/// Direction byte of an acknowledgement frame from a runtime. Its batch
+/// number is the last Incoming batch the runtime applied; its one-byte
+/// payload holds the `ACK_*` flags.
+pub const ACK_DIRECTION: u8 = 4;
+
+/// Set in an acknowledgement when the runtime has Ready processes that
+/// are held until the next batch, so consensus should not back off.
+pub const ACK_READY: u8 = 1;
+
+/// Tells a runtime whether its outgoing batches are the authoritative
+/// copy. A follower sends only digests and keeps its recent batches, so
+/// that on promotion it can resend every one numbered after `resend_after`.
+#[derive(Debug, Clone, Copy, Serialize, Deserialize, PartialEq, Eq)]
+pub struct Control {
+    pub leader: bool,
+    pub resend_after: u64,
+}
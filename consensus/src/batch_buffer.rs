@@ -0,0 +1,311 @@
+use std::sync::{Condvar, Mutex, MutexGuard};
+use std::time::{Duration, Instant};
+use log::{error, info};
+use crate::wire;
+
+/// When the batch sender cuts a batch. A batch is cut as soon as the pending
+/// records reach `max_bytes` or `max_records`, or once the oldest of them has
+/// waited `max_latency`. With nothing pending, clock-only batches start at
+/// `max_latency` apart and back off (doubling) up to `idle_interval_max`.
+/// Cut batches of at least `compress_min_bytes` are compressed (0 disables).
+#[derive(Debug, Clone)]
+pub struct BatchPolicy {
+    pub max_bytes: usize,
+    pub max_records: usize,
+    pub max_latency: Duration,
+    pub idle_interval_max: Duration,
+    pub compress_min_bytes: usize,
+}
+
+impl Default for BatchPolicy {
+    fn default() -> Self {
+        Self {
+            max_bytes: 64 * 1024,
+            max_records: 1024,
+            max_latency: Duration::from_micros(15000),
+            idle_interval_max: Duration::from_millis(250),
+            compress_min_bytes: 16 * 1024,
+        }
+    }
+}
+
+impl BatchPolicy {
+    /// Defaults overridden by `REPLICODE_BATCH_*` environment variables.
+    pub fn from_env() -> Self {
+        let defaults = Self::default();
+        let policy = Self {
+            max_bytes: env_parse("REPLICODE_BATCH_MAX_BYTES").unwrap_or(defaults.max_bytes),
+            max_records: env_parse("REPLICODE_BATCH_MAX_RECORDS").unwrap_or(defaults.max_records),
+            max_latency: env_parse("REPLICODE_BATCH_MAX_LATENCY_US")
+                .map(Duration::from_micros)
+                .unwrap_or(defaults.max_latency),
+            idle_interval_max: env_parse("REPLICODE_BATCH_IDLE_MAX_MS")
+                .map(Duration::from_millis)
+                .unwrap_or(defaults.idle_interval_max),
+            compress_min_bytes: env_parse("REPLICODE_BATCH_COMPRESS_MIN_BYTES")
+                .unwrap_or(defaults.compress_min_bytes),
+        };
+        info!("Batch policy: {:?}", policy);
+        policy
+    }
+
+    /// Wait before the next clock-only batch, after one that waited `previous`.
+    pub fn next_idle_interval(&self, previous: Duration) -> Duration {
+        (previous * 2).min(self.idle_interval_max).max(self.max_latency)
+    }
+}
+
+pub(crate) fn env_parse<T: std::str::FromStr>(name: &str) -> Option<T> {
+    let value = std::env::var(name).ok()?;
+    match value.parse() {
+        Ok(v) => Some(v),
+        Err(_) => {
+            error!("Ignoring invalid {}={}", name, value);
+            None
+        }
+    }
+}
+
+struct Pending {
+    data: Vec<u8>,
+    records: usize,
+    /// When the oldest pending record was added.
+    first_at: Option<Instant>,
+    /// Batches cut so far.
+    cuts: u64,
+    /// A runtime is holding Ready processes until the next batch.
+    hurry: bool,
+}
+
+/// Records waiting for the next Incoming batch.
+pub struct BatchBuffer {
+    pending: Mutex<Pending>,
+    changed: Condvar,
+    policy: BatchPolicy,
+}
+
+/// Appends records under the buffer lock, so records pushed through one
+/// writer always land in the same batch. Wakes the batch sender on drop.
+pub struct BatchWriter<'a> {
+    pending: MutexGuard<'a, Pending>,
+    changed: &'a Condvar,
+}
+
+impl BatchWriter<'_> {
+    pub fn push(&mut self, record: Vec<u8>) {
+        if self.pending.first_at.is_none() {
+            self.pending.first_at = Some(Instant::now());
+        }
+        if self.pending.data.is_empty() {
+            wire::start_batch(&mut self.pending.data);
+        }
+        self.pending.data.extend(record);
+        self.pending.records += 1;
+    }
+
+    /// Batches cut so far. Everything pushed while this writer is held
+    /// lands in the same batch, the one cut next, so state kept per batch
+    /// can be keyed by this count.
+    pub fn cuts(&self) -> u64 {
+        self.pending.cuts
+    }
+}
+
+impl Drop for BatchWriter<'_> {
+    fn drop(&mut self) {
+        self.changed.notify_one();
+    }
+}
+
+/// A cut batch: the pending records, how many there were, and when the
+/// first of them arrived.
+pub struct CutBatch {
+    pub data: Vec<u8>,
+    pub records: usize,
+    pub first_at: Option<Instant>,
+    /// A runtime asked for this batch; the sender should not back off.
+    pub hurried: bool,
+}
+
+impl BatchBuffer {
+    pub fn new(policy: BatchPolicy) -> Self {
+        Self {
+            pending: Mutex::new(Pending { data: Vec::new(), records: 0, first_at: None, cuts: 0, hurry: false }),
+            changed: Condvar::new(),
+            policy,
+        }
+    }
+
+    pub fn policy(&self) -> &BatchPolicy {
+        &self.policy
+    }
+
+    pub fn writer(&self) -> BatchWriter<'_> {
+        BatchWriter {
+            pending: self.pending.lock().unwrap(),
+            changed: &self.changed,
+        }
+    }
+
+    /// Asks for the next batch within `max_latency` even if nothing is
+    /// pending. Runtimes give Ready processes a fixed number of slices per
+    /// batch, so while they have any, idle backoff only makes them wait.
+    pub fn hurry(&self) {
+        self.pending.lock().unwrap().hurry = true;
+        self.changed.notify_one();
+    }
+
+    /// Blocks until the policy says to cut a batch and takes the pending records.
+    /// With nothing pending the batch is cut after `idle_interval`, or after
+    /// `max_latency` once `hurry` was called.
+    pub fn next_batch(&self, idle_interval: Duration) -> CutBatch {
+        let started = Instant::now();
+        let mut pending = self.pending.lock().unwrap();
+        loop {
+            if pending.data.len() >= self.policy.max_bytes || pending.records >= self.policy.max_records {
+                break;
+            }
+            let deadline = match pending.first_at {
+                Some(first_at) => first_at + self.policy.max_latency,
+                None if pending.hurry => started + idle_interval.min(self.policy.max_latency),
+                None => started + idle_interval,
+            };
+            let now = Instant::now();
+            if now >= deadline {
+                break;
+            }
+            pending = self.changed.wait_timeout(pending, deadline - now).unwrap().0;
+        }
+        pending.cuts += 1;
+        CutBatch {
+            data: std::mem::take(&mut pending.data),
+            records: std::mem::take(&mut pending.records),
+            first_at: pending.first_at.take(),
+            hurried: std::mem::take(&mut pending.hurry),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn policy(max_bytes: usize, max_records: usize, max_latency_ms: u64) -> BatchPolicy {
+        BatchPolicy {
+            max_bytes,
+            max_records,
+            max_latency: Duration::from_millis(max_latency_ms),
+            idle_interval_max: Duration::from_millis(250),
+            compress_min_bytes: 0,
+        }
+    }
+
+    const LONG: Duration = Duration::from_secs(60);
+
+    #[test]
+    fn cuts_at_max_records() {
+        let buffer = BatchBuffer::new(policy(usize::MAX, 3, 60_000));
+        {
+            let mut writer = buffer.writer();
+            for _ in 0..3 {
+                writer.push(vec![0, 1]);
+            }
+        }
+        let started = Instant::now();
+        let batch = buffer.next_batch(LONG);
+        assert!(started.elapsed() < Duration::from_secs(5));
+        assert_eq!(batch.records, 3);
+        assert_eq!(batch.data, [wire::WIRE_VERSION, 0, 1, 0, 1, 0, 1]);
+        assert!(batch.first_at.is_some());
+    }
+
+    #[test]
+    fn cuts_at_max_bytes() {
+        let buffer = BatchBuffer::new(policy(100, usize::MAX, 60_000));
+        buffer.writer().push(vec![0; 99]);
+        let batch = buffer.next_batch(LONG);
+        assert_eq!(batch.records, 1);
+        assert_eq!(batch.data.len(), 100);
+    }
+
+    #[test]
+    fn cuts_at_max_latency() {
+        let buffer = BatchBuffer::new(policy(usize::MAX, usize::MAX, 30));
+        buffer.writer().push(vec![0, 5]);
+        let batch = buffer.next_batch(LONG);
+        let waited = batch.first_at.unwrap().elapsed();
+        assert!(waited >= Duration::from_millis(30), "cut after {:?}", waited);
+        assert!(waited < Duration::from_secs(5), "cut after {:?}", waited);
+        assert_eq!(batch.records, 1);
+    }
+
+    #[test]
+    fn cuts_empty_batches_after_the_idle_interval() {
+        let buffer = BatchBuffer::new(policy(usize::MAX, usize::MAX, 30));
+        let started = Instant::now();
+        let batch = buffer.next_batch(Duration::from_millis(20));
+        assert!(started.elapsed() >= Duration::from_millis(20));
+        assert_eq!(batch.records, 0);
+        assert!(batch.data.is_empty());
+        assert!(batch.first_at.is_none());
+    }
+
+    #[test]
+    fn hurries_idle_batches_for_ready_runtimes() {
+        let buffer = BatchBuffer::new(policy(usize::MAX, usize::MAX, 10));
+        buffer.hurry();
+        let started = Instant::now();
+        let batch = buffer.next_batch(LONG);
+        assert!(started.elapsed() < Duration::from_secs(5));
+        assert!(batch.hurried);
+        assert_eq!(batch.records, 0);
+        // The request is used up by the cut.
+        let batch = buffer.next_batch(Duration::from_millis(20));
+        assert!(!batch.hurried);
+    }
+
+    #[test]
+    fn counts_cuts_for_writers() {
+        let buffer = BatchBuffer::new(policy(usize::MAX, 1, 60_000));
+        assert_eq!(buffer.writer().cuts(), 0);
+        buffer.writer().push(vec![0, 1]);
+        buffer.next_batch(LONG);
+        buffer.next_batch(Duration::ZERO);
+        let mut writer = buffer.writer();
+        assert_eq!(writer.cuts(), 2);
+        writer.push(vec![0, 2]);
+        assert_eq!(writer.cuts(), 2);
+    }
+
+    #[test]
+    fn wakes_on_a_write_that_reaches_a_limit() {
+        let buffer = std::sync::Arc::new(BatchBuffer::new(policy(usize::MAX, 2, 60_000)));
+        let writer = {
+            let buffer = buffer.clone();
+            std::thread::spawn(move || {
+                std::thread::sleep(Duration::from_millis(20));
+                let mut writer = buffer.writer();
+                writer.push(vec![0, 1]);
+                writer.push(vec![0, 2]);
+            })
+        };
+        let started = Instant::now();
+        let batch = buffer.next_batch(LONG);
+        writer.join().unwrap();
+        assert!(started.elapsed() < Duration::from_secs(5));
+        assert_eq!(batch.records, 2);
+    }
+
+    #[test]
+    fn backs_off_between_idle_batches() {
+        let policy = policy(usize::MAX, usize::MAX, 15);
+        let mut interval = policy.max_latency;
+        let mut seen = Vec::new();
+        for _ in 0..6 {
+            interval = policy.next_idle_interval(interval);
+            seen.push(interval.as_millis());
+        }
+        assert_eq!(seen, [30, 60, 120, 240, 250, 250]);
+        assert_eq!(policy.next_idle_interval(Duration::ZERO), policy.max_latency);
+    }
+}
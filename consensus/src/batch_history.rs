@@ -1,125 +1,1443 @@
-use std::fs::{File, OpenOptions};
+use std::fs::{self, File, OpenOptions};
 use std::io::{self, Write, Read, Seek, SeekFrom};
-use std::path::Path;
-use std::sync::{Arc, Mutex};
-use log::{error, debug};
-use crate::batch::{Batch, BatchDirection};
+use std::path::{Path, PathBuf};
+use std::sync::mpsc::{self, Receiver, RecvTimeoutError, Sender};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Condvar, Mutex, RwLock, Weak};
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, Instant};
+use log::{error, debug, info, warn};
+use crate::batch::{direction_byte, split_direction, Batch, BatchDirection};
+use crate::batch_buffer::env_parse;
+use crate::wire::{self, Record, Records};
 
+/// Size of the batch header in a segment file: number, direction, data length.
+const BATCH_HEADER_LEN: u64 = 8 + 1 + 8;
+/// Size of one entry in a segment's index file.
+const INDEX_ENTRY_LEN: usize = 8 + 8 + 8 + 1 + 8;
+/// Index entries handed to a reader per index lock acquisition.
+const STREAM_CHUNK: usize = 256;
+/// Direction byte of a clock run in a segment file. Never sent on the wire:
+/// readers expand a run back into the batches it replaced.
+const CLOCK_RUN: u8 = 0x40;
+const MANIFEST: &str = "manifest";
+
+/// Location of one batch, or of a run of clock-only batches, in a segment.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct IndexEntry {
+    /// Number of the batch, or of the first batch of a run.
+    pub number: u64,
+    /// Offset of the batch header in the segment file.
+    pub offset: u64,
+    pub data_len: u64,
+    pub direction: BatchDirection,
+    pub compressed: bool,
+    /// Batches covered: 1, or the length of a clock run.
+    pub count: u64,
+}
+
+impl IndexEntry {
+    fn record_len(&self) -> u64 {
+        BATCH_HEADER_LEN + self.data_len
+    }
+
+    fn last_number(&self) -> u64 {
+        self.number + self.count - 1
+    }
+
+    fn is_run(&self) -> bool {
+        self.count > 1
+    }
+
+    fn file_direction(&self) -> u8 {
+        if self.is_run() { CLOCK_RUN } else { direction_byte(&self.direction, self.compressed) }
+    }
+
+    fn encode(&self) -> [u8; INDEX_ENTRY_LEN] {
+        let mut buf = [0u8; INDEX_ENTRY_LEN];
+        buf[0..8].copy_from_slice(&self.number.to_le_bytes());
+        buf[8..16].copy_from_slice(&self.offset.to_le_bytes());
+        buf[16..24].copy_from_slice(&self.data_len.to_le_bytes());
+        buf[24] = self.file_direction();
+        buf[25..33].copy_from_slice(&self.count.to_le_bytes());
+        buf
+    }
+
+    fn decode(buf: &[u8]) -> Option<Self> {
+        let count = u64::from_le_bytes(buf[25..33].try_into().unwrap());
+        let (direction, compressed) = match buf[24] {
+            CLOCK_RUN if count > 1 => (BatchDirection::Incoming, false),
+            byte => parse_direction(byte)?,
+        };
+        if count == 0 {
+            return None;
+        }
+        Some(Self {
+            number: u64::from_le_bytes(buf[0..8].try_into().unwrap()),
+            offset: u64::from_le_bytes(buf[8..16].try_into().unwrap()),
+            data_len: u64::from_le_bytes(buf[16..24].try_into().unwrap()),
+            direction,
+            compressed,
+            count,
+        })
+    }
+}
+
+/// History direction bytes match the frame's, so streamed ranges need no rewriting.
+fn parse_direction(byte: u8) -> Option<(BatchDirection, bool)> {
+    let (direction, compressed) = split_direction(byte);
+    match direction {
+        0 => Some((BatchDirection::Incoming, compressed)),
+        1 => Some((BatchDirection::Outgoing, compressed)),
+        _ => None,
+    }
+}
+
+/// When the history writer fsyncs the history file.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum SyncMode {
+    /// Leave it to the OS; a crash may lose recently broadcast batches.
+    None,
+    /// Every `sync_batches` batches or `sync_interval`, whichever comes first.
+    Interval,
+    /// Before `save_batch` returns, so no batch is broadcast before it is durable.
+    Always,
+}
+
+/// How the history is written: fsync policy and segment size.
+#[derive(Debug, Clone)]
+pub struct HistoryPolicy {
+    pub sync: SyncMode,
+    pub sync_batches: u64,
+    pub sync_interval: Duration,
+    /// The active segment is sealed and compacted once it reaches this size.
+    pub segment_bytes: u64,
+}
+
+impl Default for HistoryPolicy {
+    fn default() -> Self {
+        Self {
+            sync: SyncMode::Interval,
+            sync_batches: 64,
+            sync_interval: Duration::from_millis(200),
+            segment_bytes: 64 * 1024 * 1024,
+        }
+    }
+}
+
+impl HistoryPolicy {
+    /// Defaults overridden by `REPLICODE_HISTORY_*` environment variables.
+    pub fn from_env() -> Self {
+        let defaults = Self::default();
+        let sync = match std::env::var("REPLICODE_HISTORY_SYNC").ok().as_deref() {
+            None => defaults.sync,
+            Some("none") => SyncMode::None,
+            Some("interval") => SyncMode::Interval,
+            Some("always") => SyncMode::Always,
+            Some(other) => {
+                error!("Ignoring invalid REPLICODE_HISTORY_SYNC={}", other);
+                defaults.sync
+            }
+        };
+        let policy = Self {
+            sync,
+            sync_batches: env_parse("REPLICODE_HISTORY_SYNC_BATCHES").unwrap_or(defaults.sync_batches),
+            sync_interval: env_parse("REPLICODE_HISTORY_SYNC_MS")
+                .map(Duration::from_millis)
+                .unwrap_or(defaults.sync_interval),
+            segment_bytes: env_parse("REPLICODE_HISTORY_SEGMENT_BYTES").unwrap_or(defaults.segment_bytes),
+        };
+        info!("History policy: {:?}", policy);
+        policy
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum SegmentState {
+    /// Being appended to; always the last segment.
+    Active,
+    /// Full, waiting for compaction.
+    Sealed,
+    /// Full, with its clock-only batches folded into runs.
+    Compacted,
+}
+
+impl SegmentState {
+    fn name(self) -> &'static str {
+        match self {
+            SegmentState::Active => "active",
+            SegmentState::Sealed => "sealed",
+            SegmentState::Compacted => "compacted",
+        }
+    }
+
+    fn parse(name: &str) -> Option<Self> {
+        match name {
+            "active" => Some(SegmentState::Active),
+            "sealed" => Some(SegmentState::Sealed),
+            "compacted" => Some(SegmentState::Compacted),
+            _ => None,
+        }
+    }
+}
+
+/// One segment file and its entries.
+struct Segment {
+    /// Number in the file name; segments are numbered in creation order.
+    id: u64,
+    /// Bumped whenever compaction replaces the file. Each generation has its
+    /// own file name, so the manifest alone says which one is current, and
+    /// readers know to reopen it.
+    generation: u64,
+    state: SegmentState,
+    entries: Vec<IndexEntry>,
+}
+
+impl Segment {
+    fn last_number(&self) -> Option<u64> {
+        self.entries.last().map(IndexEntry::last_number)
+    }
+}
+
+/// The segments in order; shared by the history, its writer and readers.
+type SharedIndex = Arc<RwLock<Vec<Segment>>>;
+
+/// Serializes manifest rewrites by the writer and the compactor.
+type ManifestLock = Arc<Mutex<()>>;
+
+/// How far each open `HistoryReader` has streamed. Segments holding batches
+/// after the slowest of them are not collected, so a runtime joining from
+/// an older checkpoint never loses the batches it still has to replay.
+type ReaderCursors = Arc<Mutex<Vec<Weak<AtomicU64>>>>;
+
+enum WriteRequest {
+    /// An encoded batch (header and data) and its index entry; the writer
+    /// fills in the offset.
+    Append { entry: IndexEntry, bytes: Vec<u8> },
+    /// Fsync everything appended so far, whatever the policy.
+    Sync,
+    /// Persist a runtime checkpoint once the batches before it are durable,
+    /// then drop the segments holding only batches up to it.
+    Checkpoint { batch: u64, data: Vec<u8> },
+}
+
+/// How far the writer thread has got, in appends since the history was opened.
+#[derive(Default)]
+struct Progress {
+    written: u64,
+    synced: u64,
+    /// Set once a write fails; the writer stops appending after that.
+    error: Option<String>,
+}
+
+type SharedProgress = Arc<(Mutex<Progress>, Condvar)>;
+
+/// Log of every batch in a session, kept in a directory of fixed-size
+/// segments (`segment-<id>.bin`, each with a `.idx` sidecar mapping batch
+/// numbers to offsets) listed in order by a `manifest`.
+///
+/// Appends are handed to a writer thread, which writes whatever has queued
+/// up since its last write with one call per file and fsyncs according to
+/// the `HistoryPolicy`. An index entry becomes visible only once its batch
+/// is in the file. Full segments are compacted on a thread of their own by
+/// folding runs of clock-only batches into one record each, and segments
+/// entirely covered by the latest runtime checkpoint are deleted.
 pub struct BatchHistory {
-    file: Arc<Mutex<File>>,
+    writer: Option<Sender<WriteRequest>>,
+    writer_thread: Option<JoinHandle<()>>,
+    compactor_thread: Option<JoinHandle<()>>,
+    progress: SharedProgress,
+    policy: HistoryPolicy,
+    dir: PathBuf,
+    index: SharedIndex,
+    readers: ReaderCursors,
     current_batch: u64,
+    /// Appends handed to the writer so far.
+    appended: u64,
+    /// Latest runtime checkpoint: (batch number, encoded `Checkpoint`).
+    checkpoint: Option<(u64, Vec<u8>)>,
 }
 
 impl BatchHistory {
-    pub fn new(history_path: &Path) -> io::Result<Self> {
-        let file = OpenOptions::new()
-            .read(true)
-            .write(true)
-            .create(true)
-            .append(true)
-            .open(history_path)?;
-        
+    /// Opens (or creates) the history in `dir`.
+    pub fn new(dir: &Path, policy: HistoryPolicy) -> io::Result<Self> {
+        fs::create_dir_all(dir)?;
+        let mut segments = Vec::new();
+        for (id, state, generation) in load_manifest(dir)? {
+            let path = segment_path(dir, id, generation);
+            let file = OpenOptions::new().read(true).write(true).open(&path)?;
+            let len = file.metadata()?.len();
+            let index_path = index_path(&path);
+            let entries = match load_index(&index_path, len) {
+                Some(entries) => entries,
+                None => {
+                    let entries = scan_segment(&file)?;
+                    if len > 0 {
+                        warn!("Rebuilt batch index for {} ({} entries)", path.display(), entries.len());
+                    }
+                    write_index(&index_path, &entries)?;
+                    entries
+                }
+            };
+            // Drop a torn tail left by a crash between the data and index writes.
+            let end = entries.last().map(|e| e.offset + e.record_len()).unwrap_or(0);
+            if end != len {
+                file.set_len(end)?;
+            }
+            segments.push(Segment { id, generation, state, entries });
+        }
+        remove_orphans(dir, &segments)?;
+        let current_batch = segments.iter().rev().find_map(Segment::last_number).unwrap_or(0);
+        let checkpoint = load_checkpoint(&dir.join("checkpoint"));
+
+        let index: SharedIndex = Arc::new(RwLock::new(segments));
+        let manifest: ManifestLock = Arc::default();
+        let readers: ReaderCursors = Arc::default();
+        let progress: SharedProgress = Arc::default();
+
+        let compactor = Compactor {
+            dir: dir.to_path_buf(),
+            index: Arc::clone(&index),
+            manifest: Arc::clone(&manifest),
+            policy: policy.clone(),
+        };
+        let (compact_jobs, jobs) = mpsc::channel();
+        // Finish compactions a crash interrupted.
+        for segment in index.read().unwrap().iter().filter(|s| s.state == SegmentState::Sealed) {
+            let _ = compact_jobs.send(segment.id);
+        }
+        let compactor_thread = thread::Builder::new()
+            .name("history-compactor".into())
+            .spawn(move || compactor.run(jobs))?;
+
+        let mut log = HistoryWriter {
+            dir: dir.to_path_buf(),
+            active: None,
+            index: Arc::clone(&index),
+            readers: Arc::clone(&readers),
+            manifest,
+            compactor: compact_jobs,
+            progress: Arc::clone(&progress),
+            policy: policy.clone(),
+        };
+        log.open_active()?;
+
+        let (writer, requests) = mpsc::channel();
+        let writer_thread = thread::Builder::new()
+            .name("history-writer".into())
+            .spawn(move || log.run(requests))?;
+
         Ok(Self {
-            file: Arc::new(Mutex::new(file)),
-            current_batch: 0,
+            writer: Some(writer),
+            writer_thread: Some(writer_thread),
+            compactor_thread: Some(compactor_thread),
+            progress,
+            policy,
+            dir: dir.to_path_buf(),
+            index,
+            readers,
+            current_batch,
+            appended: 0,
+            checkpoint,
         })
     }
 
+    /// Queues a batch for the writer thread. Only waits for it to reach the
+    /// disk under `SyncMode::Always`; otherwise an error here is the first
+    /// failure of an earlier write.
     pub fn save_batch(&mut self, batch: &Batch) -> io::Result<()> {
-        let mut file = self.file.lock().unwrap();
-        
-        // Write batch number (8 bytes)
-        file.write_all(&batch.number.to_le_bytes())?;
-        
-        // Write direction (1 byte)
-        file.write_all(&[match batch.direction {
-            BatchDirection::Incoming => 0,
-            BatchDirection::Outgoing => 1,
-        }])?;
-        
-        // Write data length (8 bytes)
-        file.write_all(&(batch.data.len() as u64).to_le_bytes())?;
-        
-        // Write the actual data
-        file.write_all(&batch.data)?;
-        
-        // Flush to ensure data is written to disk
-        file.flush()?;
-        
+        let entry = IndexEntry {
+            number: batch.number,
+            offset: 0,
+            data_len: batch.data.len() as u64,
+            direction: batch.direction,
+            compressed: batch.compressed,
+            count: 1,
+        };
+        let mut bytes = Vec::with_capacity(entry.record_len() as usize);
+        bytes.extend_from_slice(&batch.number.to_le_bytes());
+        bytes.push(batch.direction_byte());
+        bytes.extend_from_slice(&(batch.data.len() as u64).to_le_bytes());
+        bytes.extend_from_slice(&batch.data);
+
+        self.check_writer()?;
+        self.send(WriteRequest::Append { entry, bytes })?;
+        self.appended += 1;
         self.current_batch = batch.number;
-        debug!("Saved batch {} to history file", batch.number);
+        debug!("Queued batch {} for the history file", batch.number);
+
+        if self.policy.sync == SyncMode::Always {
+            self.wait(self.appended, true)?;
+        }
         Ok(())
     }
 
+    /// Blocks until every queued batch is in the file (not necessarily
+    /// durable), so readers opened from now on see all of them.
+    pub fn wait_written(&self) -> io::Result<()> {
+        self.wait(self.appended, false)
+    }
+
+    /// Fsyncs every queued batch, whatever the policy, and waits for it.
+    pub fn sync(&self) -> io::Result<()> {
+        self.send(WriteRequest::Sync)?;
+        self.wait(self.appended, true)
+    }
+
+    fn send(&self, request: WriteRequest) -> io::Result<()> {
+        let writer = self.writer.as_ref().expect("history writer already closed");
+        writer.send(request).map_err(|_| io::Error::new(io::ErrorKind::BrokenPipe, "history writer exited"))
+    }
+
+    fn check_writer(&self) -> io::Result<()> {
+        match &self.progress.0.lock().unwrap().error {
+            Some(e) => Err(io::Error::new(io::ErrorKind::Other, e.clone())),
+            None => Ok(()),
+        }
+    }
+
+    fn wait(&self, appended: u64, durable: bool) -> io::Result<()> {
+        let (lock, cond) = &*self.progress;
+        let mut progress = lock.lock().unwrap();
+        loop {
+            if let Some(e) = &progress.error {
+                return Err(io::Error::new(io::ErrorKind::Other, e.clone()));
+            }
+            let reached = if durable { progress.synced } else { progress.written };
+            if reached >= appended {
+                return Ok(());
+            }
+            progress = cond.wait(progress).unwrap();
+        }
+    }
+
+    /// Returns every batch numbered after `batch_number` that is still kept,
+    /// reading only the segments that hold them. Clock runs come back as the
+    /// batches they replaced.
+    /// Prefer `reader()` for catch-up, which streams without materializing them.
+    /// Payloads are returned as stored; see `Batch::compressed`.
     pub fn get_batches_since(&self, batch_number: u64) -> io::Result<Vec<Batch>> {
-        let mut file = self.file.lock().unwrap();
+        self.wait_written()?;
         let mut batches = Vec::new();
-        
-        // Seek to start of file
-        file.seek(SeekFrom::Start(0))?;
-        
-        loop {
-            // Read batch number (8 bytes)
-            let mut batch_num_buf = [0u8; 8];
-            match file.read_exact(&mut batch_num_buf) {
-                Ok(_) => {
-                    let batch_num = u64::from_le_bytes(batch_num_buf);
-                    
-                    // Read direction (1 byte)
-                    let mut direction_buf = [0u8; 1];
-                    if file.read_exact(&mut direction_buf).is_err() {
-                        error!("Failed to read batch direction, file may be corrupted");
-                        break;
-                    }
-                    let direction = match direction_buf[0] {
-                        0 => BatchDirection::Incoming,
-                        1 => BatchDirection::Outgoing,
-                        _ => {
-                            error!("Invalid batch direction in history file");
-                            break;
-                        }
-                    };
-                    
-                    // Read data length (8 bytes)
-                    let mut len_buf = [0u8; 8];
-                    if file.read_exact(&mut len_buf).is_err() {
-                        error!("Failed to read batch data length, file may be corrupted");
-                        break;
-                    }
-                    let data_len = u64::from_le_bytes(len_buf) as usize;
-                    
-                    // Read the data
-                    let mut data = vec![0u8; data_len];
-                    if file.read_exact(&mut data).is_err() {
-                        error!("Failed to read batch data, file may be corrupted");
-                        break;
-                    }
-                    
-                    // Only add batches after the requested number
-                    if batch_num > batch_number {
-                        batches.push(Batch {
-                            number: batch_num,
-                            direction,
-                            data,
-                        });
-                    }
-                }
-                Err(e) if e.kind() == io::ErrorKind::UnexpectedEof => {
-                    // Normal EOF, we're done
-                    break;
-                }
-                Err(e) => {
-                    error!("Error reading batch history: {}", e);
+        let mut reader = self.reader()?;
+        let mut last = batch_number;
+        while let Some((file, entries)) = reader.next_chunk(last)? {
+            let from = last;
+            last = entries.last().map_or(last, IndexEntry::last_number);
+            for entry in entries {
+                file.seek(SeekFrom::Start(entry.offset + BATCH_HEADER_LEN))?;
+                let mut data = vec![0u8; entry.data_len as usize];
+                if let Err(e) = file.read_exact(&mut data) {
+                    error!("Failed to read batch {} data, file may be corrupted", entry.number);
                     return Err(e);
                 }
+                if entry.is_run() {
+                    for (number, delta) in run_batches(&entry, &data, from) {
+                        batches.push(Batch::new(number, BatchDirection::Incoming, clock_batch(delta?)));
+                    }
+                } else {
+                    batches.push(Batch {
+                        number: entry.number,
+                        direction: entry.direction,
+                        data,
+                        compressed: entry.compressed,
+                    });
+                }
             }
         }
-        
+
         debug!("Retrieved {} batches since batch {}", batches.len(), batch_number);
         Ok(batches)
     }
 
+    /// Opens an independent read handle on the history. The reader only takes
+    /// the index lock briefly, so it can run without holding `BatchHistory`.
+    /// It sees the batches the writer thread has written; call
+    /// `wait_written` first to include everything queued.
+    /// A reader over the history, holding back collection of every batch
+    /// until it has streamed past it.
+    pub fn reader(&self) -> io::Result<HistoryReader> {
+        let cursor = Arc::new(AtomicU64::new(0));
+        self.readers.lock().unwrap().push(Arc::downgrade(&cursor));
+        Ok(HistoryReader {
+            dir: self.dir.clone(),
+            index: Arc::clone(&self.index),
+            cursor,
+            open: None,
+        })
+    }
+
     pub fn get_current_batch(&self) -> u64 {
         self.current_batch
     }
-} 
\ No newline at end of file
+
+    /// Records a checkpoint reported by a runtime. Every replica reports the
+    /// same ones, so anything not newer than the stored checkpoint is ignored.
+    /// The writer thread persists it behind the batches already queued and
+    /// then deletes the segments holding nothing after it; this only queues
+    /// that, so the lock is never held across the fsync.
+    /// Returns whether the checkpoint was accepted.
+    pub fn save_checkpoint(&mut self, batch: u64, data: &[u8]) -> io::Result<bool> {
+        if batch > self.current_batch || self.checkpoint.as_ref().is_some_and(|(b, _)| *b >= batch) {
+            return Ok(false);
+        }
+        self.check_writer()?;
+        self.send(WriteRequest::Checkpoint { batch, data: data.to_vec() })?;
+        self.checkpoint = Some((batch, data.to_vec()));
+        debug!("Queued runtime checkpoint at batch {}", batch);
+        Ok(true)
+    }
+
+    pub fn latest_checkpoint(&self) -> Option<(u64, Vec<u8>)> {
+        self.checkpoint.clone()
+    }
+}
+
+impl Drop for BatchHistory {
+    /// Lets the writer drain its queue before the history goes away. The
+    /// compactor stops once the writer, which queues its jobs, is gone.
+    fn drop(&mut self) {
+        self.writer.take();
+        if let Some(thread) = self.writer_thread.take() {
+            let _ = thread.join();
+        }
+        if let Some(thread) = self.compactor_thread.take() {
+            let _ = thread.join();
+        }
+    }
+}
+
+/// The segment being appended to.
+struct ActiveSegment {
+    id: u64,
+    file: File,
+    index_file: File,
+    end_offset: u64,
+}
+
+/// The writer thread's end of the history: owns the active segment's file
+/// handles, publishes index entries once their batches are written, and
+/// rotates and deletes segments, handing sealed ones to the compactor.
+struct HistoryWriter {
+    dir: PathBuf,
+    active: Option<ActiveSegment>,
+    index: SharedIndex,
+    readers: ReaderCursors,
+    manifest: ManifestLock,
+    /// Ids of sealed segments for the compactor thread.
+    compactor: Sender<u64>,
+    progress: SharedProgress,
+    policy: HistoryPolicy,
+}
+
+impl HistoryWriter {
+    fn run(mut self, requests: Receiver<WriteRequest>) {
+        let mut data = Vec::new();
+        let mut index_buf = Vec::new();
+        let mut entries = Vec::new();
+        let mut written = 0u64;
+        let mut synced = 0u64;
+        let mut last_sync = Instant::now();
+        loop {
+            // Under the interval policy, wake up in time for an overdue fsync.
+            let first = if self.policy.sync == SyncMode::Interval && synced < written {
+                let timeout = self.policy.sync_interval.saturating_sub(last_sync.elapsed());
+                match requests.recv_timeout(timeout) {
+                    Ok(request) => Some(request),
+                    Err(RecvTimeoutError::Timeout) => None,
+                    Err(RecvTimeoutError::Disconnected) => break,
+                }
+            } else {
+                match requests.recv() {
+                    Ok(request) => Some(request),
+                    Err(_) => break,
+                }
+            };
+
+            // Group commit: take everything queued so far in one write.
+            let mut sync_requested = false;
+            let mut checkpoint = None;
+            let offset = self.active.as_ref().map_or(0, |a| a.end_offset);
+            for request in first.into_iter().chain(requests.try_iter()) {
+                match request {
+                    WriteRequest::Append { mut entry, bytes } => {
+                        entry.offset = offset + data.len() as u64;
+                        data.extend_from_slice(&bytes);
+                        index_buf.extend_from_slice(&entry.encode());
+                        entries.push(entry);
+                    }
+                    WriteRequest::Sync => sync_requested = true,
+                    WriteRequest::Checkpoint { batch, data } => {
+                        // Never leave a checkpoint pointing past the durable history.
+                        sync_requested |= self.policy.sync != SyncMode::None;
+                        checkpoint = Some((batch, data));
+                    }
+                }
+            }
+
+            let group = entries.len() as u64;
+            if let Err(e) = self.write_group(&data, &index_buf, &mut entries) {
+                self.fail(e);
+                return;
+            }
+            written += group;
+            data.clear();
+            index_buf.clear();
+            entries.clear();
+
+            let due = match self.policy.sync {
+                SyncMode::None => false,
+                SyncMode::Interval => {
+                    written - synced >= self.policy.sync_batches.max(1)
+                        || last_sync.elapsed() >= self.policy.sync_interval
+                }
+                SyncMode::Always => true,
+            };
+            if synced < written && (due || sync_requested) {
+                // A segment's index is rebuilt from its file if it falls behind.
+                if let Err(e) = self.active_file().sync_data() {
+                    self.fail(e);
+                    return;
+                }
+                synced = written;
+                last_sync = Instant::now();
+            }
+
+            {
+                let (lock, cond) = &*self.progress;
+                let mut progress = lock.lock().unwrap();
+                progress.written = written;
+                progress.synced = synced;
+                cond.notify_all();
+            }
+
+            // Housekeeping runs after waiters are released.
+            let full = self.active.as_ref().is_some_and(|a| a.end_offset >= self.policy.segment_bytes);
+            if full {
+                if let Err(e) = self.rotate() {
+                    self.fail(e);
+                    return;
+                }
+            }
+            if let Some((batch, data)) = checkpoint {
+                // A lost checkpoint only delays garbage collection.
+                if let Err(e) = self.write_checkpoint(batch, &data) {
+                    error!("Failed to save checkpoint at batch {}: {}", batch, e);
+                } else if let Err(e) = self.collect(batch) {
+                    self.fail(e);
+                    return;
+                }
+            }
+        }
+
+        if self.policy.sync != SyncMode::None && synced < written {
+            if let Err(e) = self.active_file().sync_data() {
+                error!("Failed to sync batch history on close: {}", e);
+            }
+        }
+    }
+
+    fn active_file(&self) -> &File {
+        &self.active.as_ref().expect("history has no active segment").file
+    }
+
+    /// Writes a group of batches to the active segment and publishes their
+    /// index entries, draining `entries`.
+    fn write_group(&mut self, data: &[u8], index_buf: &[u8], entries: &mut Vec<IndexEntry>) -> io::Result<()> {
+        if entries.is_empty() {
+            return Ok(());
+        }
+        let active = self.active.as_mut().expect("history has no active segment");
+        active.file.write_all(data)?;
+        active.index_file.write_all(index_buf)?;
+        active.end_offset += data.len() as u64;
+        let mut segments = self.index.write().unwrap();
+        let segment = segments.last_mut().expect("history has no active segment");
+        segment.entries.append(entries);
+        Ok(())
+    }
+
+    /// Opens the last segment for appending, or starts a new one if there is
+    /// none or the last one is full.
+    fn open_active(&mut self) -> io::Result<()> {
+        let last = self.index.read().unwrap().last().map(|s| (s.id, s.state));
+        let id = match last {
+            Some((id, SegmentState::Active)) => id,
+            Some((id, _)) => self.start_segment(id + 1)?,
+            None => self.start_segment(0)?,
+        };
+        // The active segment is never compacted, so it is still generation 0.
+        let path = segment_path(&self.dir, id, 0);
+        let file = OpenOptions::new().append(true).open(&path)?;
+        let end_offset = file.metadata()?.len();
+        let index_file = OpenOptions::new().append(true).open(index_path(&path))?;
+        self.active = Some(ActiveSegment { id, file, index_file, end_offset });
+        Ok(())
+    }
+
+    fn start_segment(&mut self, id: u64) -> io::Result<u64> {
+        let path = segment_path(&self.dir, id, 0);
+        File::create(&path)?;
+        File::create(index_path(&path))?;
+        self.index.write().unwrap().push(Segment {
+            id,
+            generation: 0,
+            state: SegmentState::Active,
+            entries: Vec::new(),
+        });
+        self.write_manifest()?;
+        debug!("Started history segment {}", path.display());
+        Ok(id)
+    }
+
+    /// Seals the full active segment, starts the next one and queues the
+    /// sealed one for compaction.
+    fn rotate(&mut self) -> io::Result<()> {
+        let Some(active) = self.active.take() else {
+            return Ok(());
+        };
+        if self.policy.sync != SyncMode::None {
+            active.file.sync_data()?;
+        }
+        if let Some(segment) = self.index.write().unwrap().iter_mut().find(|s| s.id == active.id) {
+            segment.state = SegmentState::Sealed;
+        }
+        let sealed = active.id;
+        drop(active);
+        self.open_active()?;
+        // A compactor that has gone away leaves the segment sealed for the next start.
+        let _ = self.compactor.send(sealed);
+        Ok(())
+    }
+
+    fn write_checkpoint(&self, batch: u64, data: &[u8]) -> io::Result<()> {
+        let path = self.dir.join("checkpoint");
+        // Write to a temp file first so a crash never leaves a truncated checkpoint behind.
+        let tmp_path = path.with_extension("tmp");
+        let mut buf = Vec::with_capacity(16 + data.len());
+        buf.extend_from_slice(&batch.to_le_bytes());
+        buf.extend_from_slice(&(data.len() as u64).to_le_bytes());
+        buf.extend_from_slice(data);
+        fs::write(&tmp_path, buf)?;
+        fs::rename(&tmp_path, &path)?;
+        info!("Saved runtime checkpoint at batch {}", batch);
+        Ok(())
+    }
+
+    /// Deletes every full segment that holds nothing after batch `through`.
+    fn collect(&mut self, checkpoint: u64) -> io::Result<()> {
+        let through = {
+            let mut readers = self.readers.lock().unwrap();
+            readers.retain(|cursor| cursor.strong_count() > 0);
+            readers.iter().filter_map(Weak::upgrade).fold(checkpoint, |through, cursor| through.min(cursor.load(Ordering::SeqCst)))
+        };
+        if through < checkpoint {
+            debug!("Keeping history after batch {} for runtimes still catching up", through);
+        }
+        let removed: Vec<(u64, u64)> = {
+            let mut segments = self.index.write().unwrap();
+            let keep = |s: &Segment| s.state == SegmentState::Active || s.last_number().map_or(true, |n| n > through);
+            let removed = segments.iter().filter(|s| !keep(s)).map(|s| (s.id, s.generation)).collect();
+            segments.retain(keep);
+            removed
+        };
+        if removed.is_empty() {
+            return Ok(());
+        }
+        // Drop them from the manifest before deleting, so a crash never
+        // leaves the manifest naming a missing segment.
+        self.write_manifest()?;
+        for &(id, generation) in &removed {
+            remove_segment_files(&segment_path(&self.dir, id, generation))?;
+        }
+        info!("Removed {} history segments covered by the checkpoint at batch {}", removed.len(), checkpoint);
+        Ok(())
+    }
+
+    fn write_manifest(&self) -> io::Result<()> {
+        write_manifest(&self.dir, &self.index, &self.manifest)
+    }
+
+    fn fail(&self, e: io::Error) {
+        error!("Batch history writer failed: {}", e);
+        let (lock, cond) = &*self.progress;
+        lock.lock().unwrap().error = Some(e.to_string());
+        cond.notify_all();
+    }
+}
+
+/// Compacts sealed segments on its own thread, so rewriting a full segment
+/// never holds up appends, fsyncs or the batches waiting on them.
+struct Compactor {
+    dir: PathBuf,
+    index: SharedIndex,
+    manifest: ManifestLock,
+    policy: HistoryPolicy,
+}
+
+impl Compactor {
+    fn run(self, jobs: Receiver<u64>) {
+        for id in jobs {
+            // A segment left sealed is compacted again on the next start.
+            if let Err(e) = self.compact(id) {
+                error!("Failed to compact history segment {}: {}", id, e);
+            }
+        }
+    }
+
+    /// Writes the compacted segment and its index as the next generation's
+    /// files, then publishes them with the manifest swap. A crash before the
+    /// manifest names them leaves the sealed generation in place.
+    fn compact(&self, id: u64) -> io::Result<()> {
+        let found = self.index.read().unwrap().iter()
+            .find(|s| s.id == id && s.state == SegmentState::Sealed)
+            .map(|s| (s.generation, s.entries.clone()));
+        let Some((generation, entries)) = found else {
+            return Ok(());
+        };
+        let path = segment_path(&self.dir, id, generation);
+        let data = match fs::read(&path) {
+            Ok(data) => data,
+            // Collected since it was sealed.
+            Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(()),
+            Err(e) => return Err(e),
+        };
+        let (out, compacted) = fold_clock_runs(&data, &entries);
+
+        let new_path = segment_path(&self.dir, id, generation + 1);
+        let new_index = index_path(&new_path);
+        fs::write(&new_path, &out)?;
+        write_index(&new_index, &compacted)?;
+        if self.policy.sync != SyncMode::None {
+            File::open(&new_path)?.sync_all()?;
+            File::open(&new_index)?.sync_all()?;
+        }
+        {
+            // Readers open segment files under the index lock, so they always
+            // get a file that matches the entries they see.
+            let mut segments = self.index.write().unwrap();
+            let Some(segment) = segments.iter_mut().find(|s| s.id == id && s.generation == generation) else {
+                drop(segments);
+                return remove_segment_files(&new_path);
+            };
+            segment.entries = compacted;
+            segment.generation += 1;
+            segment.state = SegmentState::Compacted;
+        }
+        write_manifest(&self.dir, &self.index, &self.manifest)?;
+        // Readers still on the old generation keep their open handles.
+        remove_segment_files(&path)?;
+        info!("Compacted history segment {} from {} to {} bytes", new_path.display(), data.len(), out.len());
+        Ok(())
+    }
+}
+
+/// Rewrites a segment's `data` with each run of consecutive clock-only
+/// batches folded into a single `CLOCK_RUN` record, whose payload is the
+/// run's clock records. Returns the new contents and their index.
+fn fold_clock_runs(data: &[u8], entries: &[IndexEntry]) -> (Vec<u8>, Vec<IndexEntry>) {
+    let mut out = Vec::with_capacity(data.len());
+    let mut compacted = Vec::with_capacity(entries.len());
+    let mut run: Option<(u64, u64, Vec<u8>)> = None;
+    for entry in entries {
+        let start = entry.offset as usize;
+        let bytes = &data[start..start + entry.record_len() as usize];
+        let payload = &bytes[BATCH_HEADER_LEN as usize..];
+        if let Some(delta) = clock_only_delta(entry, payload) {
+            match &mut run {
+                Some((first, count, records)) if *first + *count == entry.number => {
+                    *count += 1;
+                    Record::Clock { delta }.encode(records);
+                }
+                _ => {
+                    flush_run(run.take(), &mut out, &mut compacted);
+                    let mut records = Vec::new();
+                    wire::start_batch(&mut records);
+                    Record::Clock { delta }.encode(&mut records);
+                    run = Some((entry.number, 1, records));
+                }
+            }
+            continue;
+        }
+        flush_run(run.take(), &mut out, &mut compacted);
+        compacted.push(IndexEntry { offset: out.len() as u64, ..*entry });
+        out.extend_from_slice(bytes);
+    }
+    flush_run(run.take(), &mut out, &mut compacted);
+    (out, compacted)
+}
+
+/// Rewrites the manifest from the index, atomically by rename.
+fn write_manifest(dir: &Path, index: &SharedIndex, lock: &ManifestLock) -> io::Result<()> {
+    // Held across reading the index and the rename, so the last manifest
+    // written is never older than one written before it.
+    let _guard = lock.lock().unwrap();
+    let mut manifest = String::new();
+    for segment in index.read().unwrap().iter() {
+        manifest.push_str(&format!("{} {} {}\n", segment.id, segment.state.name(), segment.generation));
+    }
+    let path = dir.join(MANIFEST);
+    let tmp_path = path.with_extension("tmp");
+    fs::write(&tmp_path, manifest)?;
+    fs::rename(&tmp_path, &path)
+}
+
+/// Deletes a segment file and its index, if they are still there.
+fn remove_segment_files(path: &Path) -> io::Result<()> {
+    for file in [index_path(path), path.to_path_buf()] {
+        match fs::remove_file(&file) {
+            Err(e) if e.kind() != io::ErrorKind::NotFound => return Err(e),
+            _ => {}
+        }
+    }
+    Ok(())
+}
+
+/// Deletes segment files the manifest does not name: generations replaced
+/// by a compaction, or written by one a crash interrupted.
+fn remove_orphans(dir: &Path, segments: &[Segment]) -> io::Result<()> {
+    let mut known = std::collections::HashSet::new();
+    for segment in segments {
+        let path = segment_path(dir, segment.id, segment.generation);
+        known.insert(index_path(&path));
+        known.insert(path);
+    }
+    for entry in fs::read_dir(dir)? {
+        let path = entry?.path();
+        let is_segment = path.file_name().and_then(|n| n.to_str()).is_some_and(|n| n.starts_with("segment-"));
+        if is_segment && !known.contains(&path) {
+            debug!("Removing stale history file {}", path.display());
+            fs::remove_file(&path)?;
+        }
+    }
+    Ok(())
+}
+
+/// The clock delta of an uncompressed Incoming batch whose only record is a clock record.
+fn clock_only_delta(entry: &IndexEntry, payload: &[u8]) -> Option<u64> {
+    if entry.is_run() || entry.compressed || entry.direction != BatchDirection::Incoming {
+        return None;
+    }
+    let mut records = Records::new(payload).ok()?;
+    match (records.next(), records.next()) {
+        (Some(Ok(Record::Clock { delta })), None) => Some(delta),
+        _ => None,
+    }
+}
+
+/// Appends a run to a compacted segment. A run of one stays a plain batch.
+fn flush_run(run: Option<(u64, u64, Vec<u8>)>, out: &mut Vec<u8>, entries: &mut Vec<IndexEntry>) {
+    let Some((first, count, records)) = run else {
+        return;
+    };
+    let direction = if count == 1 { 0 } else { CLOCK_RUN };
+    entries.push(IndexEntry {
+        number: first,
+        offset: out.len() as u64,
+        data_len: records.len() as u64,
+        direction: BatchDirection::Incoming,
+        compressed: false,
+        count,
+    });
+    out.extend_from_slice(&first.to_le_bytes());
+    out.push(direction);
+    out.extend_from_slice(&(records.len() as u64).to_le_bytes());
+    out.extend_from_slice(&records);
+}
+
+/// The batches of a clock run numbered after `after`, with their deltas.
+fn run_batches<'a>(entry: &IndexEntry, payload: &'a [u8], after: u64) -> impl Iterator<Item = (u64, io::Result<u64>)> + 'a {
+    let first = entry.number;
+    let records = match Records::new(payload) {
+        Ok(records) => Some(records),
+        Err(e) => {
+            error!("Invalid clock run at batch {}: {}", first, e);
+            None
+        }
+    };
+    records.into_iter().flatten().enumerate().filter_map(move |(i, record)| {
+        let number = first + i as u64;
+        if number <= after {
+            return None;
+        }
+        Some((number, match record {
+            Ok(Record::Clock { delta }) => Ok(delta),
+            Ok(_) => Err(io::Error::new(io::ErrorKind::InvalidData, "non-clock record in clock run")),
+            Err(e) => Err(e),
+        }))
+    })
+}
+
+/// The payload of a clock-only batch, exactly as the batch sender built it.
+fn clock_batch(delta: u64) -> Vec<u8> {
+    let mut data = Vec::new();
+    wire::start_batch(&mut data);
+    Record::Clock { delta }.encode(&mut data);
+    data
+}
+
+/// Streams history batches to a joining runtime.
+pub struct HistoryReader {
+    dir: PathBuf,
+    index: SharedIndex,
+    /// Last batch streamed, shared with the writer's collection.
+    cursor: Arc<AtomicU64>,
+    /// The segment file last read: (id, generation, file).
+    open: Option<(u64, u64, File)>,
+}
+
+impl HistoryReader {
+    /// The next entries holding batches numbered after `after`, all from one
+    /// segment, with that segment's file opened to match them. Fails if the
+    /// batch right after `after` is no longer in the history.
+    fn next_chunk(&mut self, after: u64) -> io::Result<Option<(&mut File, Vec<IndexEntry>)>> {
+        self.cursor.fetch_max(after, Ordering::SeqCst);
+        let index = Arc::clone(&self.index);
+        let segments = index.read().unwrap();
+        let Some(segment) = segments.iter().find(|s| s.last_number().is_some_and(|n| n > after)) else {
+            return Ok(None);
+        };
+        let start = segment.entries.partition_point(|e| e.last_number() <= after);
+        let first = segment.entries[start].number;
+        if first > after + 1 {
+            return Err(io::Error::new(
+                io::ErrorKind::NotFound,
+                format!("batches {} to {} are no longer in the history", after + 1, first - 1),
+            ));
+        }
+        let chunk = segment.entries[start..].iter().take(STREAM_CHUNK).copied().collect();
+        let current = self.open.as_ref().is_some_and(|(id, gen, _)| *id == segment.id && *gen == segment.generation);
+        if !current {
+            let file = File::open(segment_path(&self.dir, segment.id, segment.generation))?;
+            self.open = Some((segment.id, segment.generation, file));
+        }
+        Ok(Some((&mut self.open.as_mut().unwrap().2, chunk)))
+    }
+
+    /// Writes every Incoming batch numbered after `after`, as laid out on the
+    /// wire, until the reader reaches the end of the index. Runs of adjacent
+    /// batches are copied file-to-socket in one `io::copy`, and clock runs
+    /// are expanded back into their batches. Returns the number of the last
+    /// batch written (or `after` if none) and the count written.
+    pub fn stream_incoming_since<W: Write>(&mut self, after: u64, out: &mut W) -> io::Result<(u64, u64)> {
+        let mut last = after;
+        let mut sent = 0u64;
+        while let Some((file, chunk)) = self.next_chunk(last)? {
+            let Some(tail) = chunk.last() else {
+                break;
+            };
+            let from = last;
+            last = tail.last_number();
+
+            // Coalesce contiguous Incoming batches into a single byte range.
+            let mut range: Option<(u64, u64)> = None;
+            for entry in chunk.iter().filter(|e| e.direction == BatchDirection::Incoming) {
+                if entry.is_run() {
+                    if let Some((start, end)) = range.take() {
+                        copy_range(file, start, end, out)?;
+                    }
+                    sent += expand_run(file, entry, from, out)?;
+                    continue;
+                }
+                range = match range {
+                    Some((start, end)) if end == entry.offset => Some((start, end + entry.record_len())),
+                    Some((start, end)) => {
+                        copy_range(file, start, end, out)?;
+                        Some((entry.offset, entry.offset + entry.record_len()))
+                    }
+                    None => Some((entry.offset, entry.offset + entry.record_len())),
+                };
+                sent += 1;
+            }
+            if let Some((start, end)) = range {
+                copy_range(file, start, end, out)?;
+            }
+        }
+        out.flush()?;
+        if sent > 0 {
+            info!("Streamed {} historical incoming batches (through batch {})", sent, last);
+        }
+        Ok((last, sent))
+    }
+}
+
+fn copy_range<W: Write>(file: &mut File, start: u64, end: u64, out: &mut W) -> io::Result<()> {
+    file.seek(SeekFrom::Start(start))?;
+    let len = end - start;
+    let copied = io::copy(&mut (&*file).take(len), out)?;
+    if copied != len {
+        return Err(io::Error::new(io::ErrorKind::UnexpectedEof, "batch history truncated"));
+    }
+    Ok(())
+}
+
+/// Writes the batches of a clock run numbered after `after` as frames.
+fn expand_run<W: Write>(file: &mut File, entry: &IndexEntry, after: u64, out: &mut W) -> io::Result<u64> {
+    file.seek(SeekFrom::Start(entry.offset + BATCH_HEADER_LEN))?;
+    let mut payload = vec![0u8; entry.data_len as usize];
+    file.read_exact(&mut payload)?;
+    let mut frames = Vec::new();
+    let mut sent = 0;
+    for (number, delta) in run_batches(entry, &payload, after) {
+        let data = clock_batch(delta?);
+        frames.extend_from_slice(&number.to_le_bytes());
+        frames.push(0);
+        frames.extend_from_slice(&(data.len() as u64).to_le_bytes());
+        frames.extend_from_slice(&data);
+        sent += 1;
+    }
+    out.write_all(&frames)?;
+    Ok(sent)
+}
+
+/// Generation 0 is the segment as written; compactions add `.g<generation>`.
+fn segment_path(dir: &Path, id: u64, generation: u64) -> PathBuf {
+    match generation {
+        0 => dir.join(format!("segment-{:08}.bin", id)),
+        _ => dir.join(format!("segment-{:08}.g{}.bin", id, generation)),
+    }
+}
+
+fn index_path(segment_path: &Path) -> PathBuf {
+    segment_path.with_extension("idx")
+}
+
+/// Segment ids, states and generations in order, or none for a new history.
+/// Lines without a generation predate compaction into new files: generation 0.
+fn load_manifest(dir: &Path) -> io::Result<Vec<(u64, SegmentState, u64)>> {
+    let manifest = match fs::read_to_string(dir.join(MANIFEST)) {
+        Ok(manifest) => manifest,
+        Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(Vec::new()),
+        Err(e) => return Err(e),
+    };
+    let mut segments = Vec::new();
+    for line in manifest.lines().filter(|l| !l.trim().is_empty()) {
+        let mut fields = line.split_whitespace();
+        let id = fields.next().and_then(|id| id.parse().ok());
+        let state = fields.next().and_then(SegmentState::parse);
+        let generation = fields.next().map_or(Some(0), |g| g.parse().ok());
+        match (id, state, generation) {
+            (Some(id), Some(state), Some(generation)) => segments.push((id, state, generation)),
+            _ => {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    format!("invalid history manifest line: {}", line),
+                ))
+            }
+        }
+    }
+    Ok(segments)
+}
+
+fn load_checkpoint(path: &Path) -> Option<(u64, Vec<u8>)> {
+    let buf = fs::read(path).ok()?;
+    if buf.len() < 16 {
+        return None;
+    }
+    let batch = u64::from_le_bytes(buf[0..8].try_into().unwrap());
+    let len = u64::from_le_bytes(buf[8..16].try_into().unwrap()) as usize;
+    let data = buf.get(16..16 + len)?.to_vec();
+    Some((batch, data))
+}
+
+fn write_index(path: &Path, entries: &[IndexEntry]) -> io::Result<()> {
+    let mut buf = Vec::with_capacity(entries.len() * INDEX_ENTRY_LEN);
+    for entry in entries {
+        buf.extend_from_slice(&entry.encode());
+    }
+    fs::write(path, buf)
+}
+
+/// Loads a segment's index, or None if it is missing or disagrees with the segment file.
+fn load_index(index_path: &Path, segment_len: u64) -> Option<Vec<IndexEntry>> {
+    let buf = fs::read(index_path).ok()?;
+    let mut entries = Vec::with_capacity(buf.len() / INDEX_ENTRY_LEN);
+    for chunk in buf.chunks_exact(INDEX_ENTRY_LEN) {
+        entries.push(IndexEntry::decode(chunk)?);
+    }
+    let indexed_len = entries.last().map(|e| e.offset + e.record_len()).unwrap_or(0);
+    if buf.len() % INDEX_ENTRY_LEN != 0 || indexed_len != segment_len {
+        return None;
+    }
+    Some(entries)
+}
+
+/// Rebuilds a segment's index by walking the batch headers and skipping
+/// over their data; only clock runs are read, to count their batches.
+fn scan_segment(mut file: &File) -> io::Result<Vec<IndexEntry>> {
+    let len = file.metadata()?.len();
+    let mut entries = Vec::new();
+    let mut offset = 0u64;
+    while offset + BATCH_HEADER_LEN <= len {
+        let mut header = [0u8; BATCH_HEADER_LEN as usize];
+        file.seek(SeekFrom::Start(offset))?;
+        file.read_exact(&mut header)?;
+        let number = u64::from_le_bytes(header[0..8].try_into().unwrap());
+        let data_len = u64::from_le_bytes(header[9..17].try_into().unwrap());
+        if offset + BATCH_HEADER_LEN + data_len > len {
+            error!("Truncated batch {} in history segment", number);
+            break;
+        }
+        let (direction, compressed, count) = if header[8] == CLOCK_RUN {
+            let mut payload = vec![0u8; data_len as usize];
+            file.read_exact(&mut payload)?;
+            let count = match Records::new(&payload) {
+                Ok(records) => records.count() as u64,
+                Err(_) => 0,
+            };
+            if count < 2 {
+                error!("Invalid clock run at batch {} in history segment", number);
+                break;
+            }
+            (BatchDirection::Incoming, false, count)
+        } else {
+            let Some((direction, compressed)) = parse_direction(header[8]) else {
+                error!("Invalid batch direction in history segment at offset {}", offset);
+                break;
+            };
+            (direction, compressed, 1)
+        };
+        let entry = IndexEntry { number, offset, data_len, direction, compressed, count };
+        offset += entry.record_len();
+        entries.push(entry);
+    }
+    Ok(entries)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn clock(delta: u64) -> Vec<u8> {
+        clock_batch(delta)
+    }
+
+    fn fd_msg(pid: u64) -> Vec<u8> {
+        let mut data = Vec::new();
+        wire::start_batch(&mut data);
+        Record::FdMsg { pid, data: b"0:x" }.encode(&mut data);
+        data
+    }
+
+    /// Lays `batches` out as a segment file, the way the writer appends them.
+    fn segment_of(batches: &[Batch]) -> (Vec<u8>, Vec<IndexEntry>) {
+        let mut data = Vec::new();
+        let mut entries = Vec::new();
+        for batch in batches {
+            entries.push(IndexEntry {
+                number: batch.number,
+                offset: data.len() as u64,
+                data_len: batch.data.len() as u64,
+                direction: batch.direction,
+                compressed: batch.compressed,
+                count: 1,
+            });
+            data.extend_from_slice(&batch.number.to_le_bytes());
+            data.push(batch.direction_byte());
+            data.extend_from_slice(&(batch.data.len() as u64).to_le_bytes());
+            data.extend_from_slice(&batch.data);
+        }
+        (data, entries)
+    }
+
+    /// Reads every batch back out of a segment, expanding clock runs.
+    fn batches_in(data: &[u8], entries: &[IndexEntry]) -> Vec<(u64, BatchDirection, Vec<u8>)> {
+        let mut batches = Vec::new();
+        for entry in entries {
+            let start = (entry.offset + BATCH_HEADER_LEN) as usize;
+            let payload = &data[start..start + entry.data_len as usize];
+            if entry.is_run() {
+                for (number, delta) in run_batches(entry, payload, 0) {
+                    batches.push((number, BatchDirection::Incoming, clock(delta.unwrap())));
+                }
+            } else {
+                batches.push((entry.number, entry.direction, payload.to_vec()));
+            }
+        }
+        batches
+    }
+
+    fn temp_dir(name: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!("replicode-history-{}-{}", name, std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(&dir).unwrap();
+        dir
+    }
+
+    #[test]
+    fn index_entries_round_trip() {
+        let entries = [
+            IndexEntry { number: 1, offset: 0, data_len: 3, direction: BatchDirection::Incoming, compressed: false, count: 1 },
+            IndexEntry { number: 2, offset: 20, data_len: 900, direction: BatchDirection::Incoming, compressed: true, count: 1 },
+            IndexEntry { number: 3, offset: 937, data_len: 0, direction: BatchDirection::Outgoing, compressed: false, count: 1 },
+            IndexEntry { number: 4, offset: 954, data_len: 7, direction: BatchDirection::Outgoing, compressed: true, count: 1 },
+            IndexEntry { number: 5, offset: 978, data_len: 61, direction: BatchDirection::Incoming, compressed: false, count: 30 },
+            IndexEntry { number: u64::MAX - 1, offset: u64::MAX, data_len: u64::MAX, direction: BatchDirection::Incoming, compressed: false, count: 1 },
+        ];
+        for entry in entries {
+            let encoded = entry.encode();
+            assert_eq!(IndexEntry::decode(&encoded), Some(entry));
+        }
+        let run = entries[4].encode();
+        assert_eq!(run[24], CLOCK_RUN);
+    }
+
+    #[test]
+    fn index_entries_reject_bad_fields() {
+        let plain = IndexEntry { number: 9, offset: 0, data_len: 3, direction: BatchDirection::Incoming, compressed: false, count: 1 };
+        let mut zero_count = plain.encode();
+        zero_count[25..33].copy_from_slice(&0u64.to_le_bytes());
+        assert_eq!(IndexEntry::decode(&zero_count), None);
+
+        // A clock run must cover at least two batches.
+        let mut short_run = plain.encode();
+        short_run[24] = CLOCK_RUN;
+        assert_eq!(IndexEntry::decode(&short_run), None);
+
+        let mut bad_direction = plain.encode();
+        bad_direction[24] = 7;
+        assert_eq!(IndexEntry::decode(&bad_direction), None);
+    }
+
+    #[test]
+    fn index_files_round_trip() {
+        let dir = temp_dir("index");
+        let batches: Vec<Batch> = (1..=5).map(|n| Batch::new(n, BatchDirection::Incoming, fd_msg(n))).collect();
+        let (data, entries) = segment_of(&batches);
+        let path = dir.join("segment.idx");
+        write_index(&path, &entries).unwrap();
+        assert_eq!(load_index(&path, data.len() as u64), Some(entries.clone()));
+        // An index that does not reach the end of the segment is rebuilt.
+        assert_eq!(load_index(&path, data.len() as u64 + 1), None);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn folds_consecutive_clock_batches_into_runs() {
+        let mut compressed = Batch::new(12, BatchDirection::Incoming, clock(12));
+        compressed.compressed = true;
+        let mut two_clocks = clock(13);
+        Record::Clock { delta: 14 }.encode(&mut two_clocks);
+        let batches = vec![
+            Batch::new(1, BatchDirection::Incoming, clock(1)),
+            Batch::new(2, BatchDirection::Incoming, clock(2)),
+            Batch::new(3, BatchDirection::Incoming, clock(u64::MAX)),
+            Batch::new(4, BatchDirection::Incoming, fd_msg(1)),
+            Batch::new(5, BatchDirection::Outgoing, clock(5)),
+            Batch::new(6, BatchDirection::Incoming, clock(6)),
+            Batch::new(7, BatchDirection::Incoming, fd_msg(2)),
+            Batch::new(8, BatchDirection::Incoming, clock(8)),
+            Batch::new(9, BatchDirection::Incoming, clock(9)),
+            // A gap in the numbering ends a run.
+            Batch::new(11, BatchDirection::Incoming, clock(11)),
+            compressed,
+            Batch::new(13, BatchDirection::Incoming, two_clocks),
+        ];
+        let (data, entries) = segment_of(&batches);
+        let (out, folded) = fold_clock_runs(&data, &entries);
+
+        let shape: Vec<(u64, u64)> = folded.iter().map(|e| (e.number, e.count)).collect();
+        assert_eq!(shape, [(1, 3), (4, 1), (5, 1), (6, 1), (7, 1), (8, 2), (11, 1), (12, 1), (13, 1)]);
+        assert!(out.len() < data.len());
+        assert!(!folded[3].is_run());
+        assert_eq!(folded[3].file_direction(), 0);
+
+        let expected: Vec<_> = batches.iter().map(|b| (b.number, b.direction, b.data.clone())).collect();
+        assert_eq!(batches_in(&out, &folded), expected);
+        // Compressed payloads are copied untouched, flag included.
+        assert!(folded[7].compressed);
+
+        // Runs are cut at the batches already streamed.
+        let run = &folded[0];
+        let start = (run.offset + BATCH_HEADER_LEN) as usize;
+        let tail: Vec<u64> = run_batches(run, &out[start..start + run.data_len as usize], 1)
+            .map(|(number, _)| number)
+            .collect();
+        assert_eq!(tail, [2, 3]);
+
+        // An index rebuilt by scanning the compacted file matches the fold.
+        let dir = temp_dir("fold");
+        let path = dir.join("segment.bin");
+        fs::write(&path, &out).unwrap();
+        assert_eq!(scan_segment(&File::open(&path).unwrap()).unwrap(), folded);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn folding_is_idempotent() {
+        let batches: Vec<Batch> = (1..=10).map(|n| Batch::new(n, BatchDirection::Incoming, clock(n))).collect();
+        let (data, entries) = segment_of(&batches);
+        let (out, folded) = fold_clock_runs(&data, &entries);
+        assert_eq!(folded.len(), 1);
+        assert_eq!(fold_clock_runs(&out, &folded), (out, folded));
+    }
+
+    #[test]
+    fn keeps_batches_open_readers_still_need() {
+        let dir = temp_dir("readers");
+        let policy = HistoryPolicy { sync: SyncMode::Always, segment_bytes: 256, ..HistoryPolicy::default() };
+        let fill = |history: &mut BatchHistory, numbers: std::ops::RangeInclusive<u64>| {
+            for n in numbers {
+                history.save_batch(&Batch::new(n, BatchDirection::Incoming, fd_msg(n))).unwrap();
+            }
+        };
+
+        // A runtime starts streaming before a newer checkpoint arrives.
+        let mut history = BatchHistory::new(&dir, policy.clone()).unwrap();
+        fill(&mut history, 1..=100);
+        let mut reader = history.reader().unwrap();
+        assert!(history.save_checkpoint(80, b"cp").unwrap());
+        drop(history);
+        let mut out = Vec::new();
+        assert_eq!(reader.stream_incoming_since(0, &mut out).unwrap(), (100, 100));
+        drop(reader);
+
+        // With no reader left, the next checkpoint collects them.
+        let mut history = BatchHistory::new(&dir, policy).unwrap();
+        fill(&mut history, 101..=120);
+        assert!(history.save_checkpoint(90, b"cp").unwrap());
+        drop(history);
+        let history = BatchHistory::new(&dir, HistoryPolicy::default()).unwrap();
+        let mut reader = history.reader().unwrap();
+        let err = reader.stream_incoming_since(0, &mut Vec::new()).unwrap_err();
+        assert_eq!(err.kind(), io::ErrorKind::NotFound);
+        let (last, sent) = reader.stream_incoming_since(90, &mut Vec::new()).unwrap();
+        assert_eq!((last, sent), (120, 30));
+        drop(history);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn compacts_sealed_segments_in_the_background() {
+        let dir = temp_dir("compact");
+        let policy = HistoryPolicy { sync: SyncMode::Always, segment_bytes: 256, ..HistoryPolicy::default() };
+        let batches: Vec<Batch> = (1..=200)
+            .map(|n| Batch::new(n, BatchDirection::Incoming, if n % 50 == 0 { fd_msg(n) } else { clock(n) }))
+            .collect();
+        {
+            let mut history = BatchHistory::new(&dir, policy.clone()).unwrap();
+            for batch in &batches {
+                history.save_batch(batch).unwrap();
+            }
+        }
+        // Reopening finishes any compaction still queued and drops stale files.
+        let history = BatchHistory::new(&dir, policy).unwrap();
+        drop(history);
+        let history = BatchHistory::new(&dir, HistoryPolicy::default()).unwrap();
+        let manifest = fs::read_to_string(dir.join(MANIFEST)).unwrap();
+        assert!(manifest.lines().any(|l| l.contains("compacted")), "{}", manifest);
+        assert!(!manifest.lines().any(|l| l.contains("sealed")), "{}", manifest);
+        assert!(!manifest.lines().any(|l| l.ends_with(" 0") && l.contains("compacted")), "{}", manifest);
+        let files = fs::read_dir(&dir).unwrap().count();
+        assert_eq!(files, 2 * manifest.lines().count() + 1, "{}", manifest);
+
+        let read: Vec<_> = history.get_batches_since(0).unwrap()
+            .into_iter()
+            .map(|b| (b.number, b.data))
+            .collect();
+        let expected: Vec<_> = batches.into_iter().map(|b| (b.number, b.data)).collect();
+        assert_eq!(read, expected);
+        drop(history);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -27,6 +27,20 @@ pub enum NetworkOperation {
     },
 }
 
+impl NetworkOperation {
+    /// The operation's name and payload size, for logs that must not dump data.
+    pub fn summary(&self) -> (&'static str, usize) {
+        match self {
+            NetworkOperation::Connect { .. } => ("connect", 0),
+            NetworkOperation::Send { data, .. } => ("send", data.len()),
+            NetworkOperation::Close { .. } => ("close", 0),
+            NetworkOperation::Listen { .. } => ("listen", 0),
+            NetworkOperation::Accept { .. } => ("accept", 0),
+            NetworkOperation::Recv { .. } => ("recv", 0),
+        }
+    }
+}
+
 /// High-level command variants.
 #[derive(Clone, Debug)]
 pub enum Command {
@@ -0,0 +1,250 @@
+use std::collections::BTreeMap;
+
+use log::{error, info, warn};
+
+use crate::batch::Control;
+use crate::batch_buffer::env_parse;
+use crate::metrics::{Exposition, CONSENSUS};
+
+/// Outgoing batches behind the newest one whose digests are kept for
+/// comparison. A replica further behind than this is reported as lagging.
+pub const DIGEST_WINDOW: u64 = 1024;
+
+/// Which runtimes send their outgoing records.
+#[derive(Debug, Clone, Copy)]
+pub struct OutgoingPolicy {
+    /// Only one runtime, the leader, sends records; the others send digests.
+    pub leader_only: bool,
+    /// Outgoing batches the leader may fall behind a follower before another
+    /// runtime takes over.
+    pub max_leader_lag: u64,
+}
+
+impl Default for OutgoingPolicy {
+    fn default() -> Self {
+        Self { leader_only: false, max_leader_lag: 16 }
+    }
+}
+
+impl OutgoingPolicy {
+    pub fn from_env() -> Self {
+        let defaults = Self::default();
+        let policy = Self {
+            leader_only: env_parse::<u8>("REPLICODE_OUTGOING_LEADER").map_or(defaults.leader_only, |v| v != 0),
+            max_leader_lag: env_parse("REPLICODE_LEADER_MAX_LAG").unwrap_or(defaults.max_leader_lag),
+        };
+        info!("Outgoing policy: {:?}", policy);
+        policy
+    }
+}
+
+/// What to do with an outgoing batch from one replica.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Verdict {
+    /// First copy of this batch number with records: apply it.
+    Apply,
+    /// A copy was already applied, or this one is only a digest.
+    Duplicate,
+}
+
+/// The first copy of an outgoing batch seen, full or summary: its digest
+/// and who sent it.
+struct FirstCopy {
+    digest: Option<u64>,
+    runtime_id: u64,
+}
+
+#[derive(Default)]
+struct Replica {
+    /// Newest outgoing batch number this replica sent.
+    last: u64,
+    /// Batch at which its digest first disagreed with the first copy.
+    diverged_at: Option<u64>,
+    lagging: bool,
+}
+
+/// Every replica produces the same outgoing batches, and the first copy
+/// with records of each number is applied. Every copy is checked against
+/// the digest of the first one seen, over a window of `DIGEST_WINDOW`
+/// batches, so memory stays bounded however long the session runs.
+///
+/// With `leader_only`, one replica is told to send records and the rest
+/// only digests, so upstream traffic does not grow with the replica count.
+/// A leader that disconnects or falls `max_leader_lag` batches behind a
+/// follower is replaced by the most advanced follower, which resends what
+/// has not been applied yet.
+pub struct OutgoingTracker {
+    policy: OutgoingPolicy,
+    /// Newest outgoing batch number applied.
+    applied: u64,
+    /// Newest outgoing batch number any replica sent.
+    newest: u64,
+    window: BTreeMap<u64, FirstCopy>,
+    replicas: BTreeMap<u64, Replica>,
+    leader: Option<u64>,
+    /// Control frames to send, by runtime.
+    controls: Vec<(u64, Control)>,
+}
+
+impl OutgoingTracker {
+    pub fn new(policy: OutgoingPolicy) -> Self {
+        Self {
+            policy,
+            applied: 0,
+            newest: 0,
+            window: BTreeMap::new(),
+            replicas: BTreeMap::new(),
+            leader: None,
+            controls: Vec::new(),
+        }
+    }
+
+    /// A runtime joined. With `leader_only` it becomes the leader if there
+    /// is none, and a follower otherwise.
+    pub fn connected(&mut self, runtime_id: u64) {
+        self.replicas.entry(runtime_id).or_default();
+        if !self.policy.leader_only {
+            return;
+        }
+        if self.leader.is_some() {
+            self.controls.push((runtime_id, Control { leader: false, resend_after: self.applied }));
+        } else {
+            self.elect();
+        }
+    }
+
+    pub fn remove(&mut self, runtime_id: u64) {
+        self.replicas.remove(&runtime_id);
+        if self.leader == Some(runtime_id) {
+            warn!("Outgoing leader runtime {} disconnected", runtime_id);
+            self.leader = None;
+            self.elect();
+        }
+    }
+
+    /// Control frames queued by the last calls, to send in order.
+    pub fn take_controls(&mut self) -> Vec<(u64, Control)> {
+        std::mem::take(&mut self.controls)
+    }
+
+    /// Checks a copy of outgoing batch `number`. `summary` copies carry
+    /// only the digest.
+    pub fn observe(&mut self, runtime_id: u64, number: u64, digest: Option<u64>, summary: bool) -> Verdict {
+        let replica = self.replicas.entry(runtime_id).or_default();
+        replica.last = replica.last.max(number);
+
+        if number > self.newest {
+            self.newest = number;
+            let oldest = self.newest.saturating_sub(DIGEST_WINDOW);
+            self.window = self.window.split_off(&oldest);
+        }
+        match self.window.get(&number) {
+            None if number + DIGEST_WINDOW >= self.newest => {
+                self.window.insert(number, FirstCopy { digest, runtime_id });
+                replica.lagging = false;
+            }
+            Some(first) => {
+                replica.lagging = false;
+                if let (Some(expected), Some(got)) = (first.digest, digest) {
+                    if expected != got {
+                        CONSENSUS.divergences.inc();
+                        if replica.diverged_at.is_none() {
+                            replica.diverged_at = Some(number);
+                            error!(
+                                "Runtime {} diverged at outgoing batch {}: digest {:016x}, runtime {} sent {:016x}",
+                                runtime_id, number, got, first.runtime_id, expected
+                            );
+                        }
+                    }
+                }
+            }
+            None => {
+                CONSENSUS.unchecked_outgoing.inc();
+                if !replica.lagging {
+                    replica.lagging = true;
+                    warn!(
+                        "Runtime {} is lagging: sent outgoing batch {}, {} behind the newest",
+                        runtime_id, number, self.newest - number
+                    );
+                }
+            }
+        }
+
+        let verdict = if !summary && number > self.applied {
+            self.applied = number;
+            Verdict::Apply
+        } else {
+            Verdict::Duplicate
+        };
+        if self.policy.leader_only && self.leader_lag() > self.policy.max_leader_lag {
+            self.elect();
+        }
+        verdict
+    }
+
+    /// How far the leader is behind the newest outgoing batch.
+    fn leader_lag(&self) -> u64 {
+        match self.leader.and_then(|id| self.replicas.get(&id)) {
+            Some(leader) => self.newest.saturating_sub(leader.last),
+            None => 0,
+        }
+    }
+
+    /// Makes the most advanced replica the leader, if it is ahead of the
+    /// current one, demoting the old leader.
+    fn elect(&mut self) {
+        let current = self.leader.and_then(|id| self.replicas.get(&id)).map(|r| r.last);
+        let Some((&best, candidate)) = self
+            .replicas
+            .iter()
+            .filter(|(id, _)| Some(**id) != self.leader)
+            .max_by_key(|(id, r)| (r.last, std::cmp::Reverse(**id)))
+        else {
+            return;
+        };
+        if current.is_some_and(|last| candidate.last <= last) {
+            return;
+        }
+        if let Some(old) = self.leader {
+            warn!(
+                "Outgoing leader runtime {} is {} batches behind; runtime {} takes over",
+                old,
+                self.leader_lag(),
+                best
+            );
+            self.controls.push((old, Control { leader: false, resend_after: self.applied }));
+            CONSENSUS.leader_failovers.inc();
+        } else {
+            info!("Runtime {} is the outgoing leader", best);
+        }
+        self.leader = Some(best);
+        self.controls.push((best, Control { leader: true, resend_after: self.applied }));
+    }
+
+    pub fn render(&self, out: &mut Exposition) {
+        if self.policy.leader_only {
+            out.gauge(
+                "replicode_outgoing_leader",
+                "Runtime whose outgoing batches are applied, -1 if none.",
+                "",
+                self.leader.map_or(-1, |id| id as i64),
+            );
+        }
+        for (id, replica) in &self.replicas {
+            out.gauge(
+                "replicode_runtime_outgoing_lag_batches",
+                "Outgoing batches a runtime is behind the newest one sent.",
+                &format!("runtime=\"{}\"", id),
+                self.newest.saturating_sub(replica.last) as i64,
+            );
+        }
+        for (id, replica) in &self.replicas {
+            out.gauge(
+                "replicode_runtime_diverged_at",
+                "Outgoing batch at which a runtime's digest first disagreed, 0 if never.",
+                &format!("runtime=\"{}\"", id),
+                replica.diverged_at.unwrap_or(0) as i64,
+            );
+        }
+    }
+}
@@ -3,16 +3,24 @@ use std::io::{Read, Write};
 use std::sync::{Arc, Mutex};
 use std::thread;
 use log::{info, error};
-use serde_json::json;
-use crate::nat::NatTable;
+use crate::divergence::OutgoingTracker;
+use crate::metrics::{self, Exposition, CONSENSUS};
+use crate::nat::Nat;
+use crate::runtime_manager::RuntimeManager;
 
 pub struct HttpServer {
-    nat_table: Arc<Mutex<NatTable>>,
+    nat: Arc<Nat>,
+    runtime_manager: RuntimeManager,
+    outgoing: Arc<Mutex<OutgoingTracker>>,
 }
 
 impl HttpServer {
-    pub fn new(nat_table: Arc<Mutex<NatTable>>) -> Self {
-        HttpServer { nat_table }
+    pub fn new(
+        nat: Arc<Nat>,
+        runtime_manager: RuntimeManager,
+        outgoing: Arc<Mutex<OutgoingTracker>>,
+    ) -> Self {
+        HttpServer { nat, runtime_manager, outgoing }
     }
 
     pub fn start(&self, port: u16) -> std::io::Result<()> {
@@ -22,9 +30,11 @@ impl HttpServer {
         for stream in listener.incoming() {
             match stream {
                 Ok(stream) => {
-                    let nat_table = Arc::clone(&self.nat_table);
+                    let nat = Arc::clone(&self.nat);
+                    let runtime_manager = self.runtime_manager.clone();
+                    let outgoing = Arc::clone(&self.outgoing);
                     thread::spawn(move || {
-                        if let Err(e) = Self::handle_client(stream, nat_table) {
+                        if let Err(e) = Self::handle_client(stream, nat, runtime_manager, outgoing) {
                             error!("Error handling client: {}", e);
                         }
                     });
@@ -37,7 +47,12 @@ impl HttpServer {
         Ok(())
     }
 
-    fn handle_client(mut stream: TcpStream, nat_table: Arc<Mutex<NatTable>>) -> std::io::Result<()> {
+    fn handle_client(
+        mut stream: TcpStream,
+        nat: Arc<Nat>,
+        runtime_manager: RuntimeManager,
+        outgoing: Arc<Mutex<OutgoingTracker>>,
+    ) -> std::io::Result<()> {
         let mut buffer = [0; 1024];
         let n = stream.read(&mut buffer)?;
         let request = String::from_utf8_lossy(&buffer[..n]);
@@ -48,26 +63,21 @@ impl HttpServer {
         // Generate response based on path
         let response = match path {
             "/status" => {
-                let nat_table = nat_table.lock().unwrap();
-                let status = json!({
-                    "processes": nat_table.get_process_info(),
-                    "connections": nat_table.get_connection_info(),
-                    "listeners": nat_table.get_listener_info(),
-                    "mappings": nat_table.get_port_mappings().iter().map(|(pid, process_port, consensus_port, mapping_type)| {
-                        json!({
-                            "pid": pid,
-                            "process_port": process_port,
-                            "consensus_port": consensus_port,
-                            "type": mapping_type
-                        })
-                    }).collect::<Vec<_>>()
-                });
+                // Built from a snapshot, so no shard stays locked while it is written out
+                let status = nat.snapshot().to_json();
                 format!(
                     "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: {}\r\n\r\n{}",
                     status.to_string().len(),
                     status
                 )
             }
+            "/metrics" => {
+                let mut out = Exposition::new();
+                CONSENSUS.render(&mut out);
+                runtime_manager.render_metrics(&mut out);
+                outgoing.lock().unwrap().render(&mut out);
+                metrics::http_response(&out.finish())
+            }
             _ => {
                 "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n".to_string()
             }
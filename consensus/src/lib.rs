@@ -1,5 +1,7 @@
+pub mod aot;
 pub mod commands;
 pub mod record;
+pub mod wire;
 pub mod nat;
 pub mod modes;
 pub mod http_server;
@@ -7,6 +9,11 @@ pub mod clients;
 pub mod runtime_manager;
 pub mod batch;
 pub mod batch_history;
+pub mod batch_buffer;
+pub mod metrics;
+pub mod divergence;
+pub mod runtime_sender;
+pub mod runtime_reader;
 
 pub use http_server::HttpServer;
 pub use modes::run_tcp_mode;
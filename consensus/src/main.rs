@@ -1,10 +1,14 @@
+mod aot;
 mod commands;
 mod record;
+mod wire;
 mod modes {
     pub mod benchmark;
     pub mod tcp;
+    pub mod workload;
     pub use benchmark::run_benchmark_mode;
     pub use tcp::run_tcp_mode;
+    pub use workload::run_workload_mode;
 }
 mod nat;
 mod clients;
@@ -12,6 +16,11 @@ mod http_server;
 mod batch;
 mod runtime_manager;
 mod batch_history;
+mod batch_buffer;
+mod divergence;
+use consensus::metrics;
+mod runtime_sender;
+mod runtime_reader;
 use std::env;
 use std::io;
 use log::{info, error};
@@ -23,9 +32,10 @@ fn main() -> io::Result<()> {
 
     eprintln!("Consensus Input Tool");
     eprintln!("----------------------");
-    eprintln!("Record format: [ msg_type: u8 ][ process_id: u64 ][ msg_size: u16 ][ payload: [u8; msg_size] ]");
+    eprintln!("Record format: [ tag: u8 ][ process_id: varint ][ len: varint ][ payload: [u8; len] ] (see wire.rs)");
     eprintln!("Benchmark mode: records are written immediately to a binary file.");
     eprintln!("TCP mode: enter commands interactively; every 10 seconds a batch is sent over TCP with an automatic clock record appended.");
+    eprintln!("Workload mode: generates record streams and measures request latency ('workload' without arguments prints usage).");
     eprintln!("Test server: starts a local echo server on 127.0.0.1:8000 for testing network connections.");
     eprintln!("Test client: starts a test client for testing network connections.");
     eprintln!("Type 'exit' to quit.\n");
@@ -48,6 +58,7 @@ fn main() -> io::Result<()> {
         //     modes::run_hybrid_mode(input_file_path)
         // },
         "tcp" => modes::run_tcp_mode(),
+        "workload" => modes::run_workload_mode(&args[2..]),
         "test-server" => clients::start_test_server(),
         "test-client" => {
             clients::run_test_client();
@@ -0,0 +1,336 @@
+use std::collections::BTreeSet;
+use std::fmt::Write as _;
+use std::io::{Read, Write};
+use std::net::{TcpListener, TcpStream};
+use std::sync::atomic::{AtomicI64, AtomicU64, Ordering};
+use std::time::Duration;
+
+use log::{error, info};
+
+/// Histogram buckets; bucket `i` counts values up to `2^i`, the last one
+/// everything larger.
+const BUCKETS: usize = 32;
+
+/// A monotonically increasing count.
+#[derive(Debug, Default)]
+pub struct Counter(AtomicU64);
+
+impl Counter {
+    pub const fn new() -> Self {
+        Counter(AtomicU64::new(0))
+    }
+
+    pub fn inc(&self) {
+        self.add(1);
+    }
+
+    pub fn add(&self, n: u64) {
+        self.0.fetch_add(n, Ordering::Relaxed);
+    }
+
+    pub fn get(&self) -> u64 {
+        self.0.load(Ordering::Relaxed)
+    }
+}
+
+/// A value that can go up and down.
+#[derive(Debug, Default)]
+pub struct Gauge(AtomicI64);
+
+impl Gauge {
+    pub const fn new() -> Self {
+        Gauge(AtomicI64::new(0))
+    }
+
+    pub fn set(&self, value: i64) {
+        self.0.store(value, Ordering::Relaxed);
+    }
+
+    pub fn get(&self) -> i64 {
+        self.0.load(Ordering::Relaxed)
+    }
+}
+
+/// Distribution of u64 observations in power-of-two buckets. Observing is
+/// three relaxed atomic adds, so it is safe to use on hot paths and from
+/// any thread. Durations are observed in microseconds.
+#[derive(Debug)]
+pub struct Histogram {
+    buckets: [AtomicU64; BUCKETS + 1],
+    sum: AtomicU64,
+    count: AtomicU64,
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl Histogram {
+    pub const fn new() -> Self {
+        #[allow(clippy::declare_interior_mutable_const)]
+        const ZERO: AtomicU64 = AtomicU64::new(0);
+        Histogram { buckets: [ZERO; BUCKETS + 1], sum: ZERO, count: ZERO }
+    }
+
+    pub fn observe(&self, value: u64) {
+        // Smallest i with value <= 2^i.
+        let bucket = (u64::BITS - value.saturating_sub(1).leading_zeros()) as usize;
+        self.buckets[bucket.min(BUCKETS)].fetch_add(1, Ordering::Relaxed);
+        self.sum.fetch_add(value, Ordering::Relaxed);
+        self.count.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn observe_duration(&self, elapsed: Duration) {
+        self.observe(elapsed.as_micros() as u64);
+    }
+
+    pub fn count(&self) -> u64 {
+        self.count.load(Ordering::Relaxed)
+    }
+
+    pub fn sum(&self) -> u64 {
+        self.sum.load(Ordering::Relaxed)
+    }
+}
+
+/// Unit a histogram's observations are rendered in.
+#[derive(Debug, Clone, Copy)]
+pub enum Unit {
+    /// Observed in microseconds, exported in seconds.
+    Micros,
+    /// Observed in nanoseconds, exported in seconds.
+    Nanos,
+    /// Exported as observed (bytes, records, ...).
+    Plain,
+}
+
+impl Unit {
+    fn scale(self, value: u64) -> f64 {
+        match self {
+            Unit::Micros => value as f64 / 1e6,
+            Unit::Nanos => value as f64 / 1e9,
+            Unit::Plain => value as f64,
+        }
+    }
+}
+
+/// Builds a Prometheus text-format exposition. Samples of one metric must
+/// be added together; `# HELP`/`# TYPE` are written before the first one.
+#[derive(Default)]
+pub struct Exposition {
+    out: String,
+    described: BTreeSet<&'static str>,
+}
+
+impl Exposition {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    fn describe(&mut self, name: &'static str, kind: &str, help: &str) {
+        if self.described.insert(name) {
+            let _ = writeln!(self.out, "# HELP {} {}\n# TYPE {} {}", name, help, name, kind);
+        }
+    }
+
+    /// `labels` is empty or a list like `pid="3",reason="stdin"`.
+    pub fn counter(&mut self, name: &'static str, help: &str, labels: &str, value: u64) {
+        self.describe(name, "counter", help);
+        let _ = writeln!(self.out, "{}{} {}", name, braces(labels), value);
+    }
+
+    pub fn gauge(&mut self, name: &'static str, help: &str, labels: &str, value: i64) {
+        self.describe(name, "gauge", help);
+        let _ = writeln!(self.out, "{}{} {}", name, braces(labels), value);
+    }
+
+    pub fn histogram(&mut self, name: &'static str, help: &str, labels: &str, hist: &Histogram, unit: Unit) {
+        self.describe(name, "histogram", help);
+        let sep = if labels.is_empty() { "" } else { "," };
+        let mut cumulative = 0;
+        for (i, bucket) in hist.buckets[..BUCKETS].iter().enumerate() {
+            cumulative += bucket.load(Ordering::Relaxed);
+            let _ = writeln!(
+                self.out,
+                "{}_bucket{{{}{}le=\"{}\"}} {}",
+                name, labels, sep, unit.scale(1u64 << i), cumulative
+            );
+        }
+        cumulative += hist.buckets[BUCKETS].load(Ordering::Relaxed);
+        let _ = writeln!(self.out, "{}_bucket{{{}{}le=\"+Inf\"}} {}", name, labels, sep, cumulative);
+        let _ = writeln!(self.out, "{}_sum{} {}", name, braces(labels), unit.scale(hist.sum()));
+        let _ = writeln!(self.out, "{}_count{} {}", name, braces(labels), cumulative);
+    }
+
+    pub fn finish(self) -> String {
+        self.out
+    }
+}
+
+fn braces(labels: &str) -> String {
+    if labels.is_empty() {
+        String::new()
+    } else {
+        format!("{{{}}}", labels)
+    }
+}
+
+/// HTTP response carrying an exposition.
+pub fn http_response(body: &str) -> String {
+    format!(
+        "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: {}\r\n\r\n{}",
+        body.len(),
+        body
+    )
+}
+
+/// Serves `GET /metrics` on `addr` with whatever `render` returns, one
+/// request per connection, on the calling thread.
+pub fn serve(addr: &str, render: impl Fn() -> String) -> std::io::Result<()> {
+    let listener = TcpListener::bind(addr)?;
+    info!("Metrics endpoint listening on http://{}/metrics", addr);
+    for stream in listener.incoming() {
+        match stream {
+            Ok(stream) => {
+                if let Err(e) = answer(stream, &render) {
+                    error!("Error serving metrics: {}", e);
+                }
+            }
+            Err(e) => error!("Failed to accept metrics connection: {}", e),
+        }
+    }
+    Ok(())
+}
+
+fn answer(mut stream: TcpStream, render: &impl Fn() -> String) -> std::io::Result<()> {
+    let mut buffer = [0; 1024];
+    let n = stream.read(&mut buffer)?;
+    let request = String::from_utf8_lossy(&buffer[..n]);
+    let path = request.lines().next().unwrap_or("").split_whitespace().nth(1).unwrap_or("/");
+    let response = if path == "/metrics" {
+        http_response(&render())
+    } else {
+        "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n".to_string()
+    };
+    stream.write_all(response.as_bytes())?;
+    stream.flush()
+}
+
+/// Consensus-side metrics.
+pub struct ConsensusMetrics {
+    pub batches: Counter,
+    pub batch_bytes: Histogram,
+    pub batch_records: Histogram,
+    /// From a batch's first record arriving until the batch is cut.
+    pub batch_build: Histogram,
+    /// From cutting a batch until it is queued for every runtime.
+    pub batch_broadcast: Histogram,
+    pub outgoing_batches: Counter,
+    pub nat_bytes_in: Counter,
+    pub nat_bytes_out: Counter,
+    /// Send operations queued on external connections, and the vectored
+    /// writes that flushed them.
+    pub nat_sends: Counter,
+    pub nat_writes: Counter,
+    /// Recv deliveries that left data for later batches, recvs deferred to
+    /// the next batch by their process's budget, and reads paused on a
+    /// full window.
+    pub nat_split_recvs: Counter,
+    pub nat_deferred_recvs: Counter,
+    pub nat_paused_reads: Counter,
+    /// Outgoing batch copies whose state digest disagreed with the first copy.
+    pub divergences: Counter,
+    /// Outgoing batch copies too old to compare against the first copy.
+    pub unchecked_outgoing: Counter,
+    /// Times another runtime took over as outgoing leader.
+    pub leader_failovers: Counter,
+}
+
+pub static CONSENSUS: ConsensusMetrics = ConsensusMetrics {
+    batches: Counter::new(),
+    batch_bytes: Histogram::new(),
+    batch_records: Histogram::new(),
+    batch_build: Histogram::new(),
+    batch_broadcast: Histogram::new(),
+    outgoing_batches: Counter::new(),
+    nat_bytes_in: Counter::new(),
+    nat_bytes_out: Counter::new(),
+    nat_sends: Counter::new(),
+    nat_writes: Counter::new(),
+    nat_split_recvs: Counter::new(),
+    nat_deferred_recvs: Counter::new(),
+    nat_paused_reads: Counter::new(),
+    divergences: Counter::new(),
+    unchecked_outgoing: Counter::new(),
+    leader_failovers: Counter::new(),
+};
+
+impl ConsensusMetrics {
+    pub fn render(&self, out: &mut Exposition) {
+        out.counter("replicode_batches_total", "Incoming batches cut and broadcast.", "", self.batches.get());
+        out.histogram("replicode_batch_bytes", "Encoded size of each Incoming batch.", "", &self.batch_bytes, Unit::Plain);
+        out.histogram("replicode_batch_records", "Records in each Incoming batch.", "", &self.batch_records, Unit::Plain);
+        out.histogram(
+            "replicode_batch_build_seconds",
+            "Time from a batch's first record until the batch is cut.",
+            "",
+            &self.batch_build,
+            Unit::Micros,
+        );
+        out.histogram(
+            "replicode_batch_broadcast_seconds",
+            "Time from cutting a batch until it is queued for every runtime.",
+            "",
+            &self.batch_broadcast,
+            Unit::Micros,
+        );
+        out.counter(
+            "replicode_outgoing_batches_total",
+            "Outgoing batches received from runtimes.",
+            "",
+            self.outgoing_batches.get(),
+        );
+        out.counter("replicode_nat_bytes_in_total", "Bytes received from external connections.", "", self.nat_bytes_in.get());
+        out.counter("replicode_nat_bytes_out_total", "Bytes sent on external connections.", "", self.nat_bytes_out.get());
+        out.counter("replicode_nat_sends_total", "Send operations queued on external connections.", "", self.nat_sends.get());
+        out.counter("replicode_nat_writes_total", "Vectored writes to external connections.", "", self.nat_writes.get());
+        out.counter(
+            "replicode_nat_split_recvs_total",
+            "Recv deliveries that left received data for later batches.",
+            "",
+            self.nat_split_recvs.get(),
+        );
+        out.counter(
+            "replicode_nat_deferred_recvs_total",
+            "Recvs deferred to the next batch by their process's byte budget.",
+            "",
+            self.nat_deferred_recvs.get(),
+        );
+        out.counter(
+            "replicode_nat_paused_reads_total",
+            "Times a connection stopped being read on a full window.",
+            "",
+            self.nat_paused_reads.get(),
+        );
+        out.counter(
+            "replicode_divergences_total",
+            "Outgoing batch copies whose state digest disagreed with the first copy.",
+            "",
+            self.divergences.get(),
+        );
+        out.counter(
+            "replicode_unchecked_outgoing_total",
+            "Outgoing batch copies that arrived too late to compare digests.",
+            "",
+            self.unchecked_outgoing.get(),
+        );
+        out.counter(
+            "replicode_leader_failovers_total",
+            "Times another runtime took over as outgoing leader.",
+            "",
+            self.leader_failovers.get(),
+        );
+    }
+}
@@ -3,6 +3,7 @@ use std::fs::OpenOptions;
 use log::info;
 
 use crate::record::write_record;
+use crate::wire;
 use crate::commands::{parse_command, Command};
 
 pub fn run_benchmark_mode() -> io::Result<()> {
@@ -11,6 +12,11 @@ pub fn run_benchmark_mode() -> io::Result<()> {
         .create(true)
         .append(true)
         .open(file_path)?;
+    if output.metadata()?.len() == 0 {
+        let mut header = Vec::new();
+        wire::start_batch(&mut header);
+        output.write_all(&header)?;
+    }
 
     loop {
         eprint!("Command (init <wasm_file> | msg <pid> <message> | ftp <pid> <ftp_command> | clock <nanoseconds>): ");
@@ -1,5 +1,7 @@
 pub mod benchmark;
 pub mod tcp;
+pub mod workload;
 
 pub use benchmark::run_benchmark_mode;
 pub use tcp::run_tcp_mode;
+pub use workload::run_workload_mode;
@@ -1,27 +1,37 @@
-use std::io::{self, Write, Read, BufReader};
+use std::io::{self, Write};
 use std::sync::{Arc, Mutex};
 use std::thread;
-use std::time::Duration;
+use std::time::Instant;
 use std::path::PathBuf;
-use std::collections::HashSet;
-use log::{error, info, debug, warn};
+use log::{error, info, debug, trace, warn};
 use bincode;
 use chrono::Local;
+use mio::{Events, Poll};
 
-use crate::record::write_record;
+use crate::record::{write_record, write_status_record};
+use crate::wire::{self, Record, Records};
 use crate::commands::{parse_command, Command, NetworkOperation};
-use crate::nat::NatTable;
+use crate::nat::{self, Nat};
 use crate::http_server::HttpServer;
+use crate::metrics::CONSENSUS;
 use crate::runtime_manager::RuntimeManager;
-use crate::batch::{Batch, BatchDirection};
-use crate::batch_history::BatchHistory;
+use crate::batch::{self, Batch, BatchDirection, Checkpoint, ACK_DIRECTION, ACK_READY, CHECKPOINT_DIRECTION};
+use crate::divergence::{OutgoingPolicy, OutgoingTracker, Verdict};
+use crate::batch_history::{BatchHistory, HistoryPolicy};
+use crate::batch_buffer::{BatchBuffer, BatchPolicy};
+use crate::runtime_reader::{ReaderEvent, RuntimeFrame};
+
+/// Batches between logs of per-runtime sender statistics.
+const SENDER_STATS_INTERVAL: u64 = 1000;
+/// Readiness events handled per wakeup of the NAT poller.
+const NAT_EVENTS_CAPACITY: usize = 256;
 
 pub struct TcpMode {
     runtime_manager: RuntimeManager,
-    nat_table: Arc<Mutex<NatTable>>,
-    shared_buffer: Arc<Mutex<Vec<u8>>>,
+    nat: Arc<Nat>,
+    shared_buffer: Arc<BatchBuffer>,
     batch_history: Arc<Mutex<BatchHistory>>,
-    executed_outgoing: Arc<Mutex<HashSet<u64>>>,
+    outgoing: Arc<Mutex<OutgoingTracker>>,
 }
 
 impl TcpMode {
@@ -33,21 +43,21 @@ impl TcpMode {
         // Create sessions directory if it doesn't exist
         let sessions_dir = PathBuf::from("sessions");
         std::fs::create_dir_all(&sessions_dir)?;
-        let history_path = sessions_dir.join(format!("session-{}.bin", date));
-        let batch_history: Arc<Mutex<BatchHistory>> = Arc::new(Mutex::new(BatchHistory::new(&history_path)?));
+        let history_dir = sessions_dir.join(format!("session-{}", date));
+        let batch_history: Arc<Mutex<BatchHistory>> = Arc::new(Mutex::new(BatchHistory::new(&history_dir, HistoryPolicy::from_env())?));
         
         let runtime_manager = RuntimeManager::new("127.0.0.1:9000", Arc::clone(&batch_history))?;
-        let nat_table = Arc::new(Mutex::new(NatTable::new()));
-        let shared_buffer = Arc::new(Mutex::new(Vec::new()));
-        let executed_outgoing = Arc::new(Mutex::new(HashSet::new()));
+        let nat = Arc::new(Nat::from_env());
+        let shared_buffer = Arc::new(BatchBuffer::new(BatchPolicy::from_env()));
+        let outgoing = Arc::new(Mutex::new(OutgoingTracker::new(OutgoingPolicy::from_env())));
         
         info!("TcpMode initialized successfully");
         Ok(Self {
             runtime_manager,
-            nat_table,
+            nat,
             shared_buffer,
             batch_history,
-            executed_outgoing,
+            outgoing,
         })
     }
 
@@ -77,7 +87,10 @@ impl TcpMode {
         // Run the main command loop
         info!("Starting main command loop");
         self.run_command_loop()?;
-        
+
+        if let Err(e) = self.batch_history.lock().unwrap().sync() {
+            error!("Failed to sync batch history on shutdown: {}", e);
+        }
         info!("TcpMode shutdown complete");
         Ok(())
     }
@@ -85,40 +98,74 @@ impl TcpMode {
     fn start_batch_sender(&self) -> io::Result<()> {
         debug!("Initializing batch sender thread");
         let buffer = Arc::clone(&self.shared_buffer);
+        let nat = Arc::clone(&self.nat);
         let runtime_manager = self.runtime_manager.clone();
         let batch_history: Arc<Mutex<BatchHistory>> = Arc::clone(&self.batch_history);
         thread::spawn(move || {
             let mut batch_number = 0u64;
+            let mut idle_interval = buffer.policy().max_latency;
+            let mut last_cut = Instant::now();
             info!("Batch sender thread started");
             loop {
-                thread::sleep(Duration::from_micros(15000));
-                let mut buf = buffer.lock().unwrap();
+                // Cut on size, record count or latency deadline; back off while idle.
+                let cut = buffer.next_batch(idle_interval);
+                let cut_at = Instant::now();
+                // Recvs held back by their process's budget go in the next batch
+                nat.new_batch(&buffer);
+                if let Some(first_at) = cut.first_at {
+                    CONSENSUS.batch_build.observe_duration(cut_at.duration_since(first_at));
+                }
+                idle_interval = if cut.records == 0 && !cut.hurried {
+                    buffer.policy().next_idle_interval(idle_interval)
+                } else {
+                    buffer.policy().max_latency
+                };
+                let mut data = cut.data;
+                if data.is_empty() {
+                    wire::start_batch(&mut data);
+                }
                 batch_number += 1;
-                debug!("Creating new batch {} with {} bytes", batch_number, buf.len());
+                debug!("Creating new batch {} with {} records ({} bytes)", batch_number, cut.records, data.len());
                 
-                // Append clock record for 10 seconds
-                if let Ok(clock_record) = write_record(&Command::Clock(15_000_000)) {
-                    buf.extend(clock_record);
-                    debug!("Added clock record for 10 seconds");
+                // Append a clock record for the real time since the previous batch
+                let now = Instant::now();
+                let elapsed = now.duration_since(last_cut);
+                last_cut = now;
+                if let Ok(clock_record) = write_record(&Command::Clock(elapsed.as_nanos() as u64)) {
+                    data.extend(clock_record);
+                    debug!("Added clock record for {:?}", elapsed);
                 } else {
                     error!("Failed to create clock record");
                 }
 
-                let batch = Batch {
-                    number: batch_number,
-                    direction: BatchDirection::Incoming,
-                    data: buf.clone(),
-                };
+                let mut batch = Batch::new(batch_number, BatchDirection::Incoming, data);
+                let raw_len = batch.data.len();
+                CONSENSUS.batch_bytes.observe(raw_len as u64);
+                CONSENSUS.batch_records.observe(cut.records as u64);
+                if batch.compress(buffer.policy().compress_min_bytes) {
+                    debug!("Compressed batch {} from {} to {} bytes", batch_number, raw_len, batch.data.len());
+                }
                 
                 // Save batch to history
                 if let Err(e) = batch_history.lock().unwrap().save_batch(&batch) {
                     error!("Failed to save batch {} to history: {}", batch_number, e);
                 }
                 
-                info!("Broadcasting batch {} to all runtimes", batch.number);
-                runtime_manager.broadcast_batch(&batch);
-                buf.clear();
-                debug!("Batch {} broadcast complete, buffer cleared", batch_number);
+                debug!("Broadcasting batch {} to all runtimes", batch.number);
+                runtime_manager.broadcast_batch(batch);
+                CONSENSUS.batches.inc();
+                CONSENSUS.batch_broadcast.observe_duration(cut_at.elapsed());
+                debug!("Batch {} broadcast complete", batch_number);
+
+                if batch_number % SENDER_STATS_INTERVAL == 0 {
+                    for (runtime_id, stats) in runtime_manager.sender_stats() {
+                        info!("Runtime {} sender: {:?}", runtime_id, stats);
+                    }
+                    let slow = runtime_manager.slow_disconnects();
+                    if slow > 0 {
+                        warn!("{} runtimes disconnected so far for falling behind", slow);
+                    }
+                }
             }
         });
         info!("Batch sender thread initialized successfully");
@@ -126,220 +173,45 @@ impl TcpMode {
     }
 
     fn start_runtime_reader(&self) -> io::Result<()> {
-        debug!("Initializing runtime reader thread");
+        debug!("Initializing runtime frame processor thread");
         let runtime_manager = self.runtime_manager.clone();
-        let nat_table = Arc::clone(&self.nat_table);
+        let nat = Arc::clone(&self.nat);
         let shared_buffer = Arc::clone(&self.shared_buffer);
-        let executed_outgoing = Arc::clone(&self.executed_outgoing);
+        let outgoing = Arc::clone(&self.outgoing);
+        let batch_history = Arc::clone(&self.batch_history);
+        let events = runtime_manager.take_reader_events()
+            .ok_or_else(|| io::Error::new(io::ErrorKind::Other, "Runtime reader already started"))?;
         
         thread::spawn(move || {
-            info!("Runtime reader thread started");
-            let mut last_processed_batch = 0u64;
-            loop {
-                // Get list of runtime IDs
-                let runtime_ids: Vec<u64> = {
-                    let conns = runtime_manager.runtimes.lock().unwrap();
-                    conns.keys().copied().collect()
-                };
-                
-                for runtime_id in runtime_ids {
-                    // Get connection for this runtime
-                    let conn = {
-                        let mut conns = runtime_manager.runtimes.lock().unwrap();
-                        if let Some(conn) = conns.get_mut(&runtime_id) {
-                            conn.stream.lock().unwrap().try_clone().ok()
-                        } else {
-                            None
-                        }
-                    };
-
-                    if let Some(stream) = conn {
-                        debug!("Reading from runtime {}", runtime_id);
-                        let mut reader = BufReader::new(stream);
-                        
-                        // Read batch header (8 bytes for batch number, 1 byte for direction)
-                        let mut batch_header = [0u8; 9];
-                        if reader.read_exact(&mut batch_header).is_err() {
-                            error!("Lost connection to runtime {}", runtime_id);
-                            // Remove the disconnected runtime
-                            let mut conns = runtime_manager.runtimes.lock().unwrap();
-                            conns.remove(&runtime_id);
-                            continue;
-                        }
-                        let batch_number = u64::from_le_bytes(batch_header[0..8].try_into().unwrap());
-                        let direction = batch_header[8];
-                        debug!("Received batch {} with direction {} from runtime {}", batch_number, direction, runtime_id);
-                        
-                        // Skip processing if batch number is less than or equal to last processed batch
-                        if batch_number <= last_processed_batch {
-                            debug!("Skipping batch {} (already processed up to {})", batch_number, last_processed_batch);
-                            continue;
-                        }
-                        last_processed_batch = batch_number;
-
-                        // For outgoing batches, check if we've already executed this batch number
-                        if direction == 1 {  // Outgoing batch
-                            let mut done = executed_outgoing.lock().unwrap();
-                            if !done.insert(batch_number) {
-                                debug!("Duplicate outgoing batch {} – skipping", batch_number);
-                                continue;
-                            }
-                        }
-
-                        // Read batch data length (8 bytes)
-                        let mut data_len_buf = [0u8; 8];
-                        if reader.read_exact(&mut data_len_buf).is_err() {
-                            error!("Failed to read batch data length from runtime {}", runtime_id);
-                            continue;
-                        }
-                        let data_len = u64::from_le_bytes(data_len_buf) as usize;
-                        debug!("Reading {} bytes of batch data from runtime {}", data_len, runtime_id);
-
-                        // Read the batch data
-                        let mut batch_data = vec![0u8; data_len];
-                        if reader.read_exact(&mut batch_data).is_err() {
-                            error!("Failed to read batch data from runtime {}", runtime_id);
-                            continue;
-                        }
-
-                        // Process the batch data as a series of records
-                        let mut data_reader = std::io::Cursor::new(batch_data);
-                        loop {
-                            // Read the message type (1 byte)
-                            let mut msg_type_buf = [0u8; 1];
-                            if data_reader.read_exact(&mut msg_type_buf).is_err() {
-                                debug!("No more records in batch {} from runtime {}", batch_number, runtime_id);
-                                break; // No more data.
-                            }
-                            let msg_type = msg_type_buf[0];
-                            debug!("Processing record type {} in batch {} from runtime {}", msg_type, batch_number, runtime_id);
-                            
-                            // If it's a NetworkOut message (type 5)
-                            if msg_type == 5 {
-                                debug!("Processing NetworkOut message from runtime {}", runtime_id);
-                                // Read process ID (8 bytes)
-                                let mut pid_buf = [0u8; 8];
-                                if data_reader.read_exact(&mut pid_buf).is_err() {
-                                    error!("Failed to read process ID from runtime {}", runtime_id);
-                                    break;
-                                }
-                                let pid = u64::from_le_bytes(pid_buf);
-                                debug!("NetworkOut message for process {}", pid);
-                                
-                                // Read payload length (4 bytes)
-                                let mut len_buf = [0u8; 4];
-                                if data_reader.read_exact(&mut len_buf).is_err() {
-                                    error!("Failed to read payload length from runtime {}", runtime_id);
-                                    break;
-                                }
-                                let payload_len = u32::from_le_bytes(len_buf) as usize;
-                                debug!("Reading {} bytes of payload", payload_len);
-                                
-                                // Read payload
-                                let mut payload = vec![0u8; payload_len];
-                                if data_reader.read_exact(&mut payload).is_err() {
-                                    error!("Failed to read payload from runtime {}", runtime_id);
-                                    break;
-                                }
-                                
-                                // Handle network operation
-                                if let Ok(op) = bincode::deserialize::<NetworkOperation>(&payload) {
-                                    info!("Processing network operation from runtime {}: {:?}", runtime_id, op);
-                                    let (src_port, new_port, is_accept, _is_recv) = match &op {
-                                        NetworkOperation::Connect { src_port, .. } => (*src_port, 0, false, false),
-                                        NetworkOperation::Send { src_port, .. } => (*src_port, 0, false, false),
-                                        NetworkOperation::Listen { src_port } => (*src_port, 0, false, false),
-                                        NetworkOperation::Accept { src_port, new_port, .. } => (*src_port, *new_port, true, false),
-                                        NetworkOperation::Close { src_port } => (*src_port, 0, false, false),
-                                        NetworkOperation::Recv { src_port } => (*src_port, 0, false, true),
-                                    };
-
-                                    // Process the network operation
-                                    let mut nat_table = nat_table.lock().unwrap();
-                                    let mut messages = Vec::new();
-                                    let status: u8 = match nat_table.handle_network_operation(pid, op.clone(), &mut messages) {
-                                        Ok(success) => {
-                                            if !success {
-                                                0  // Return status 0 for failure
-                                            } else {
-                                                // Check if operation is waiting
-                                                let is_waiting = match &op {
-                                                    NetworkOperation::Accept { src_port, .. } => nat_table.is_waiting_for_accept(pid, *src_port),
-                                                    NetworkOperation::Recv { src_port } => nat_table.is_waiting_for_recv(pid, *src_port),
-                                                    _ => false
-                                                };
-                                                
-                                                if is_waiting {
-                                                    debug!("Operation is waiting for process {}:{}", pid, src_port);
-                                                    2 // Return status 2 for waiting
-                                                } else {
-                                                    1 // Return status 1 for success
-                                                }
-                                            }
-                                        },
-                                        Err(e) => {
-                                            error!("Failed to handle network operation: {}", e);
-                                            0
-                                        }
-                                    };
-
-                                    // Process any messages returned from the operation
-                                    let mut buf = shared_buffer.lock().unwrap();
-                                    for (msg_pid, msg_port, msg_data, is_connection) in messages {
-                                        if is_connection {
-                                            // Get the new port from the NAT table
-                                            let new_port = nat_table.get_waiting_port(msg_pid, msg_port)
-                                                .unwrap_or_else(|| {
-                                                    error!("1, No waiting accept entry found for {}:{}", msg_pid, msg_port);
-                                                    msg_port + 1  // Fallback to old behavior if entry not found
-                                                });
-
-                                            if let Ok(record) = write_record(&Command::NetworkIn(msg_pid, 0, vec![
-                                                1,  // Success status
-                                                msg_port as u8, (msg_port >> 8) as u8,  // Listening port
-                                                new_port as u8, (new_port >> 8) as u8  // New port from NAT table
-                                            ])) {
-                                                buf.extend(record);
-                                                info!("Added connection notification for process {}:{} -> {}", msg_pid, msg_port, new_port);
-                                                // Clear the waiting state after successfully processing the notification
-                                                nat_table.clear_waiting_accept(msg_pid, msg_port);
-                                            }
-                                        } else if !msg_data.is_empty() {
-                                            debug!("Adding {} bytes of data for process {}:{}", msg_data.len(), msg_pid, msg_port);
-                                            if let Ok(record) = write_record(&Command::NetworkIn(msg_pid, msg_port, msg_data)) {
-                                                buf.extend(record);
-                                            }
-                                            if let Ok(record) = write_record(&Command::NetworkIn(msg_pid, 0, vec![
-                                                1,  // Success status
-                                                msg_port as u8, (msg_port >> 8) as u8,  // Source port
-                                                0, 0  // No new port for recv
-                                            ])) {
-                                                buf.extend(record);
-                                            }
-                                        }
-                                    }
-
-                                    // Add success/failure message to batch
-                                    if let Ok(record) = write_record(&Command::NetworkIn(pid, 0, vec![
-                                        status,  // Use the computed status code
-                                        src_port as u8, (src_port >> 8) as u8,  // Source port
-                                        if is_accept { new_port as u8 } else { 0 },  // New port for accept
-                                        if is_accept { (new_port >> 8) as u8 } else { 0 }  // New port high byte
-                                    ])) {
-                                        buf.extend(record);
-                                        info!("Added network operation result for process {}:{} (status: {})", 
-                                            pid, src_port, status);
-                                    }
-                                } else {
-                                    error!("Failed to deserialize network operation from runtime {}", runtime_id);
-                                }
-                            }
+            info!("Runtime frame processor thread started");
+            for event in events {
+                match event {
+                    ReaderEvent::Opened(runtime_id) => outgoing.lock().unwrap().connected(runtime_id),
+                    ReaderEvent::Frame(frame) if frame.direction == ACK_DIRECTION => {
+                        runtime_manager.acknowledge(frame.runtime_id, frame.number);
+                        if frame.data.first().is_some_and(|flags| flags & ACK_READY != 0) {
+                            shared_buffer.hurry();
                         }
                     }
+                    ReaderEvent::Frame(frame) => process_runtime_frame(
+                        frame,
+                        &nat,
+                        &shared_buffer,
+                        &outgoing,
+                        &batch_history,
+                    ),
+                    ReaderEvent::Closed(runtime_id) => {
+                        outgoing.lock().unwrap().remove(runtime_id);
+                        runtime_manager.remove_runtime(runtime_id);
+                    }
+                }
+                // Leadership changes go out as soon as they are decided.
+                let controls = outgoing.lock().unwrap().take_controls();
+                for (runtime_id, control) in controls {
+                    runtime_manager.send_control(runtime_id, &control);
                 }
-                // Sleep briefly to avoid tight loop
-                //thread::sleep(Duration::from_millis(10));
             }
+            warn!("Runtime frame processor thread ended");
         });
         info!("Runtime reader thread initialized successfully");
         Ok(())
@@ -347,53 +219,32 @@ impl TcpMode {
 
     fn start_nat_checker(&self) -> io::Result<()> {
         debug!("Initializing NAT checker thread");
-        let nat_table = Arc::clone(&self.nat_table);
+        let nat = Arc::clone(&self.nat);
         let shared_buffer = Arc::clone(&self.shared_buffer);
+        // The NAT table registers its sockets with this poller as they are
+        // created, so the thread sleeps until one of them is readable.
+        let mut poll = Poll::new()?;
+        nat.attach_registry(poll.registry().try_clone()?);
         
         thread::spawn(move || {
             info!("NAT checker thread started");
+            let mut events = Events::with_capacity(NAT_EVENTS_CAPACITY);
+            let mut tokens = Vec::with_capacity(NAT_EVENTS_CAPACITY);
             loop {
-                //thread::sleep(Duration::from_millis(10));
-                let messages = nat_table.lock().unwrap().check_for_incoming_data();
-                if !messages.is_empty() {
-                    debug!("Processing {} NAT messages", messages.len());
-                    let mut buf = shared_buffer.lock().unwrap();
-                    for (pid, port, data, is_connection) in messages {
-                        debug!("Processing NAT message for process {}:{} (connection: {})", 
-                            pid, port, is_connection);
-                        if is_connection {
-                            // Get the new port from the NAT table
-                            let new_port = nat_table.lock().unwrap().get_waiting_port(pid, port)
-                                .unwrap_or_else(|| {
-                                    error!("2, No waiting accept entry found for {}:{}", pid, port);
-                                    port + 1  // Fallback to old behavior if entry not found
-                                });
-
-                            if let Ok(record) = write_record(&Command::NetworkIn(pid, 0, vec![
-                                1,  // Success status
-                                port as u8, (port >> 8) as u8,  // Listening port
-                                new_port as u8, (new_port >> 8) as u8  // New port from NAT table
-                            ])) {
-                                buf.extend(record);
-                                info!("Added connection notification for process {}:{} -> {}", pid, port, new_port);
-                                // Clear the waiting state after successfully processing the notification
-                                nat_table.lock().unwrap().clear_waiting_accept(pid, port);
-                            }
-                        } else if !data.is_empty() {
-                            debug!("Adding {} bytes of data for process {}:{}", data.len(), pid, port);
-                            if let Ok(record) = write_record(&Command::NetworkIn(pid, port, data)) {
-                                buf.extend(record);
-                            }
-                            if let Ok(record) = write_record(&Command::NetworkIn(pid, 0, vec![
-                                1,  // Success status
-                                port as u8, (port >> 8) as u8,  // Source port
-                                0, 0  // No new port for recv
-                            ])) {
-                                buf.extend(record);
-                            }
-                        }
+                if let Err(e) = poll.poll(&mut events, nat.poll_timeout()) {
+                    if e.kind() == io::ErrorKind::Interrupted {
+                        continue;
                     }
+                    error!("NAT poller failed: {}", e);
+                    return;
                 }
+                tokens.clear();
+                tokens.extend(events.iter().map(|event| event.token()));
+
+                // Each shard is locked once for its events; new connections
+                // and data for waiting recvs become records of the next batch.
+                nat.handle_readiness(&tokens, &shared_buffer);
+                nat.expire_lingering();
             }
         });
         
@@ -403,7 +254,11 @@ impl TcpMode {
 
     fn start_http_server(&self) -> io::Result<()> {
         debug!("Initializing HTTP server");
-        let http_server = HttpServer::new(Arc::clone(&self.nat_table));
+        let http_server = HttpServer::new(
+            Arc::clone(&self.nat),
+            self.runtime_manager.clone(),
+            Arc::clone(&self.outgoing),
+        );
         thread::spawn(move || {
             info!("HTTP server thread started");
             if let Err(e) = http_server.start(8080) {
@@ -434,9 +289,9 @@ impl TcpMode {
                 //info!("Parsed command: {:?}", cmd);
                 if let Ok(record) = write_record(&cmd) {
                     debug!("Writing command record ({} bytes)", record.len());
-                    let mut buf = self.shared_buffer.lock().unwrap();
-                    buf.extend(record);
-                    info!("Command added to shared buffer");
+                    let mut buf = self.shared_buffer.writer();
+                    buf.push(record);
+                    trace!("Command added to shared buffer");
                 } else {
                     error!("Failed to write command record");
                 }
@@ -454,4 +309,129 @@ pub fn run_tcp_mode() -> io::Result<()> {
     info!("Starting TCP mode");
     let tcp_mode = TcpMode::new()?;
     tcp_mode.run()
-} 
\ No newline at end of file
+} 
+
+/// Applies one frame from a runtime: saves checkpoints, and turns the
+/// NetworkOut records of a not yet seen outgoing batch into NAT operations.
+/// Copies of batches already applied only have their digest checked.
+fn process_runtime_frame(
+    frame: RuntimeFrame,
+    nat: &Nat,
+    shared_buffer: &BatchBuffer,
+    outgoing: &Mutex<OutgoingTracker>,
+    batch_history: &Mutex<BatchHistory>,
+) {
+    let RuntimeFrame { runtime_id, number: batch_number, direction, data: mut batch_data } = frame;
+
+    // Checkpoints are numbered by Incoming batch, not by the runtime's
+    // outgoing counter, so they bypass the duplicate check below.
+    if direction == CHECKPOINT_DIRECTION {
+        match bincode::deserialize::<Checkpoint>(&batch_data) {
+            Ok(cp) if cp.batch == batch_number => {
+                debug!("Checkpoint from runtime {}: {:?}", runtime_id, cp);
+            }
+            _ => {
+                error!("Invalid checkpoint frame for batch {} from runtime {}", batch_number, runtime_id);
+                return;
+            }
+        }
+        if let Err(e) = batch_history.lock().unwrap().save_checkpoint(batch_number, &batch_data) {
+            error!("Failed to save checkpoint at batch {}: {}", batch_number, e);
+        }
+        return;
+    }
+
+    let summary = batch::is_summary(direction);
+    let digest = match batch::split_digest(direction, &mut batch_data) {
+        Ok((_, digest)) => digest,
+        Err(e) => {
+            error!("Invalid batch {} from runtime {}: {}", batch_number, runtime_id, e);
+            return;
+        }
+    };
+    if outgoing.lock().unwrap().observe(runtime_id, batch_number, digest, summary) == Verdict::Duplicate {
+        debug!("Duplicate or summary outgoing batch {} from runtime {} – skipping", batch_number, runtime_id);
+        return;
+    }
+    debug!("Processing {} bytes of batch data from runtime {}", batch_data.len(), runtime_id);
+
+
+    // Process the batch data as a series of records
+    let records = match Records::new(&batch_data) {
+        Ok(records) => records,
+        Err(e) => {
+            error!("Invalid batch {} from runtime {}: {}", batch_number, runtime_id, e);
+            return;
+        }
+    };
+    for record in records {
+        let (pid, op) = match record {
+            Ok(Record::NetworkOut { pid, op }) => (pid, op.to_operation()),
+            Ok(other) => {
+                error!("Unexpected record from runtime {}: {:?}", runtime_id, other);
+                continue;
+            }
+            Err(e) => {
+                error!("Failed to decode batch {} from runtime {}: {}", batch_number, runtime_id, e);
+                break;
+            }
+        };
+        debug!("NetworkOut message for process {}", pid);
+
+        // Handle network operation
+        let (src_port, new_port, is_accept, is_recv) = match &op {
+            NetworkOperation::Connect { src_port, .. } => (*src_port, 0, false, false),
+            NetworkOperation::Send { src_port, .. } => (*src_port, 0, false, false),
+            NetworkOperation::Listen { src_port } => (*src_port, 0, false, false),
+            NetworkOperation::Accept { src_port, new_port, .. } => (*src_port, *new_port, true, false),
+            NetworkOperation::Close { src_port } => (*src_port, 0, false, false),
+            NetworkOperation::Recv { src_port } => (*src_port, 0, false, true),
+        };
+        trace!("Processing network operation from runtime {} for process {}:{}", runtime_id, pid, src_port);
+
+        // Process the network operation. A recv spends its process's budget
+        // for the batch being filled, so the buffer is held from the budget
+        // check until its data is pushed; other operations may block on a
+        // connect and take it afterwards.
+        let mut nat_table = nat.shard(pid);
+        let held = is_recv.then(|| shared_buffer.writer());
+        if let Some(buf) = &held {
+            nat_table.sync_budget(buf.cuts());
+        }
+        let mut messages = Vec::new();
+        let status: u8 = match nat_table.handle_network_operation(pid, op.clone(), &mut messages) {
+            Ok(success) => {
+                if !success {
+                    0  // Return status 0 for failure
+                } else {
+                    // Check if operation is waiting
+                    let is_waiting = match &op {
+                        NetworkOperation::Accept { src_port, .. } => nat_table.is_waiting_for_accept(pid, *src_port),
+                        NetworkOperation::Recv { src_port } => nat_table.is_waiting_for_recv(pid, *src_port),
+                        _ => false
+                    };
+                                    
+                    if is_waiting {
+                        debug!("Operation is waiting for process {}:{}", pid, src_port);
+                        2 // Return status 2 for waiting
+                    } else {
+                        1 // Return status 1 for success
+                    }
+                }
+            },
+            Err(e) => {
+                error!("Failed to handle network operation: {}", e);
+                0
+            }
+        };
+
+        // Process any messages returned from the operation
+        let mut buf = held.unwrap_or_else(|| shared_buffer.writer());
+        nat::push_messages(&mut buf, messages);
+
+        // Add success/failure message to batch, with the new port for accept
+        buf.push(write_status_record(pid, status, src_port, if is_accept { new_port } else { 0 }));
+        trace!("Added network operation result for process {}:{} (status: {})",
+            pid, src_port, status);
+    }
+}
@@ -0,0 +1,399 @@
+use std::collections::HashMap;
+use std::fs::{self, File};
+use std::io::{self, BufRead, BufReader, BufWriter, Read, Write};
+use std::net::TcpStream;
+use std::time::{Duration, Instant};
+
+use log::info;
+
+use crate::commands::Command;
+use crate::record::write_record;
+use crate::wire::{self, Record};
+
+const USAGE: &str = "\
+Usage: consensus workload <command> [--option value ...]
+  gen     --out <file> [--wasm <file>] [--inits N] [--batches B] [--records M]
+          [--payload BYTES] [--kind fd|net] [--port P] [--clock NS]
+          Writes a record file for `runtime benchmark <file>`.
+  script  (same options as gen, no --out)
+          Prints the workload as `consensus tcp` commands, one per line.
+  kv      --addr <[label=]host:port,...> [--requests N] [--keys K] [--value-size BYTES]
+          [--pipeline P]
+          SET/GET round trips against kv_server, one connection per request,
+          or P requests per write on one connection with --pipeline.
+  image   --addr <[label=]host:port,...> --file <path> [--rounds N]
+          SEND/GET round trips against image_server or test/native_image_server.";
+
+/// `--key value` pairs after the workload command.
+struct Options(HashMap<String, String>);
+
+impl Options {
+    fn parse(args: &[String]) -> io::Result<Self> {
+        let mut map = HashMap::new();
+        let mut iter = args.iter();
+        while let Some(arg) = iter.next() {
+            let Some(key) = arg.strip_prefix("--") else {
+                return Err(invalid(format!("unexpected argument '{}'", arg)));
+            };
+            let value = iter.next().ok_or_else(|| invalid(format!("--{} needs a value", key)))?;
+            map.insert(key.to_owned(), value.clone());
+        }
+        Ok(Options(map))
+    }
+
+    fn str(&self, key: &str) -> Option<&str> {
+        self.0.get(key).map(String::as_str)
+    }
+
+    fn required(&self, key: &str) -> io::Result<&str> {
+        self.str(key).ok_or_else(|| invalid(format!("--{} is required", key)))
+    }
+
+    fn num<T: std::str::FromStr>(&self, key: &str, default: T) -> io::Result<T> {
+        match self.str(key) {
+            None => Ok(default),
+            Some(v) => v.parse().map_err(|_| invalid(format!("invalid --{} '{}'", key, v))),
+        }
+    }
+}
+
+fn invalid(msg: String) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidInput, msg)
+}
+
+/// Entry point of `consensus workload`; `args` are the arguments after it.
+pub fn run_workload_mode(args: &[String]) -> io::Result<()> {
+    let Some((command, rest)) = args.split_first() else {
+        eprintln!("{}", USAGE);
+        return Err(invalid("missing workload command".into()));
+    };
+    let options = Options::parse(rest)?;
+    match command.as_str() {
+        "gen" => {
+            let spec = Spec::from_options(&options)?;
+            let out = options.required("out")?;
+            spec.write_file(out)
+        }
+        "script" => Spec::from_options(&options)?.write_script(&mut io::stdout().lock()),
+        "kv" => run_kv(&options),
+        "image" => run_image(&options),
+        other => {
+            eprintln!("{}", USAGE);
+            Err(invalid(format!("unknown workload command '{}'", other)))
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+enum Kind {
+    /// FdMsg records: stdin data for each guest.
+    Fd,
+    /// NetworkIn records on `port`, applied without a guest reading them.
+    Net,
+}
+
+/// A generated record stream: `inits` guests, then `batches` batches of
+/// `records` records each, spread round-robin over the guests and closed by
+/// a Clock record.
+#[derive(Debug)]
+struct Spec {
+    wasm: String,
+    inits: u64,
+    batches: u64,
+    records: u64,
+    payload: usize,
+    kind: Kind,
+    port: u16,
+    clock_ns: u64,
+}
+
+impl Spec {
+    fn from_options(options: &Options) -> io::Result<Self> {
+        let kind = match options.str("kind").unwrap_or("fd") {
+            "fd" => Kind::Fd,
+            "net" => Kind::Net,
+            other => return Err(invalid(format!("unknown --kind '{}'", other))),
+        };
+        let spec = Spec {
+            wasm: options.str("wasm").unwrap_or("wasm_programs/build/bench_sink.wasm").to_owned(),
+            inits: options.num("inits", 1)?,
+            batches: options.num("batches", 1000)?,
+            records: options.num("records", 16)?,
+            payload: options.num("payload", 64)?,
+            kind,
+            port: options.num("port", 7000)?,
+            clock_ns: options.num("clock", 15_000_000)?,
+        };
+        if spec.inits == 0 {
+            return Err(invalid("--inits must be at least 1".into()));
+        }
+        Ok(spec)
+    }
+
+    /// Guests get pids from 1 in Init order, as on a fresh runtime.
+    fn pid(&self, record: u64) -> u64 {
+        record % self.inits + 1
+    }
+
+    /// Stdin bytes guest `pid` will receive, passed to it as its argument
+    /// so bench_sink knows when to exit. NetworkIn workloads send each guest
+    /// a single byte at the end instead.
+    fn stdin_bytes(&self, pid: u64) -> u64 {
+        match self.kind {
+            Kind::Fd => {
+                let total = self.batches * self.records;
+                let mine = total / self.inits + u64::from(pid - 1 < total % self.inits);
+                mine * self.payload as u64
+            }
+            Kind::Net => 1,
+        }
+    }
+
+    fn payload(&self) -> Vec<u8> {
+        (0..self.payload).map(|i| b'a' + (i % 26) as u8).collect()
+    }
+
+    fn write_file(&self, path: &str) -> io::Result<()> {
+        let wasm_bytes = fs::read(&self.wasm)?;
+        let payload = self.payload();
+        let mut out = BufWriter::new(File::create(path)?);
+        let mut buf = Vec::new();
+        wire::start_batch(&mut buf);
+
+        for pid in 1..=self.inits {
+            let init = Command::Init {
+                wasm_bytes: wasm_bytes.clone(),
+                dir_path: None,
+                args: vec![self.stdin_bytes(pid).to_string()],
+            };
+            buf.extend(write_record(&init)?);
+        }
+        Record::Clock { delta: self.clock_ns }.encode(&mut buf);
+
+        let mut total = 0;
+        for batch in 0..self.batches {
+            for i in 0..self.records {
+                let pid = self.pid(batch * self.records + i);
+                match self.kind {
+                    Kind::Fd => Record::FdMsg { pid, data: &payload },
+                    Kind::Net => Record::NetworkIn { pid, port: self.port, data: &payload },
+                }
+                .encode(&mut buf);
+                total += 1;
+            }
+            Record::Clock { delta: self.clock_ns }.encode(&mut buf);
+            out.write_all(&buf)?;
+            buf.clear();
+        }
+        if self.kind == Kind::Net {
+            for pid in 1..=self.inits {
+                Record::FdMsg { pid, data: b"." }.encode(&mut buf);
+            }
+            Record::Clock { delta: self.clock_ns }.encode(&mut buf);
+        }
+        out.write_all(&buf)?;
+        out.flush()?;
+
+        let size = fs::metadata(path)?.len();
+        println!(
+            "workload gen {} inits {} batches {} records {} bytes {}",
+            path, self.inits, self.batches, total, size
+        );
+        Ok(())
+    }
+
+    /// Text payloads only: `msg` takes a word, so the payload is letters.
+    fn write_script(&self, out: &mut impl Write) -> io::Result<()> {
+        if self.kind != Kind::Fd {
+            return Err(invalid("script only supports --kind fd".into()));
+        }
+        let payload = String::from_utf8(self.payload()).unwrap();
+        for pid in 1..=self.inits {
+            writeln!(out, "init {} -a {}", self.wasm, self.stdin_bytes(pid))?;
+        }
+        for batch in 0..self.batches {
+            for i in 0..self.records {
+                writeln!(out, "msg {} {}", self.pid(batch * self.records + i), payload)?;
+            }
+        }
+        out.flush()
+    }
+}
+
+/// Latencies of one kind of request against one target.
+struct Samples {
+    micros: Vec<u64>,
+    started: Instant,
+}
+
+impl Samples {
+    fn new() -> Self {
+        Samples { micros: Vec::new(), started: Instant::now() }
+    }
+
+    fn add(&mut self, elapsed: Duration) {
+        self.micros.push(elapsed.as_micros() as u64);
+    }
+
+    fn print(&mut self, target: &str, op: &str, bytes: u64) {
+        let elapsed = self.started.elapsed().as_secs_f64();
+        self.micros.sort_unstable();
+        let at = |p: f64| match self.micros.len() {
+            0 => 0,
+            n => self.micros[((n - 1) as f64 * p).round() as usize],
+        };
+        let mut line = format!(
+            "workload {} {} n {} p50_us {} p90_us {} p99_us {} max_us {} ops_per_sec {:.1}",
+            target,
+            op,
+            self.micros.len(),
+            at(0.5),
+            at(0.9),
+            at(0.99),
+            at(1.0),
+            self.micros.len() as f64 / elapsed.max(f64::EPSILON)
+        );
+        if bytes > 0 {
+            line += &format!(" mb_per_sec {:.2}", bytes as f64 / elapsed.max(f64::EPSILON) / 1e6);
+        }
+        println!("{}", line);
+    }
+}
+
+/// `label=host:port` entries, labelled by their address when unnamed.
+fn targets(options: &Options) -> io::Result<Vec<(String, String)>> {
+    Ok(options
+        .required("addr")?
+        .split(',')
+        .map(|entry| match entry.split_once('=') {
+            Some((label, addr)) => (label.to_owned(), addr.to_owned()),
+            None => (entry.to_owned(), entry.to_owned()),
+        })
+        .collect())
+}
+
+fn connect(addr: &str) -> io::Result<TcpStream> {
+    let stream = TcpStream::connect(addr)?;
+    stream.set_nodelay(true)?;
+    stream.set_read_timeout(Some(Duration::from_secs(30)))?;
+    Ok(stream)
+}
+
+/// One kv_server request on a fresh connection, like `kv-client` does.
+fn kv_request(addr: &str, line: &str) -> io::Result<String> {
+    let mut stream = connect(addr)?;
+    stream.write_all(line.as_bytes())?;
+    stream.write_all(b"\n")?;
+    let mut response = String::new();
+    BufReader::new(stream).read_line(&mut response)?;
+    Ok(response)
+}
+
+/// Sends `lines` in one write on `stream` and reads a response to each.
+fn kv_pipelined(stream: &mut BufReader<TcpStream>, lines: &[String]) -> io::Result<()> {
+    let mut request = lines.join("\n");
+    request.push('\n');
+    stream.get_mut().write_all(request.as_bytes())?;
+    let mut response = String::new();
+    for _ in lines {
+        response.clear();
+        if stream.read_line(&mut response)? == 0 {
+            return Err(io::Error::new(io::ErrorKind::UnexpectedEof, "kv_server closed the connection"));
+        }
+    }
+    Ok(())
+}
+
+/// Runs `requests` requests made by `line`, timing each. With a pipeline
+/// depth, every request in a write is charged the latency of the write.
+fn kv_run(addr: &str, requests: u64, pipeline: u64, line: impl Fn(u64) -> String) -> io::Result<Samples> {
+    let mut samples = Samples::new();
+    if pipeline == 0 {
+        for i in 0..requests {
+            let start = Instant::now();
+            kv_request(addr, &line(i))?;
+            samples.add(start.elapsed());
+        }
+        return Ok(samples);
+    }
+    let mut stream = BufReader::new(connect(addr)?);
+    for first in (0..requests).step_by(pipeline as usize) {
+        let lines: Vec<String> = (first..requests.min(first + pipeline)).map(&line).collect();
+        let start = Instant::now();
+        kv_pipelined(&mut stream, &lines)?;
+        let elapsed = start.elapsed();
+        for _ in &lines {
+            samples.add(elapsed);
+        }
+    }
+    Ok(samples)
+}
+
+fn run_kv(options: &Options) -> io::Result<()> {
+    let requests: u64 = options.num("requests", 1000)?;
+    let keys: u64 = options.num("keys", 100)?.max(1);
+    let pipeline: u64 = options.num("pipeline", 0)?;
+    let value: String = (0..options.num("value-size", 32)?).map(|i| (b'a' + (i % 26) as u8) as char).collect();
+
+    for (label, addr) in targets(options)? {
+        info!("Running {} kv requests against {} (pipeline {})", requests, addr, pipeline);
+        kv_run(&addr, requests, pipeline, |i| format!("SET key{} {}", i % keys, value))?.print(&label, "set", 0);
+        kv_run(&addr, requests, pipeline, |i| format!("GET key{}", i % keys))?.print(&label, "get", 0);
+    }
+    Ok(())
+}
+
+/// Uploads `data` as `name` and waits for the server to close the connection.
+fn image_send(addr: &str, name: &str, data: &[u8]) -> io::Result<()> {
+    let mut stream = connect(addr)?;
+    writeln!(stream, "SEND {}", name)?;
+    stream.write_all(&(data.len() as u32).to_be_bytes())?;
+    stream.write_all(data)?;
+    let mut response = Vec::new();
+    stream.read_to_end(&mut response)?;
+    Ok(())
+}
+
+/// Downloads `name`, returning its size.
+fn image_get(addr: &str, name: &str) -> io::Result<usize> {
+    let mut stream = connect(addr)?;
+    writeln!(stream, "GET {}", name)?;
+    let mut size = [0u8; 4];
+    stream.read_exact(&mut size)?;
+    let mut data = vec![0u8; u32::from_be_bytes(size) as usize];
+    stream.read_exact(&mut data)?;
+    stream.write_all(b"OK\n")?;
+    let mut rest = Vec::new();
+    stream.read_to_end(&mut rest)?;
+    Ok(data.len())
+}
+
+fn run_image(options: &Options) -> io::Result<()> {
+    let path = options.required("file")?;
+    let rounds: u64 = options.num("rounds", 10)?;
+    let data = fs::read(path)?;
+    let name = std::path::Path::new(path)
+        .file_name()
+        .map_or("workload.bin".into(), |n| n.to_string_lossy().into_owned());
+
+    for (label, addr) in targets(options)? {
+        info!("Running {} image rounds of {} bytes against {}", rounds, data.len(), addr);
+        let mut sends = Samples::new();
+        for _ in 0..rounds {
+            let start = Instant::now();
+            image_send(&addr, &name, &data)?;
+            sends.add(start.elapsed());
+        }
+        sends.print(&label, "send", rounds * data.len() as u64);
+
+        let mut gets = Samples::new();
+        let mut received = 0;
+        for _ in 0..rounds {
+            let start = Instant::now();
+            received += image_get(&addr, &name)? as u64;
+            gets.add(start.elapsed());
+        }
+        gets.print(&label, "get", received);
+    }
+    Ok(())
+}
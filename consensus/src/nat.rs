@@ -1,72 +1,355 @@
-use std::collections::HashMap;
+use std::collections::{HashMap, VecDeque};
 use std::net::{TcpStream, TcpListener};
-use std::io::{Write, Read};
-use log::{info, error, debug};
-use crate::commands::NetworkOperation;
+use std::io::{self, IoSlice, Write, Read};
+use std::os::fd::{AsRawFd, RawFd};
+use std::sync::atomic::{AtomicBool, AtomicU16, AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex, MutexGuard, OnceLock};
+use std::time::{Duration, Instant};
+use mio::{Interest, Registry, Token};
+use mio::unix::SourceFd;
+use log::{info, error, debug, trace};
+use crate::batch_buffer::{env_parse, BatchBuffer, BatchWriter};
+use crate::commands::{Command, NetworkOperation};
+use crate::metrics::CONSENSUS;
+use crate::record::{write_record, write_status_record};
 use serde_json::json;
 
-#[allow(dead_code)]
-pub struct NatEntry {
-    pub process_id: u64,
-    pub process_port: u16,
-    pub consensus_port: u16,
-    pub connection: TcpStream,
-    pub buffer: Vec<u8>,  // Add buffer for received data
+/// First consensus port handed out.
+const FIRST_PORT: u16 = 10000;
+/// Shards of the consensus-side table unless `REPLICODE_NAT_SHARDS` says otherwise.
+const DEFAULT_SHARDS: usize = 16;
+/// Most queued sends handed to one vectored write.
+const MAX_IOVECS: usize = 64;
+/// How long a close waits for the peer to take data still queued.
+const CLOSE_LINGER: Duration = Duration::from_secs(1);
+/// How often the poller wakes to expire closed connections while any linger.
+const LINGER_SWEEP: Duration = Duration::from_millis(100);
+
+/// How much received data reaches processes, and how fast.
+#[derive(Debug, Clone, Copy)]
+pub struct RecvPolicy {
+    /// Bytes of NetworkIn data each process may get per batch; the rest of
+    /// a large read follows in later batches.
+    pub batch_budget: usize,
+    /// Bytes buffered per connection before the NAT stops reading it. TCP
+    /// flow control then slows the remote to the rate the guest consumes.
+    pub window: usize,
 }
 
-#[allow(dead_code)]
-pub struct NatListener {
-    pub process_id: u64,
-    pub process_port: u16,
-    pub consensus_port: u16,
-    pub listener: TcpListener,
-    pub pending_accepts: Vec<TcpStream>,
+impl Default for RecvPolicy {
+    fn default() -> Self {
+        Self { batch_budget: 16 * 1024, window: 256 * 1024 }
+    }
+}
+
+impl RecvPolicy {
+    pub fn from_env() -> Self {
+        let defaults = Self::default();
+        let policy = Self {
+            batch_budget: env_parse("REPLICODE_NAT_RECV_BUDGET").unwrap_or(defaults.batch_budget).max(1),
+            window: env_parse("REPLICODE_NAT_WINDOW").unwrap_or(defaults.window).max(1),
+        };
+        info!("Recv policy: {:?}", policy);
+        policy
+    }
+}
+
+/// The host socket behind a process port.
+pub enum Socket {
+    /// An established connection, with the data read from it that no recv
+    /// has taken yet and the data sent that it has not taken yet.
+    Connection { stream: TcpStream, inbound: Inbound, outbound: Outbound },
+    Listener(TcpListener),
+    /// A connection the process closed with sends still queued. It is
+    /// written as it becomes writable and shut down once drained or at
+    /// `deadline`, whichever comes first.
+    Closing { stream: TcpStream, outbound: Outbound, deadline: Instant },
+}
+
+/// Data read from a connection that no recv has taken yet. Reading stops
+/// at the `RecvPolicy` window and resumes as recvs take data.
+#[derive(Default)]
+pub struct Inbound {
+    data: VecDeque<u8>,
+    /// Reading stopped at the window, not because the socket would block.
+    paused: bool,
+    /// The remote closed; the entry is removed once `data` is delivered.
+    eof: bool,
+}
+
+/// Sends a connection has not taken yet, in order. They are written with
+/// one vectored write per readiness, and a partial write leaves the rest
+/// queued until the socket is writable again.
+#[derive(Default)]
+pub struct Outbound {
+    chunks: VecDeque<Vec<u8>>,
+    /// Bytes of the front chunk already written.
+    offset: usize,
+    /// Whether the socket is registered for writability.
+    writable_interest: bool,
+}
+
+impl Outbound {
+    pub fn len(&self) -> usize {
+        self.chunks.iter().map(Vec::len).sum::<usize>() - self.offset
+    }
+
+    fn push(&mut self, data: Vec<u8>) {
+        if !data.is_empty() {
+            self.chunks.push_back(data);
+        }
+    }
+
+    /// Writes until the queue is empty or the socket would block. Returns
+    /// whether the queue is empty.
+    fn flush(&mut self, stream: &mut TcpStream) -> io::Result<bool> {
+        while !self.chunks.is_empty() {
+            let mut slices = [IoSlice::new(&[]); MAX_IOVECS];
+            let mut count = 0;
+            for (slice, chunk) in slices.iter_mut().zip(&self.chunks) {
+                let skip = if count == 0 { self.offset } else { 0 };
+                *slice = IoSlice::new(&chunk[skip..]);
+                count += 1;
+            }
+            let written = match stream.write_vectored(&slices[..count]) {
+                Ok(0) => return Err(io::ErrorKind::WriteZero.into()),
+                Ok(n) => n,
+                Err(e) if e.kind() == io::ErrorKind::WouldBlock => return Ok(false),
+                Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+                Err(e) => return Err(e),
+            };
+            CONSENSUS.nat_writes.inc();
+            CONSENSUS.nat_bytes_out.add(written as u64);
+            self.advance(written);
+        }
+        Ok(true)
+    }
+
+    fn advance(&mut self, mut written: usize) {
+        while let Some(front) = self.chunks.front() {
+            let left = front.len() - self.offset;
+            if written < left {
+                self.offset += written;
+                return;
+            }
+            written -= left;
+            self.offset = 0;
+            self.chunks.pop_front();
+        }
+    }
 }
 
+impl Socket {
+    fn connection(stream: TcpStream) -> Self {
+        Socket::Connection { stream, inbound: Inbound::default(), outbound: Outbound::default() }
+    }
+
+    fn raw_fd(&self) -> RawFd {
+        match self {
+            Socket::Connection { stream, .. } | Socket::Closing { stream, .. } => stream.as_raw_fd(),
+            Socket::Listener(listener) => listener.as_raw_fd(),
+        }
+    }
+}
+
+/// Everything known about one process port, looked up once per operation:
+/// its consensus port, the host socket and what the process waits on.
+pub struct PortEntry {
+    pub pid: u64,
+    pub port: u16,
+    pub consensus_port: Option<u16>,
+    pub socket: Option<Socket>,
+    /// Port an Accept waiting on this listener gives its connection.
+    pub waiting_accept: Option<u16>,
+    pub waiting_recv: bool,
+}
+
+impl PortEntry {
+    fn is_unused(&self) -> bool {
+        self.consensus_port.is_none() && self.socket.is_none() && self.waiting_accept.is_none() && !self.waiting_recv
+    }
+}
+
+/// What the NAT reports back to a process.
+#[derive(Debug)]
+pub enum NatMessage {
+    /// A waiting Accept on listening `port` got a connection, now `new_port`.
+    Accepted { pid: u64, port: u16, new_port: u16 },
+    /// Data for a recv waiting on `port`. A single zero byte reports that
+    /// the connection closed.
+    Data { pid: u64, port: u16, data: Vec<u8> },
+}
+
+/// Adds the records reporting NAT messages to the next batch.
+pub fn push_messages(buf: &mut BatchWriter<'_>, messages: Vec<NatMessage>) {
+    for message in messages {
+        match message {
+            NatMessage::Accepted { pid, port, new_port } => {
+                // Success status for the listening port, with the new port
+                buf.push(write_status_record(pid, 1, port, new_port));
+                debug!("Added connection notification for process {}:{} -> {}", pid, port, new_port);
+            }
+            NatMessage::Data { pid, port, data } => {
+                debug!("Adding {} bytes of data for process {}:{}", data.len(), pid, port);
+                if let Ok(record) = write_record(&Command::NetworkIn(pid, port, data)) {
+                    buf.push(record);
+                }
+                // Success status for the source port; no new port for recv
+                buf.push(write_status_record(pid, 1, port, 0));
+            }
+        }
+    }
+}
+
+/// State shared by every shard: the consensus port space, the poller and
+/// the recv policy.
+struct Shared {
+    next_port: AtomicU16,
+    registry: OnceLock<Registry>,
+    policy: RecvPolicy,
+    /// Some process used recv budget since the last batch cut.
+    budget_used: AtomicBool,
+    /// Closed connections still draining, in every shard.
+    lingering: AtomicUsize,
+}
+
+/// Port entries of a set of processes, in a slab indexed by
+/// `(pid, process port)`. The slot number is also the entry's poller
+/// token, so a readiness event finds its entry without a lookup. The
+/// consensus process keeps one per shard of `Nat`.
 pub struct NatTable {
-    port_mappings: HashMap<u16, NatEntry>, // consensus_port -> entry
-    process_ports: HashMap<(u64, u16), u16>, // (pid, process_port) -> consensus_port
-    listeners: HashMap<(u64, u16), NatListener>, // (pid, process_port) -> listener
-    connections: HashMap<(u64, u16), u16>, // (pid, process_port) -> connection_consensus_port
-    next_port: u16,
-    waiting_accepts: HashMap<(u64, u16), u16>, // (pid, src_port) -> requested new_port
-    waiting_recvs: HashMap<(u64, u16), bool>, // (pid, src_port) -> is_waiting
+    shard: usize,
+    shards: usize,
+    slots: Vec<Option<PortEntry>>,
+    free: Vec<usize>,
+    index: HashMap<(u64, u16), usize>,
+    shared: Arc<Shared>,
+    /// Recv bytes each process got in the batch being filled.
+    budget_spent: HashMap<u64, usize>,
+    /// Cut count of that batch, see `sync_budget`.
+    budget_batch: u64,
+    /// Slots whose waiting recv ran out of budget, for the next batch.
+    deferred: Vec<usize>,
+    /// Slots of closed connections still draining. They are not in `index`,
+    /// so the process can reuse the port at once.
+    closing: Vec<usize>,
 }
 
 impl NatTable {
-    pub fn new() -> Self {
-        info!("Creating new NAT table");
+    fn shard(shard: usize, shards: usize, shared: Arc<Shared>) -> Self {
         NatTable {
-            port_mappings: HashMap::new(),
-            process_ports: HashMap::new(),
-            listeners: HashMap::new(),
-            connections: HashMap::new(),
-            next_port: 10000, // Start from a high port number
-            waiting_accepts: HashMap::new(),
-            waiting_recvs: HashMap::new(),
+            shard,
+            shards,
+            slots: Vec::new(),
+            free: Vec::new(),
+            index: HashMap::new(),
+            shared,
+            budget_spent: HashMap::new(),
+            budget_batch: 0,
+            deferred: Vec::new(),
+            closing: Vec::new(),
         }
     }
 
-    fn allocate_port(&mut self) -> u16 {
-        let port = self.next_port;
-        self.next_port += 1;
+    fn allocate_port(&self) -> u16 {
+        let port = self.shared.next_port.fetch_add(1, Ordering::Relaxed);
         debug!("Allocated new NAT port: {}", port);
         port
     }
 
+    fn token(&self, slot: usize) -> Token {
+        Token(slot * self.shards + self.shard)
+    }
+
+    fn get(&self, pid: u64, port: u16) -> Option<&PortEntry> {
+        self.slots[*self.index.get(&(pid, port))?].as_ref()
+    }
+
+    /// Slot of the entry for a process port, created empty if there is none.
+    fn slot_for(&mut self, pid: u64, port: u16) -> usize {
+        if let Some(&slot) = self.index.get(&(pid, port)) {
+            return slot;
+        }
+        let slot = self.insert(PortEntry { pid, port, consensus_port: None, socket: None, waiting_accept: None, waiting_recv: false });
+        self.index.insert((pid, port), slot);
+        slot
+    }
+
+    fn insert(&mut self, entry: PortEntry) -> usize {
+        match self.free.pop() {
+            Some(slot) => {
+                self.slots[slot] = Some(entry);
+                slot
+            }
+            None => {
+                self.slots.push(Some(entry));
+                self.slots.len() - 1
+            }
+        }
+    }
+
+    /// Frees the entry in `slot` once nothing refers to it any more.
+    fn release_if_unused(&mut self, slot: usize) {
+        if let Some(entry) = self.slots[slot].as_ref().filter(|entry| entry.is_unused()) {
+            self.index.remove(&(entry.pid, entry.port));
+            self.slots[slot] = None;
+            self.free.push(slot);
+        }
+    }
+
+    /// Gives a process port a consensus port and a socket, registering the
+    /// socket with the NAT poller if one is attached.
+    fn open(&mut self, pid: u64, port: u16, consensus_port: u16, socket: Socket) {
+        let slot = self.slot_for(pid, port);
+        if let Some(registry) = self.shared.registry.get() {
+            let fd = socket.raw_fd();
+            if let Err(e) = registry.register(&mut SourceFd(&fd), self.token(slot), Interest::READABLE) {
+                error!("Failed to register consensus port {} with NAT poller: {}", consensus_port, e);
+            }
+        }
+        let entry = self.slots[slot].as_mut().unwrap();
+        if let Some(old) = entry.socket.replace(socket) {
+            error!("Replacing open socket of {}:{}", pid, port);
+            if let Some(registry) = self.shared.registry.get() {
+                let _ = registry.deregister(&mut SourceFd(&old.raw_fd()));
+            }
+        }
+        entry.consensus_port = Some(consensus_port);
+    }
+
+    /// Drops the socket and consensus port of the entry in `slot`. A recv
+    /// still waiting on it is told the connection closed.
+    fn close(&mut self, slot: usize, messages: &mut Vec<NatMessage>) {
+        let Some(entry) = self.slots[slot].as_mut() else {
+            return;
+        };
+        if let Some(socket) = entry.socket.take() {
+            if let Some(registry) = self.shared.registry.get() {
+                let _ = registry.deregister(&mut SourceFd(&socket.raw_fd()));
+            }
+        }
+        entry.consensus_port = None;
+        entry.waiting_accept = None;
+        if std::mem::take(&mut entry.waiting_recv) {
+            debug!("Connection closed while waiting for recv, sending status 0 for {}:{}", entry.pid, entry.port);
+            messages.push(NatMessage::Data { pid: entry.pid, port: entry.port, data: vec![0] });
+        }
+        self.release_if_unused(slot);
+    }
+
     pub fn handle_network_operation(
         &mut self,
         pid: u64,
         op: NetworkOperation,
-        messages: &mut Vec<(u64, u16, Vec<u8>, bool)>,
+        messages: &mut Vec<NatMessage>,
     ) -> Result<bool, Box<dyn std::error::Error>> {
-        let _start_time = std::time::Instant::now();
-        debug!("Handling network operation for process {}: {:?}", pid, op);
+        let (kind, len) = op.summary();
+        trace!("Handling {} for process {} ({} bytes)", kind, pid, len);
         match op {
             NetworkOperation::Listen { src_port } => {
                 let consensus_port = self.allocate_port();
                 let addr = format!("127.0.0.1:{}", consensus_port);
-                
+
                 debug!("Attempting to listen on {}", addr);
                 match TcpListener::bind(&addr) {
                     Ok(listener) => {
@@ -74,18 +357,8 @@ impl NatTable {
                         if let Err(e) = listener.set_nonblocking(true) {
                             error!("Failed to set non-blocking mode: {}", e);
                         }
-                        
-                        let entry = NatListener {
-                            process_id: pid,
-                            process_port: src_port,
-                            consensus_port,
-                            listener,
-                            pending_accepts: Vec::new(),
-                        };
-                        
-                        self.listeners.insert((pid, src_port), entry);
-                        self.process_ports.insert((pid, src_port), consensus_port);
-                        info!("Created NAT listener: {}:{} -> consensus:{}", 
+                        self.open(pid, src_port, consensus_port, Socket::Listener(listener));
+                        info!("Created NAT listener: {}:{} -> consensus:{}",
                             pid, src_port, consensus_port);
                         Ok(true) // Success
                     }
@@ -96,54 +369,24 @@ impl NatTable {
                 }
             }
             NetworkOperation::Accept { src_port, new_port } => {
-                // First check if we have a listener
-                if !self.listeners.contains_key(&(pid, src_port)) {
-                    error!("No NAT mapping found for process {}:{}", pid, src_port);
-                    return Ok(false);
-                }
-
-                // Try to accept any pending connections
-                let accept_result = {
-                    let listener = self.listeners.get_mut(&(pid, src_port)).unwrap();
-                    listener.listener.accept()
+                let accept_result = match self.get(pid, src_port).and_then(|entry| entry.socket.as_ref()) {
+                    Some(Socket::Listener(listener)) => listener.accept(),
+                    _ => {
+                        error!("No NAT mapping found for process {}:{}", pid, src_port);
+                        return Ok(false);
+                    }
                 };
 
                 match accept_result {
                     Ok((stream, addr)) => {
-                        debug!("Accepted connection from {} on {}:{} -> new port {} (listener: {})", 
-                            addr, pid, src_port, new_port, self.listeners.get(&(pid, src_port)).unwrap().consensus_port);
-                        
-                        // Set non-blocking mode
-                        if let Err(e) = stream.set_nonblocking(true) {
-                            error!("Failed to set non-blocking mode: {}", e);
-                        }
-
-                        // Create a new NAT entry for the accepted connection
-                        let consensus_port = self.allocate_port();
-                        let entry = NatEntry {
-                            process_id: pid,
-                            process_port: new_port,  // Use the new_port from the runtime
-                            consensus_port,
-                            connection: stream,
-                            buffer: Vec::new(),
-                        };
-                        
-                        // Add the new connection to our tables
-                        self.port_mappings.insert(consensus_port, entry);
-                        self.process_ports.insert((pid, new_port), consensus_port);
-                        self.connections.insert((pid, new_port), consensus_port);
-                        
-                        info!("Created NAT entry for accepted connection: {}:{} -> consensus:{}", 
-                            pid, new_port, consensus_port);
-                        
-                        // Clear waiting state since we have a connection
-                        self.waiting_accepts.remove(&(pid, src_port));
+                        debug!("Accepted connection from {} on {}:{} -> new port {}", addr, pid, src_port, new_port);
+                        self.open_accepted(pid, src_port, new_port, stream);
                         Ok(true)
                     }
                     Err(e) if e.kind() == std::io::ErrorKind::WouldBlock => {
                         // No connection available, set waiting state with the requested port
                         self.set_waiting_accept(pid, src_port, new_port);
-                        debug!("No connection available for {}:{}, process will wait for port {}", 
+                        debug!("No connection available for {}:{}, process will wait for port {}",
                             pid, src_port, new_port);
                         Ok(true) // Return true to indicate this is a valid waiting state
                     }
@@ -156,7 +399,7 @@ impl NatTable {
             NetworkOperation::Connect { dest_addr, dest_port, src_port } => {
                 let consensus_port = self.allocate_port();
                 let addr = format!("{}:{}", dest_addr, dest_port);
-                
+
                 debug!("Attempting to connect to {}", addr);
                 match TcpStream::connect(&addr) {
                     Ok(stream) => {
@@ -164,19 +407,8 @@ impl NatTable {
                         if let Err(e) = stream.set_nonblocking(true) {
                             error!("Failed to set non-blocking mode: {}", e);
                         }
-                        
-                        let entry = NatEntry {
-                            process_id: pid,
-                            process_port: src_port,
-                            consensus_port,
-                            connection: stream,
-                            buffer: Vec::new(),
-                        };
-                        
-                        self.port_mappings.insert(consensus_port, entry);
-                        self.process_ports.insert((pid, src_port), consensus_port);
-                        self.connections.insert((pid, src_port), consensus_port);  // Add to connections map
-                        info!("Created NAT entry: {}:{} -> consensus:{} -> {}:{}", 
+                        self.open(pid, src_port, consensus_port, Socket::connection(stream));
+                        info!("Created NAT entry: {}:{} -> consensus:{} -> {}:{}",
                             pid, src_port, consensus_port, dest_addr, dest_port);
                         Ok(true)
                     }
@@ -188,478 +420,562 @@ impl NatTable {
             }
             NetworkOperation::Send { src_port, data } => {
                 let start_time = std::time::Instant::now();
-                info!("Processing send operation for process {}:{} ({} bytes): {:?}", 
-                     pid, src_port, data.len(), String::from_utf8_lossy(&data));
-                
-                // First check for an active connection
-                if let Some(&consensus_port) = self.connections.get(&(pid, src_port)) {
-                    debug!("Found connection mapping: process {}:{} -> consensus:{}", pid, src_port, consensus_port);
-                    if let Some(entry) = self.port_mappings.get_mut(&consensus_port) {
-                        debug!("Found connection entry, attempting to write {} bytes", data.len());
-                        match entry.connection.write_all(&data) {
-                            Ok(_) => {
-                                if let Err(e) = entry.connection.flush() {
-                                    error!("Failed to flush data to connection: {}", e);
-                                    return Err(Box::new(e));
-                                }
-                                info!("Send operation completed in {:?} with {} bytes", 
-                                     start_time.elapsed(), data.len());
-                                Ok(true)
-                            }
-                            Err(e) => {
-                                error!("Failed to send data to connection: {}", e);
-                                Err(Box::new(e))
-                            }
-                        }
-                    } else {
-                        error!("Inconsistent state: consensus port {} found but no mapping entry exists", consensus_port);
-                        Ok(false)
+                trace!("Processing send operation for process {}:{} ({} bytes)",
+                     pid, src_port, data.len());
+
+                let slot = self.index.get(&(pid, src_port)).copied();
+                let Some(Socket::Connection { outbound, .. }) =
+                    slot.and_then(|slot| self.slots[slot].as_mut()).and_then(|e| e.socket.as_mut())
+                else {
+                    error!("No NAT connection found for process {}:{}", pid, src_port);
+                    return Ok(false);
+                };
+                let len = data.len();
+                outbound.push(data);
+                CONSENSUS.nat_sends.inc();
+                match self.flush_outbound(slot.unwrap()) {
+                    Ok(()) => {
+                        trace!("Send operation completed in {:?} with {} bytes",
+                             start_time.elapsed(), len);
+                        Ok(true)
                     }
-                }
-                // If no connection found, check for a listener
-                else if let Some(&consensus_port) = self.process_ports.get(&(pid, src_port)) {
-                    debug!("Found listener mapping: process {}:{} -> consensus:{}", pid, src_port, consensus_port);
-                    if let Some(entry) = self.port_mappings.get_mut(&consensus_port) {
-                        debug!("Found listener entry, attempting to write {} bytes", data.len());
-                        match entry.connection.write_all(&data) {
-                            Ok(_) => {
-                                if let Err(e) = entry.connection.flush() {
-                                    error!("Failed to flush data to listener: {}", e);
-                                    return Err(Box::new(e));
-                                }
-                                info!("Successfully sent and flushed {} bytes to listener", data.len());
-                                Ok(true)
-                            }
-                            Err(e) => {
-                                error!("Failed to send data to listener: {}", e);
-                                Err(Box::new(e))
-                            }
-                        }
-                    } else {
-                        error!("Inconsistent state: consensus port {} found but no mapping entry exists", consensus_port);
-                        Ok(false)
+                    Err(e) => {
+                        error!("Failed to send data to connection: {}", e);
+                        Err(Box::new(e))
                     }
-                } else {
-                    error!("No NAT mapping found for process {}:{}", pid, src_port);
-                    Ok(false)
                 }
             }
             NetworkOperation::Recv { src_port } => {
                 let start_time = std::time::Instant::now();
-                // Only check the buffer, do not read from the socket here
-                if let Some(&consensus_port) = self.connections.get(&(pid, src_port)) {
-                    if let Some(entry) = self.port_mappings.get_mut(&consensus_port) {
-                        if !entry.buffer.is_empty() {
-                            // Data is available in the buffer
-                            let data = entry.buffer.clone();
-                            entry.buffer.clear();
-                            self.waiting_recvs.remove(&(pid, src_port));
-                            info!("Recv operation completed in {:?} with {} bytes", 
-                                 start_time.elapsed(), data.len());
-                            messages.push((pid, src_port, data, false));
-                            Ok(true)
-                        } else {
-                            // No data available, mark as waiting
-                            self.waiting_recvs.insert((pid, src_port), true);
-                            debug!("No buffered data for {}:{}, process will wait", pid, src_port);
-                            Ok(true)
-                        }
-                    } else {
-                        error!("No connection entry found for consensus port {}", consensus_port);
-                        Ok(false)
-                    }
-                } else {
+                // Only hand over data already read, do not read from the socket here
+                let slot = self.index.get(&(pid, src_port)).copied();
+                let Some(entry) = slot.and_then(|slot| self.slots[slot].as_mut()) else {
                     error!("No connection found for process {}:{}", pid, src_port);
-                    Ok(false)
+                    return Ok(false);
+                };
+                if !matches!(entry.socket, Some(Socket::Connection { .. })) {
+                    error!("No connection found for process {}:{}", pid, src_port);
+                    return Ok(false);
                 }
+                entry.waiting_recv = true;
+                match self.settle(slot.unwrap(), messages) {
+                    Some(n) => trace!("Recv operation completed in {:?} with {} bytes", start_time.elapsed(), n),
+                    None => debug!("No data deliverable to {}:{} yet, process will wait", pid, src_port),
+                }
+                Ok(true)
             }
             NetworkOperation::Close { src_port } => {
                 debug!("Processing close operation for process {}:{}", pid, src_port);
-                
-                // First check if this is a connection
-                if let Some(&consensus_port) = self.connections.get(&(pid, src_port)) {
-                    if let Some(entry) = self.port_mappings.get_mut(&consensus_port) {
-                        // Shutdown the socket
-                        if let Err(e) = entry.connection.shutdown(std::net::Shutdown::Both) {
-                            error!("Failed to shutdown socket: {}", e);
+                let Some(&slot) = self.index.get(&(pid, src_port)) else {
+                    error!("No NAT mapping found for process {}:{}", pid, src_port);
+                    return Ok(false);
+                };
+                match self.slots[slot].as_mut().and_then(|entry| entry.socket.as_mut()) {
+                    Some(Socket::Connection { .. }) => {
+                        // Shutdown the socket once what the process sent is written
+                        if let Some(Socket::Connection { stream, outbound, .. }) =
+                            self.slots[slot].as_mut().and_then(|entry| entry.socket.take())
+                        {
+                            self.linger(pid, src_port, stream, outbound);
                         }
+                        self.close(slot, messages);
+                        info!("Closed connection for {}:{}", pid, src_port);
+                        Ok(true)
                     }
-                    self.port_mappings.remove(&consensus_port);
-                    self.connections.remove(&(pid, src_port));
-                    info!("Closed connection for {}:{}", pid, src_port);
-                    Ok(true)
-                }
-                // If not a connection, check if it's a listener
-                else if let Some(&consensus_port) = self.process_ports.get(&(pid, src_port)) {
-                    if let Some(entry) = self.port_mappings.get_mut(&consensus_port) {
-                        // Shutdown the socket
-                        if let Err(e) = entry.connection.shutdown(std::net::Shutdown::Both) {
-                            error!("Failed to shutdown socket: {}", e);
-                        }
+                    Some(Socket::Listener(_)) => {
+                        self.close(slot, messages);
+                        info!("Closed listener for {}:{}", pid, src_port);
+                        Ok(true)
+                    }
+                    Some(Socket::Closing { .. }) | None => {
+                        error!("No NAT mapping found for process {}:{}", pid, src_port);
+                        Ok(false)
                     }
-                    self.port_mappings.remove(&consensus_port);
-                    self.process_ports.remove(&(pid, src_port));
-                    self.listeners.remove(&(pid, src_port));
-                    info!("Closed listener for {}:{}", pid, src_port);
-                    Ok(true)
-                } else {
-                    error!("No NAT mapping found for process {}:{}", pid, src_port);
-                    Ok(false)
                 }
             }
         }
     }
 
-    pub fn is_waiting_for_accept(&self, pid: u64, src_port: u16) -> bool {
-        self.waiting_accepts.contains_key(&(pid, src_port))
-    }
-
-    pub fn is_waiting_for_recv(&self, pid: u64, src_port: u16) -> bool {
-        self.waiting_recvs.get(&(pid, src_port)).copied().unwrap_or(false)
-    }
-
-    pub fn set_waiting_accept(&mut self, pid: u64, src_port: u16, new_port: u16) {
-        self.waiting_accepts.insert((pid, src_port), new_port);
-        debug!("Process {}:{} is now waiting for accept on port {}", pid, src_port, new_port);
+    /// Shuts a closed connection down once the peer has taken what is still
+    /// queued for it. The socket stays non-blocking: if it cannot take
+    /// everything now, it moves to a slot of its own and is written on
+    /// writability until it drains or `CLOSE_LINGER` passes.
+    fn linger(&mut self, pid: u64, port: u16, mut stream: TcpStream, mut outbound: Outbound) {
+        match outbound.flush(&mut stream) {
+            Ok(false) => {}
+            done => {
+                if let Err(e) = done {
+                    error!("Dropped {} unsent bytes on close: {}", outbound.len(), e);
+                }
+                self.shut(Socket::Closing { stream, outbound, deadline: Instant::now() });
+                return;
+            }
+        }
+        debug!("{} bytes left to send after close of {}:{}", outbound.len(), pid, port);
+        let slot = self.insert(PortEntry { pid, port, consensus_port: None, socket: None, waiting_accept: None, waiting_recv: false });
+        if let Some(registry) = self.shared.registry.get() {
+            if let Err(e) = registry.reregister(&mut SourceFd(&stream.as_raw_fd()), self.token(slot), Interest::WRITABLE) {
+                error!("Failed to update NAT poller interest: {}", e);
+            }
+        }
+        let deadline = Instant::now() + CLOSE_LINGER;
+        self.slots[slot].as_mut().unwrap().socket = Some(Socket::Closing { stream, outbound, deadline });
+        self.closing.push(slot);
+        self.shared.lingering.fetch_add(1, Ordering::Relaxed);
     }
 
-    #[allow(dead_code)]
-    pub fn set_waiting_recv(&mut self, pid: u64, src_port: u16) {
-        self.waiting_recvs.insert((pid, src_port), true);
-        debug!("Process {}:{} is now waiting for recv", pid, src_port);
+    /// Writes what the closed connection in `slot` will take, and shuts it
+    /// down once everything is written, a write fails or `now` is past its
+    /// deadline.
+    fn flush_closing(&mut self, slot: usize, now: Instant) {
+        let Some(Socket::Closing { stream, outbound, deadline }) = self.slots[slot].as_mut().and_then(|e| e.socket.as_mut()) else {
+            return;
+        };
+        match outbound.flush(stream) {
+            Ok(true) => {}
+            Ok(false) if now < *deadline => return,
+            Ok(false) => error!("Dropped {} unsent bytes on close", outbound.len()),
+            Err(e) => error!("Dropped {} unsent bytes on close: {}", outbound.len(), e),
+        }
+        if let Some(socket) = self.slots[slot].take().and_then(|entry| entry.socket) {
+            self.shut(socket);
+        }
+        self.free.push(slot);
+        self.closing.retain(|&s| s != slot);
+        self.shared.lingering.fetch_sub(1, Ordering::Relaxed);
     }
 
-    pub fn clear_waiting_accept(&mut self, pid: u64, src_port: u16) {
-        self.waiting_accepts.remove(&(pid, src_port));
-        debug!("Process {}:{} is no longer waiting for accept", pid, src_port);
+    /// Gives up on closed connections whose deadline has passed.
+    fn expire_closing(&mut self, now: Instant) {
+        let expired: Vec<usize> = self.closing.iter().copied().filter(|&slot| {
+            matches!(self.slots[slot].as_ref().and_then(|e| e.socket.as_ref()),
+                Some(Socket::Closing { deadline, .. }) if now >= *deadline)
+        }).collect();
+        for slot in expired {
+            self.flush_closing(slot, now);
+        }
     }
 
-    #[allow(dead_code)]
-    pub fn process_pending_accept(&mut self, pid: u64, src_port: u16) -> bool {
-        debug!("Processing pending accept for process {}:{}", pid, src_port);
-        
-        // Get the pending connection if any
-        let pending_connection = {
-            if let Some(listener) = self.listeners.get_mut(&(pid, src_port)) {
-                debug!("Found listener for {}:{} with {} pending accepts", 
-                    pid, src_port, listener.pending_accepts.len());
-                listener.pending_accepts.pop()
-            } else {
-                debug!("No listener found for {}:{}", pid, src_port);
-                None
+    fn shut(&self, socket: Socket) {
+        if let Some(registry) = self.shared.registry.get() {
+            let _ = registry.deregister(&mut SourceFd(&socket.raw_fd()));
+        }
+        if let Socket::Closing { stream, .. } = socket {
+            if let Err(e) = stream.shutdown(std::net::Shutdown::Both) {
+                error!("Failed to shutdown socket: {}", e);
             }
-        };
-
-        // If we have a pending connection, create the NAT entry
-        if let Some(stream) = pending_connection {
-            let consensus_port = self.allocate_port();
-            debug!("Allocated consensus port {} for connection from {}:{}", 
-                consensus_port, pid, src_port);
-            
-            let entry = NatEntry {
-                process_id: pid,
-                process_port: src_port,
-                consensus_port,
-                connection: stream,
-                buffer: Vec::new(),
-            };
-            
-            self.port_mappings.insert(consensus_port, entry);
-            self.connections.insert((pid, src_port), consensus_port);
-            info!("Created NAT entry for connection from {}:{} on consensus port {}", 
-                pid, src_port, consensus_port);
-            true
-        } else {
-            debug!("No pending connection found for {}:{}", pid, src_port);
-            false
         }
     }
 
-    #[allow(dead_code)]
-    pub fn clear_waiting_recv(&mut self, pid: u64, src_port: u16) {
-        self.waiting_recvs.remove(&(pid, src_port));
-        debug!("Process {}:{} is no longer waiting for recv", pid, src_port);
-    }
-
-    #[allow(dead_code)]
-    pub fn has_pending_accept(&self, pid: u64, src_port: u16) -> bool {
-        if let Some(listener) = self.listeners.get(&(pid, src_port)) {
-            !listener.pending_accepts.is_empty()
-        } else {
-            false
+    /// Opens the connection accepted for an Accept on `src_port` as process
+    /// port `new_port`; the listener stops waiting.
+    fn open_accepted(&mut self, pid: u64, src_port: u16, new_port: u16, stream: TcpStream) {
+        // Set non-blocking mode
+        if let Err(e) = stream.set_nonblocking(true) {
+            error!("Failed to set non-blocking mode: {}", e);
         }
+        let consensus_port = self.allocate_port();
+        self.open(pid, new_port, consensus_port, Socket::connection(stream));
+        info!("Created NAT entry for accepted connection: {}:{} -> consensus:{}",
+            pid, new_port, consensus_port);
+        self.clear_waiting_accept(pid, src_port);
     }
 
-    #[allow(dead_code)]
-    pub fn has_port_mapping(&self, pid: u64, src_port: u16) -> bool {
-        self.process_ports.contains_key(&(pid, src_port))
+    pub fn is_waiting_for_accept(&self, pid: u64, src_port: u16) -> bool {
+        self.get(pid, src_port).is_some_and(|entry| entry.waiting_accept.is_some())
     }
 
-    #[allow(dead_code)]
-    pub fn add_port_mapping(&mut self, pid: u64, src_port: u16) {
-        let consensus_port = self.next_port;
-        self.next_port += 1;
-        self.process_ports.insert((pid, src_port), consensus_port);
-        debug!("Added port mapping: {}:{} -> consensus:{}", pid, src_port, consensus_port);
+    pub fn is_waiting_for_recv(&self, pid: u64, src_port: u16) -> bool {
+        self.get(pid, src_port).is_some_and(|entry| entry.waiting_recv)
     }
 
-    pub fn check_for_incoming_data(&mut self) -> Vec<(u64, u16, Vec<u8>, bool)> {
-        let mut messages = Vec::new();
-        let mut to_remove = Vec::new();
-        let start_time = std::time::Instant::now();
-
-        // First check all listeners for new connections
-        let waiting_listeners: Vec<(u64, u16)> = self.listeners.keys()
-            .filter(|(pid, src_port)| self.is_waiting_for_accept(*pid, *src_port))
-            .cloned()
-            .collect();
+    pub fn set_waiting_accept(&mut self, pid: u64, src_port: u16, new_port: u16) {
+        let slot = self.slot_for(pid, src_port);
+        self.slots[slot].as_mut().unwrap().waiting_accept = Some(new_port);
+        debug!("Process {}:{} is now waiting for accept on port {}", pid, src_port, new_port);
+    }
 
-        // First collect all waiting recv operations
-        let waiting_recvs: Vec<(u64, u16)> = self.connections.keys()
-            .filter(|(pid, src_port)| self.is_waiting_for_recv(*pid, *src_port))
-            .cloned()
-            .collect();
+    pub fn clear_waiting_accept(&mut self, pid: u64, src_port: u16) {
+        if let Some(&slot) = self.index.get(&(pid, src_port)) {
+            self.slots[slot].as_mut().unwrap().waiting_accept = None;
+            self.release_if_unused(slot);
+        }
+        debug!("Process {}:{} is no longer waiting for accept", pid, src_port);
+    }
 
-        // Then check which of these have closed connections
-        for (pid, src_port) in waiting_recvs {
-            if let Some(&consensus_port) = self.connections.get(&(pid, src_port)) {
-                if self.port_mappings.get_mut(&consensus_port).is_none() {
-                    // No entry found, treat as closed
-                    debug!("Adding status 0 for missing connection with waiting recv operation {}:{}", pid, src_port);
-                    messages.push((pid, src_port, vec![0], false));
-                    self.waiting_recvs.remove(&(pid, src_port));
+    /// Writes what the connection in `slot` will take of its queued sends,
+    /// and keeps the poller watching for writability while any are left.
+    fn flush_outbound(&mut self, slot: usize) -> io::Result<()> {
+        let token = self.token(slot);
+        let Some(Socket::Connection { stream, outbound, .. }) = self.slots[slot].as_mut().and_then(|e| e.socket.as_mut()) else {
+            return Ok(());
+        };
+        let drained = outbound.flush(stream)?;
+        if drained == outbound.writable_interest {
+            if let Some(registry) = self.shared.registry.get() {
+                let interest = if drained { Interest::READABLE } else { Interest::READABLE | Interest::WRITABLE };
+                if let Err(e) = registry.reregister(&mut SourceFd(&stream.as_raw_fd()), token, interest) {
+                    error!("Failed to update NAT poller interest: {}", e);
                 }
-                // Otherwise, do nothing: let the main read loop handle data and closure
-            } else {
-                // No connection found, treat as closed
-                debug!("Adding status 0 for missing connection with waiting recv operation {}:{}", pid, src_port);
-                messages.push((pid, src_port, vec![0], false));
-                self.waiting_recvs.remove(&(pid, src_port));
             }
+            outbound.writable_interest = !drained;
         }
+        if !drained {
+            debug!("{} bytes left queued until the connection is writable", outbound.len());
+        }
+        Ok(())
+    }
 
-        for (pid, src_port) in waiting_listeners {
-            if let Some(listener) = self.listeners.get_mut(&(pid, src_port)) {
-                debug!("Attempting to accept connection on listener {}:{} (consensus port: {})", 
-                    pid, src_port, listener.consensus_port);
-                match listener.listener.accept() {
-                    Ok((stream, addr)) => {
-                        debug!("Accepted connection from {} on {}:{} (listener: {})", 
-                            addr, pid, src_port, listener.consensus_port);
-                        
-                        // Set non-blocking mode
-                        if let Err(e) = stream.set_nonblocking(true) {
-                            error!("Failed to set non-blocking mode: {}", e);
-                        }
-
-                        // Get the requested port from waiting_accepts without removing it
-                        let new_port = match self.peek_waiting_port(pid, src_port) {
-                            Some(port) => port,
-                            None => {
-                                error!("No waiting accept entry for {}:{}", pid, src_port);
-                                continue;
-                            }
-                        };
-
-                        // Create a new NAT entry for the accepted connection
-                        let consensus_port = self.allocate_port();
-                        let entry = NatEntry {
-                            process_id: pid,
-                            process_port: new_port,  // Use the stored requested port
-                            consensus_port,
-                            connection: stream,
-                            buffer: Vec::new(),
-                        };
-                        
-                        // Add the new connection to our tables
-                        self.port_mappings.insert(consensus_port, entry);
-                        self.process_ports.insert((pid, new_port), consensus_port);
-                        self.connections.insert((pid, new_port), consensus_port);
-                        
-                        info!("Created NAT entry for accepted connection: {}:{} -> consensus:{}", 
-                            pid, new_port, consensus_port);
-
-                        // Notify runtime about the new connection
-                        debug!("Adding connection notification to messages queue for {}:{}, {}:{}", pid, src_port, pid, new_port);
-                        messages.push((pid, src_port, Vec::new(), true));
-                        debug!("Added connection notification to messages queue");
-                    }
-                    Err(e) if e.kind() == std::io::ErrorKind::WouldBlock => {
-                        debug!("No connection available for {}:{} (WouldBlock)", pid, src_port);
-                        continue;
-                    }
-                    Err(e) => {
-                        error!("Error accepting connection on {}:{}: {}", pid, src_port, e);
+    /// Handles a readiness event for the entry in `slot`. The sockets are
+    /// registered edge-triggered, so a ready connection is written and read
+    /// until it would block.
+    fn handle_ready(&mut self, slot: usize, messages: &mut Vec<NatMessage>) {
+        match self.slots.get(slot).and_then(|entry| entry.as_ref()).and_then(|entry| entry.socket.as_ref()) {
+            Some(Socket::Listener(_)) => self.accept_waiting(slot, messages),
+            Some(Socket::Connection { .. }) => {
+                if let Err(e) = self.flush_outbound(slot) {
+                    error!("Error writing to connection in slot {}: {}", slot, e);
+                    if let Some(inbound) = self.inbound_mut(slot) {
+                        inbound.eof = true;
                     }
                 }
+                self.fill(slot);
+                self.settle(slot, messages);
+            }
+            Some(Socket::Closing { .. }) => self.flush_closing(slot, Instant::now()),
+            // Stale event for a socket closed since it was polled.
+            None => {}
+        }
+    }
+
+    /// Accepts one connection for a process waiting on the listener in
+    /// `slot`. Connections nobody waits for stay in the backlog until the
+    /// process's next Accept.
+    fn accept_waiting(&mut self, slot: usize, messages: &mut Vec<NatMessage>) {
+        let entry = self.slots[slot].as_ref().unwrap();
+        let (pid, src_port) = (entry.pid, entry.port);
+        let Some(new_port) = entry.waiting_accept else {
+            debug!("Listener {}:{} is ready but no accept is waiting", pid, src_port);
+            return;
+        };
+        let Some(Socket::Listener(listener)) = &entry.socket else {
+            return;
+        };
+        debug!("Attempting to accept connection on listener {}:{}", pid, src_port);
+        match listener.accept() {
+            Ok((stream, addr)) => {
+                debug!("Accepted connection from {} on {}:{}", addr, pid, src_port);
+                self.open_accepted(pid, src_port, new_port, stream);
+                // Notify runtime about the new connection
+                messages.push(NatMessage::Accepted { pid, port: src_port, new_port });
+            }
+            Err(e) if e.kind() == std::io::ErrorKind::WouldBlock => {
+                debug!("No connection available for {}:{} (WouldBlock)", pid, src_port);
+            }
+            Err(e) => {
+                error!("Error accepting connection on {}:{}: {}", pid, src_port, e);
             }
         }
+    }
+
+    fn inbound_mut(&mut self, slot: usize) -> Option<&mut Inbound> {
+        match self.slots.get_mut(slot)?.as_mut()?.socket.as_mut()? {
+            Socket::Connection { inbound, .. } => Some(inbound),
+            Socket::Listener(_) | Socket::Closing { .. } => None,
+        }
+    }
 
-        // Then check all connections for incoming data
-        for (consensus_port, entry) in &mut self.port_mappings {
-            let mut buf = [0u8; 1024];
-            match entry.connection.read(&mut buf) {
+    /// Reads the connection in `slot` until it would block or the window is
+    /// full, noting a remote close.
+    fn fill(&mut self, slot: usize) {
+        let window = self.shared.policy.window;
+        let Some(entry) = self.slots[slot].as_mut() else {
+            return;
+        };
+        let Some(Socket::Connection { stream, inbound, .. }) = entry.socket.as_mut() else {
+            return;
+        };
+        let mut buf = [0u8; 16 * 1024];
+        inbound.paused = false;
+        while !inbound.eof {
+            if inbound.data.len() >= window {
+                debug!("Window of {}:{} is full, pausing reads", entry.pid, entry.port);
+                CONSENSUS.nat_paused_reads.inc();
+                inbound.paused = true;
+                break;
+            }
+            match stream.read(&mut buf) {
                 Ok(0) => {
-                    info!("Connection closed by remote for {}:{}", entry.process_id, entry.process_port);
-                    to_remove.push(*consensus_port);
+                    info!("Connection closed by remote for {}:{}", entry.pid, entry.port);
+                    inbound.eof = true;
                 }
                 Ok(n) => {
-                    // Always append received data to the buffer
-                    entry.buffer.extend_from_slice(&buf[..n]);
-                    // Only push to messages if this process is waiting for recv
-                    let is_waiting = self.waiting_recvs.contains_key(&(entry.process_id, entry.process_port));
-                    if is_waiting {
-                        info!("Delivered {} bytes to process {}:{} in {:?}", 
-                             entry.buffer.len(), entry.process_id, entry.process_port, start_time.elapsed());
-                        messages.push((
-                            entry.process_id,
-                            entry.process_port,
-                            entry.buffer.clone(),
-                            false
-                        ));
-                        entry.buffer.clear();
-                        self.waiting_recvs.remove(&(entry.process_id, entry.process_port));
-                    }
-                }
-                Err(e) if e.kind() == std::io::ErrorKind::WouldBlock => {
-                    continue;
+                    CONSENSUS.nat_bytes_in.add(n as u64);
+                    inbound.data.extend(&buf[..n]);
                 }
+                Err(e) if e.kind() == std::io::ErrorKind::WouldBlock => break,
+                Err(e) if e.kind() == std::io::ErrorKind::Interrupted => continue,
                 Err(e) => {
-                    error!("Error reading from connection {}:{}: {}", 
-                        entry.process_id, entry.process_port, e);
-                    to_remove.push(*consensus_port);
+                    error!("Error reading from connection {}:{}: {}",
+                        entry.pid, entry.port, e);
+                    inbound.eof = true;
                 }
             }
         }
+    }
 
-        // Clean up closed connections
-        for port in to_remove {
-            if let Some(entry) = self.port_mappings.remove(&port) {
-                // Check if this was a connection and if it was waiting for recv BEFORE removing it
-                let was_connection = self.connections.contains_key(&(entry.process_id, entry.process_port));
-                let was_waiting_recv = self.is_waiting_for_recv(entry.process_id, entry.process_port);
-
-                // Remove from appropriate mapping
-                if was_connection {
-                    self.connections.remove(&(entry.process_id, entry.process_port));
-                    debug!("Removed connection mapping for {}:{}", entry.process_id, entry.process_port);
-                } else if self.listeners.contains_key(&(entry.process_id, entry.process_port)) {
-                    self.process_ports.remove(&(entry.process_id, entry.process_port));
-                    self.listeners.remove(&(entry.process_id, entry.process_port));
-                    debug!("Removed listener mapping for {}:{}", entry.process_id, entry.process_port);
-                }
-                info!("Removed NAT entry for {}:{}", entry.process_id, entry.process_port);
-
-                // If this was a connection and it was waiting for recv, send status 0
-                if was_connection && was_waiting_recv {
-                    debug!("Connection closed while waiting for recv, sending status 0 for {}:{}", 
-                        entry.process_id, entry.process_port);
-                    messages.push((entry.process_id, entry.process_port, vec![0], false));
-                    self.waiting_recvs.remove(&(entry.process_id, entry.process_port));
-                }
+    /// Gives a recv waiting on the connection in `slot` as much buffered
+    /// data as its process has budget left for in this batch, resumes
+    /// reading once that opens the window, and removes a connection the
+    /// remote closed once all of its data was delivered. Returns the bytes
+    /// delivered.
+    fn settle(&mut self, slot: usize, messages: &mut Vec<NatMessage>) -> Option<usize> {
+        let delivered = self.deliver(slot, messages);
+        let window = self.shared.policy.window;
+        if self.inbound_mut(slot).is_some_and(|inbound| inbound.paused && inbound.data.len() < window) {
+            self.fill(slot);
+        }
+        if self.inbound_mut(slot).is_some_and(|inbound| inbound.eof && inbound.data.is_empty()) {
+            let entry = self.slots[slot].as_ref().unwrap();
+            info!("Removed NAT entry for {}:{}", entry.pid, entry.port);
+            self.close(slot, messages);
+        }
+        delivered
+    }
+
+    fn deliver(&mut self, slot: usize, messages: &mut Vec<NatMessage>) -> Option<usize> {
+        let budget = self.shared.policy.batch_budget;
+        let entry = self.slots.get_mut(slot)?.as_mut()?;
+        let Some(Socket::Connection { inbound, .. }) = entry.socket.as_mut() else {
+            return None;
+        };
+        if !entry.waiting_recv || inbound.data.is_empty() {
+            return None;
+        }
+        let spent = self.budget_spent.entry(entry.pid).or_default();
+        let n = inbound.data.len().min(budget.saturating_sub(*spent));
+        if n == 0 {
+            debug!("Process {} used its recv budget, port {} waits for the next batch", entry.pid, entry.port);
+            CONSENSUS.nat_deferred_recvs.inc();
+            if !self.deferred.contains(&slot) {
+                self.deferred.push(slot);
             }
+            return None;
+        }
+        *spent += n;
+        self.shared.budget_used.store(true, Ordering::Relaxed);
+        let data: Vec<u8> = inbound.data.drain(..n).collect();
+        if !inbound.data.is_empty() {
+            CONSENSUS.nat_split_recvs.inc();
         }
+        entry.waiting_recv = false;
+        trace!("Delivered {} bytes to process {}:{}, {} left buffered", n, entry.pid, entry.port, inbound.data.len());
+        messages.push(NatMessage::Data { pid: entry.pid, port: entry.port, data });
+        Some(n)
+    }
 
-        messages
+    /// Starts fresh recv budgets if a batch was cut since they were last
+    /// spent. Callers pass the count from the `BatchWriter` they push this
+    /// table's messages through, and hold it from here until the push, so
+    /// budget spent and data delivered always belong to the same batch.
+    pub fn sync_budget(&mut self, cuts: u64) {
+        if cuts != self.budget_batch {
+            self.budget_spent.clear();
+            self.budget_batch = cuts;
+        }
     }
 
-    pub fn has_connection(&self, pid: u64, port: u16) -> bool {
-        self.connections.contains_key(&(pid, port))
+    /// Serves the recvs that were waiting for a new batch's budget.
+    fn new_batch(&mut self, cuts: u64, messages: &mut Vec<NatMessage>) {
+        self.sync_budget(cuts);
+        for slot in std::mem::take(&mut self.deferred) {
+            self.settle(slot, messages);
+        }
     }
 
-    pub fn get_process_info(&self) -> serde_json::Value {
-        let mut processes = HashMap::new();
-        
-        // Collect all unique process IDs
-        for &(pid, _) in self.process_ports.keys() {
-            if !processes.contains_key(&pid) {
-                let mut ports = Vec::new();
-                let mut listeners = Vec::new();
-                let mut connections = Vec::new();
-                
-                // Get all ports for this process
-                for &(p, port) in self.process_ports.keys() {
-                    if p == pid {
-                        ports.push(port);
-                        
-                        // Check if it's a listener
-                        if self.listeners.contains_key(&(pid, port)) {
-                            listeners.push(port);
-                        }
-                        
-                        // Check if it's a connection
-                        if self.connections.contains_key(&(pid, port)) {
-                            connections.push(port);
-                        }
-                    }
-                }
-                
-                processes.insert(pid, json!({
-                    "ports": ports,
-                    "listeners": listeners,
-                    "connections": connections
-                }));
+    fn snapshot_into(&self, ports: &mut Vec<PortInfo>) {
+        for entry in self.slots.iter().flatten() {
+            let (kind, buffered) = match &entry.socket {
+                Some(Socket::Connection { inbound, .. }) => ("connection", inbound.data.len()),
+                Some(Socket::Listener(_)) => ("listener", 0),
+                Some(Socket::Closing { outbound, .. }) => ("closing", outbound.len()),
+                None => ("unknown", 0),
+            };
+            ports.push(PortInfo {
+                pid: entry.pid,
+                port: entry.port,
+                consensus_port: entry.consensus_port,
+                kind,
+                buffered,
+                waiting_accept: entry.waiting_accept.is_some(),
+                waiting_recv: entry.waiting_recv,
+            });
+        }
+    }
+}
+
+/// One process port as shown by the HTTP status server.
+pub struct PortInfo {
+    pub pid: u64,
+    pub port: u16,
+    pub consensus_port: Option<u16>,
+    pub kind: &'static str,
+    pub buffered: usize,
+    pub waiting_accept: bool,
+    pub waiting_recv: bool,
+}
+
+/// A copy of the NAT state, taken one shard at a time.
+pub struct NatSnapshot {
+    pub ports: Vec<PortInfo>,
+}
+
+impl NatSnapshot {
+    /// The `/status` document: ports by process, connections, listeners and
+    /// every port mapping.
+    pub fn to_json(&self) -> serde_json::Value {
+        let mut processes: HashMap<u64, (Vec<u16>, Vec<u16>, Vec<u16>)> = HashMap::new();
+        for p in self.ports.iter().filter(|p| p.consensus_port.is_some()) {
+            let (ports, listeners, connections) = processes.entry(p.pid).or_default();
+            ports.push(p.port);
+            match p.kind {
+                "listener" => listeners.push(p.port),
+                "connection" => connections.push(p.port),
+                _ => {}
             }
         }
-        
-        json!(processes)
-    }
-
-    pub fn get_connection_info(&self) -> serde_json::Value {
-        let mut connections = Vec::new();
-        
-        for (consensus_port, entry) in &self.port_mappings {
-            if self.connections.contains_key(&(entry.process_id, entry.process_port)) {
-                connections.push(json!({
-                    "process_id": entry.process_id,
-                    "process_port": entry.process_port,
-                    "consensus_port": consensus_port,
-                    "buffer_size": entry.buffer.len()
-                }));
+        let processes: HashMap<u64, serde_json::Value> = processes
+            .into_iter()
+            .map(|(pid, (ports, listeners, connections))| {
+                (pid, json!({ "ports": ports, "listeners": listeners, "connections": connections }))
+            })
+            .collect();
+        let of_kind = |kind: &'static str| self.ports.iter().filter(move |p| p.kind == kind);
+        json!({
+            "processes": processes,
+            "connections": of_kind("connection").map(|p| json!({
+                "process_id": p.pid,
+                "process_port": p.port,
+                "consensus_port": p.consensus_port,
+                "buffer_size": p.buffered,
+                "waiting_recv": p.waiting_recv,
+            })).collect::<Vec<_>>(),
+            "listeners": of_kind("listener").map(|p| json!({
+                "process_id": p.pid,
+                "process_port": p.port,
+                "consensus_port": p.consensus_port,
+                "waiting_accept": p.waiting_accept,
+            })).collect::<Vec<_>>(),
+            "mappings": self.ports.iter().filter_map(|p| Some(json!({
+                "pid": p.pid,
+                "process_port": p.port,
+                "consensus_port": p.consensus_port?,
+                "type": p.kind,
+            }))).collect::<Vec<_>>(),
+        })
+    }
+}
+
+/// The consensus process's NAT: `NatTable` shards by pid, sharing one
+/// consensus port space and one poller. NetworkOut processing and the NAT
+/// poller only contend when they touch processes in the same shard.
+pub struct Nat {
+    shards: Box<[Mutex<NatTable>]>,
+    shared: Arc<Shared>,
+}
+
+impl Nat {
+    pub fn new(shards: usize, policy: RecvPolicy) -> Self {
+        let shards = shards.max(1);
+        let shared = Arc::new(Shared {
+            next_port: AtomicU16::new(FIRST_PORT),
+            registry: OnceLock::new(),
+            policy,
+            budget_used: AtomicBool::new(false),
+            lingering: AtomicUsize::new(0),
+        });
+        info!("Creating NAT table with {} shards", shards);
+        Nat {
+            shards: (0..shards).map(|i| Mutex::new(NatTable::shard(i, shards, Arc::clone(&shared)))).collect(),
+            shared,
+        }
+    }
+
+    pub fn from_env() -> Self {
+        Self::new(env_parse("REPLICODE_NAT_SHARDS").unwrap_or(DEFAULT_SHARDS), RecvPolicy::from_env())
+    }
+
+    /// The shard holding `pid`'s ports.
+    pub fn shard(&self, pid: u64) -> MutexGuard<'_, NatTable> {
+        self.shards[(pid % self.shards.len() as u64) as usize].lock().unwrap()
+    }
+
+    /// Registers every listener and connection opened from now on with the
+    /// NAT poller.
+    pub fn attach_registry(&self, registry: Registry) {
+        if self.shared.registry.set(registry).is_err() {
+            error!("NAT poller registry already attached");
+        }
+    }
+
+    /// Handles readiness events from the NAT poller, locking each shard
+    /// once for all of its tokens. New connections and data for waiting
+    /// recvs become records of the next batch in `buffer`.
+    pub fn handle_readiness(&self, tokens: &[Token], buffer: &BatchBuffer) {
+        let mut messages = Vec::new();
+        let n = self.shards.len();
+        let mut by_shard: Vec<(usize, usize)> = tokens.iter().map(|t| (t.0 % n, t.0 / n)).collect();
+        by_shard.sort_unstable();
+        for group in by_shard.chunk_by(|a, b| a.0 == b.0) {
+            let mut shard = self.shards[group[0].0].lock().unwrap();
+            let mut buf = buffer.writer();
+            shard.sync_budget(buf.cuts());
+            for &(_, slot) in group {
+                shard.handle_ready(slot, &mut messages);
             }
+            push_messages(&mut buf, std::mem::take(&mut messages));
         }
-        
-        json!(connections)
-    }
-
-    pub fn get_listener_info(&self) -> serde_json::Value {
-        let mut listeners = Vec::new();
-        
-        for ((pid, port), listener) in &self.listeners {
-            listeners.push(json!({
-                "process_id": pid,
-                "process_port": port,
-                "consensus_port": listener.consensus_port,
-                "pending_accepts": listener.pending_accepts.len()
-            }));
-        }
-        
-        json!(listeners)
-    }
-
-    pub fn get_port_mappings(&self) -> Vec<(u64, u16, u16, &'static str)> {
-        let mut mappings = Vec::new();
-        
-        for ((pid, process_port), &consensus_port) in &self.process_ports {
-            let mapping_type = if self.listeners.contains_key(&(*pid, *process_port)) {
-                "listener"
-            } else if self.connections.contains_key(&(*pid, *process_port)) {
-                "connection"
-            } else {
-                "unknown"
-            };
-            
-            mappings.push((*pid, *process_port, consensus_port, mapping_type));
+    }
+    /// How long the poller may sleep without an event: until the next
+    /// sweep while closed connections are draining, else indefinitely.
+    pub fn poll_timeout(&self) -> Option<Duration> {
+        (self.shared.lingering.load(Ordering::Relaxed) > 0).then_some(LINGER_SWEEP)
+    }
+
+    /// Shuts down closed connections that did not drain by their deadline.
+    pub fn expire_lingering(&self) {
+        if self.shared.lingering.load(Ordering::Relaxed) == 0 {
+            return;
+        }
+        let now = Instant::now();
+        for shard in self.shards.iter() {
+            shard.lock().unwrap().expire_closing(now);
         }
-        
-        mappings
     }
 
-    pub fn get_waiting_port(&self, pid: u64, src_port: u16) -> Option<u16> {
-        self.waiting_accepts.get(&(pid, src_port)).copied()
+    /// Gives the recvs deferred by their budget the data they can take now
+    /// that a batch was cut, as records of the next batch in `buffer`.
+    pub fn new_batch(&self, buffer: &BatchBuffer) {
+        if !self.shared.budget_used.swap(false, Ordering::Relaxed) {
+            return;
+        }
+        let mut messages = Vec::new();
+        for shard in self.shards.iter() {
+            let mut shard = shard.lock().unwrap();
+            if shard.deferred.is_empty() {
+                continue;
+            }
+            let mut buf = buffer.writer();
+            shard.new_batch(buf.cuts(), &mut messages);
+            push_messages(&mut buf, std::mem::take(&mut messages));
+        }
     }
 
-    pub fn peek_waiting_port(&self, pid: u64, src_port: u16) -> Option<u16> {
-        self.waiting_accepts.get(&(pid, src_port)).copied()
+    pub fn snapshot(&self) -> NatSnapshot {
+        let mut ports = Vec::new();
+        for shard in self.shards.iter() {
+            shard.lock().unwrap().snapshot_into(&mut ports);
+        }
+        NatSnapshot { ports }
     }
-} 
\ No newline at end of file
+}
@@ -1,18 +1,12 @@
 use std::io;
-use byteorder::{LittleEndian, WriteBytesExt};
-use std::io::Write;
+use crate::aot;
 use crate::commands::Command;
-use bincode;
+use crate::wire::{NetOp, Record};
 
-/// Write a binary record for a given command.
-/// New record layout:
-/// [ 1 byte msg_type ][ 8 bytes process_id ][ 4 bytes payload_length ][ payload ]
+/// Encode the record for a given command (see `wire::Record` for the layout).
 pub fn write_record(cmd: &Command) -> io::Result<Vec<u8>> {
-    let (msg_type, pid, payload) = match cmd {
-        Command::Clock(delta) => {
-            // Type 0; payload is "clock:<delta>"
-            (0u8, 0u64, format!("clock:{}", delta).as_bytes().to_vec())
-        },
+    let record = match cmd {
+        Command::Clock(delta) => Record::Clock { delta: *delta }.to_vec(),
         Command::Init { wasm_bytes, dir_path, args } => {
             let mut payload = Vec::new();
             
@@ -30,26 +24,20 @@ pub fn write_record(cmd: &Command) -> io::Result<Vec<u8>> {
                 payload.push(0); // Null terminator between args and wasm
             }
             
+            // Precompiled artifact, when configured, right before the wasm
+            aot::push_prefix(&mut payload, wasm_bytes);
+
             payload.extend(wasm_bytes);
-            (2u8, u64::MAX, payload)
+            Record::Init { payload: &payload }.to_vec()
         },
-        Command::FDMsg(pid, data) => (1u8, *pid, data.clone()),
-        Command::NetworkIn(pid, port, data) => (3u8, *pid, {
-            let mut payload = Vec::new();
-            payload.write_u16::<LittleEndian>(*port)?;
-            payload.extend(data);
-            payload
-        }),
-        Command::NetworkOut(pid, op) => (4u8, *pid, bincode::serialize(op).unwrap()),
+        Command::FDMsg(pid, data) => Record::FdMsg { pid: *pid, data }.to_vec(),
+        Command::NetworkIn(pid, port, data) => Record::NetworkIn { pid: *pid, port: *port, data }.to_vec(),
+        Command::NetworkOut(pid, op) => Record::NetworkOut { pid: *pid, op: NetOp::from(op) }.to_vec(),
     };
-
-    if payload.len() > (u32::MAX as usize) {
-        return Err(io::Error::new(io::ErrorKind::InvalidInput, "Payload too long"));
-    }
-    let mut record = Vec::with_capacity(1 + 8 + 4 + payload.len());
-    record.push(msg_type);
-    record.write_u64::<LittleEndian>(pid)?;
-    record.write_u32::<LittleEndian>(payload.len() as u32)?;
-    record.write_all(&payload)?;
     Ok(record)
-}
\ No newline at end of file
+}
+
+/// Encode the result of a network operation for process `pid`.
+pub fn write_status_record(pid: u64, status: u8, src_port: u16, new_port: u16) -> Vec<u8> {
+    Record::NetworkStatus { pid, status, src_port, new_port }.to_vec()
+}
@@ -1,17 +1,27 @@
 use std::io::{self, Write};
-use std::net::{TcpStream, TcpListener};
-use std::sync::{Arc, Mutex};
+use std::net::{Shutdown, TcpStream, TcpListener};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::mpsc::{self, Receiver, Sender};
+use std::sync::{Arc, Mutex, MutexGuard};
 use std::thread;
 use std::collections::HashMap;
 use log::{error, info, debug, warn};
-pub use crate::batch::{Batch, BatchDirection};
+pub use crate::batch::{Batch, Control, CHECKPOINT_DIRECTION, CONTROL_DIRECTION};
 use crate::batch_history::BatchHistory;
+use crate::metrics::{Exposition, CONSENSUS};
+use crate::runtime_reader::{self, ReaderEvent};
+use crate::runtime_sender::{Enqueue, Frame, RuntimeSender, SenderStatsSnapshot, RUNTIME_QUEUE_CAPACITY};
+use bytes::Bytes;
 
 /// Represents a connected runtime.
-#[derive(Clone)]
 pub struct RuntimeConnection {
     pub stream: Arc<Mutex<TcpStream>>,
+    /// Writes broadcast batches to `stream` from a dedicated thread.
+    pub sender: RuntimeSender,
+    /// Newest batch queued for the runtime.
     pub last_processed_batch: u64,
+    /// Newest Incoming batch the runtime reported applied.
+    pub last_applied_batch: u64,
 }
 
 /// Manages multiple runtime connections and session batches.
@@ -21,6 +31,10 @@ pub struct RuntimeManager {
     pub runtimes: Arc<Mutex<HashMap<u64, RuntimeConnection>>>,
     next_runtime_id: Arc<Mutex<u64>>,
     batch_history: Arc<Mutex<BatchHistory>>,
+    slow_disconnects: Arc<AtomicU64>,
+    /// Where each runtime's reader thread sends the frames it decodes.
+    reader_events: Sender<ReaderEvent>,
+    reader_events_rx: Arc<Mutex<Option<Receiver<ReaderEvent>>>>,
 }
 
 impl RuntimeManager {
@@ -29,12 +43,16 @@ impl RuntimeManager {
         let listener = Arc::new(TcpListener::bind(addr)?);
         let runtimes = Arc::new(Mutex::new(HashMap::new()));
         let next_runtime_id = Arc::new(Mutex::new(0));
+        let (reader_events, reader_events_rx) = mpsc::channel();
         info!("RuntimeManager: Listening for runtimes on {}...", addr);
         Ok(Self {
             listener,
             runtimes,
             next_runtime_id,
             batch_history,
+            slow_disconnects: Arc::new(AtomicU64::new(0)),
+            reader_events,
+            reader_events_rx: Arc::new(Mutex::new(Some(reader_events_rx))),
         })
     }
 
@@ -45,6 +63,7 @@ impl RuntimeManager {
         let next_runtime_id = Arc::clone(&self.next_runtime_id);
         let listener = self.listener.try_clone().expect("Failed to clone listener");
         let batch_history = Arc::clone(&self.batch_history);
+        let reader_events = self.reader_events.clone();
         thread::spawn(move || {
             info!("Runtime acceptor thread started");
             for stream in listener.incoming() {
@@ -56,52 +75,37 @@ impl RuntimeManager {
                         drop(id_lock);
                         info!("Accepted runtime {} from {}", runtime_id, stream.peer_addr().unwrap());
                         
-                        // Send historical batches to new runtime
-                        if let Ok(batches) = batch_history.lock().unwrap().get_batches_since(0) {
-                            // Filter to only include incoming batches
-                            let incoming_batches: Vec<_> = batches.into_iter()
-                                .filter(|batch| matches!(batch.direction, BatchDirection::Incoming))
-                                .collect();
-                            
-                            info!("Sending {} historical incoming batches to new runtime {}", 
-                                incoming_batches.len(), runtime_id);
-                            
-                            for batch in incoming_batches {
-                                // Create a new buffer for each batch to ensure clean state
-                                let mut serialized = Vec::new();
-                                // Write batch number (8 bytes)
-                                serialized.extend_from_slice(&batch.number.to_le_bytes());
-                                // Write direction (1 byte)
-                                serialized.push(0); // Always Incoming (0) since we filtered
-                                // Write data length (8 bytes)
-                                serialized.extend_from_slice(&(batch.data.len() as u64).to_le_bytes());
-                                // Write the actual data
-                                serialized.extend_from_slice(&batch.data);
-                                
-                                // Write the entire batch at once
-                                match stream.write_all(&serialized) {
-                                    Ok(_) => {
-                                        if let Err(e) = stream.flush() {
-                                            error!("Failed to flush historical batch {} to runtime {}: {}", batch.number, runtime_id, e);
-                                            break;
-                                        }
-                                        debug!("Successfully sent historical batch {} to runtime {} ({} bytes)", 
-                                            batch.number, runtime_id, serialized.len());
-                                    }
-                                    Err(e) => {
-                                        error!("Failed to send historical batch {} to runtime {}: {}", batch.number, runtime_id, e);
-                                        break;
-                                    }
-                                }
+                        // Send the checkpoint and historical batches to the new runtime.
+                        let history = match catch_up(&batch_history, &mut stream, runtime_id) {
+                            Ok(history) => history,
+                            Err(e) => {
+                                error!("Failed to send batch history to runtime {}: {}", runtime_id, e);
+                                continue;
+                            }
+                        };
+                        let sender = match stream.try_clone().and_then(|s| RuntimeSender::spawn(runtime_id, s)) {
+                            Ok(sender) => sender,
+                            Err(e) => {
+                                error!("Failed to start sender for runtime {}: {}", runtime_id, e);
+                                continue;
                             }
+                        };
+                        let reader = stream.try_clone()
+                            .and_then(|s| runtime_reader::spawn(runtime_id, s, reader_events.clone()));
+                        if let Err(e) = reader {
+                            error!("Failed to start reader for runtime {}: {}", runtime_id, e);
+                            continue;
                         }
-                        
                         let conn = RuntimeConnection {
                             stream: Arc::new(Mutex::new(stream)),
-                            last_processed_batch: batch_history.lock().unwrap().get_current_batch(),
+                            sender,
+                            last_processed_batch: history.get_current_batch(),
+                            last_applied_batch: 0,
                         };
                         runtimes.lock().unwrap().insert(runtime_id, conn);
+                        drop(history);
                         info!("Runtime {} added to connection pool", runtime_id);
+                        let _ = reader_events.send(ReaderEvent::Opened(runtime_id));
                     }
                     Err(e) => {
                         error!("Failed to accept runtime: {}", e);
@@ -114,113 +118,148 @@ impl RuntimeManager {
     }
 
     /// Broadcasts a batch to all connected runtimes that haven't processed it yet.
-    pub fn broadcast_batch(&self, batch: &Batch) {
+    /// The batch is encoded once; each runtime's sender thread writes the shared
+    /// frame, so this never waits on a slow runtime. A runtime whose queue is
+    /// full is disconnected rather than stalling the batch cadence.
+    pub fn broadcast_batch(&self, batch: Batch) {
         debug!("Broadcasting batch {} to all runtimes ({} bytes)", batch.number, batch.data.len());
-        if batch.data.len() > 27 {
-            info!("Broadcasting batch {} to all runtimes ({} bytes)", batch.number, batch.data.len());
-        }
-        let conns = self.runtimes.lock().unwrap();
-        let mut sent_count = 0;
-        let mut error_count = 0;
-        
+        let frame = Frame::new(batch.number, batch.direction_byte(), Bytes::from(batch.data));
+
+        let mut conns = self.runtimes.lock().unwrap();
         if conns.is_empty() {
-            warn!("No runtimes connected to broadcast batch {}", batch.number);
+            warn!("No runtimes connected to broadcast batch {}", frame.number);
             return;
         }
 
-        info!("Found {} connected runtimes", conns.len());
-        for (runtime_id, conn) in conns.iter() {
-            debug!("Runtime {} last processed batch: {}", runtime_id, conn.last_processed_batch);
-        }
-
-        // Serialize the batch header and data
-        let mut serialized = Vec::new();
-        // Write batch number (8 bytes)
-        serialized.extend_from_slice(&batch.number.to_le_bytes());
-        // Write direction (1 byte)
-        serialized.push(match batch.direction {
-            BatchDirection::Incoming => 0,
-            BatchDirection::Outgoing => 1,
-        });
-        // Write data length (8 bytes)
-        serialized.extend_from_slice(&(batch.data.len() as u64).to_le_bytes());
-        // Write the actual data
-        serialized.extend_from_slice(&batch.data);
-
-        // Get list of runtimes to process
-        let runtimes_to_process: Vec<(u64, Arc<Mutex<TcpStream>>)> = conns.iter()
-            .filter(|(_, conn)| conn.last_processed_batch <= batch.number)
-            .map(|(id, conn)| (*id, conn.stream.clone()))
-            .collect();
-
-        // Release the lock before sending
-        drop(conns);
-
-        // Process each runtime
-        for (runtime_id, stream) in runtimes_to_process {
-            debug!("Sending batch {} to runtime {} (last processed: {})", 
-                batch.number, runtime_id, batch.number - 1);
-            
-            let mut stream_guard = stream.lock().unwrap();
-            match stream_guard.write_all(&serialized) {
-                Ok(_) => {
-                    debug!("Batch {} sent to runtime {}", batch.number, runtime_id);
-                    if let Err(e) = stream_guard.flush() {
-                        error!("Failed to flush batch {} to runtime {}: {}", batch.number, runtime_id, e);
-                        error_count += 1;
-                        // Remove runtime if we get a broken pipe error
-                        if e.kind() == io::ErrorKind::BrokenPipe {
-                            let mut conns = self.runtimes.lock().unwrap();
-                            if conns.remove(&runtime_id).is_some() {
-                                info!("Removed disconnected runtime {} due to broken pipe", runtime_id);
-                            }
-                        }
-                        continue;
-                    }
-                    // Update last processed batch
-                    let mut conns = self.runtimes.lock().unwrap();
-                    if let Some(conn) = conns.get_mut(&runtime_id) {
-                        conn.last_processed_batch = batch.number;
-                    }
+        let mut sent_count = 0;
+        let mut dropped = Vec::new();
+        for (runtime_id, conn) in conns.iter_mut() {
+            if conn.last_processed_batch >= frame.number {
+                continue;
+            }
+            match conn.sender.enqueue(frame.clone()) {
+                Enqueue::Queued => {
+                    conn.last_processed_batch = frame.number;
                     sent_count += 1;
-                    info!("Successfully sent batch {} to runtime {} ({} bytes)", 
-                        batch.number, runtime_id, serialized.len());
                 }
-                Err(e) => {
-                    error!("Failed to send batch {} to runtime {}: {}", batch.number, runtime_id, e);
-                    error_count += 1;
-                    // Remove runtime if we get a broken pipe error
-                    if e.kind() == io::ErrorKind::BrokenPipe {
-                        let mut conns = self.runtimes.lock().unwrap();
-                        if conns.remove(&runtime_id).is_some() {
-                            info!("Removed disconnected runtime {} due to broken pipe", runtime_id);
-                        }
-                    }
+                Enqueue::Full => {
+                    warn!("Runtime {} is {} batches behind; disconnecting it", runtime_id, RUNTIME_QUEUE_CAPACITY);
+                    self.slow_disconnects.fetch_add(1, Ordering::Relaxed);
+                    dropped.push(*runtime_id);
                 }
+                Enqueue::Closed => {
+                    info!("Removing disconnected runtime {}", runtime_id);
+                    dropped.push(*runtime_id);
+                }
+            }
+        }
+        for runtime_id in dropped {
+            if let Some(conn) = conns.remove(&runtime_id) {
+                // Also stops the reader, which sees the connection close.
+                let _ = conn.stream.lock().unwrap().shutdown(Shutdown::Both);
             }
         }
 
-        info!("Batch {} broadcast complete (sent to {} runtimes, {} errors)", 
-            batch.number, sent_count, error_count);
+        debug!("Batch {} queued for {} runtimes ({} bytes each)", frame.number, sent_count, frame.len());
     }
 
-    /// Sends the session file (all previous batches) to a specific runtime.
-    pub fn send_session_file(&self, runtime_id: u64, session_data: &[u8], batch_number: u64) -> io::Result<()> {
-        info!("Sending session file to runtime {} ({} bytes, up to batch {})", 
-            runtime_id, session_data.len(), batch_number);
-        let mut conns = self.runtimes.lock().unwrap();
-        if let Some(conn) = conns.get_mut(&runtime_id) {
-            if let Err(e) = conn.stream.lock().unwrap().write_all(session_data) {
-                error!("Failed to send session file to runtime {}: {}", runtime_id, e);
-                return Err(e);
+    /// Queues a control frame for one runtime, behind the batches already
+    /// queued for it. Returns false if the runtime is gone.
+    pub fn send_control(&self, runtime_id: u64, control: &Control) -> bool {
+        let payload = match bincode::serialize(control) {
+            Ok(payload) => payload,
+            Err(e) => {
+                error!("Failed to encode control frame: {}", e);
+                return false;
             }
-            conn.last_processed_batch = batch_number;
-            info!("Successfully sent session file to runtime {}", runtime_id);
-            Ok(())
-        } else {
-            error!("Runtime {} not found for session file transfer", runtime_id);
-            Err(io::Error::new(io::ErrorKind::NotFound, "Runtime not found"))
+        };
+        let frame = Frame::new(control.resend_after, CONTROL_DIRECTION, Bytes::from(payload));
+        let conns = self.runtimes.lock().unwrap();
+        match conns.get(&runtime_id).map(|conn| conn.sender.enqueue(frame)) {
+            Some(Enqueue::Queued) => {
+                debug!("Sent {:?} to runtime {}", control, runtime_id);
+                true
+            }
+            _ => {
+                warn!("Could not send {:?} to runtime {}", control, runtime_id);
+                false
+            }
+        }
+    }
+
+    /// Frames decoded by the per-runtime reader threads. Returns `None` after
+    /// the first call; there is a single consumer.
+    pub fn take_reader_events(&self) -> Option<Receiver<ReaderEvent>> {
+        self.reader_events_rx.lock().unwrap().take()
+    }
+
+    /// Drops a runtime whose connection was lost.
+    pub fn remove_runtime(&self, runtime_id: u64) {
+        if let Some(conn) = self.runtimes.lock().unwrap().remove(&runtime_id) {
+            let _ = conn.stream.lock().unwrap().shutdown(Shutdown::Both);
+            info!("Removed runtime {}", runtime_id);
+        }
+    }
+
+    /// Records that a runtime applied every Incoming batch up to `batch`.
+    pub fn acknowledge(&self, runtime_id: u64, batch: u64) {
+        if let Some(conn) = self.runtimes.lock().unwrap().get_mut(&runtime_id) {
+            conn.last_applied_batch = conn.last_applied_batch.max(batch);
+        }
+    }
+
+    /// Fan-out counters for every connected runtime.
+    pub fn sender_stats(&self) -> Vec<(u64, SenderStatsSnapshot)> {
+        let conns = self.runtimes.lock().unwrap();
+        let mut stats: Vec<_> = conns.iter().map(|(id, conn)| (*id, conn.sender.stats())).collect();
+        stats.sort_by_key(|(id, _)| *id);
+        stats
+    }
+
+    /// Adds per-runtime progress and fan-out counters to `out`.
+    pub fn render_metrics(&self, out: &mut Exposition) {
+        let mut runtimes: Vec<(u64, u64, SenderStatsSnapshot)> = {
+            let conns = self.runtimes.lock().unwrap();
+            conns.iter().map(|(id, conn)| (*id, conn.last_applied_batch, conn.sender.stats())).collect()
+        };
+        runtimes.sort_by_key(|(id, ..)| *id);
+
+        out.gauge("replicode_runtimes", "Connected runtimes.", "", runtimes.len() as i64);
+        out.counter(
+            "replicode_runtime_slow_disconnects_total",
+            "Runtimes disconnected for falling too far behind.",
+            "",
+            self.slow_disconnects(),
+        );
+        for (id, last_batch, _) in &runtimes {
+            out.gauge(
+                "replicode_runtime_last_batch",
+                "Number of the last Incoming batch the runtime applied.",
+                &format!("runtime=\"{}\"", id),
+                *last_batch as i64,
+            );
         }
+        for (id, _, stats) in &runtimes {
+            out.gauge(
+                "replicode_runtime_lag_batches",
+                "Batches broadcast but not yet written to the runtime.",
+                &format!("runtime=\"{}\"", id),
+                stats.queued as i64,
+            );
+        }
+        for (id, _, stats) in &runtimes {
+            out.counter(
+                "replicode_runtime_sent_bytes_total",
+                "Bytes written to the runtime.",
+                &format!("runtime=\"{}\"", id),
+                stats.sent_bytes,
+            );
+        }
+    }
+
+    /// Runtimes disconnected so far because their send queue filled up.
+    pub fn slow_disconnects(&self) -> u64 {
+        self.slow_disconnects.load(Ordering::Relaxed)
     }
 
     /// Handles an outgoing batch from a runtime. Returns true if the batch was processed, false if it was ignored.
@@ -229,8 +268,9 @@ impl RuntimeManager {
         let mut conns = self.runtimes.lock().unwrap();
         if let Some(conn) = conns.get_mut(&runtime_id) {
             if conn.last_processed_batch < batch.number {
-                info!("Processing outgoing batch {} from runtime {}", batch.number, runtime_id);
+                debug!("Processing outgoing batch {} from runtime {}", batch.number, runtime_id);
                 conn.last_processed_batch = batch.number;
+                CONSENSUS.outgoing_batches.inc();
                 true
             } else {
                 debug!("Ignoring outgoing batch {} from runtime {} (already processed)", batch.number, runtime_id);
@@ -257,4 +297,43 @@ impl RuntimeManager {
             Err(io::Error::new(io::ErrorKind::NotFound, "No runtimes connected"))
         }
     }
-} 
\ No newline at end of file
+}
+
+/// Brings a runtime up to date: the latest checkpoint, if any, then every
+/// Incoming batch after it. The bulk is streamed from a separate file handle
+/// without the history lock, so the batch sender keeps saving new batches
+/// meanwhile. The few batches saved during catch-up are sent under the lock,
+/// which is returned held so the caller can register the runtime before the
+/// next batch is saved and broadcast.
+fn catch_up<'a>(
+    batch_history: &'a Mutex<BatchHistory>,
+    stream: &mut TcpStream,
+    runtime_id: u64,
+) -> io::Result<MutexGuard<'a, BatchHistory>> {
+    let (mut reader, checkpoint) = {
+        let history = batch_history.lock().unwrap();
+        (history.reader()?, history.latest_checkpoint())
+    };
+
+    let mut after = 0;
+    if let Some((batch, data)) = checkpoint {
+        let mut frame = Vec::with_capacity(17 + data.len());
+        frame.extend_from_slice(&batch.to_le_bytes());
+        frame.push(CHECKPOINT_DIRECTION);
+        frame.extend_from_slice(&(data.len() as u64).to_le_bytes());
+        frame.extend_from_slice(&data);
+        stream.write_all(&frame)?;
+        info!("Sent checkpoint at batch {} to runtime {}", batch, runtime_id);
+        after = batch;
+    }
+
+    let (caught_up, sent) = reader.stream_incoming_since(after, stream)?;
+    info!("Sent {} historical incoming batches to runtime {}", sent, runtime_id);
+
+    // Holding the history lock stops new batches being queued; once the
+    // writer has caught up, everything not streamed here is still to be broadcast.
+    let history = batch_history.lock().unwrap();
+    history.wait_written()?;
+    reader.stream_incoming_since(caught_up, stream)?;
+    Ok(history)
+}
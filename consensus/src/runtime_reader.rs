@@ -0,0 +1,65 @@
+use std::io::{self, BufReader, Read};
+use std::net::TcpStream;
+use std::sync::mpsc::Sender;
+use std::thread;
+use log::{debug, info};
+
+/// A complete batch frame read from a runtime.
+pub struct RuntimeFrame {
+    pub runtime_id: u64,
+    pub number: u64,
+    pub direction: u8,
+    pub data: Vec<u8>,
+}
+
+/// What the per-runtime reader threads report to the consensus side.
+pub enum ReaderEvent {
+    /// A runtime was caught up and joined the broadcast set.
+    Opened(u64),
+    Frame(RuntimeFrame),
+    /// The runtime's connection closed or failed; no more frames will follow.
+    Closed(u64),
+}
+
+/// Reads frames from one runtime on its own thread and forwards them whole.
+/// The `BufReader` lives as long as the connection, so read-ahead is never
+/// lost, and a quiet runtime only blocks its own thread.
+pub fn spawn(runtime_id: u64, stream: TcpStream, events: Sender<ReaderEvent>) -> io::Result<()> {
+    thread::Builder::new()
+        .name(format!("runtime{}-reader", runtime_id))
+        .spawn(move || reader_loop(runtime_id, stream, events))?;
+    Ok(())
+}
+
+fn reader_loop(runtime_id: u64, stream: TcpStream, events: Sender<ReaderEvent>) {
+    debug!("Reader thread for runtime {} started", runtime_id);
+    let mut reader = BufReader::new(stream);
+    loop {
+        match read_frame(&mut reader) {
+            Ok((number, direction, data)) => {
+                debug!("Received batch {} with direction {} from runtime {}", number, direction, runtime_id);
+                let frame = RuntimeFrame { runtime_id, number, direction, data };
+                if events.send(ReaderEvent::Frame(frame)).is_err() {
+                    return;
+                }
+            }
+            Err(e) => {
+                info!("Lost connection to runtime {}: {}", runtime_id, e);
+                let _ = events.send(ReaderEvent::Closed(runtime_id));
+                return;
+            }
+        }
+    }
+}
+
+/// Reads one `[number u64][direction u8][len u64][data]` frame.
+fn read_frame(reader: &mut impl Read) -> io::Result<(u64, u8, Vec<u8>)> {
+    let mut header = [0u8; 17];
+    reader.read_exact(&mut header)?;
+    let number = u64::from_le_bytes(header[0..8].try_into().unwrap());
+    let direction = header[8];
+    let len = u64::from_le_bytes(header[9..17].try_into().unwrap()) as usize;
+    let mut data = vec![0u8; len];
+    reader.read_exact(&mut data)?;
+    Ok((number, direction, data))
+}
@@ -0,0 +1,178 @@
+use std::io::{self, IoSlice, Write};
+use std::net::TcpStream;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::mpsc::{self, Receiver, SyncSender, TrySendError};
+use std::sync::Arc;
+use std::thread::{self, JoinHandle};
+use bytes::Bytes;
+use log::{debug, error, info};
+use serde::Serialize;
+
+/// Batches a runtime may fall behind by before it is disconnected
+/// (about 4 seconds at the default 15ms batch interval).
+pub const RUNTIME_QUEUE_CAPACITY: usize = 256;
+/// Queued frames written with a single `write_vectored` call.
+const MAX_FRAMES_PER_WRITE: usize = 32;
+/// Batch header on the wire: number (8 bytes), direction (1 byte), data length (8 bytes).
+pub const FRAME_HEADER_LEN: usize = 17;
+
+/// A batch encoded once and shared by every runtime's sender.
+#[derive(Clone)]
+pub struct Frame {
+    pub number: u64,
+    header: [u8; FRAME_HEADER_LEN],
+    payload: Bytes,
+}
+
+impl Frame {
+    pub fn new(number: u64, direction: u8, payload: Bytes) -> Self {
+        let mut header = [0u8; FRAME_HEADER_LEN];
+        header[0..8].copy_from_slice(&number.to_le_bytes());
+        header[8] = direction;
+        header[9..17].copy_from_slice(&(payload.len() as u64).to_le_bytes());
+        Self { number, header, payload }
+    }
+
+    pub fn len(&self) -> usize {
+        FRAME_HEADER_LEN + self.payload.len()
+    }
+}
+
+/// Per-runtime fan-out counters, updated by the broadcaster and the sender thread.
+#[derive(Default)]
+pub struct SenderStats {
+    queued: AtomicU64,
+    max_queued: AtomicU64,
+    sent_batches: AtomicU64,
+    sent_bytes: AtomicU64,
+    writes: AtomicU64,
+    failed: AtomicBool,
+}
+
+#[derive(Debug, Clone, Copy, Serialize)]
+pub struct SenderStatsSnapshot {
+    /// Batches waiting in the runtime's queue.
+    pub queued: u64,
+    /// High-water mark of `queued`.
+    pub max_queued: u64,
+    pub sent_batches: u64,
+    pub sent_bytes: u64,
+    /// Vectored writes issued; lower than `sent_batches` when frames coalesce.
+    pub writes: u64,
+    pub failed: bool,
+}
+
+pub enum Enqueue {
+    Queued,
+    /// The runtime is `RUNTIME_QUEUE_CAPACITY` batches behind.
+    Full,
+    /// The sender thread stopped after a write error.
+    Closed,
+}
+
+/// Writes batches to one runtime from its own thread, so a slow runtime only
+/// delays itself. The broadcaster never blocks on it: it enqueues a shared
+/// `Frame` and moves on.
+pub struct RuntimeSender {
+    queue: SyncSender<Frame>,
+    stats: Arc<SenderStats>,
+    worker: JoinHandle<()>,
+}
+
+impl RuntimeSender {
+    pub fn spawn(runtime_id: u64, stream: TcpStream) -> io::Result<Self> {
+        let (queue, frames) = mpsc::sync_channel(RUNTIME_QUEUE_CAPACITY);
+        let stats = Arc::new(SenderStats::default());
+        let worker_stats = Arc::clone(&stats);
+        let worker = thread::Builder::new()
+            .name(format!("runtime{}-sender", runtime_id))
+            .spawn(move || sender_loop(runtime_id, stream, frames, worker_stats))?;
+        Ok(Self { queue, stats, worker })
+    }
+
+    pub fn enqueue(&self, frame: Frame) -> Enqueue {
+        if self.stats.failed.load(Ordering::Relaxed) {
+            return Enqueue::Closed;
+        }
+        match self.queue.try_send(frame) {
+            Ok(()) => {
+                let depth = self.stats.queued.fetch_add(1, Ordering::Relaxed) + 1;
+                self.stats.max_queued.fetch_max(depth, Ordering::Relaxed);
+                Enqueue::Queued
+            }
+            Err(TrySendError::Full(_)) => Enqueue::Full,
+            Err(TrySendError::Disconnected(_)) => Enqueue::Closed,
+        }
+    }
+
+    pub fn stats(&self) -> SenderStatsSnapshot {
+        let stats = &self.stats;
+        SenderStatsSnapshot {
+            queued: stats.queued.load(Ordering::Relaxed),
+            max_queued: stats.max_queued.load(Ordering::Relaxed),
+            sent_batches: stats.sent_batches.load(Ordering::Relaxed),
+            sent_bytes: stats.sent_bytes.load(Ordering::Relaxed),
+            writes: stats.writes.load(Ordering::Relaxed),
+            failed: stats.failed.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Writes out everything already queued, then stops the sender thread.
+    pub fn finish(self) {
+        drop(self.queue);
+        if self.worker.join().is_err() {
+            error!("Runtime sender thread panicked");
+        }
+    }
+}
+
+fn sender_loop(runtime_id: u64, mut stream: TcpStream, frames: Receiver<Frame>, stats: Arc<SenderStats>) {
+    debug!("Sender thread for runtime {} started", runtime_id);
+    let mut pending: Vec<Frame> = Vec::with_capacity(MAX_FRAMES_PER_WRITE);
+    while let Ok(frame) = frames.recv() {
+        pending.push(frame);
+        // Coalesce whatever else is already queued into the same write.
+        while pending.len() < MAX_FRAMES_PER_WRITE {
+            match frames.try_recv() {
+                Ok(frame) => pending.push(frame),
+                Err(_) => break,
+            }
+        }
+        stats.queued.fetch_sub(pending.len() as u64, Ordering::Relaxed);
+
+        if let Err(e) = write_frames(&mut stream, &pending) {
+            error!("Failed to send batch {} to runtime {}: {}", pending[0].number, runtime_id, e);
+            stats.failed.store(true, Ordering::Relaxed);
+            return;
+        }
+        let bytes: usize = pending.iter().map(Frame::len).sum();
+        stats.writes.fetch_add(1, Ordering::Relaxed);
+        stats.sent_batches.fetch_add(pending.len() as u64, Ordering::Relaxed);
+        stats.sent_bytes.fetch_add(bytes as u64, Ordering::Relaxed);
+        debug!("Sent {} batches ({} bytes) to runtime {}", pending.len(), bytes, runtime_id);
+        pending.clear();
+    }
+    info!("Sender thread for runtime {} stopped", runtime_id);
+}
+
+/// Writes the headers and shared payloads of `frames` without copying them
+/// into one buffer.
+fn write_frames(stream: &mut TcpStream, frames: &[Frame]) -> io::Result<()> {
+    let mut slices: Vec<IoSlice> = Vec::with_capacity(frames.len() * 2);
+    for frame in frames {
+        slices.push(IoSlice::new(&frame.header));
+        if !frame.payload.is_empty() {
+            slices.push(IoSlice::new(&frame.payload));
+        }
+    }
+    let mut slices = &mut slices[..];
+    while !slices.is_empty() {
+        match stream.write_vectored(slices) {
+            Ok(0) => return Err(io::Error::new(io::ErrorKind::WriteZero, "runtime closed the connection")),
+            Ok(n) => IoSlice::advance_slices(&mut slices, n),
+            Err(e) if e.kind() == io::ErrorKind::Interrupted => {}
+            Err(e) => return Err(e),
+        }
+    }
+    stream.flush()
+}
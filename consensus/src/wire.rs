@@ -0,0 +1,465 @@
+use std::io;
+use crate::commands::NetworkOperation;
+
+/// Version byte at the start of every batch payload (and record file).
+/// Bump it whenever the record layout below changes.
+pub const WIRE_VERSION: u8 = 0xB1;
+
+const TAG_CLOCK: u8 = 0;
+const TAG_FD_MSG: u8 = 1;
+const TAG_INIT: u8 = 2;
+const TAG_NETWORK_IN: u8 = 3;
+const TAG_NETWORK_STATUS: u8 = 4;
+const TAG_NETWORK_OUT: u8 = 5;
+
+const OP_CONNECT: u8 = 0;
+const OP_SEND: u8 = 1;
+const OP_CLOSE: u8 = 2;
+const OP_LISTEN: u8 = 3;
+const OP_ACCEPT: u8 = 4;
+const OP_RECV: u8 = 5;
+
+/// One record of a batch, borrowing its payload from the batch buffer.
+///
+/// Layout: a tag byte, then per tag (pids, lengths and the clock delta are
+/// LEB128 varints, ports little-endian u16):
+///   Clock          [0][delta]
+///   FdMsg          [1][pid][len][data]
+///   Init           [2][len][payload]
+///   NetworkIn      [3][pid][port][len][data]
+///   NetworkStatus  [4][pid][status u8][src_port][new_port]
+///   NetworkOut     [5][pid][op u8][op fields]
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Record<'a> {
+    Clock { delta: u64 },
+    FdMsg { pid: u64, data: &'a [u8] },
+    /// `args:`/`dir:` prefixes followed by the WASM binary.
+    Init { payload: &'a [u8] },
+    NetworkIn { pid: u64, port: u16, data: &'a [u8] },
+    /// Result of a network operation: 1 success, 2 still waiting, else failure.
+    /// `new_port` is the accepted connection's port, or 0.
+    NetworkStatus { pid: u64, status: u8, src_port: u16, new_port: u16 },
+    NetworkOut { pid: u64, op: NetOp<'a> },
+}
+
+/// A `NetworkOperation` borrowing its data.
+/// Op fields: Connect [src_port][dest_port][len][addr], Send [src_port][len][data],
+/// Accept [src_port][new_port], Close/Listen/Recv [src_port].
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum NetOp<'a> {
+    Connect { dest_addr: &'a str, dest_port: u16, src_port: u16 },
+    Send { src_port: u16, data: &'a [u8] },
+    Close { src_port: u16 },
+    Listen { src_port: u16 },
+    Accept { src_port: u16, new_port: u16 },
+    Recv { src_port: u16 },
+}
+
+impl<'a> From<&'a NetworkOperation> for NetOp<'a> {
+    fn from(op: &'a NetworkOperation) -> Self {
+        match op {
+            NetworkOperation::Connect { dest_addr, dest_port, src_port } => {
+                NetOp::Connect { dest_addr, dest_port: *dest_port, src_port: *src_port }
+            }
+            NetworkOperation::Send { src_port, data } => NetOp::Send { src_port: *src_port, data },
+            NetworkOperation::Close { src_port } => NetOp::Close { src_port: *src_port },
+            NetworkOperation::Listen { src_port } => NetOp::Listen { src_port: *src_port },
+            NetworkOperation::Accept { src_port, new_port } => {
+                NetOp::Accept { src_port: *src_port, new_port: *new_port }
+            }
+            NetworkOperation::Recv { src_port } => NetOp::Recv { src_port: *src_port },
+        }
+    }
+}
+
+impl NetOp<'_> {
+    pub fn to_operation(&self) -> NetworkOperation {
+        match *self {
+            NetOp::Connect { dest_addr, dest_port, src_port } => {
+                NetworkOperation::Connect { dest_addr: dest_addr.to_owned(), dest_port, src_port }
+            }
+            NetOp::Send { src_port, data } => NetworkOperation::Send { src_port, data: data.to_vec() },
+            NetOp::Close { src_port } => NetworkOperation::Close { src_port },
+            NetOp::Listen { src_port } => NetworkOperation::Listen { src_port },
+            NetOp::Accept { src_port, new_port } => NetworkOperation::Accept { src_port, new_port },
+            NetOp::Recv { src_port } => NetworkOperation::Recv { src_port },
+        }
+    }
+
+    fn encode(&self, out: &mut Vec<u8>) {
+        match *self {
+            NetOp::Connect { dest_addr, dest_port, src_port } => {
+                out.push(OP_CONNECT);
+                put_u16(out, src_port);
+                put_u16(out, dest_port);
+                put_bytes(out, dest_addr.as_bytes());
+            }
+            NetOp::Send { src_port, data } => {
+                out.push(OP_SEND);
+                put_u16(out, src_port);
+                put_bytes(out, data);
+            }
+            NetOp::Close { src_port } => {
+                out.push(OP_CLOSE);
+                put_u16(out, src_port);
+            }
+            NetOp::Listen { src_port } => {
+                out.push(OP_LISTEN);
+                put_u16(out, src_port);
+            }
+            NetOp::Accept { src_port, new_port } => {
+                out.push(OP_ACCEPT);
+                put_u16(out, src_port);
+                put_u16(out, new_port);
+            }
+            NetOp::Recv { src_port } => {
+                out.push(OP_RECV);
+                put_u16(out, src_port);
+            }
+        }
+    }
+
+    fn decode<'a>(cursor: &mut Cursor<'a>) -> io::Result<NetOp<'a>> {
+        Ok(match cursor.u8()? {
+            OP_CONNECT => {
+                let src_port = cursor.u16()?;
+                let dest_port = cursor.u16()?;
+                let dest_addr = std::str::from_utf8(cursor.bytes()?)
+                    .map_err(|_| invalid("connect address is not UTF-8"))?;
+                NetOp::Connect { dest_addr, dest_port, src_port }
+            }
+            OP_SEND => {
+                let src_port = cursor.u16()?;
+                NetOp::Send { src_port, data: cursor.bytes()? }
+            }
+            OP_CLOSE => NetOp::Close { src_port: cursor.u16()? },
+            OP_LISTEN => NetOp::Listen { src_port: cursor.u16()? },
+            OP_ACCEPT => {
+                let src_port = cursor.u16()?;
+                NetOp::Accept { src_port, new_port: cursor.u16()? }
+            }
+            OP_RECV => NetOp::Recv { src_port: cursor.u16()? },
+            other => return Err(invalid_tag("network op", other)),
+        })
+    }
+}
+
+impl Record<'_> {
+    /// Appends the encoded record to `out`.
+    pub fn encode(&self, out: &mut Vec<u8>) {
+        match *self {
+            Record::Clock { delta } => {
+                out.push(TAG_CLOCK);
+                put_varint(out, delta);
+            }
+            Record::FdMsg { pid, data } => {
+                out.push(TAG_FD_MSG);
+                put_varint(out, pid);
+                put_bytes(out, data);
+            }
+            Record::Init { payload } => {
+                out.push(TAG_INIT);
+                put_bytes(out, payload);
+            }
+            Record::NetworkIn { pid, port, data } => {
+                out.push(TAG_NETWORK_IN);
+                put_varint(out, pid);
+                put_u16(out, port);
+                put_bytes(out, data);
+            }
+            Record::NetworkStatus { pid, status, src_port, new_port } => {
+                out.push(TAG_NETWORK_STATUS);
+                put_varint(out, pid);
+                out.push(status);
+                put_u16(out, src_port);
+                put_u16(out, new_port);
+            }
+            Record::NetworkOut { pid, op } => {
+                out.push(TAG_NETWORK_OUT);
+                put_varint(out, pid);
+                op.encode(out);
+            }
+        }
+    }
+
+    pub fn to_vec(&self) -> Vec<u8> {
+        let mut out = Vec::new();
+        self.encode(&mut out);
+        out
+    }
+}
+
+/// Starts a batch payload (or record file) in `out`.
+pub fn start_batch(out: &mut Vec<u8>) {
+    out.push(WIRE_VERSION);
+}
+
+/// Decodes the records of a batch payload in place; yields an error and
+/// stops at the first malformed record.
+pub struct Records<'a> {
+    cursor: Cursor<'a>,
+}
+
+impl<'a> Records<'a> {
+    /// Checks the version byte of `batch` and iterates over its records.
+    pub fn new(batch: &'a [u8]) -> io::Result<Self> {
+        match batch.first() {
+            Some(&WIRE_VERSION) => Ok(Self::resume(batch, 1)),
+            Some(&other) => Err(invalid_tag("wire version", other)),
+            None => Err(invalid("empty batch")),
+        }
+    }
+
+    /// Iterates over the records of `data` from `pos`, a record boundary
+    /// past the version byte.
+    pub fn resume(data: &'a [u8], pos: usize) -> Self {
+        Records { cursor: Cursor { data, pos } }
+    }
+
+    /// Offset of the next record.
+    pub fn position(&self) -> usize {
+        self.cursor.pos
+    }
+}
+
+impl<'a> Iterator for Records<'a> {
+    type Item = io::Result<Record<'a>>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        if self.cursor.pos >= self.cursor.data.len() {
+            return None;
+        }
+        let start = self.cursor.pos;
+        let record = decode_record(&mut self.cursor);
+        if record.is_err() {
+            // Leave the position at the bad record and stop there.
+            self.cursor.pos = start;
+            self.cursor.data = &self.cursor.data[..start];
+        }
+        Some(record)
+    }
+}
+
+fn decode_record<'a>(cursor: &mut Cursor<'a>) -> io::Result<Record<'a>> {
+    Ok(match cursor.u8()? {
+        TAG_CLOCK => Record::Clock { delta: cursor.varint()? },
+        TAG_FD_MSG => {
+            let pid = cursor.varint()?;
+            Record::FdMsg { pid, data: cursor.bytes()? }
+        }
+        TAG_INIT => Record::Init { payload: cursor.bytes()? },
+        TAG_NETWORK_IN => {
+            let pid = cursor.varint()?;
+            let port = cursor.u16()?;
+            Record::NetworkIn { pid, port, data: cursor.bytes()? }
+        }
+        TAG_NETWORK_STATUS => {
+            let pid = cursor.varint()?;
+            let status = cursor.u8()?;
+            let src_port = cursor.u16()?;
+            Record::NetworkStatus { pid, status, src_port, new_port: cursor.u16()? }
+        }
+        TAG_NETWORK_OUT => {
+            let pid = cursor.varint()?;
+            Record::NetworkOut { pid, op: NetOp::decode(cursor)? }
+        }
+        other => return Err(invalid_tag("record tag", other)),
+    })
+}
+
+struct Cursor<'a> {
+    data: &'a [u8],
+    pos: usize,
+}
+
+impl<'a> Cursor<'a> {
+    fn take(&mut self, n: usize) -> io::Result<&'a [u8]> {
+        if self.data.len() - self.pos < n {
+            return Err(io::Error::new(io::ErrorKind::UnexpectedEof, "truncated record"));
+        }
+        let bytes = &self.data[self.pos..self.pos + n];
+        self.pos += n;
+        Ok(bytes)
+    }
+
+    fn u8(&mut self) -> io::Result<u8> {
+        Ok(self.take(1)?[0])
+    }
+
+    fn u16(&mut self) -> io::Result<u16> {
+        Ok(u16::from_le_bytes(self.take(2)?.try_into().unwrap()))
+    }
+
+    fn varint(&mut self) -> io::Result<u64> {
+        let mut value = 0u64;
+        for shift in (0..64).step_by(7) {
+            let byte = self.u8()?;
+            value |= u64::from(byte & 0x7f) << shift;
+            if byte & 0x80 == 0 {
+                return Ok(value);
+            }
+        }
+        Err(invalid("varint longer than 10 bytes"))
+    }
+
+    /// A varint length followed by that many bytes.
+    fn bytes(&mut self) -> io::Result<&'a [u8]> {
+        let len = self.varint()?;
+        let len = usize::try_from(len).map_err(|_| invalid("length out of range"))?;
+        self.take(len)
+    }
+}
+
+fn put_varint(out: &mut Vec<u8>, mut value: u64) {
+    while value >= 0x80 {
+        out.push(value as u8 | 0x80);
+        value >>= 7;
+    }
+    out.push(value as u8);
+}
+
+fn put_u16(out: &mut Vec<u8>, value: u16) {
+    out.extend_from_slice(&value.to_le_bytes());
+}
+
+fn put_bytes(out: &mut Vec<u8>, bytes: &[u8]) {
+    put_varint(out, bytes.len() as u64);
+    out.extend_from_slice(bytes);
+}
+
+fn invalid(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+fn invalid_tag(what: &str, tag: u8) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, format!("unknown {} {:#04x}", what, tag))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn batch_of(records: &[Record]) -> Vec<u8> {
+        let mut out = Vec::new();
+        start_batch(&mut out);
+        for record in records {
+            record.encode(&mut out);
+        }
+        out
+    }
+
+    fn decode_all(batch: &[u8]) -> io::Result<Vec<Record<'_>>> {
+        Records::new(batch)?.collect()
+    }
+
+    fn every_record() -> Vec<Record<'static>> {
+        vec![
+            Record::Clock { delta: 15_000_000 },
+            Record::FdMsg { pid: 1, data: b"3:hello" },
+            Record::Init { payload: b"args:a\x1Fb\0\0asm\x01\0\0\0" },
+            Record::NetworkIn { pid: 2, port: 7000, data: b"GET key\n" },
+            Record::NetworkStatus { pid: 3, status: 1, src_port: 7000, new_port: 40001 },
+            Record::NetworkOut { pid: 4, op: NetOp::Connect { dest_addr: "127.0.0.1", dest_port: 80, src_port: 5000 } },
+            Record::NetworkOut { pid: 4, op: NetOp::Send { src_port: 5000, data: b"payload" } },
+            Record::NetworkOut { pid: 4, op: NetOp::Close { src_port: 5000 } },
+            Record::NetworkOut { pid: 5, op: NetOp::Listen { src_port: 7000 } },
+            Record::NetworkOut { pid: 5, op: NetOp::Accept { src_port: 7000, new_port: 40002 } },
+            Record::NetworkOut { pid: 5, op: NetOp::Recv { src_port: 40002 } },
+        ]
+    }
+
+    #[test]
+    fn round_trips_every_record() {
+        let records = every_record();
+        let batch = batch_of(&records);
+        assert_eq!(batch[0], WIRE_VERSION);
+        assert_eq!(decode_all(&batch).unwrap(), records);
+    }
+
+    #[test]
+    fn round_trips_varint_boundaries() {
+        for value in [0, 1, 127, 128, 16_383, 16_384, u32::MAX as u64, u64::MAX - 1, u64::MAX] {
+            let records = [
+                Record::Clock { delta: value },
+                Record::FdMsg { pid: value, data: b"" },
+                Record::NetworkStatus { pid: value, status: 2, src_port: u16::MAX, new_port: 0 },
+            ];
+            assert_eq!(decode_all(&batch_of(&records)).unwrap(), records, "value {}", value);
+        }
+        let mut out = Vec::new();
+        put_varint(&mut out, 127);
+        assert_eq!(out, [0x7f]);
+        out.clear();
+        put_varint(&mut out, 128);
+        assert_eq!(out, [0x80, 0x01]);
+        out.clear();
+        put_varint(&mut out, u64::MAX);
+        assert_eq!(out.len(), 10);
+    }
+
+    #[test]
+    fn round_trips_empty_payloads() {
+        let records = [
+            Record::FdMsg { pid: 0, data: b"" },
+            Record::Init { payload: b"" },
+            Record::NetworkIn { pid: 0, port: 0, data: b"" },
+            Record::NetworkOut { pid: 0, op: NetOp::Connect { dest_addr: "", dest_port: 0, src_port: 0 } },
+            Record::NetworkOut { pid: 0, op: NetOp::Send { src_port: 0, data: b"" } },
+        ];
+        assert_eq!(decode_all(&batch_of(&records)).unwrap(), records);
+        // A batch with no records is just the version byte.
+        assert_eq!(decode_all(&batch_of(&[])).unwrap(), []);
+    }
+
+    #[test]
+    fn rejects_every_truncation() {
+        for record in every_record() {
+            let full = batch_of(&[record]);
+            for cut in 2..full.len() {
+                let mut records = Records::new(&full[..cut]).unwrap();
+                assert!(records.next().unwrap().is_err(), "{:?} cut at {}", record, cut);
+                assert!(records.next().is_none(), "{:?} cut at {}", record, cut);
+            }
+        }
+    }
+
+    #[test]
+    fn stops_at_the_first_bad_record() {
+        let mut batch = batch_of(&[Record::Clock { delta: 1 }]);
+        let good_end = batch.len();
+        batch.push(0x7f);
+        Record::Clock { delta: 2 }.encode(&mut batch);
+
+        let mut records = Records::new(&batch).unwrap();
+        assert_eq!(records.next().unwrap().unwrap(), Record::Clock { delta: 1 });
+        assert_eq!(records.next().unwrap().unwrap_err().kind(), io::ErrorKind::InvalidData);
+        assert_eq!(records.position(), good_end);
+        assert!(records.next().is_none());
+    }
+
+    #[test]
+    fn rejects_bad_versions_and_fields() {
+        assert!(Records::new(&[]).is_err());
+        assert!(Records::new(&[WIRE_VERSION + 1]).is_err());
+
+        // An unknown network op.
+        let batch = [WIRE_VERSION, TAG_NETWORK_OUT, 1, 0x7f, 0, 0];
+        assert!(decode_all(&batch).is_err());
+        // A connect address that is not UTF-8.
+        let batch = [WIRE_VERSION, TAG_NETWORK_OUT, 1, OP_CONNECT, 0, 0, 0, 0, 1, 0xff];
+        assert!(decode_all(&batch).is_err());
+        // A varint that never ends.
+        let mut batch = vec![WIRE_VERSION, TAG_CLOCK];
+        batch.extend([0xff; 11]);
+        assert_eq!(decode_all(&batch).unwrap_err().kind(), io::ErrorKind::InvalidData);
+    }
+
+    #[test]
+    fn converts_network_operations() {
+        for record in every_record() {
+            if let Record::NetworkOut { op, .. } = record {
+                assert_eq!(NetOp::from(&op.to_operation()), op);
+            }
+        }
+    }
+}
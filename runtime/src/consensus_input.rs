@@ -1,13 +1,21 @@
 use anyhow::Result;
-use std::io::{BufReader, Read, Seek, SeekFrom, Write};
-use std::fs::File;
-use byteorder::{LittleEndian, ReadBytesExt};
-use log::{info, error, debug};
+use std::io::{self, BufReader, Read, Seek, SeekFrom, Write};
+use std::sync::Mutex;
+use log::{info, error, debug, trace};
 use std::sync::atomic::{AtomicU64, Ordering};
 use crate::runtime::clock::GlobalClock;
 use crate::runtime::process;
+use crate::runtime::process::Process;
+use crate::runtime::process_set::ProcessSet;
+use crate::runtime::checkpoint;
+use crate::runtime::digest;
+use crate::runtime::outgoing;
+use crate::runtime::metrics::{self, RUNTIME};
+use consensus::batch::{self, Checkpoint, Control, ACK_DIRECTION, ACK_READY, CHECKPOINT_DIRECTION, CONTROL_DIRECTION, DIGEST_FLAG, SUMMARY_FLAG};
+use consensus::commands::NetworkOperation;
+use consensus::wire::{self, NetOp, Record, Records, WIRE_VERSION};
 use crate::wasi_syscalls::net::OutgoingNetworkMessage;
-use crate::runtime::fd_table::FDEntry;
+use crate::runtime::fd_table::{FDEntry, PendingOp, SocketState};
 use bincode;
 
 // Use an AtomicU64 for generating unique process IDs.
@@ -15,28 +23,208 @@ static NEXT_PID: AtomicU64 = AtomicU64::new(1);
 // Track file position for consensus file
 static FILE_POSITION: AtomicU64 = AtomicU64::new(0);
 static OUTGOING_BATCH_NUMBER: AtomicU64 = AtomicU64::new(1);
+// Number of the last Incoming batch applied
+static LAST_BATCH: AtomicU64 = AtomicU64::new(0);
+// Number of the last Incoming batch acknowledged to consensus, and its flags
+static LAST_ACKED: Mutex<(u64, u8)> = Mutex::new((0, 0));
+// Contents of the consensus file read so far
+static FILE_DATA: Mutex<Vec<u8>> = Mutex::new(Vec::new());
 
 fn get_next_pid() -> u64 {
     NEXT_PID.fetch_add(1, Ordering::SeqCst)
 }
 
+/// Runtime-global state after the last applied Incoming batch.
+fn current_checkpoint() -> Checkpoint {
+    Checkpoint {
+        batch: LAST_BATCH.load(Ordering::SeqCst),
+        clock: GlobalClock::now(),
+        next_pid: NEXT_PID.load(Ordering::SeqCst),
+        outgoing_batch: OUTGOING_BATCH_NUMBER.load(Ordering::SeqCst),
+        digest: digest::current(),
+    }
+}
+
+/// Resumes from a checkpoint sent ahead of the history. Only a runtime that
+/// has applied nothing yet may do so; anyone else ignores it.
+fn restore_checkpoint(payload: &[u8], processes: &ProcessSet) -> Result<()> {
+    let cp: Checkpoint = bincode::deserialize(payload)?;
+    if LAST_BATCH.load(Ordering::SeqCst) != 0 || !processes.is_empty() {
+        debug!("Ignoring checkpoint at batch {}: runtime already running", cp.batch);
+        return Ok(());
+    }
+    GlobalClock::set(cp.clock);
+    NEXT_PID.store(cp.next_pid, Ordering::SeqCst);
+    OUTGOING_BATCH_NUMBER.store(cp.outgoing_batch, Ordering::SeqCst);
+    LAST_BATCH.store(cp.batch, Ordering::SeqCst);
+    digest::restore(cp.digest);
+    checkpoint::restored(&cp);
+    Ok(())
+}
+
+/// Writes one `[number u64][direction u8][len u64][payload]` frame.
+fn write_frame(out: &mut impl Write, number: u64, direction: u8, payload: &[u8]) -> io::Result<()> {
+    out.write_all(&number.to_le_bytes())?;
+    out.write_all(&[direction])?;
+    out.write_all(&(payload.len() as u64).to_le_bytes())?;
+    out.write_all(payload)
+}
+
+/// Switches between sending outgoing records and only their digests. A
+/// promoted follower first resends, in full, the batches consensus has
+/// not applied.
+fn apply_control(out: &mut impl Write, payload: &[u8]) -> Result<()> {
+    let control: Control = bincode::deserialize(payload)?;
+    let next_number = OUTGOING_BATCH_NUMBER.load(Ordering::SeqCst);
+    for held in outgoing::apply_control(&control, next_number) {
+        write_frame(out, held.number, 1 | DIGEST_FLAG, &batch::with_digest(held.digest, &held.records))?;
+        debug!("Resent outgoing batch {} ({} bytes)", held.number, held.records.len());
+    }
+    Ok(())
+}
+
+/// Parses an FD update payload, `"fd:<number>,body:<data>"`.
+fn parse_fd_update(payload: &[u8]) -> Option<(usize, &[u8])> {
+    let sep = payload.windows(6).position(|w| w == b",body:")?;
+    let fd = std::str::from_utf8(payload[..sep].strip_prefix(b"fd:")?).ok()?;
+    let fd = fd.trim().parse().ok()?;
+    Some((fd, payload[sep + 6..].trim_ascii()))
+}
+
+/// Appends an FD update to the process's input file buffer.
+fn apply_fd_update(processes: &mut ProcessSet, process_id: u64, payload: &[u8]) {
+    let Some((fd, body)) = parse_fd_update(payload) else {
+        error!("Invalid FD update format for process {}: {}", process_id, String::from_utf8_lossy(payload));
+        return;
+    };
+    if let Some(process) = processes.get(process_id) {
+        let mut table = process.data.fd_table.lock().unwrap();
+        if let Some(Some(FDEntry::File { buffer, .. })) = table.entries.get_mut(fd) {
+            buffer.extend_from_slice(body);
+            buffer.push(b'\n');
+            trace!("Added FD update to process {}'s FD {} ({} bytes)", process_id, fd, body.len());
+        } else {
+            error!("Process {} does not have FD {} open for FD update", process_id, fd);
+        }
+        process.data.cond.notify_all();
+    } else {
+        error!("No process found with ID {} for FD update", process_id);
+    }
+    processes.wake(process_id);
+}
+
+/// Starts the process described by an Init payload.
+fn apply_init(processes: &mut ProcessSet, payload: &[u8]) {
+    debug!("Processing init command for new process");
+    let new_pid = get_next_pid();
+    match process::start_process_from_bytes(payload, new_pid) {
+        Ok(proc) => {
+            processes.spawn(proc);
+            checkpoint::process_spawned(new_pid);
+            info!("Added new process {} to scheduler", new_pid);
+        }
+        Err(e) => {
+            error!("Failed to create new process {}: {}", new_pid, e);
+        }
+    }
+}
+
+/// Applies the consensus result of a network operation (1 success, 2 still
+/// waiting, anything else failure).
+fn apply_network_status(process: &Process, process_id: u64, status: u8, src_port: u16, new_port: u16) {
+    let mut table = process.data.fd_table.lock().unwrap();
+    let sockets = table.entries.iter_mut().enumerate().filter_map(|(fd, entry)| match entry {
+        Some(FDEntry::Socket { local_port, state, .. }) => Some((fd, *local_port, state)),
+        _ => None,
+    });
+    match status {
+        1 => { // Success
+            debug!("Network operation succeeded for process {}:{}", process_id, src_port);
+            let mut accepted = new_port == 0;
+            for (fd, port, state) in sockets {
+                if new_port != 0 && port == new_port {
+                    // The connection preallocated by accept
+                    state.set(SocketState::MAPPED | SocketState::CONNECTED, true);
+                    debug!("Marked socket FD {} as connected for process {}:{}", fd, process_id, new_port);
+                    accepted = true;
+                } else if port == src_port {
+                    state.set(SocketState::MAPPED, true);
+                    if matches!(state.pending, PendingOp::Listen | PendingOp::Accept) {
+                        state.pending = PendingOp::None;
+                    }
+                }
+            }
+            if !accepted {
+                error!("Could not find socket with port {} in FD table for process {}", new_port, process_id);
+            }
+        }
+        2 => { // Still waiting
+            // The socket's pending operation, set before blocking, keeps the process blocked
+            debug!("Network operation still waiting for process {}:{}", process_id, src_port);
+        }
+        _ => { // Failure
+            error!("Network operation failed for process {}:{}, status {}", process_id, src_port, status);
+            for (fd, port, state) in sockets {
+                if port == src_port {
+                    // Unblock the process and mark the socket disconnected
+                    state.pending = PendingOp::None;
+                    state.set(SocketState::CONNECTED, false);
+                    state.set(SocketState::FAILED, true);
+                    debug!("Cleared socket FD {} for process {}:{} due to failure", fd, process_id, src_port);
+                }
+            }
+        }
+    }
+}
+
+/// Appends data received from the network to the socket bound to `dest_port`,
+/// preferring an accepted connection over a listener.
+fn apply_network_data(process: &Process, process_id: u64, dest_port: u16, data: &[u8]) {
+    let mut table = process.data.fd_table.lock().unwrap();
+    let mut matching = None;
+    for (fd, entry) in table.entries.iter_mut().enumerate() {
+        if let Some(FDEntry::Socket { local_port, state, buffer }) = entry {
+            if *local_port == dest_port {
+                let listener = state.has(SocketState::LISTENER);
+                matching = Some((fd, state, buffer));
+                if !listener {
+                    break;
+                }
+            }
+        }
+    }
+
+    if let Some((fd, state, buffer)) = matching {
+        buffer.extend_from_slice(data);
+        // Data completes a pending recv
+        if state.pending == PendingOp::Recv {
+            state.pending = PendingOp::None;
+        }
+        trace!("Added NetworkIn data to process {}'s socket FD {} ({} bytes)",
+             process_id, fd, data.len());
+    } else {
+        error!("No matching socket found for process {} port {}", process_id, dest_port);
+    }
+}
+
 /// Reads new records from a live consensus pipe/socket for one batch only.
-/// 
-/// Record format (total header: 1 byte msg_type, 8 bytes process_id, 2 bytes payload length):
-///   [ msg_type: u8 ][ process_id: u64 ][ payload_length: u16 ][ payload: [u8; payload_length] ]
 ///
-/// Supported message types:
-/// - **0**: Clock update. The payload must start with `"clock:"` followed by the nanoseconds value.
-/// - **1**: FD update. The payload is expected to be `"fd:<number>,body:<data>"`.
-/// - **2**: Init command. The payload is a WASM binary; a new process is created.
-/// - **3**: Msg command. The payload is expected to be `"msg:<message>"` (or just a message),
-///        and the message is sent (for example, to FD 0).
-/// - **4**: FTP update. (Logic to dispatch the FTP command can be added.)
-/// - **5**: NetworkIn. The payload is expected to be a network message.
+/// Each batch payload is decoded in place with `consensus::wire::Records`
+/// (see there for the layout); record payloads are borrowed from the batch
+/// buffer rather than copied out. Incoming batches carry:
+/// - **Clock**: advances the global clock by `delta` nanoseconds.
+/// - **FdMsg**: an FD update, `"fd:<number>,body:<data>"`.
+/// - **Init**: a WASM binary (with optional `args:`/`dir:` prefixes); a new process is created.
+/// - **NetworkIn**: data received on a process's port.
+/// - **NetworkStatus**: the outcome of a network operation the process is blocked on.
+///
+/// Outgoing network operations are sent as NetworkOut records. `ready` is
+/// how many processes are Ready but held until this batch is applied.
 pub fn process_consensus_pipe<R: Read + Write>(
     reader: &mut BufReader<R>, 
-    processes: &mut Vec<process::Process>,
+    processes: &mut ProcessSet,
     outgoing_messages: Vec<OutgoingNetworkMessage>,
+    ready: usize,
 ) -> Result<bool> {
     let batch_start_time = std::time::Instant::now();
     debug!("Processing consensus pipe with {} outgoing messages", outgoing_messages.len());
@@ -44,33 +232,59 @@ pub fn process_consensus_pipe<R: Read + Write>(
     // First, send any outgoing network messages as a batch
     if !outgoing_messages.is_empty() {
         let batch_number = OUTGOING_BATCH_NUMBER.fetch_add(1, Ordering::SeqCst);
-        let direction = 1u8; // Outgoing
         let mut batch_data = Vec::new();
         let start_time = std::time::Instant::now();
-        
-        for msg in outgoing_messages {
-            debug!("Sending outgoing network message for process {}: {:?}", msg.pid, msg.operation);
-            // Write message type (NetworkOut = 5)
-            batch_data.push(5);
-            // Write process ID
-            batch_data.extend_from_slice(&msg.pid.to_le_bytes());
-            // Serialize and write the network operation
-            let op_bytes = bincode::serialize(&msg.operation)?;
-            batch_data.extend_from_slice(&(op_bytes.len() as u32).to_le_bytes());
-            batch_data.extend_from_slice(&op_bytes);
+
+        wire::start_batch(&mut batch_data);
+        for msg in &outgoing_messages {
+            let (kind, len) = msg.operation.summary();
+            trace!("Sending outgoing {} for process {} ({} bytes)", kind, msg.pid, len);
+            if matches!(msg.operation, NetworkOperation::Send { .. }) {
+                RUNTIME.send_ops.inc();
+            }
+            Record::NetworkOut { pid: msg.pid, op: NetOp::from(&msg.operation) }.encode(&mut batch_data);
         }
-        
-        // Write batch header
-        reader.get_mut().write_all(&batch_number.to_le_bytes())?;
-        reader.get_mut().write_all(&[direction])?;
-        reader.get_mut().write_all(&(batch_data.len() as u64).to_le_bytes())?;
-        // Write batch data
-        reader.get_mut().write_all(&batch_data)?;
+        let state_digest = digest::outgoing(batch_number, &batch_data);
+
+        // Outgoing, with the state digest; a follower sends only the digest
+        let payload_len = if outgoing::is_leader() {
+            let payload = batch::with_digest(state_digest, &batch_data);
+            write_frame(reader.get_mut(), batch_number, 1 | DIGEST_FLAG, &payload)?;
+            payload.len()
+        } else {
+            write_frame(reader.get_mut(), batch_number, 1 | DIGEST_FLAG | SUMMARY_FLAG, &state_digest.to_le_bytes())?;
+            outgoing::hold(batch_number, state_digest, batch_data);
+            8
+        };
         
         let duration = start_time.elapsed();
-        info!("Consensus sent outgoing batch {} ({} bytes) in {:?}", 
-             batch_number, batch_data.len(), duration);
+        debug!("Consensus sent outgoing batch {} ({} bytes, digest {:016x}) in {:?}",
+             batch_number, payload_len, state_digest, duration);
+    }
+
+    // Report a checkpoint once the resume point has advanced far enough
+    if let Some(cp) = checkpoint::due(current_checkpoint()) {
+        let cp_bytes = bincode::serialize(&cp)?;
+        write_frame(reader.get_mut(), cp.batch, CHECKPOINT_DIRECTION, &cp_bytes)?;
+        info!("Consensus sent checkpoint at batch {}", cp.batch);
+    }
+
+    // Acknowledge what was applied once caught up with the frames already
+    // read, so a runtime working through a backlog sends one ack for it all.
+    // Ready processes waiting on the next batch ask consensus for it now.
+    let ack = (LAST_BATCH.load(Ordering::SeqCst), if ready > 0 { ACK_READY } else { 0 });
+    let mut last_acked = LAST_ACKED.lock().unwrap();
+    if reader.buffer().is_empty() && ack != *last_acked && (ack.0 > last_acked.0 || ack.1 != 0) {
+        let mut frame = [0u8; 18];
+        frame[0..8].copy_from_slice(&ack.0.to_le_bytes());
+        frame[8] = ACK_DIRECTION;
+        frame[9..17].copy_from_slice(&1u64.to_le_bytes());
+        frame[17] = ack.1;
+        reader.get_mut().write_all(&frame)?;
+        *last_acked = ack;
+        trace!("Acknowledged batch {} (flags {})", ack.0, ack.1);
     }
+    drop(last_acked);
 
     // Read batch header (8 bytes for batch number, 1 byte for direction)
     let mut batch_header = [0u8; 9];
@@ -80,8 +294,8 @@ pub fn process_consensus_pipe<R: Read + Write>(
     }
 
     let batch_number = u64::from_le_bytes(batch_header[0..8].try_into().unwrap());
-    let direction = batch_header[8];
-    debug!("Received batch {} with direction {}", batch_number, direction);
+    let (direction, compressed) = batch::split_direction(batch_header[8]);
+    debug!("Received batch {} with direction {} (compressed: {})", batch_number, direction, compressed);
 
     // Read batch data length (8 bytes)
     let mut data_len_buf = [0u8; 8];
@@ -98,462 +312,163 @@ pub fn process_consensus_pipe<R: Read + Write>(
         error!("Failed to read batch data");
         return Ok(false);
     }
+    let apply_start = std::time::Instant::now();
 
-    // Process the batch data as a series of records
-    let mut data_reader = std::io::Cursor::new(batch_data);
-    let mut processed_records = 0;
-    loop {
-        // Read the message type (1 byte)
-        let mut msg_type_buf = [0u8; 1];
-        if data_reader.read_exact(&mut msg_type_buf).is_err() {
-            debug!("No more records in batch {} (processed {} records)", batch_number, processed_records);
-            break; // No more data.
-        }
-        let msg_type = msg_type_buf[0];
-        debug!("Processing record type {} in batch {} (record {})", msg_type, batch_number, processed_records + 1);
-
-        // Read process_id (8 bytes)
-        let process_id = match data_reader.read_u64::<LittleEndian>() {
-            Ok(pid) => pid,
-            Err(_) => break,
-        };
-
-        // Read payload length (4 bytes)
-        let payload_len = match data_reader.read_u32::<LittleEndian>() {
-            Ok(sz) => sz as usize,
-            Err(_) => break,
-        };
+    if compressed {
+        let packed_len = batch_data.len();
+        batch_data = batch::decompress(&batch_data)?;
+        debug!("Batch {} decompressed from {} to {} bytes", batch_number, packed_len, batch_data.len());
+    }
 
-        debug!("Reading payload of {} bytes for process {} in batch {} (record {})", 
-            payload_len, process_id, batch_number, processed_records + 1);
+    if direction == CHECKPOINT_DIRECTION {
+        restore_checkpoint(&batch_data, processes)?;
+        return Ok(true);
+    }
+    if direction == CONTROL_DIRECTION {
+        apply_control(reader.get_mut(), &batch_data)?;
+        return Ok(true);
+    }
 
-        // Read the payload.
-        let mut payload = vec![0u8; payload_len];
-        if let Err(e) = data_reader.read_exact(&mut payload) {
-            error!("Failed to read message from batch {}: {}", batch_number, e);
-            break;
+    let records = match Records::new(&batch_data) {
+        Ok(records) => records,
+        Err(e) => {
+            error!("Skipping batch {}: {}", batch_number, e);
+            return Ok(true);
         }
+    };
+    checkpoint::begin_batch(current_checkpoint());
+    LAST_BATCH.store(batch_number, Ordering::SeqCst);
+    RUNTIME.last_batch.set(batch_number as i64);
 
-        match msg_type {
-            0 => { // Clock update.
-                let msg_str = String::from_utf8_lossy(&payload);
-                debug!("Processing clock update in batch {}: {}", batch_number, msg_str);
-                if let Some(delta_str) = msg_str.strip_prefix("clock:") {
-                    match delta_str.trim().parse::<u64>() {
-                        Ok(delta) => {
-                            GlobalClock::increment(delta);
-                            info!("Global clock incremented by {} in batch {}", delta, batch_number);
-                        }
-                        Err(e) => error!("Invalid clock increment in batch {}: {}", batch_number, e),
-                    }
+    // Process the batch data as a series of records
+    let mut processed_records = 0;
+    for record in records {
+        let record = match record {
+            Ok(record) => record,
+            Err(e) => {
+                error!("Failed to read record {} of batch {}: {}", processed_records + 1, batch_number, e);
+                break;
+            }
+        };
+        debug!("Processing record {} of batch {}", processed_records + 1, batch_number);
+
+        match record {
+            Record::Clock { delta } => {
+                GlobalClock::increment(delta);
+                digest::clock(delta);
+                trace!("Global clock incremented by {} in batch {}", delta, batch_number);
+            }
+            Record::FdMsg { pid, data } => apply_fd_update(processes, pid, data),
+            Record::Init { payload } => apply_init(processes, payload),
+            Record::NetworkIn { pid, port, data } => {
+                trace!("Consensus received {} bytes from network for process {} port {}",
+                     data.len(), pid, port);
+                if let Some(process) = processes.get(pid) {
+                    apply_network_data(process, pid, port, data);
+                    // Notify the waiting process
+                    process.data.cond.notify_all();
                 } else {
-                    error!("Invalid clock message format in batch {}: {}", batch_number, msg_str);
-                }
-            },
-            1 => { // FD update.
-                let msg_str = String::from_utf8_lossy(&payload);
-                debug!("Processing FD update for process {}: {}", process_id, msg_str);
-                let parts: Vec<&str> = msg_str.split(",body:").collect();
-                if parts.len() != 2 {
-                    error!("Invalid FD update format for process {}: {}", process_id, msg_str);
-                    continue;
+                    error!("No process found with ID {} for NetworkIn", pid);
                 }
-                let fd: i32 = if let Some(fd_part) = parts[0].strip_prefix("fd:") {
-                    match fd_part.trim().parse() {
-                        Ok(num) => num,
-                        Err(_) => {
-                            error!("Invalid FD in FD update for process {}: {}", process_id, msg_str);
-                            continue;
-                        }
-                    }
+                processes.wake(pid);
+            }
+            Record::NetworkStatus { pid, status, src_port, new_port } => {
+                if let Some(process) = processes.get(pid) {
+                    apply_network_status(process, pid, status, src_port, new_port);
+                    // Notify the process whose operation completed
+                    process.data.cond.notify_all();
                 } else {
-                    error!("Missing FD prefix in FD update for process {}: {}", process_id, msg_str);
-                    continue;
-                };
-                let body = parts[1].trim();
-                let mut found = false;
-                for process in processes.iter_mut() {
-                    if process.id == process_id {
-                        found = true;
-                        let mut table = process.data.fd_table.lock().unwrap();
-                        if let Some(Some(FDEntry::File { buffer, .. })) = table.entries.get_mut(fd as usize) {
-                            buffer.extend_from_slice(body.as_bytes());
-                            buffer.push(b'\n');
-                            info!("Added FD update to process {}'s FD {} ({} bytes)", process_id, fd, body.len());
-                        } else {
-                            error!("Process {} does not have FD {} open for FD update", process_id, fd);
-                        }
-                        process.data.cond.notify_all();
-                        break;
-                    }
-                }
-                if !found {
-                    error!("No process found with ID {} for FD update", process_id);
-                }
-            },
-            2 => { // Init command.
-                debug!("Processing init command for new process");
-                let new_pid = get_next_pid();
-                match process::start_process_from_bytes(payload, new_pid) {
-                    Ok(proc) => {
-                        processes.push(proc);
-                        info!("Added new process {} to scheduler", new_pid);
-                    }
-                    Err(e) => {
-                        error!("Failed to create new process {}: {}", new_pid, e);
-                    }
-                }
-            },
-            3 => { // NetworkIn
-                debug!("Processing NetworkIn for process {}", process_id);
-                let start_time = std::time::Instant::now();
-                
-                // The payload already contains the port + data
-                // First 2 bytes are the destination port
-                if payload.len() < 2 {
-                    error!("NetworkIn payload too short for process {}", process_id);
-                    continue;
+                    error!("No process found with ID {} for network status", pid);
                 }
-                
-                let dest_port = (payload[0] as u16) | ((payload[1] as u16) << 8);
-                let data = &payload[2..];
-                
-                info!("Consensus received {} bytes from network for process {} port {} in {:?}", 
-                     data.len(), process_id, dest_port, start_time.elapsed());
-                
-                let mut found = false;
-                for process in processes.iter_mut() {
-                    if process.id == process_id {
-                        found = true;
-                        // If this is a success status message (port 0)
-                        if dest_port == 0 && data.len() >= 5 {  // Now we expect at least 5 bytes
-                            let status = data[0];
-                            let src_port = (data[1] as u16) | ((data[2] as u16) << 8);
-                            let new_port = (data[3] as u16) | ((data[4] as u16) << 8);
-                            match status {
-                                1 => { // Success
-                                    info!("Network operation succeeded for process {}:{}", process_id, src_port);
-                                    // Update the runtime's NAT table to match consensus
-                                    let mut nat_table = process.data.nat_table.lock().unwrap();
-                                    if new_port != 0 {  // This is an accept operation
-                                        debug!("Processing accept success for process {}:{} -> {}", process_id, src_port, new_port);
-                                        // Add mapping for the new port
-                                        nat_table.add_port_mapping(process_id, new_port);
-                                        // Mark the socket as connected
-                                        let mut table = process.data.fd_table.lock().unwrap();
-                                        debug!("Looking for socket with port {} in FD table (size: {})", new_port, table.entries.len());
-                                        // Find the socket with matching port
-                                        let mut found = false;
-                                        for (fd, entry) in table.entries.iter_mut().enumerate() {
-                                            if let Some(FDEntry::Socket { local_port, connected, .. }) = entry {
-                                                if *local_port == new_port {
-                                                    *connected = true;
-                                                    debug!("Marked socket FD {} as connected for process {}:{}", fd, process_id, new_port);
-                                                    found = true;
-                                                    break;
-                                                }
-                                            }
-                                        }
-                                        if !found {
-                                            error!("Could not find socket with port {} in FD table for process {}", new_port, process_id);
-                                            // Debug: Print all socket entries
-                                            for (fd, entry) in table.entries.iter().enumerate() {
-                                                if let Some(FDEntry::Socket { local_port, is_listener, connected, .. }) = entry {
-                                                    debug!("FD {}: port={}, is_listener={}, connected={}", fd, local_port, is_listener, connected);
-                                                }
-                                            }
-                                        }
-                                    } else {
-                                        // Regular operation, just add mapping for src_port
-                                        nat_table.add_port_mapping(process_id, src_port);
-                                    }
-                                    // Clear the waiting state
-                                    nat_table.clear_waiting_accept(process_id, src_port);
-                                }
-                                2 => { // Still waiting
-                                    debug!("Network operation still waiting for process {}:{}", process_id, src_port);
-                                    // Keep the process blocked
-                                    let mut nat_table = process.data.nat_table.lock().unwrap();
-                                    nat_table.set_waiting_accept(process_id, src_port, 0);
-                                }
-                                _ => { // Failure
-                                    error!("Network operation failed for process {}:{}, status {}", process_id, src_port, status);
-                                    // Clear both waiting states to ensure process unblocks
-                                    let mut nat_table = process.data.nat_table.lock().unwrap();
-                                    nat_table.clear_waiting_accept(process_id, src_port);
-                                    nat_table.clear_waiting_recv(process_id, src_port);
-                                    debug!("Cleared waiting states for process {}:{} due to failure", process_id, src_port);
-                                    
-                                    // Also mark any connected sockets as disconnected
-                                    let mut table = process.data.fd_table.lock().unwrap();
-                                    for (fd, entry) in table.entries.iter_mut().enumerate() {
-                                        if let Some(FDEntry::Socket { local_port, connected, .. }) = entry {
-                                            if *local_port == src_port && *connected {
-                                                *connected = false;
-                                                debug!("Marked socket FD {} as disconnected for process {}:{}", 
-                                                      fd, process_id, src_port);
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-                            // Notify the process that the operation completed (or is still waiting)
-                            process.data.cond.notify_all();
-                            break;
-                        }
-                        
-                        // Find socket with matching port
-                        let mut matching_fd = None;
-                        {
-                            let table = process.data.fd_table.lock().unwrap();
-                            // First look for an accepted connection socket
-                            for (fd, entry) in table.entries.iter().enumerate() {
-                                if let Some(FDEntry::Socket { local_port, is_listener, .. }) = entry {
-                                    if *local_port == dest_port && !*is_listener {
-                                        matching_fd = Some(fd);
-                                        break;
-                                    }
-                                }
-                            }
-                            // If no accepted connection found, look for a listening socket
-                            if matching_fd.is_none() {
-                                for (fd, entry) in table.entries.iter().enumerate() {
-                                    if let Some(FDEntry::Socket { local_port, is_listener, .. }) = entry {
-                                        if *local_port == dest_port && *is_listener {
-                                            matching_fd = Some(fd);
-                                            break;
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                        
-                        // If we found a matching socket, update it with the data
-                        if let Some(fd) = matching_fd {
-                            let mut table = process.data.fd_table.lock().unwrap();
-                            if let Some(Some(FDEntry::Socket { buffer, .. })) = table.entries.get_mut(fd) {
-                                buffer.extend_from_slice(data);
-                                // Clear waiting state since we have data
-                                let mut nat_table = process.data.nat_table.lock().unwrap();
-                                nat_table.clear_waiting_recv(process_id, dest_port);
-                                info!("Added NetworkIn data to process {}'s socket FD {} ({} bytes)", 
-                                     process_id, fd, data.len());
-                            }
-                        } else {
-                            error!("No matching socket found for process {} port {}", process_id, dest_port);
-                        }
-                        
-                        // Notify waiting process
-                        process.data.cond.notify_all();
-                        break;
-                    }
-                }
-                
-                if !found {
-                    error!("No process found with ID {} for NetworkIn", process_id);
-                }
-            },
-            _ => {
-                error!("Unknown message type: {} in message", msg_type);
+                processes.wake(pid);
+            }
+            Record::NetworkOut { pid, .. } => {
+                error!("Unexpected NetworkOut record for process {} in incoming batch {}", pid, batch_number);
             }
         }
         processed_records += 1;
     }
 
-    let batch_duration = batch_start_time.elapsed();
-    
-    if processed_records > 1 {
-        info!("Consensus processed batch {} with {} records in {:?}", 
-             batch_number, processed_records, batch_duration);
-    }
-    else {
-        debug!("Consensus processed batch {} with {} records in {:?}", 
-             batch_number, processed_records, batch_duration);
-    }
+    metrics::batch_applied(processed_records, batch_data.len(), apply_start.elapsed());
+    debug!("Consensus processed batch {} with {} records in {:?}",
+         batch_number, processed_records, batch_start_time.elapsed());
     Ok(true) // For pipe mode, we always return true to keep scheduler running
 }
 
-pub fn process_consensus_file(file_path: &str, processes: &mut Vec<process::Process>) -> Result<bool> {
+/// Applies records from a record file (as written by the consensus
+/// benchmark mode) up to and including the next Clock record, which marks
+/// the end of a batch. The file starts with the wire version byte; a
+/// record cut off at the end of the file is retried on the next call.
+pub fn process_consensus_file(file_path: &str, processes: &mut ProcessSet) -> Result<bool> {
     debug!("Processing consensus file: {}", file_path);
-    let file = File::open(file_path)?;
-    let mut reader = BufReader::new(file);
-    
-    // Seek to the current position
-    let current_pos = FILE_POSITION.load(Ordering::SeqCst);
-    debug!("Seeking to position {} in consensus file", current_pos);
-    reader.seek(SeekFrom::Start(current_pos))?;
-    
-    let mut processed_something = false;
-
-    loop {
-        // Read the message type (1 byte)
-        let mut msg_type_buf = [0u8; 1];
-        if reader.read_exact(&mut msg_type_buf).is_err() {
-            // End of file reached
-            // Return true if we processed at least one command in this batch
-            // Return false if we reached EOF without processing anything
-            return Ok(processed_something);
-        }
-        let msg_type = msg_type_buf[0];
+    // Only read what was appended since the last call; large generated
+    // workloads would otherwise be re-read once per batch.
+    let mut data = FILE_DATA.lock().unwrap();
+    let mut file = std::fs::File::open(file_path)?;
+    file.seek(SeekFrom::Start(data.len() as u64))?;
+    file.read_to_end(&mut data)?;
+    let apply_start = std::time::Instant::now();
+    let mut applied = 0;
 
-        // Read process_id (8 bytes)
-        let process_id = match reader.read_u64::<LittleEndian>() {
-            Ok(pid) => pid,
-            Err(_) => return Ok(processed_something), // End of file
-        };
-
-        // Read payload length (4 bytes)
-        let payload_len = match reader.read_u32::<LittleEndian>() {
-            Ok(sz) => sz as usize,
-            Err(_) => return Ok(processed_something), // End of file
-        };
-
-        // Read the payload.
-        let mut payload = vec![0u8; payload_len];
-        if let Err(e) = reader.read_exact(&mut payload) {
-            error!("Failed to read message from file: {}", e);
-            return Ok(processed_something);
+    let mut current_pos = FILE_POSITION.load(Ordering::SeqCst) as usize;
+    if current_pos == 0 {
+        match data.first() {
+            None => return Ok(false),
+            Some(&WIRE_VERSION) => current_pos = 1,
+            Some(&other) => {
+                error!("Unsupported record format {:#04x} in consensus file {}", other, file_path);
+                return Ok(false);
+            }
         }
+    }
+    debug!("Resuming consensus file at position {}", current_pos);
 
-        // Save the current position after reading this record
-        let current_pos = reader.stream_position()?;
-        FILE_POSITION.store(current_pos, Ordering::SeqCst);
-
-        processed_something = true;
-
-        // Convert payload to a string for text-based messages.
-        let msg_str = match msg_type {
-            0 | 1 | 4 => {
-                match String::from_utf8(payload.clone()) {
-                    Ok(s) => s,
-                    Err(e) => {
-                        error!("Failed to decode file message as UTF-8: {}", e);
-                        continue; // Try to process next command in batch
-                    }
+    let mut records = Records::resume(&data, current_pos);
+    while let Some(record) = records.next() {
+        let record = match record {
+            Ok(record) => record,
+            Err(e) => {
+                // A truncated record is still being written; try again later.
+                if e.kind() != io::ErrorKind::UnexpectedEof {
+                    error!("Failed to read record from file: {}", e);
                 }
-            },
-            2 => String::new(), // For Init command, the payload is binary.
-            _ => {
-                error!("Unknown message type: {} in file", msg_type);
-                continue; // Try to process next command in batch
+                break;
             }
         };
 
-        match msg_type {
-            0 => { // Clock update.
-                if let Some(delta_str) = msg_str.strip_prefix("clock:") {
-                    match delta_str.trim().parse::<u64>() {
-                        Ok(delta) => {
-                            GlobalClock::increment(delta);
-                            info!("Global clock incremented by {} (via file)", delta);
-                        }
-                        Err(e) => error!("Invalid clock increment in file: {}", e),
-                    }
-                } else {
-                    error!("Invalid clock message format in file: {}", msg_str);
-                }
+        // Save the current position after reading this record
+        FILE_POSITION.store(records.position() as u64, Ordering::SeqCst);
+        applied += 1;
+
+        match record {
+            Record::Clock { delta } => {
+                GlobalClock::increment(delta);
+                digest::clock(delta);
+                trace!("Global clock incremented by {} (via file)", delta);
                 // Clock command marks the end of a batch, so return
-                return Ok(true);
-            },
-            1 => { // FD update.
-                debug!("Processing FD update for process {}: {}", process_id, msg_str);
-                let parts: Vec<&str> = msg_str.split(",body:").collect();
-                if parts.len() != 2 {
-                    error!("Invalid file message format for FD update: {}", msg_str);
-                    continue; // Try to process next command in batch
-                }
-                let fd: i32 = if let Some(fd_part) = parts[0].strip_prefix("fd:") {
-                    match fd_part.trim().parse() {
-                        Ok(num) => num,
-                        Err(_) => {
-                            error!("Invalid FD in file message: {}", msg_str);
-                            continue; // Try to process next command in batch
-                        }
-                    }
-                } else {
-                    error!("Missing FD prefix in file message: {}", msg_str);
-                    continue; // Try to process next command in batch
-                };
-                let body = parts[1].trim();
-                let mut found = false;
-                for process in processes.iter_mut() {
-                    if process.id == process_id {
-                        found = true;
-                        let mut table = process.data.fd_table.lock().unwrap();
-                        if let Some(Some(FDEntry::File { buffer, .. })) = table.entries.get_mut(fd as usize) {
-                            buffer.extend_from_slice(body.as_bytes());
-                            buffer.push(b'\n');
-                            info!(
-                                "Added input to process {}'s FD {} (via file)",
-                                process_id, fd
-                            );
-                        } else {
-                            error!(
-                                "Process {} does not have FD {} open (via file)",
-                                process_id, fd
-                            );
-                        }
-                        process.data.cond.notify_all();
-                        break;
-                    }
-                }
-                if !found {
-                    error!("No process found with ID {} (via file)", process_id);
-                }
-            },
-            2 => { // Init command.
+                break;
+            }
+            Record::FdMsg { pid, data } => apply_fd_update(processes, pid, data),
+            Record::Init { payload } => {
                 info!("Received init command from consensus file");
-                let new_pid = get_next_pid();
-                match process::start_process_from_bytes(payload, new_pid) {
-                    Ok(proc) => {
-                        processes.push(proc);
-                        info!("Added new process {} to scheduler (via file)", new_pid);
-                    }
-                    Err(e) => {
-                        error!("Failed to create new process {}: {}", new_pid, e);
-                    }
-                }
-            },
-            3 => { // Msg command.
-                debug!("Processing message command for process {}: {}", process_id, msg_str);
-                let message = if let Some(msg_part) = msg_str.strip_prefix("msg:") {
-                    msg_part.trim()
+                apply_init(processes, payload);
+            }
+            Record::NetworkIn { pid, port, data } => {
+                if let Some(process) = processes.get(pid) {
+                    apply_network_data(process, pid, port, data);
                 } else {
-                    msg_str.trim()
-                };
-                let mut found = false;
-                for process in processes.iter_mut() {
-                    if process.id == process_id {
-                        found = true;
-                        let mut table = process.data.fd_table.lock().unwrap();
-                        if let Some(Some(FDEntry::File { buffer, .. })) = table.entries.get_mut(0) {
-                            buffer.extend_from_slice(message.as_bytes());
-                            buffer.push(b'\n');
-                            info!(
-                                "Added msg to process {}'s FD 0 (via file)",
-                                process_id
-                            );
-                        } else {
-                            error!(
-                                "Process {} does not have FD 0 open for msg (via file)",
-                                process_id
-                            );
-                        }
-                        process.data.cond.notify_all();
-                        break;
-                    }
+                    error!("No process found with ID {} for NetworkIn", pid);
                 }
-                if !found {
-                    error!("No process found with ID {} for msg (via file)", process_id);
-                }
-            },
-            4 => { // FTP update.
-                info!("Received FTP command for process {}: {} (via file)", process_id, msg_str);
-                // Add FTP command dispatch logic here if needed.
-            },
-            _ => {
-                error!("Unknown message type: {} in file message: {}", msg_type, msg_str);
+                processes.wake(pid);
+            }
+            other => {
+                error!("Unsupported record in consensus file: {:?}", other);
             }
         }
     }
+    if applied > 0 {
+        metrics::batch_applied(applied, records.position() - current_pos, apply_start.elapsed());
+    }
+    // False once the end of the file is reached without applying anything
+    Ok(applied > 0)
 }
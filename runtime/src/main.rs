@@ -36,11 +36,14 @@ fn main() -> Result<()> {
     // Ensure cleanup on exit
     let sandbox_root_cleanup = sandbox_root.clone();
     ctrlc::set_handler(move || {
+        runtime::stats::report();
         info!("Cleaning up sandbox root: {}", sandbox_root_cleanup.display());
         let _ = fs::remove_dir_all(&sandbox_root_cleanup);
         std::process::exit(0);
     }).expect("Error setting Ctrl-C handler");
 
+    runtime::metrics::start_endpoint();
+
     // Determine execution mode: "benchmark" or "tcp"
     let args: Vec<String> = std::env::args().collect();
     let mode = if args.len() > 1 { &args[1] } else { "benchmark" };
@@ -53,7 +56,7 @@ fn main() -> Result<()> {
     //let preload_dir = Some(testdir_path);
     match mode {
         "benchmark" => {
-            let consensus_file = "consensus/consensus_input.bin";
+            let consensus_file = args.get(2).map_or("consensus/consensus_input.bin", String::as_str);
             info!("Runtime: Running in benchmark mode with file: {}", consensus_file);
             runtime::scheduler::run_scheduler_with_file(processes, consensus_file)?;
         },
@@ -68,6 +71,7 @@ fn main() -> Result<()> {
         }
     }
 
+    runtime::stats::report();
     info!("Runtime: Exiting.");
     // Clean up sandbox root on normal exit
     info!("Cleaning up sandbox root: {}", SANDBOX_ROOT.get().unwrap().display());
@@ -0,0 +1,81 @@
+use std::collections::BTreeMap;
+use std::sync::Mutex;
+
+use consensus::batch::Checkpoint;
+use log::{debug, info};
+
+use crate::runtime::config::RuntimeConfig;
+
+/// Tracks the oldest batch boundary any runtime still needs, so consensus
+/// can garbage-collect the history before it.
+///
+/// Checkpoints carry only runtime-global counters, not process state:
+/// guest stacks cannot be captured, so the only safe resume point is one
+/// where no process that is still alive had started yet. That is the
+/// boundary just before the oldest live process's Init batch, or the latest
+/// batch when no process is alive. A joining runtime restores the counters
+/// at that boundary and replays every batch after it, so join time is not
+/// bounded: while one tenant stays alive, joiners replay from its Init.
+struct Tracker {
+    /// State before the Incoming batch currently being applied.
+    batch_base: Option<Checkpoint>,
+    /// Resume point for each live process: the base of the batch that spawned it.
+    live: BTreeMap<u64, Checkpoint>,
+    last_emitted: u64,
+}
+
+static TRACKER: Mutex<Tracker> = Mutex::new(Tracker {
+    batch_base: None,
+    live: BTreeMap::new(),
+    last_emitted: 0,
+});
+
+/// Called before the records of an Incoming batch are applied, with the
+/// state left by every batch before it.
+pub fn begin_batch(base: Checkpoint) {
+    TRACKER.lock().unwrap().batch_base = Some(base);
+}
+
+pub fn process_spawned(pid: u64) {
+    let mut tracker = TRACKER.lock().unwrap();
+    if let Some(base) = tracker.batch_base {
+        tracker.live.insert(pid, base);
+    }
+}
+
+pub fn process_finished(pid: u64) {
+    TRACKER.lock().unwrap().live.remove(&pid);
+}
+
+/// Returns a checkpoint to report if the resume point advanced by at least
+/// the configured interval. `current` is the state after the last applied batch.
+pub fn due(current: Checkpoint) -> Option<Checkpoint> {
+    let interval = RuntimeConfig::get().checkpoint_interval;
+    if interval == 0 {
+        return None;
+    }
+    let mut tracker = TRACKER.lock().unwrap();
+    let resume_point = tracker
+        .live
+        .values()
+        .min_by_key(|cp| cp.batch)
+        .copied()
+        .unwrap_or(current);
+    if resume_point.batch < tracker.last_emitted + interval {
+        if current.batch >= tracker.last_emitted + interval {
+            debug!("Checkpoint held back at batch {} by a live process", resume_point.batch);
+        }
+        return None;
+    }
+    tracker.last_emitted = resume_point.batch;
+    debug!("Checkpoint due at batch {}", resume_point.batch);
+    Some(resume_point)
+}
+
+/// Records that this runtime resumed from `cp` instead of replaying from batch 0.
+pub fn restored(cp: &Checkpoint) {
+    let mut tracker = TRACKER.lock().unwrap();
+    tracker.last_emitted = cp.batch;
+    tracker.batch_base = None;
+    info!("Resumed from checkpoint at batch {}", cp.batch);
+}
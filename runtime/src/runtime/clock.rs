@@ -15,4 +15,9 @@ impl GlobalClock {
     pub fn increment(delta: u64) {
         CLOCK.fetch_add(delta, Ordering::SeqCst);
     }
+
+    /// Sets the clock outright, when resuming from a checkpoint.
+    pub fn set(now: u64) {
+        CLOCK.store(now, Ordering::SeqCst);
+    }
 }
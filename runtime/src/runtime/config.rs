@@ -0,0 +1,171 @@
+use std::path::PathBuf;
+use std::sync::OnceLock;
+
+use log::{error, info};
+
+static CONFIG: OnceLock<RuntimeConfig> = OnceLock::new();
+
+/// How guest code is executed.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum ExecutorKind {
+    /// One OS thread per process, handed control through its Condvar.
+    Threads,
+    /// Guests run as wasmtime async tasks on a fixed pool of worker threads.
+    Pooled,
+}
+
+/// How a preload directory is placed into a new sandbox.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum PreloadMode {
+    /// Copy every file into the sandbox.
+    Copy,
+    /// Hard-link files from a shared read-only base layer, copying a file
+    /// only when the sandbox first writes to it.
+    Link,
+}
+
+/// Where sandbox files are stored.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum SandboxFsKind {
+    /// A directory per process under the sandbox root on the host.
+    Host,
+    /// An in-memory filesystem per process; nothing reaches the host.
+    Memory,
+}
+
+/// Runtime-wide settings, read once from `REPLICODE_*` environment variables.
+#[derive(Debug, Clone)]
+pub struct RuntimeConfig {
+    /// Directory holding serialized precompiled modules (`<sha256>.cwasm`).
+    /// Unset means compiled modules are only cached in memory.
+    pub module_cache_dir: Option<PathBuf>,
+    pub executor: ExecutorKind,
+    /// Worker threads used by the pooled executor.
+    pub workers: usize,
+    /// Run all Ready processes of a batch concurrently. Changes the order of
+    /// outgoing records, so every replica must use the same setting.
+    pub parallel: bool,
+    /// Minimum number of batches between reported checkpoints, which let
+    /// consensus drop history no runtime needs; 0 disables them.
+    pub checkpoint_interval: u64,
+    /// Outgoing batches a follower keeps to resend if it becomes the leader.
+    pub retransmit_batches: usize,
+    /// Bytes of guest writes each file FD buffers before flushing to the host.
+    pub write_buffer_size: usize,
+    /// Bytes of consecutive sends on one socket merged into a single
+    /// NetworkOut Send before the guest blocks for it; 0 blocks on every send.
+    pub send_coalesce_bytes: usize,
+    pub preload_mode: PreloadMode,
+    pub sandbox_fs: SandboxFsKind,
+    /// Fuel a pooled guest may burn before it is preempted back to the ready
+    /// queue; 0 lets it run until it blocks or yields.
+    pub fuel_quantum: u64,
+    /// Slices each Ready process gets before the next batch of consensus
+    /// input is applied. Counted rather than timed so every replica agrees.
+    pub slices_per_batch: usize,
+    /// Keep batch and hostcall counters and print them on exit (see `stats`).
+    pub stats: bool,
+    /// Address serving `/metrics` in the Prometheus format; unset disables it.
+    pub metrics_addr: Option<String>,
+}
+
+impl RuntimeConfig {
+    fn from_env() -> Self {
+        let module_cache_dir = std::env::var_os("REPLICODE_MODULE_CACHE")
+            .filter(|v| !v.is_empty())
+            .map(PathBuf::from);
+
+        let executor = match std::env::var("REPLICODE_EXECUTOR").as_deref() {
+            Ok("pooled") => ExecutorKind::Pooled,
+            Ok("threads") | Err(_) => ExecutorKind::Threads,
+            Ok(other) => {
+                error!("Unknown REPLICODE_EXECUTOR '{}', using threads", other);
+                ExecutorKind::Threads
+            }
+        };
+
+        let default_workers = std::thread::available_parallelism().map(|n| n.get()).unwrap_or(2);
+        let workers = env_parse("REPLICODE_WORKERS").unwrap_or(default_workers).max(1);
+
+        let parallel = env_flag("REPLICODE_PARALLEL");
+        let checkpoint_interval = env_parse("REPLICODE_CHECKPOINT_INTERVAL").unwrap_or(1000);
+        let retransmit_batches = env_parse("REPLICODE_RETRANSMIT_BATCHES").unwrap_or(1024);
+        let write_buffer_size = env_parse("REPLICODE_WRITE_BUFFER").unwrap_or(64 * 1024).max(1);
+        let send_coalesce_bytes = env_parse("REPLICODE_SEND_COALESCE").unwrap_or(64 * 1024);
+
+        let preload_mode = match std::env::var("REPLICODE_PRELOAD").as_deref() {
+            Ok("copy") => PreloadMode::Copy,
+            Ok("link") | Err(_) => PreloadMode::Link,
+            Ok(other) => {
+                error!("Unknown REPLICODE_PRELOAD '{}', using link", other);
+                PreloadMode::Link
+            }
+        };
+
+        let sandbox_fs = match std::env::var("REPLICODE_SANDBOX_FS").as_deref() {
+            Ok("memory") => SandboxFsKind::Memory,
+            Ok("host") | Err(_) => SandboxFsKind::Host,
+            Ok(other) => {
+                error!("Unknown REPLICODE_SANDBOX_FS '{}', using host", other);
+                SandboxFsKind::Host
+            }
+        };
+
+        let fuel_quantum = env_parse("REPLICODE_FUEL_QUANTUM").unwrap_or(10_000_000);
+        let slices_per_batch = env_parse("REPLICODE_SLICES_PER_BATCH").unwrap_or(8).max(1);
+
+        let stats = env_flag("REPLICODE_STATS");
+        let metrics_addr = std::env::var("REPLICODE_METRICS_ADDR").ok().filter(|v| !v.is_empty());
+
+        let config = RuntimeConfig {
+            module_cache_dir,
+            executor,
+            workers,
+            parallel,
+            checkpoint_interval,
+            retransmit_batches,
+            write_buffer_size,
+            send_coalesce_bytes,
+            preload_mode,
+            sandbox_fs,
+            fuel_quantum,
+            slices_per_batch,
+            stats,
+            metrics_addr,
+        };
+        info!("Runtime config: {:?}", config);
+        config
+    }
+
+    pub fn get() -> &'static RuntimeConfig {
+        CONFIG.get_or_init(RuntimeConfig::from_env)
+    }
+
+    /// Whether guests are metered and preempted by fuel. Needs the pooled
+    /// executor: a thread-mode guest can't be suspended mid-instruction.
+    pub fn fuel_preemption(&self) -> bool {
+        self.executor == ExecutorKind::Pooled && self.fuel_quantum > 0
+    }
+}
+
+fn env_parse<T: std::str::FromStr>(name: &str) -> Option<T> {
+    let value = std::env::var(name).ok()?;
+    match value.parse() {
+        Ok(v) => Some(v),
+        Err(_) => {
+            error!("Ignoring invalid {}={}", name, value);
+            None
+        }
+    }
+}
+
+fn env_flag(name: &str) -> bool {
+    match std::env::var(name).as_deref() {
+        Ok("1") | Ok("true") => true,
+        Ok("0") | Ok("false") | Ok("") | Err(_) => false,
+        Ok(other) => {
+            error!("Ignoring invalid {}={}", name, other);
+            false
+        }
+    }
+}
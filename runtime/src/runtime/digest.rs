@@ -0,0 +1,65 @@
+use std::ops::Range;
+use std::sync::Mutex;
+
+/// Running hash of everything replicas must agree on: applied clock
+/// deltas, guest fd writes and the NetworkOut records of each outgoing
+/// batch. It is reported with every outgoing batch so the consensus
+/// process can tell a diverging replica from one that is merely slow.
+///
+/// Not cryptographic: it only has to catch accidental divergence, and
+/// folding is a multiply and a rotate per eight bytes.
+static DIGEST: Mutex<u64> = Mutex::new(SEED);
+
+const SEED: u64 = 0xcbf2_9ce4_8422_2325;
+const MULTIPLIER: u64 = 0x9e37_79b9_7f4a_7c15;
+
+const TAG_CLOCK: u64 = 1;
+const TAG_FD_WRITE: u64 = 2;
+const TAG_OUTGOING: u64 = 3;
+
+fn mix(h: u64, word: u64) -> u64 {
+    (h ^ word).wrapping_mul(MULTIPLIER).rotate_left(29)
+}
+
+fn mix_bytes(mut h: u64, bytes: &[u8]) -> u64 {
+    h = mix(h, bytes.len() as u64);
+    let mut words = bytes.chunks_exact(8);
+    for word in &mut words {
+        h = mix(h, u64::from_le_bytes(word.try_into().unwrap()));
+    }
+    let mut tail = [0u8; 8];
+    tail[..words.remainder().len()].copy_from_slice(words.remainder());
+    mix(h, u64::from_le_bytes(tail))
+}
+
+pub fn current() -> u64 {
+    *DIGEST.lock().unwrap()
+}
+
+/// Sets the digest outright, when resuming from a checkpoint.
+pub fn restore(digest: u64) {
+    *DIGEST.lock().unwrap() = digest;
+}
+
+pub fn clock(delta: u64) {
+    let mut h = DIGEST.lock().unwrap();
+    *h = mix(mix(*h, TAG_CLOCK), delta);
+}
+
+/// Folds a guest's write of the `iovecs` ranges of `mem` to `fd`.
+pub fn fd_write(pid: u64, fd: i32, mem: &[u8], iovecs: &[Range<usize>]) {
+    let mut h = DIGEST.lock().unwrap();
+    let mut next = mix(mix(mix(*h, TAG_FD_WRITE), pid), fd as u64);
+    for iov in iovecs {
+        next = mix_bytes(next, &mem[iov.clone()]);
+    }
+    *h = next;
+}
+
+/// Folds the records of outgoing batch `number` and returns the digest to
+/// report with it.
+pub fn outgoing(number: u64, records: &[u8]) -> u64 {
+    let mut h = DIGEST.lock().unwrap();
+    *h = mix_bytes(mix(mix(*h, TAG_OUTGOING), number), records);
+    *h
+}
@@ -0,0 +1,128 @@
+use std::collections::BTreeMap;
+use std::fs;
+use std::io;
+use std::path::{Path, PathBuf};
+
+/// One file or directory in a sandbox.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct IndexEntry {
+    pub is_dir: bool,
+    /// Content length of a file; 0 for directories.
+    pub len: u64,
+    /// Bytes this entry added to the process's disk usage (content plus any
+    /// metadata overhead), given back when it is removed.
+    pub charged: u64,
+}
+
+/// Every file and directory in a process sandbox, keyed by path relative to
+/// the sandbox root and maintained by the fs syscalls as they change the
+/// tree. Quota bookkeeping, stat and directory listings read it instead of
+/// walking or stat-ing the host tree.
+#[derive(Debug)]
+pub struct DiskIndex {
+    root: PathBuf,
+    /// `root` canonicalized; syscalls hold either form of a host path.
+    canonical_root: PathBuf,
+    entries: BTreeMap<PathBuf, IndexEntry>,
+    total_charged: u64,
+}
+
+impl DiskIndex {
+    /// Indexes whatever is already under `root` (e.g. preloaded files) with
+    /// one walk; each file is charged its length.
+    pub fn scan(root: &Path) -> io::Result<Self> {
+        let mut index = DiskIndex {
+            root: root.to_path_buf(),
+            canonical_root: root.canonicalize()?,
+            entries: BTreeMap::new(),
+            total_charged: 0,
+        };
+        index.scan_dir(root, Path::new(""))?;
+        Ok(index)
+    }
+
+    fn scan_dir(&mut self, dir: &Path, rel: &Path) -> io::Result<()> {
+        for entry in fs::read_dir(dir)? {
+            let entry = entry?;
+            let metadata = entry.metadata()?;
+            let rel_path = rel.join(entry.file_name());
+            if metadata.is_dir() {
+                self.insert(rel_path.clone(), IndexEntry { is_dir: true, len: 0, charged: 0 });
+                self.scan_dir(&entry.path(), &rel_path)?;
+            } else {
+                let len = metadata.len();
+                self.insert(rel_path, IndexEntry { is_dir: false, len, charged: len });
+            }
+        }
+        Ok(())
+    }
+
+    /// Sum of `charged` over every entry.
+    pub fn total_charged(&self) -> u64 {
+        self.total_charged
+    }
+
+    /// The index key of a host path inside the sandbox.
+    pub fn key(&self, host_path: &Path) -> Option<PathBuf> {
+        host_path
+            .strip_prefix(&self.canonical_root)
+            .or_else(|_| host_path.strip_prefix(&self.root))
+            .ok()
+            .map(Path::to_path_buf)
+    }
+
+    pub fn get(&self, host_path: &Path) -> Option<IndexEntry> {
+        self.entries.get(&self.key(host_path)?).copied()
+    }
+
+    /// Adds or replaces an entry.
+    pub fn insert(&mut self, key: PathBuf, entry: IndexEntry) {
+        if let Some(old) = self.entries.insert(key, entry) {
+            self.total_charged -= old.charged;
+        }
+        self.total_charged += entry.charged;
+    }
+
+    /// Records a new file or directory at `host_path`.
+    pub fn created(&mut self, host_path: &Path, is_dir: bool, charged: u64) {
+        if let Some(key) = self.key(host_path) {
+            self.insert(key, IndexEntry { is_dir, len: 0, charged });
+        }
+    }
+
+    /// Records `bytes` appended to the file at `host_path`.
+    pub fn appended(&mut self, host_path: &Path, bytes: u64) {
+        let Some(key) = self.key(host_path) else {
+            return;
+        };
+        let entry = self.entries.entry(key).or_insert(IndexEntry { is_dir: false, len: 0, charged: 0 });
+        entry.len += bytes;
+        entry.charged += bytes;
+        self.total_charged += bytes;
+    }
+
+    /// Drops the entry at `host_path` and returns it.
+    pub fn remove(&mut self, host_path: &Path) -> Option<IndexEntry> {
+        let entry = self.entries.remove(&self.key(host_path)?)?;
+        self.total_charged -= entry.charged;
+        Some(entry)
+    }
+
+    /// Names of the direct children of the directory at `host_path`, in
+    /// sorted order, or `None` if it is not indexed.
+    pub fn list_dir(&self, host_path: &Path) -> Option<Vec<String>> {
+        let key = self.key(host_path)?;
+        if !key.as_os_str().is_empty() && !self.entries.get(&key)?.is_dir {
+            return None;
+        }
+        let names = self
+            .entries
+            .range(key.clone()..)
+            .take_while(|(path, _)| path.starts_with(&key))
+            .filter(|(path, _)| path.parent() == Some(key.as_path()))
+            .filter_map(|(path, _)| path.file_name())
+            .map(|name| name.to_string_lossy().into_owned())
+            .collect();
+        Some(names)
+    }
+}
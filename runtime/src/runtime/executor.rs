@@ -0,0 +1,240 @@
+use log::{debug, error, info};
+use std::future::Future;
+use std::panic::AssertUnwindSafe;
+use std::pin::Pin;
+use std::sync::atomic::Ordering;
+use std::sync::mpsc::{self, Receiver, Sender};
+use std::sync::{Arc, Condvar, Mutex, OnceLock};
+use std::task::{Context, Poll, RawWaker, RawWakerVTable, Waker};
+use std::thread;
+
+use crate::runtime::config::{ExecutorKind, RuntimeConfig};
+use crate::runtime::process::{Process, ProcessHandle, ProcessState};
+
+pub type GuestFuture = Pin<Box<dyn Future<Output = ()> + Send>>;
+
+/// A guest running on wasmtime's async support. The scheduler decides when it
+/// runs; a pool worker polls it until the guest suspends in a hostcall.
+pub struct GuestTask {
+    future: Mutex<Option<GuestFuture>>,
+}
+
+impl GuestTask {
+    pub fn new(future: GuestFuture) -> Self {
+        GuestTask { future: Mutex::new(Some(future)) }
+    }
+}
+
+struct Job {
+    id: u64,
+    task: Arc<GuestTask>,
+    state: Arc<Mutex<ProcessState>>,
+    done: Sender<()>,
+}
+
+struct WorkerPool {
+    jobs: Mutex<Sender<Job>>,
+}
+
+static POOL: OnceLock<WorkerPool> = OnceLock::new();
+
+fn pool() -> &'static WorkerPool {
+    POOL.get_or_init(|| {
+        let workers = RuntimeConfig::get().workers;
+        let (tx, rx) = mpsc::channel::<Job>();
+        let rx = Arc::new(Mutex::new(rx));
+        for i in 0..workers {
+            let rx = rx.clone();
+            thread::Builder::new()
+                .name(format!("worker{}", i))
+                .spawn(move || worker_loop(rx))
+                .expect("Failed to spawn executor worker");
+        }
+        info!("Started guest executor with {} workers", workers);
+        WorkerPool { jobs: Mutex::new(tx) }
+    })
+}
+
+fn worker_loop(jobs: Arc<Mutex<Receiver<Job>>>) {
+    loop {
+        let job = match jobs.lock().unwrap().recv() {
+            Ok(job) => job,
+            Err(_) => return,
+        };
+        let finished = poll_task(job.id, &job.task);
+        if finished {
+            *job.state.lock().unwrap() = ProcessState::Finished;
+        }
+        let _ = job.done.send(());
+    }
+}
+
+/// Polls a guest once. Returns true when the guest has run to completion.
+fn poll_task(id: u64, task: &GuestTask) -> bool {
+    let mut slot = task.future.lock().unwrap();
+    let Some(future) = slot.as_mut() else {
+        return true;
+    };
+    let waker = noop_waker();
+    let mut cx = Context::from_waker(&waker);
+    let finished = match std::panic::catch_unwind(AssertUnwindSafe(|| future.as_mut().poll(&mut cx))) {
+        Ok(Poll::Ready(())) => true,
+        Ok(Poll::Pending) => false,
+        Err(_) => {
+            // proc_exit unwinds out of the guest; treat it like a normal exit.
+            debug!("Guest {} unwound out of its task", id);
+            true
+        }
+    };
+    if finished {
+        *slot = None;
+    }
+    finished
+}
+
+/// Gives `proc` the CPU until it blocks, yields or exits.
+/// On return the process state is Ready, Blocked or Finished.
+pub fn run_slice(proc: &Process) {
+    start_slice(proc).wait();
+}
+
+/// Runs a slice of every process in `procs` concurrently and returns once
+/// all of them have left Running. Pooled guests share the worker pool; with
+/// the thread executor each guest already has its own thread.
+pub fn run_slices(procs: &[Process]) {
+    let slices: Vec<Slice> = procs.iter().map(start_slice).collect();
+    for slice in slices {
+        slice.wait();
+    }
+}
+
+/// A slice handed to a process that has not been waited on yet.
+struct Slice<'a> {
+    proc: &'a Process,
+    /// Completion signal from the pool worker polling the task.
+    done: Option<Receiver<()>>,
+}
+
+fn start_slice(proc: &Process) -> Slice<'_> {
+    {
+        let mut st = proc.data.state.lock().unwrap();
+        *st = ProcessState::Running;
+        proc.data.cond.notify_all();
+    }
+
+    let done = match &proc.handle {
+        ProcessHandle::Thread(_) => None,
+        ProcessHandle::Task(task) => {
+            let (done_tx, done_rx) = mpsc::channel();
+            let job = Job {
+                id: proc.id,
+                task: task.clone(),
+                state: proc.data.state.clone(),
+                done: done_tx,
+            };
+            if pool().jobs.lock().unwrap().send(job).is_err() {
+                error!("Executor pool is gone; finishing process {}", proc.id);
+                *proc.data.state.lock().unwrap() = ProcessState::Finished;
+                None
+            } else {
+                Some(done_rx)
+            }
+        }
+    };
+    Slice { proc, done }
+}
+
+impl Slice<'_> {
+    fn wait(self) {
+        let proc = self.proc;
+        match &proc.handle {
+            ProcessHandle::Thread(_) => {
+                let mut st = proc.data.state.lock().unwrap();
+                while *st == ProcessState::Running {
+                    debug!("Scheduler waiting for process {} (state: {:?})", proc.id, *st);
+                    st = proc.data.cond.wait(st).unwrap();
+                }
+            }
+            ProcessHandle::Task(_) => {
+                let Some(done) = self.done else {
+                    return;
+                };
+                let _ = done.recv();
+
+                // Suspended without blocking or yielding in a hostcall: it was preempted.
+                let mut st = proc.data.state.lock().unwrap();
+                if *st == ProcessState::Running {
+                    *st = ProcessState::Ready;
+                    proc.data.fuel.preemptions.fetch_add(1, Ordering::Relaxed);
+                }
+            }
+        }
+    }
+}
+
+/// Future returned by `ProcessData::resumed`; completes once the scheduler
+/// sets the process back to Running.
+pub struct Resume {
+    pub(crate) state: Arc<Mutex<ProcessState>>,
+    pub(crate) cond: Arc<Condvar>,
+}
+
+impl Future for Resume {
+    type Output = ();
+
+    fn poll(self: Pin<&mut Self>, _cx: &mut Context<'_>) -> Poll<()> {
+        let mut st = self.state.lock().unwrap();
+        match RuntimeConfig::get().executor {
+            // Park the guest thread, exactly as the old Condvar handoff did.
+            ExecutorKind::Threads => {
+                while *st != ProcessState::Running {
+                    st = self.cond.wait(st).unwrap();
+                }
+                Poll::Ready(())
+            }
+            // Suspend the fiber; the scheduler re-polls the task when it runs it again.
+            ExecutorKind::Pooled => {
+                if *st == ProcessState::Running {
+                    Poll::Ready(())
+                } else {
+                    Poll::Pending
+                }
+            }
+        }
+    }
+}
+
+/// Drives a hostcall future to completion on the calling guest thread.
+/// Used to register the async hostcalls with a synchronous Linker.
+pub fn block_on<F: Future>(future: F) -> F::Output {
+    let mut future = std::pin::pin!(future);
+    let waker = thread_waker();
+    let mut cx = Context::from_waker(&waker);
+    loop {
+        match future.as_mut().poll(&mut cx) {
+            Poll::Ready(out) => return out,
+            Poll::Pending => thread::park(),
+        }
+    }
+}
+
+fn noop_waker() -> Waker {
+    fn clone(_: *const ()) -> RawWaker {
+        RawWaker::new(std::ptr::null(), &NOOP_VTABLE)
+    }
+    fn noop(_: *const ()) {}
+    static NOOP_VTABLE: RawWakerVTable = RawWakerVTable::new(clone, noop, noop, noop);
+    unsafe { Waker::from_raw(RawWaker::new(std::ptr::null(), &NOOP_VTABLE)) }
+}
+
+struct ThreadWaker(thread::Thread);
+
+impl std::task::Wake for ThreadWaker {
+    fn wake(self: Arc<Self>) {
+        self.0.unpark();
+    }
+}
+
+fn thread_waker() -> Waker {
+    Waker::from(Arc::new(ThreadWaker(thread::current())))
+}
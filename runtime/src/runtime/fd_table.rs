@@ -1,8 +1,12 @@
 use std::fmt;
-use std::path::PathBuf;
+use std::io;
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex};
 
 use log::debug;
 
+use crate::runtime::sandbox_fs::SandboxFs;
+
 #[derive(Debug, Clone)]
 pub enum FDEntry {
     File {
@@ -10,20 +14,153 @@ pub enum FDEntry {
         read_ptr: usize,    // how far we've read from buffer
         is_directory: bool,
         is_preopen: bool,
-        host_path: Option<String>, // the actual host filesystem path
+        host_path: Option<String>, // path under the sandbox root (only on the host for the host backend)
+        writer: Option<Arc<Mutex<FileWriter>>>, // buffered writes, created on first write
     },
     Socket {
         local_port: u16,
-        connected: bool,
-        is_listener: bool,  // whether this is a listening socket
-        buffer: Vec<u8>,    // data waiting to be read
+        state: SocketState,
+        buffer: RecvBuffer, // data waiting to be read
     },
 }
 
+/// Operation a guest is blocked on until consensus reports its outcome.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub enum PendingOp {
+    #[default]
+    None,
+    Listen,
+    Accept,
+    Recv,
+}
+
+/// The runtime's view of a socket. The consensus NAT owns the real socket;
+/// this only tracks what NetworkStatus and NetworkIn records have reported,
+/// which is all the scheduler needs to decide whether a guest blocked on
+/// the socket can run.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct SocketState {
+    flags: u8,
+    pub pending: PendingOp,
+}
+
+impl SocketState {
+    /// The guest called listen on it.
+    pub const LISTENER: u8 = 1 << 0;
+    /// Consensus has bound the port.
+    pub const MAPPED: u8 = 1 << 1;
+    pub const CONNECTED: u8 = 1 << 2;
+    /// Consensus reported an operation on it failed; sends report it.
+    pub const FAILED: u8 = 1 << 3;
+
+    pub fn has(&self, flags: u8) -> bool {
+        self.flags & flags == flags
+    }
+
+    pub fn set(&mut self, flags: u8, on: bool) {
+        if on {
+            self.flags |= flags;
+        } else {
+            self.flags &= !flags;
+        }
+    }
+
+    /// Whether a guest blocked on this socket has to keep waiting.
+    pub fn blocks(&self, buffer: &RecvBuffer) -> bool {
+        match self.pending {
+            PendingOp::None => false,
+            PendingOp::Listen | PendingOp::Accept => true,
+            PendingOp::Recv => buffer.is_empty(),
+        }
+    }
+}
+
+/// Writes buffered for one FD's file, appended to the sandbox in one piece
+/// per flush. The host backend keeps the file open until the FD is closed,
+/// so a large write costs one open plus a write per full buffer.
+#[derive(Debug)]
+pub struct FileWriter {
+    host_path: String,
+    pending: Vec<u8>,
+}
+
+impl FileWriter {
+    pub fn new(host_path: String) -> Self {
+        FileWriter { host_path, pending: Vec::new() }
+    }
+
+    pub fn host_path(&self) -> &str {
+        &self.host_path
+    }
+
+    pub fn pending_len(&self) -> usize {
+        self.pending.len()
+    }
+
+    pub fn push(&mut self, bytes: &[u8]) {
+        self.pending.extend_from_slice(bytes);
+    }
+
+    /// Appends the pending bytes to the file and returns how many were written.
+    pub fn flush(&mut self, fs: &mut dyn SandboxFs) -> io::Result<usize> {
+        if self.pending.is_empty() {
+            return Ok(0);
+        }
+        fs.append(Path::new(&self.host_path), &self.pending)?;
+        let bytes = self.pending.len();
+        self.pending.clear();
+        Ok(bytes)
+    }
+}
+
+/// Received socket data not yet read by the guest. Reads advance a cursor
+/// instead of shifting the remaining bytes; the consumed prefix is dropped
+/// once it outgrows what is still unread.
+#[derive(Debug, Clone, Default)]
+pub struct RecvBuffer {
+    data: Vec<u8>,
+    read_pos: usize,
+}
+
+impl RecvBuffer {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn len(&self) -> usize {
+        self.data.len() - self.read_pos
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.read_pos == self.data.len()
+    }
+
+    /// The unread bytes.
+    pub fn as_slice(&self) -> &[u8] {
+        &self.data[self.read_pos..]
+    }
+
+    pub fn extend_from_slice(&mut self, bytes: &[u8]) {
+        self.data.extend_from_slice(bytes);
+    }
+
+    /// Marks the first `n` unread bytes as read.
+    pub fn consume(&mut self, n: usize) {
+        self.read_pos = (self.read_pos + n).min(self.data.len());
+        if self.read_pos == self.data.len() {
+            self.data.clear();
+            self.read_pos = 0;
+        } else if self.read_pos > self.len() {
+            self.data.drain(..self.read_pos);
+            self.read_pos = 0;
+        }
+    }
+}
+
 impl fmt::Display for FDEntry {
     fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
         match self {
-            FDEntry::File { buffer, read_ptr, is_directory, is_preopen, host_path } => {
+            FDEntry::File { buffer, read_ptr, is_directory, is_preopen, host_path, .. } => {
                 let buffer_str = match std::str::from_utf8(&buffer) {
                     Ok(s) => s.to_string(),
                     Err(_) => format!("{:?}", buffer),
@@ -34,13 +171,14 @@ impl fmt::Display for FDEntry {
                     buffer_str, read_ptr, is_directory, is_preopen, host_path
                 )
             },
-            FDEntry::Socket { local_port, connected, is_listener, buffer } => {
-                let buffer_str = match std::str::from_utf8(&buffer) {
+            FDEntry::Socket { local_port, state, buffer } => {
+                let buffer_str = match std::str::from_utf8(buffer.as_slice()) {
                     Ok(s) => s.to_string(),
-                    Err(_) => format!("{:?}", buffer),
+                    Err(_) => format!("{:?}", buffer.as_slice()),
                 };
-                write!(f, "Socket(local_port: {}, connected: {}, is_listener: {}, buffer: \"{}\")", 
-                       local_port, connected, is_listener, buffer_str)
+                write!(f, "Socket(local_port: {}, connected: {}, is_listener: {}, pending: {:?}, buffer: \"{}\")",
+                       local_port, state.has(SocketState::CONNECTED), state.has(SocketState::LISTENER),
+                       state.pending, buffer_str)
             },
         }
     }
@@ -54,6 +192,7 @@ impl FDEntry {
             is_directory: false,
             is_preopen: false,
             host_path,
+            writer: None,
         }
     }
 
@@ -64,8 +203,13 @@ impl FDEntry {
             is_directory: true,
             is_preopen: true,
             host_path: Some(host_path),
+            writer: None,
         }
     }
+
+    pub fn new_socket(local_port: u16) -> Self {
+        FDEntry::Socket { local_port, state: SocketState::default(), buffer: RecvBuffer::new() }
+    }
 }
 
 pub struct FDTable {
@@ -85,6 +229,7 @@ impl FDTable {
             is_directory: false,
             is_preopen: false,
             host_path: None,
+            writer: None,
         }));
         table.entries.push(Some(FDEntry::File {  // stdout
             buffer: Vec::new(),
@@ -92,6 +237,7 @@ impl FDTable {
             is_directory: false,
             is_preopen: false,
             host_path: None,
+            writer: None,
         }));
         table.entries.push(Some(FDEntry::File {  // stderr
             buffer: Vec::new(),
@@ -99,6 +245,7 @@ impl FDTable {
             is_directory: false,
             is_preopen: false,
             host_path: None,
+            writer: None,
         }));
         table.entries.push(Some(FDEntry::File {
             buffer: Vec::new(),
@@ -106,6 +253,7 @@ impl FDTable {
             is_directory: true,
             is_preopen: true,
             host_path: Some(process_root.to_string_lossy().into_owned()),
+            writer: None,
         }));
         table
     }
@@ -144,6 +292,16 @@ impl FDTable {
         new_fd
     }
 
+    /// Flushes the buffered writes of every open file.
+    pub fn flush_writers(&self, fs: &mut dyn SandboxFs) -> io::Result<()> {
+        for entry in self.entries.iter().flatten() {
+            if let FDEntry::File { writer: Some(writer), .. } = entry {
+                writer.lock().unwrap().flush(fs)?;
+            }
+        }
+        Ok(())
+    }
+
     /// Mark an FD slot as closed
     pub fn deallocate_fd(&mut self, fd: i32) {
         if fd >= 0 && (fd as usize) < self.entries.len() {
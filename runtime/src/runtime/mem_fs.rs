@@ -0,0 +1,252 @@
+use std::collections::BTreeMap;
+use std::io;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+
+use crate::runtime::preload;
+use crate::runtime::sandbox_fs::{FileStat, SandboxFs};
+
+/// Bytes per file extent. Appends fill the last extent before starting a new one.
+const EXTENT_SIZE: usize = 64 * 1024;
+/// Inode of the sandbox root directory.
+const ROOT_INO: usize = 0;
+
+enum Node {
+    /// File contents as a list of extents. Extents shared with a preload
+    /// snapshot (or anything else) are never written to: an append that
+    /// finds the last extent shared starts a new one.
+    File { extents: Vec<Arc<Vec<u8>>>, len: u64 },
+    /// Children by name; the sorted map makes listings deterministic.
+    Dir { entries: BTreeMap<String, usize> },
+}
+
+struct Inode {
+    node: Node,
+    charged: u64,
+}
+
+/// A sandbox kept entirely in memory: an arena of inodes indexed by inode
+/// number, with freed slots reused. Nothing is written to the host, and
+/// tearing the sandbox down drops the arena.
+pub struct MemFs {
+    root: PathBuf,
+    inodes: Vec<Option<Inode>>,
+    free: Vec<usize>,
+    total_charged: u64,
+}
+
+fn error(kind: io::ErrorKind, msg: &str) -> io::Error {
+    io::Error::new(kind, msg)
+}
+
+impl MemFs {
+    pub fn new(root: &Path) -> Self {
+        let root_dir = Inode { node: Node::Dir { entries: BTreeMap::new() }, charged: 0 };
+        MemFs {
+            root: root.to_path_buf(),
+            inodes: vec![Some(root_dir)],
+            free: Vec::new(),
+            total_charged: 0,
+        }
+    }
+
+    /// Names of the components of `path` below the sandbox root.
+    fn components<'a>(&self, path: &'a Path) -> io::Result<Vec<&'a str>> {
+        let rel = path
+            .strip_prefix(&self.root)
+            .map_err(|_| error(io::ErrorKind::PermissionDenied, "path outside the sandbox"))?;
+        rel.iter()
+            .map(|name| name.to_str().ok_or_else(|| error(io::ErrorKind::InvalidInput, "invalid UTF-8 in path")))
+            .collect()
+    }
+
+    fn inode(&self, ino: usize) -> &Inode {
+        self.inodes[ino].as_ref().expect("directory entry points at a freed inode")
+    }
+
+    fn inode_mut(&mut self, ino: usize) -> &mut Inode {
+        self.inodes[ino].as_mut().expect("directory entry points at a freed inode")
+    }
+
+    fn child(&self, dir: usize, name: &str) -> io::Result<usize> {
+        match &self.inode(dir).node {
+            Node::Dir { entries } => entries
+                .get(name)
+                .copied()
+                .ok_or_else(|| error(io::ErrorKind::NotFound, "no such file or directory")),
+            Node::File { .. } => Err(error(io::ErrorKind::Other, "not a directory")),
+        }
+    }
+
+    fn lookup(&self, path: &Path) -> io::Result<usize> {
+        let mut ino = ROOT_INO;
+        for name in self.components(path)? {
+            ino = self.child(ino, name)?;
+        }
+        Ok(ino)
+    }
+
+    /// The directory that holds `path`, and the name of `path` in it.
+    fn lookup_parent<'a>(&self, path: &'a Path) -> io::Result<(usize, &'a str)> {
+        let names = self.components(path)?;
+        let Some((name, parents)) = names.split_last() else {
+            return Err(error(io::ErrorKind::AlreadyExists, "the sandbox root already exists"));
+        };
+        let mut ino = ROOT_INO;
+        for parent in parents {
+            ino = self.child(ino, parent)?;
+        }
+        Ok((ino, *name))
+    }
+
+    fn link_new(&mut self, path: &Path, node: Node, charged: u64) -> io::Result<usize> {
+        let (parent, name) = self.lookup_parent(path)?;
+        match self.child(parent, name) {
+            Ok(_) => return Err(error(io::ErrorKind::AlreadyExists, "file exists")),
+            Err(e) if e.kind() == io::ErrorKind::NotFound => {}
+            Err(e) => return Err(e),
+        }
+        let inode = Some(Inode { node, charged });
+        let ino = match self.free.pop() {
+            Some(ino) => {
+                self.inodes[ino] = inode;
+                ino
+            }
+            None => {
+                self.inodes.push(inode);
+                self.inodes.len() - 1
+            }
+        };
+        if let Node::Dir { entries } = &mut self.inode_mut(parent).node {
+            entries.insert(name.to_owned(), ino);
+        }
+        self.total_charged += charged;
+        Ok(ino)
+    }
+
+    fn unlink(&mut self, path: &Path, want_dir: bool) -> io::Result<u64> {
+        let (parent, name) = self.lookup_parent(path)?;
+        let ino = self.child(parent, name)?;
+        match (&self.inode(ino).node, want_dir) {
+            (Node::Dir { entries }, true) if !entries.is_empty() => {
+                return Err(error(io::ErrorKind::Other, "directory not empty"))
+            }
+            (Node::Dir { .. }, false) => return Err(error(io::ErrorKind::Other, "is a directory")),
+            (Node::File { .. }, true) => return Err(error(io::ErrorKind::Other, "not a directory")),
+            _ => {}
+        }
+        if let Node::Dir { entries } = &mut self.inode_mut(parent).node {
+            entries.remove(name);
+        }
+        let inode = self.inodes[ino].take().expect("directory entry points at a freed inode");
+        self.free.push(ino);
+        self.total_charged -= inode.charged;
+        Ok(inode.charged)
+    }
+}
+
+impl SandboxFs for MemFs {
+    /// Preloaded files share their contents with the snapshot of `src`, so
+    /// every memory sandbox preloading it holds one copy between them.
+    fn preload(&mut self, src: &Path) -> io::Result<()> {
+        let snapshot = preload::snapshot(src)?;
+        for (rel, contents) in snapshot.entries() {
+            let path = self.root.join(rel);
+            match contents {
+                None => match self.link_new(&path, Node::Dir { entries: BTreeMap::new() }, 0) {
+                    Err(e) if e.kind() != io::ErrorKind::AlreadyExists => return Err(e),
+                    _ => {}
+                },
+                Some(data) => {
+                    let len = data.len() as u64;
+                    let extents = if data.is_empty() { Vec::new() } else { vec![Arc::clone(data)] };
+                    self.link_new(&path, Node::File { extents, len }, len)?;
+                }
+            }
+        }
+        Ok(())
+    }
+
+    fn stat(&self, path: &Path) -> io::Result<FileStat> {
+        let ino = self.lookup(path)?;
+        Ok(match &self.inode(ino).node {
+            Node::File { len, .. } => FileStat { is_dir: false, len: *len, ino: ino as u64 },
+            Node::Dir { .. } => FileStat { is_dir: true, len: 0, ino: ino as u64 },
+        })
+    }
+
+    fn read_file(&self, path: &Path) -> io::Result<Vec<u8>> {
+        match &self.inode(self.lookup(path)?).node {
+            Node::File { extents, len } => {
+                let mut data = Vec::with_capacity(*len as usize);
+                for extent in extents {
+                    data.extend_from_slice(extent);
+                }
+                Ok(data)
+            }
+            Node::Dir { .. } => Err(error(io::ErrorKind::Other, "is a directory")),
+        }
+    }
+
+    fn list_dir(&self, path: &Path) -> io::Result<Vec<String>> {
+        match &self.inode(self.lookup(path)?).node {
+            Node::Dir { entries } => Ok(entries.keys().cloned().collect()),
+            Node::File { .. } => Err(error(io::ErrorKind::Other, "not a directory")),
+        }
+    }
+
+    fn create_file(&mut self, path: &Path, charged: u64) -> io::Result<()> {
+        self.link_new(path, Node::File { extents: Vec::new(), len: 0 }, charged).map(|_| ())
+    }
+
+    fn create_dir(&mut self, path: &Path, charged: u64) -> io::Result<()> {
+        self.link_new(path, Node::Dir { entries: BTreeMap::new() }, charged).map(|_| ())
+    }
+
+    fn append(&mut self, path: &Path, mut data: &[u8]) -> io::Result<()> {
+        let ino = self.lookup(path)?;
+        let bytes = data.len() as u64;
+        let inode = self.inode_mut(ino);
+        let Node::File { extents, len } = &mut inode.node else {
+            return Err(error(io::ErrorKind::Other, "is a directory"));
+        };
+        while !data.is_empty() {
+            let has_room = match extents.last_mut().and_then(Arc::get_mut) {
+                Some(extent) => extent.len() < EXTENT_SIZE,
+                None => false,
+            };
+            if !has_room {
+                extents.push(Arc::new(Vec::with_capacity(EXTENT_SIZE)));
+            }
+            let extent = Arc::get_mut(extents.last_mut().unwrap()).unwrap();
+            let chunk = data.len().min(EXTENT_SIZE - extent.len());
+            extent.extend_from_slice(&data[..chunk]);
+            data = &data[chunk..];
+        }
+        *len += bytes;
+        inode.charged += bytes;
+        self.total_charged += bytes;
+        Ok(())
+    }
+
+    fn remove_file(&mut self, path: &Path) -> io::Result<u64> {
+        self.unlink(path, false)
+    }
+
+    fn remove_dir(&mut self, path: &Path) -> io::Result<u64> {
+        self.unlink(path, true)
+    }
+
+    fn release(&mut self, _path: &Path) {}
+
+    fn total_charged(&self) -> u64 {
+        self.total_charged
+    }
+
+    fn destroy(&mut self) -> io::Result<()> {
+        self.inodes = Vec::new();
+        self.free = Vec::new();
+        self.total_charged = 0;
+        Ok(())
+    }
+}
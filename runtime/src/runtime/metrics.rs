@@ -0,0 +1,215 @@
+use std::collections::BTreeMap;
+use std::future::Future;
+use std::pin::Pin;
+use std::sync::atomic::Ordering;
+use std::sync::{Arc, Mutex};
+use std::task::{Context, Poll};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use consensus::metrics::{self, Counter, Exposition, Gauge, Histogram, Unit};
+use log::error;
+
+use crate::runtime::config::RuntimeConfig;
+use crate::runtime::process::{BlockTimes, FuelStats, BLOCK_REASONS};
+use crate::runtime::stats;
+
+/// Runtime-wide metrics. Counters are always kept; hostcall timing, which
+/// costs two clock reads per call, only with `enabled()`.
+pub struct RuntimeMetrics {
+    pub batches: Counter,
+    pub records: Counter,
+    pub batch_bytes: Histogram,
+    /// Time to apply a batch's records once it has been read.
+    pub batch_apply: Histogram,
+    pub last_batch: Gauge,
+    /// Guest sock_send calls, and the NetworkOut Sends they were merged into.
+    pub socket_sends: Counter,
+    pub send_ops: Counter,
+    pub ready: Gauge,
+    pub blocked: Gauge,
+    /// How long each block lasted, per `BLOCK_REASONS` entry.
+    pub block_time: [Histogram; BLOCK_REASONS.len()],
+}
+
+pub static RUNTIME: RuntimeMetrics = RuntimeMetrics {
+    batches: Counter::new(),
+    records: Counter::new(),
+    batch_bytes: Histogram::new(),
+    batch_apply: Histogram::new(),
+    last_batch: Gauge::new(),
+    socket_sends: Counter::new(),
+    send_ops: Counter::new(),
+    ready: Gauge::new(),
+    blocked: Gauge::new(),
+    block_time: [
+        Histogram::new(),
+        Histogram::new(),
+        Histogram::new(),
+        Histogram::new(),
+        Histogram::new(),
+    ],
+};
+
+/// Latency of each timed hostcall, in nanoseconds. Histograms are created
+/// when the first process links the hostcall and live for the whole run.
+static HOSTCALLS: Mutex<BTreeMap<&'static str, &'static Histogram>> = Mutex::new(BTreeMap::new());
+
+/// Counters of the live processes, registered at spawn.
+static PROCESSES: Mutex<BTreeMap<u64, (Arc<FuelStats>, Arc<BlockTimes>)>> = Mutex::new(BTreeMap::new());
+
+/// Whether hostcalls are timed: for the metrics endpoint or a stats report.
+pub fn enabled() -> bool {
+    let config = RuntimeConfig::get();
+    config.metrics_addr.is_some() || config.stats
+}
+
+/// Records that a batch of `records` records and `bytes` bytes was applied
+/// in `elapsed`, not counting the time spent waiting for it to arrive.
+pub fn batch_applied(records: usize, bytes: usize, elapsed: Duration) {
+    RUNTIME.batches.inc();
+    RUNTIME.records.add(records as u64);
+    RUNTIME.batch_bytes.observe(bytes as u64);
+    RUNTIME.batch_apply.observe_duration(elapsed);
+    stats::batch_applied(records, elapsed);
+}
+
+pub fn hostcall(name: &'static str) -> &'static Histogram {
+    HOSTCALLS
+        .lock()
+        .unwrap()
+        .entry(name)
+        .or_insert_with(|| Box::leak(Box::new(Histogram::new())))
+}
+
+/// Calls and total nanoseconds of every timed hostcall, by name.
+pub fn hostcall_totals() -> Vec<(&'static str, u64, u64)> {
+    HOSTCALLS.lock().unwrap().iter().map(|(name, hist)| (*name, hist.count(), hist.sum())).collect()
+}
+
+pub fn process_started(pid: u64, fuel: &Arc<FuelStats>, block_times: &Arc<BlockTimes>) {
+    PROCESSES.lock().unwrap().insert(pid, (Arc::clone(fuel), Arc::clone(block_times)));
+}
+
+pub fn process_finished(pid: u64) {
+    PROCESSES.lock().unwrap().remove(&pid);
+}
+
+/// Wraps a hostcall future so the time spent polling it is recorded in
+/// `latency`. A pooled guest that blocks is suspended between polls, so
+/// only the hostcall's own work counts; a thread-mode guest waits inside
+/// the poll.
+pub fn timed<F: Future>(latency: &'static Histogram, future: F) -> Timed<F> {
+    Timed { latency, spent: Duration::ZERO, future }
+}
+
+pub struct Timed<F> {
+    latency: &'static Histogram,
+    spent: Duration,
+    future: F,
+}
+
+impl<F: Future> Future for Timed<F> {
+    type Output = F::Output;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<F::Output> {
+        // Safety: `future` is never moved out of the pinned Timed.
+        let this = unsafe { self.get_unchecked_mut() };
+        let start = Instant::now();
+        let poll = unsafe { Pin::new_unchecked(&mut this.future) }.poll(cx);
+        this.spent += start.elapsed();
+        if poll.is_ready() {
+            this.latency.observe(this.spent.as_nanos() as u64);
+        }
+        poll
+    }
+}
+
+pub fn render() -> String {
+    let mut out = Exposition::new();
+    let m = &RUNTIME;
+    out.counter("replicode_runtime_batches_total", "Incoming batches applied.", "", m.batches.get());
+    out.counter("replicode_runtime_records_total", "Records applied.", "", m.records.get());
+    out.histogram("replicode_runtime_batch_bytes", "Size of each applied batch.", "", &m.batch_bytes, Unit::Plain);
+    out.histogram(
+        "replicode_runtime_batch_apply_seconds",
+        "Time to apply a batch's records once it was read.",
+        "",
+        &m.batch_apply,
+        Unit::Micros,
+    );
+    out.gauge("replicode_runtime_last_batch", "Number of the last Incoming batch applied.", "", m.last_batch.get());
+    out.counter("replicode_runtime_socket_sends_total", "Guest socket sends.", "", m.socket_sends.get());
+    out.counter(
+        "replicode_runtime_send_ops_total",
+        "NetworkOut Send records the guest sends were coalesced into.",
+        "",
+        m.send_ops.get(),
+    );
+    out.gauge("replicode_runtime_ready_processes", "Ready queue depth before the last batch.", "", m.ready.get());
+    out.gauge("replicode_runtime_blocked_processes", "Blocked processes before the last batch.", "", m.blocked.get());
+    for (reason, hist) in BLOCK_REASONS.iter().zip(&m.block_time) {
+        out.histogram(
+            "replicode_runtime_block_seconds",
+            "How long processes stayed blocked, by reason.",
+            &format!("reason=\"{}\"", reason),
+            hist,
+            Unit::Micros,
+        );
+    }
+    for (name, hist) in HOSTCALLS.lock().unwrap().iter() {
+        out.histogram(
+            "replicode_runtime_hostcall_seconds",
+            "Time spent in blocking hostcalls, by hostcall.",
+            &format!("hostcall=\"{}\"", name),
+            hist,
+            Unit::Nanos,
+        );
+    }
+
+    let processes = PROCESSES.lock().unwrap();
+    for (pid, (_, block_times)) in processes.iter() {
+        for (reason, total) in BLOCK_REASONS.iter().zip(&block_times.0) {
+            out.counter(
+                "replicode_process_blocked_microseconds_total",
+                "Time each live process has spent blocked, by reason.",
+                &format!("pid=\"{}\",reason=\"{}\"", pid, reason),
+                total.load(Ordering::Relaxed),
+            );
+        }
+    }
+    if RuntimeConfig::get().fuel_preemption() {
+        for (pid, (fuel, _)) in processes.iter() {
+            out.counter(
+                "replicode_process_fuel_consumed_total",
+                "Fuel each live process has burnt, as of its last hostcall.",
+                &format!("pid=\"{}\"", pid),
+                fuel.consumed.load(Ordering::Relaxed),
+            );
+        }
+        for (pid, (fuel, _)) in processes.iter() {
+            out.counter(
+                "replicode_process_preemptions_total",
+                "Slices of each live process that ended on the fuel quantum.",
+                &format!("pid=\"{}\"", pid),
+                fuel.preemptions.load(Ordering::Relaxed),
+            );
+        }
+    }
+    out.finish()
+}
+
+/// Serves `/metrics` on `REPLICODE_METRICS_ADDR`, if set.
+pub fn start_endpoint() {
+    let Some(addr) = RuntimeConfig::get().metrics_addr.clone() else {
+        return;
+    };
+    let spawned = thread::Builder::new().name("metrics".into()).spawn(move || {
+        if let Err(e) = metrics::serve(&addr, render) {
+            error!("Metrics endpoint on {} failed: {}", addr, e);
+        }
+    });
+    if let Err(e) = spawned {
+        error!("Failed to start metrics endpoint: {}", e);
+    }
+}
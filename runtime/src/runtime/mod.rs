@@ -2,3 +2,16 @@ pub mod process;
 pub mod scheduler;
 pub mod fd_table;  
 pub mod clock;
+pub mod config;
+pub mod module_cache;
+pub mod executor;
+pub mod process_set;
+pub mod checkpoint;
+pub mod digest;
+pub mod outgoing;
+pub mod disk_index;
+pub mod preload;
+pub mod sandbox_fs;
+pub mod mem_fs;
+pub mod stats;
+pub mod metrics;
@@ -0,0 +1,163 @@
+use anyhow::Result;
+use log::{debug, error, info};
+use sha2::{Digest, Sha256};
+use std::collections::HashMap;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::{Mutex, OnceLock};
+use wasmtime::{Config, Engine, Module};
+
+use crate::runtime::config::{ExecutorKind, RuntimeConfig};
+
+/// SHA-256 of the raw wasm bytes a module was compiled from.
+pub type ModuleHash = [u8; 32];
+
+static ENGINE: OnceLock<Engine> = OnceLock::new();
+static METERED_ENGINE: OnceLock<Engine> = OnceLock::new();
+static MODULES: OnceLock<Mutex<HashMap<ModuleHash, Module>>> = OnceLock::new();
+
+/// The Engine shared by every process in this runtime.
+/// Modules compiled against it can be instantiated in any process Store.
+pub fn engine() -> &'static Engine {
+    ENGINE.get_or_init(|| {
+        let mut config = Config::new();
+        // The pooled executor runs guests on fibers through `call_async`.
+        config.async_support(RuntimeConfig::get().executor == ExecutorKind::Pooled);
+        // Fuel is counted per instruction, so preemption points are the same on every replica.
+        config.consume_fuel(RuntimeConfig::get().fuel_preemption());
+        let engine = Engine::new(&config).expect("Failed to create wasmtime engine");
+        debug!("Shared WASM engine created");
+        engine
+    })
+}
+
+/// An Engine that always consumes fuel, for guests started with a fuel limit.
+/// This is `engine()` itself when fuel preemption already meters every guest.
+pub fn metered_engine() -> &'static Engine {
+    if RuntimeConfig::get().fuel_preemption() {
+        return engine();
+    }
+    METERED_ENGINE.get_or_init(|| {
+        let mut config = Config::new();
+        config.async_support(RuntimeConfig::get().executor == ExecutorKind::Pooled);
+        config.consume_fuel(true);
+        let engine = Engine::new(&config).expect("Failed to create wasmtime engine");
+        debug!("Metered WASM engine created");
+        engine
+    })
+}
+
+/// Compiles `wasm_bytes` for `metered_engine()`. Only goes through the module
+/// cache when that is the shared engine; the cache holds modules for `engine()`.
+pub fn load_metered(wasm_bytes: &[u8]) -> Result<Module> {
+    if RuntimeConfig::get().fuel_preemption() {
+        return load_module(wasm_bytes);
+    }
+    Module::new(metered_engine(), wasm_bytes)
+}
+
+pub fn hash_wasm(wasm_bytes: &[u8]) -> ModuleHash {
+    Sha256::digest(wasm_bytes).into()
+}
+
+pub fn hash_to_hex(hash: &ModuleHash) -> String {
+    hash.iter().map(|b| format!("{:02x}", b)).collect()
+}
+
+/// Returns a compiled Module for `wasm_bytes`, compiling at most once per content hash.
+/// Lookup order: in-memory cache, on-disk artifact (if configured), Cranelift compile.
+pub fn load_module(wasm_bytes: &[u8]) -> Result<Module> {
+    load(hash_wasm(wasm_bytes), wasm_bytes, None)
+}
+
+/// Like `load_module`, but before the on-disk cache tries `artifact`, which
+/// consensus precompiled from a module whose hex hash it gave as `expected`.
+/// A hash that does not match `wasm_bytes` discards the artifact.
+pub fn load_precompiled(expected: &str, artifact: &[u8], wasm_bytes: &[u8]) -> Result<Module> {
+    let hash = hash_wasm(wasm_bytes);
+    if !hash_to_hex(&hash).eq_ignore_ascii_case(expected) {
+        error!("Precompiled module claims hash {} but the wasm hashes to {}; compiling it", expected, hash_to_hex(&hash));
+        return load(hash, wasm_bytes, None);
+    }
+    load(hash, wasm_bytes, Some(artifact))
+}
+
+fn load(hash: ModuleHash, wasm_bytes: &[u8], artifact: Option<&[u8]>) -> Result<Module> {
+    let modules = MODULES.get_or_init(|| Mutex::new(HashMap::new()));
+
+    if let Some(module) = modules.lock().unwrap().get(&hash) {
+        debug!("Module cache hit for {}", hash_to_hex(&hash));
+        return Ok(module.clone());
+    }
+
+    let cache_dir = RuntimeConfig::get().module_cache_dir.as_deref();
+    let precompiled = artifact
+        .and_then(|artifact| deserialize_shipped(&hash, artifact))
+        .or_else(|| cache_dir.and_then(|dir| load_artifact(dir, &hash)));
+    let module = match precompiled {
+        Some(module) => module,
+        None => {
+            let module = Module::new(engine(), wasm_bytes)?;
+            info!("Compiled module {} ({} bytes)", hash_to_hex(&hash), wasm_bytes.len());
+            if let Some(dir) = cache_dir {
+                if let Err(e) = store_artifact(dir, &hash, &module) {
+                    error!("Failed to save precompiled module {}: {}", hash_to_hex(&hash), e);
+                }
+            }
+            module
+        }
+    };
+
+    modules.lock().unwrap().insert(hash, module.clone());
+    Ok(module)
+}
+
+fn artifact_path(dir: &Path, hash: &ModuleHash) -> PathBuf {
+    dir.join(format!("{}.cwasm", hash_to_hex(hash)))
+}
+
+fn deserialize_shipped(hash: &ModuleHash, artifact: &[u8]) -> Option<Module> {
+    // Safety: consensus is trusted with the modules themselves, and built this
+    // artifact with `Engine::precompile_module`; wasmtime rejects artifacts
+    // whose target or engine settings differ from ours.
+    match unsafe { Module::deserialize(engine(), artifact) } {
+        Ok(module) => {
+            info!("Loaded module {} precompiled by consensus ({} bytes)", hash_to_hex(hash), artifact.len());
+            Some(module)
+        }
+        Err(e) => {
+            error!("Ignoring precompiled module {} from consensus: {:?}", hash_to_hex(hash), e);
+            None
+        }
+    }
+}
+
+fn load_artifact(dir: &Path, hash: &ModuleHash) -> Option<Module> {
+    let path = artifact_path(dir, hash);
+    if !path.exists() {
+        return None;
+    }
+    // Safety: artifacts are only ever written by `store_artifact` from a module
+    // compiled by this engine; wasmtime rejects ones built with a different config.
+    match unsafe { Module::deserialize_file(engine(), &path) } {
+        Ok(module) => {
+            info!("Loaded precompiled module from {}", path.display());
+            Some(module)
+        }
+        Err(e) => {
+            error!("Ignoring unusable precompiled module {}: {:?}", path.display(), e);
+            None
+        }
+    }
+}
+
+fn store_artifact(dir: &Path, hash: &ModuleHash, module: &Module) -> Result<()> {
+    fs::create_dir_all(dir)?;
+    let path = artifact_path(dir, hash);
+    // Write to a temp file first so a crash never leaves a truncated artifact behind.
+    let tmp_path = path.with_extension(format!("tmp{}", std::process::id()));
+    fs::write(&tmp_path, module.serialize()?)?;
+    fs::rename(&tmp_path, &path)?;
+    debug!("Saved precompiled module to {}", path.display());
+    Ok(())
+}
@@ -0,0 +1,69 @@
+use std::collections::VecDeque;
+use std::sync::Mutex;
+
+use consensus::batch::Control;
+use log::{info, warn};
+
+use crate::runtime::config::RuntimeConfig;
+
+/// An outgoing batch a follower held back: its number, the state digest
+/// sent in its place and its records.
+pub struct Held {
+    pub number: u64,
+    pub digest: u64,
+    pub records: Vec<u8>,
+}
+
+struct Role {
+    /// Whether this runtime's outgoing records are the copy consensus
+    /// applies. Every runtime leads until told otherwise, so a consensus
+    /// that never sends control frames gets every copy, as before.
+    leader: bool,
+    /// The newest `retransmit_batches` batches sent as summaries.
+    held: VecDeque<Held>,
+}
+
+static ROLE: Mutex<Role> = Mutex::new(Role { leader: true, held: VecDeque::new() });
+
+pub fn is_leader() -> bool {
+    ROLE.lock().unwrap().leader
+}
+
+/// Keeps a batch sent as a summary, for resending on promotion.
+pub fn hold(number: u64, digest: u64, records: Vec<u8>) {
+    let capacity = RuntimeConfig::get().retransmit_batches;
+    if capacity == 0 {
+        return;
+    }
+    let mut role = ROLE.lock().unwrap();
+    if role.held.len() == capacity {
+        role.held.pop_front();
+    }
+    role.held.push_back(Held { number, digest, records });
+}
+
+/// Applies a control frame. On promotion, returns the held batches
+/// consensus has not applied yet, oldest first, for resending in full.
+/// `next_number` is the number the next outgoing batch will get.
+pub fn apply_control(control: &Control, next_number: u64) -> Vec<Held> {
+    let mut role = ROLE.lock().unwrap();
+    let promoted = control.leader && !role.leader;
+    role.leader = control.leader;
+    if !control.leader {
+        info!("Following: sending outgoing digests only");
+        return Vec::new();
+    }
+    let resend: Vec<Held> = role.held.drain(..).filter(|held| held.number > control.resend_after).collect();
+    if promoted {
+        info!("Leading: resending {} outgoing batches after batch {}", resend.len(), control.resend_after);
+        let first_held = resend.first().map_or(next_number, |held| held.number);
+        if first_held > control.resend_after + 1 {
+            warn!(
+                "Outgoing batches {}..{} are no longer held and cannot be resent",
+                control.resend_after + 1,
+                first_held
+            );
+        }
+    }
+    resend
+}
@@ -0,0 +1,172 @@
+use std::collections::BTreeMap;
+use std::ffi::OsString;
+use std::fs;
+use std::io;
+use std::os::unix::fs::{MetadataExt, PermissionsExt};
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex};
+
+use log::{debug, info, warn};
+
+use crate::runtime::config::{PreloadMode, RuntimeConfig};
+use crate::SANDBOX_ROOT;
+
+/// Read-only snapshots of preload directories, one per source directory,
+/// shared by every sandbox that preloads it.
+static BASE_LAYERS: Mutex<BTreeMap<PathBuf, PathBuf>> = Mutex::new(BTreeMap::new());
+/// In-memory snapshots of preload directories for memory-backed sandboxes.
+static SNAPSHOTS: Mutex<BTreeMap<PathBuf, Arc<Snapshot>>> = Mutex::new(BTreeMap::new());
+
+/// A preload directory read into memory once. Memory-backed sandboxes share
+/// the file contents instead of copying them.
+pub struct Snapshot {
+    /// Paths relative to the preload directory, parents before children;
+    /// `None` for a directory, the file's contents otherwise.
+    entries: Vec<(PathBuf, Option<Arc<Vec<u8>>>)>,
+}
+
+impl Snapshot {
+    pub fn entries(&self) -> &[(PathBuf, Option<Arc<Vec<u8>>>)] {
+        &self.entries
+    }
+}
+
+/// Fills the sandbox at `dst` with the contents of `src`.
+///
+/// In link mode `src` is snapshotted once into a read-only base layer under
+/// the sandbox root, and each sandbox gets hard links into it: preloading
+/// costs one link per file whatever the sizes, and every sandbox shares
+/// the same page cache. A file is copied out of the base the first time a
+/// sandbox writes to it (see `make_private`).
+pub fn preload(src: &Path, dst: &Path) -> io::Result<()> {
+    match RuntimeConfig::get().preload_mode {
+        PreloadMode::Copy => copy_dir_recursive(src, dst),
+        PreloadMode::Link => {
+            let base = base_layer(src)?;
+            link_tree(&base, dst)
+        }
+    }
+}
+
+/// Gives the sandbox its own copy of `host_path` if the file is still shared
+/// with the base layer. Must be called before the file is modified.
+pub fn make_private(host_path: &Path) -> io::Result<()> {
+    let metadata = match fs::metadata(host_path) {
+        Ok(metadata) => metadata,
+        Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(()),
+        Err(e) => return Err(e),
+    };
+    if !metadata.is_file() || metadata.nlink() <= 1 {
+        return Ok(());
+    }
+    let mut tmp_name = OsString::from(host_path.as_os_str());
+    tmp_name.push(".cow-tmp");
+    let tmp = PathBuf::from(tmp_name);
+    fs::copy(host_path, &tmp)?;
+    fs::set_permissions(&tmp, fs::Permissions::from_mode(0o644))?;
+    fs::rename(&tmp, host_path)?;
+    debug!("Copied {} out of the preload base layer", host_path.display());
+    Ok(())
+}
+
+/// The in-memory snapshot of `src`, read on first use.
+pub fn snapshot(src: &Path) -> io::Result<Arc<Snapshot>> {
+    let src = src.canonicalize()?;
+    let mut snapshots = SNAPSHOTS.lock().unwrap();
+    if let Some(snapshot) = snapshots.get(&src) {
+        return Ok(Arc::clone(snapshot));
+    }
+    let mut entries = Vec::new();
+    read_tree(&src, Path::new(""), &mut entries)?;
+    info!("Read preload snapshot of {} ({} entries)", src.display(), entries.len());
+    let snapshot = Arc::new(Snapshot { entries });
+    snapshots.insert(src, Arc::clone(&snapshot));
+    Ok(snapshot)
+}
+
+fn read_tree(dir: &Path, rel: &Path, entries: &mut Vec<(PathBuf, Option<Arc<Vec<u8>>>)>) -> io::Result<()> {
+    for entry in fs::read_dir(dir)? {
+        let entry = entry?;
+        let rel_path = rel.join(entry.file_name());
+        if entry.file_type()?.is_dir() {
+            entries.push((rel_path.clone(), None));
+            read_tree(&entry.path(), &rel_path, entries)?;
+        } else {
+            entries.push((rel_path, Some(Arc::new(fs::read(entry.path())?))));
+        }
+    }
+    Ok(())
+}
+
+fn base_layer(src: &Path) -> io::Result<PathBuf> {
+    let src = src.canonicalize()?;
+    let mut layers = BASE_LAYERS.lock().unwrap();
+    if let Some(base) = layers.get(&src) {
+        return Ok(base.clone());
+    }
+
+    let base = SANDBOX_ROOT
+        .get()
+        .unwrap()
+        .join("base")
+        .join(format!("layer_{}", layers.len()));
+    if base.exists() {
+        fs::remove_dir_all(&base)?;
+    }
+    fs::create_dir_all(&base)?;
+    copy_dir_recursive(&src, &base)?;
+    set_read_only(&base)?;
+    info!("Created preload base layer {} from {}", base.display(), src.display());
+    layers.insert(src, base.clone());
+    Ok(base)
+}
+
+/// Mirrors the directories of `base` under `dst` and hard-links its files,
+/// copying instead where the filesystem can't link.
+fn link_tree(base: &Path, dst: &Path) -> io::Result<()> {
+    for entry in fs::read_dir(base)? {
+        let entry = entry?;
+        let src_path = entry.path();
+        let dst_path = dst.join(entry.file_name());
+        if entry.file_type()?.is_dir() {
+            fs::create_dir_all(&dst_path)?;
+            link_tree(&src_path, &dst_path)?;
+        } else if let Err(e) = fs::hard_link(&src_path, &dst_path) {
+            warn!("Cannot link {} ({}); copying it instead", src_path.display(), e);
+            fs::copy(&src_path, &dst_path)?;
+            fs::set_permissions(&dst_path, fs::Permissions::from_mode(0o644))?;
+        }
+    }
+    Ok(())
+}
+
+/// Marks every file under `dir` read-only so the shared inodes can't be
+/// modified through a sandbox by accident.
+fn set_read_only(dir: &Path) -> io::Result<()> {
+    for entry in fs::read_dir(dir)? {
+        let entry = entry?;
+        if entry.file_type()?.is_dir() {
+            set_read_only(&entry.path())?;
+        } else {
+            fs::set_permissions(entry.path(), fs::Permissions::from_mode(0o444))?;
+        }
+    }
+    Ok(())
+}
+
+/// Recursively copy all files & subdirectories from `src` into `dst`.
+fn copy_dir_recursive(src: &Path, dst: &Path) -> io::Result<()> {
+    for entry in fs::read_dir(src)? {
+        let entry = entry?;
+        let file_type = entry.file_type()?;
+        let src_path = entry.path();
+        let dst_path = dst.join(entry.file_name());
+        if file_type.is_dir() {
+            fs::create_dir_all(&dst_path)?;
+            copy_dir_recursive(&src_path, &dst_path)?;
+        } else {
+            fs::copy(&src_path, &dst_path)?;
+        }
+    }
+    Ok(())
+}
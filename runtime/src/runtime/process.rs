@@ -1,16 +1,23 @@
 use anyhow::Result;
 use log::{debug, error, info};
 use std::{
-    fmt, fs::{self, create_dir_all}, panic::AssertUnwindSafe, path::{Path, PathBuf}, sync::{Arc, Condvar, Mutex}, thread
+    fmt, fs, panic::AssertUnwindSafe, path::{Path, PathBuf},
+    sync::{atomic::{AtomicU64, Ordering}, Arc, Condvar, Mutex}, thread
 };
-use wasmtime::{Engine, Module, Store, Linker};
+use wasmtime::{Linker, Module, Store};
 use crate::wasi_syscalls::net::OutgoingNetworkMessage;
-use consensus::nat::NatTable;
 use crate::SANDBOX_ROOT;
 
 use crate::{
-    runtime::fd_table::{FDEntry, FDTable},
-    wasi_syscalls::{self, fs::get_dir_size},
+    runtime::{
+        config::{ExecutorKind, RuntimeConfig},
+        executor::{self, GuestTask, Resume},
+        sandbox_fs::{self, SharedFs},
+        fd_table::{FDEntry, FDTable},
+        metrics,
+        module_cache,
+    },
+    wasi_syscalls,
 };
 
 #[derive(Debug, Clone, Copy, PartialEq)]
@@ -32,10 +39,26 @@ pub enum BlockReason {
     StdinRead,
     Timeout { resume_after: u64 },
     FileIO,
-    WriteIO(String),
+    /// Waiting for the scheduler to flush the write buffer of this FD.
+    WriteIO(i32),
     NetworkIO,
 }
 
+/// Metric labels of the block reasons, indexed by `BlockReason::index`.
+pub const BLOCK_REASONS: [&str; 5] = ["stdin", "timeout", "file_io", "write_io", "network_io"];
+
+impl BlockReason {
+    pub fn index(&self) -> usize {
+        match self {
+            BlockReason::StdinRead => 0,
+            BlockReason::Timeout { .. } => 1,
+            BlockReason::FileIO => 2,
+            BlockReason::WriteIO(_) => 3,
+            BlockReason::NetworkIO => 4,
+        }
+    }
+}
+
 impl fmt::Display for BlockReason {
     fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
         match self {
@@ -48,6 +71,34 @@ impl fmt::Display for BlockReason {
     }
 }
 
+/// Fuel a guest started from a file (`start_process`) may burn before it traps.
+const FILE_FUEL_LIMIT: u64 = 2_000_000;
+
+/// Fuel accounting of one guest. Only kept with fuel preemption enabled
+/// (see `RuntimeConfig::fuel_preemption`) or a fuel limit.
+#[derive(Debug, Default)]
+pub struct FuelStats {
+    /// Fuel the Store started with.
+    budget: AtomicU64,
+    /// Fuel burnt as of the guest's last hostcall or exit.
+    pub consumed: AtomicU64,
+    /// Slices that ended because the quantum ran out.
+    pub preemptions: AtomicU64,
+}
+
+impl FuelStats {
+    /// Records the fuel left in the guest's Store.
+    pub fn update(&self, remaining: u64) {
+        let budget = self.budget.load(Ordering::Relaxed);
+        self.consumed.store(budget.saturating_sub(remaining), Ordering::Relaxed);
+    }
+}
+
+/// Total time a process has spent blocked, in microseconds, per
+/// `BLOCK_REASONS` entry.
+#[derive(Debug, Default)]
+pub struct BlockTimes(pub [AtomicU64; BLOCK_REASONS.len()]);
+
 /// Holds all per-process runtime data that your WASM code can access.
 #[derive(Clone)]
 pub struct ProcessData {
@@ -58,32 +109,56 @@ pub struct ProcessData {
     pub root_path: PathBuf,
     pub max_disk_usage: u64,
     pub current_disk_usage: Arc<Mutex<u64>>,
-    pub write_buffer: Arc<Mutex<Vec<u8>>>,
+    /// Where the sandbox's files live; see `RuntimeConfig::sandbox_fs`.
+    pub sandbox_fs: SharedFs,
+    /// Bytes an FD buffers before the writer blocks for a flush.
     pub max_write_buffer: usize,
     pub id: u64,
     pub next_port: Arc<Mutex<u16>>,
     pub network_queue: Arc<Mutex<Vec<OutgoingNetworkMessage>>>,
-    pub nat_table: Arc<Mutex<NatTable>>,
     pub args: Vec<String>,
+    pub fuel: Arc<FuelStats>,
+    pub block_times: Arc<BlockTimes>,
+}
+
+impl ProcessData {
+    /// Resolves once the scheduler sets this process back to Running.
+    /// Blocking hostcalls await this after recording their state and block reason.
+    pub fn resumed(&self) -> Resume {
+        Resume { state: self.state.clone(), cond: self.cond.clone() }
+    }
+}
+
+/// What actually executes a process's guest code.
+pub enum ProcessHandle {
+    Thread(thread::JoinHandle<()>),
+    Task(Arc<GuestTask>),
 }
 
 pub struct Process {
     pub id: u64, // Unique process ID
-    pub thread: thread::JoinHandle<()>,
+    pub handle: ProcessHandle,
     pub data: ProcessData,
 }
+
+impl Process {
+    /// Releases the guest's execution resources once it has Finished.
+    pub fn join(self) {
+        if let ProcessHandle::Thread(thread) = self.handle {
+            let _ = thread.join();
+        }
+    }
+}
+
 /// Creates a new process from a WASM binary (passed as a byte vector) and assigns it a unique ID.
-pub fn start_process_from_bytes(wasm_bytes: Vec<u8>, id: u64) -> Result<Process> {
+pub fn start_process_from_bytes(wasm_bytes: &[u8], id: u64) -> Result<Process> {
     debug!("Starting process {} from WASM bytes", id);
-    let config = wasmtime::Config::new();
-    debug!("WASM config created");
-    let engine = Engine::new(&config)?;
-    debug!("WASM engine created");
 
     let mut args = Vec::new();
     let mut wasm_bytes = wasm_bytes;
     let mut preload_dir = None;
-    // Parse args and dir from the start of wasm_bytes
+    let mut precompiled = None;
+    // Parse args, dir and a precompiled artifact from the start of wasm_bytes
     loop {
         if wasm_bytes.starts_with(b"args:") {
             if let Some(null_pos) = wasm_bytes.iter().position(|&b| b == 0) {
@@ -91,7 +166,7 @@ pub fn start_process_from_bytes(wasm_bytes: Vec<u8>, id: u64) -> Result<Process>
                 // Split by the Unit Separator character
                 args = arg_str.split('\x1F').map(|s| s.to_string()).collect();
                 debug!("Process {} received args: {:?}", id, args);
-                wasm_bytes = wasm_bytes[null_pos+1..].to_vec();
+                wasm_bytes = &wasm_bytes[null_pos+1..];
             } else {
                 break;
             }
@@ -99,17 +174,36 @@ pub fn start_process_from_bytes(wasm_bytes: Vec<u8>, id: u64) -> Result<Process>
             if let Some(null_pos) = wasm_bytes.iter().position(|&b| b == 0) {
                 let dir_str = String::from_utf8_lossy(&wasm_bytes[4..null_pos]);
                 preload_dir = Some(PathBuf::from(dir_str.to_string()));
-                wasm_bytes = wasm_bytes[null_pos+1..].to_vec();
+                wasm_bytes = &wasm_bytes[null_pos+1..];
             } else {
                 break;
             }
+        } else if wasm_bytes.starts_with(b"aot:") {
+            // "aot:<hash>:<len>\0" then the precompiled artifact, then the wasm
+            let Some(null_pos) = wasm_bytes.iter().position(|&b| b == 0) else {
+                break;
+            };
+            let header = String::from_utf8_lossy(&wasm_bytes[4..null_pos]);
+            let parsed = header
+                .split_once(':')
+                .and_then(|(hash, len)| Some((hash.to_string(), len.parse::<usize>().ok()?)))
+                .filter(|(_, len)| *len <= wasm_bytes.len() - null_pos - 1);
+            let Some((hash, len)) = parsed else {
+                anyhow::bail!("Malformed aot prefix '{}'", header);
+            };
+            let rest = &wasm_bytes[null_pos+1..];
+            precompiled = Some((hash, &rest[..len]));
+            wasm_bytes = &rest[len..];
         } else {
             break;
         }
     }
 
-    // Load the module from the in-memory bytes.
-    let module = Module::new(&engine, &wasm_bytes)?;
+    // Load the module from the in-memory bytes, reusing a cached compile if we have one.
+    let module = match precompiled {
+        Some((hash, artifact)) => module_cache::load_precompiled(&hash, artifact, wasm_bytes)?,
+        None => module_cache::load_module(wasm_bytes)?,
+    };
     debug!("WASM module loaded from bytes");
 
     // Initialize process state and associated resources.
@@ -118,31 +212,26 @@ pub fn start_process_from_bytes(wasm_bytes: Vec<u8>, id: u64) -> Result<Process>
     let block_reason = Arc::new(Mutex::new(None));
     let process_root = SANDBOX_ROOT.get().unwrap().join(format!("pid_{}", id));
     let fd_table = Arc::new(Mutex::new(FDTable::new(process_root.clone())));
-    fs::create_dir_all(&process_root)?;
+    let sandbox_fs = sandbox_fs::create(&process_root)?;
 
     let max_disk_usage = 1024 * 1024 * 10;
     // Optionally preload a directory
     let preload_size;
     if let Some(src_dir) = &preload_dir {
         if src_dir.exists() {
-            copy_dir_recursive(src_dir, &process_root)?;
+            let mut fs = sandbox_fs.lock().unwrap();
+            fs.preload(src_dir)?;
             info!("Preloaded {:?} into sandbox for process {}", src_dir, id);
 
-            preload_size = match get_dir_size(&process_root) {
-                Ok(sz) => sz,
-                Err(e) => {
-                    error!("Cannot compute size of preloaded data: {}", e);
-                    0
-                }
-            };
+            preload_size = fs.total_charged();
 
             if preload_size > max_disk_usage {
                 error!(
                     "Preloaded data ({}) exceeds disk quota ({}) for process {}! Aborting...",
                     preload_size, max_disk_usage, id
                 );
-                // Clean up the partially-created sandbox directory.
-                let _ = fs::remove_dir_all(&process_root);
+                // Clean up the partially-created sandbox.
+                let _ = fs.destroy();
                 // Return an error so the caller knows the process wasn't started.
                 return Err(anyhow::anyhow!("Preloaded data exceeds disk quota; process not created."));
             }
@@ -163,68 +252,20 @@ pub fn start_process_from_bytes(wasm_bytes: Vec<u8>, id: u64) -> Result<Process>
         root_path: process_root,
         max_disk_usage: max_disk_usage, // 10MB default limit
         current_disk_usage: Arc::new(Mutex::new(preload_size)),
-        write_buffer: Arc::new(Mutex::new(Vec::new())),
-        max_write_buffer: 1024,
+        sandbox_fs,
+        max_write_buffer: RuntimeConfig::get().write_buffer_size,
         id,
         next_port: Arc::new(Mutex::new(0)),
         network_queue: Arc::new(Mutex::new(Vec::new())),
-        nat_table: Arc::new(Mutex::new(NatTable::new())),
         args,
+        fuel: Arc::new(FuelStats::default()),
+        block_times: Arc::new(BlockTimes::default()),
     };
 
-    let thread_data = process_data.clone();
-    let thread = thread::Builder::new()
-        .name(format!("pid{}", id))
-        .spawn(move || {
-            let mut store = Store::new(&engine, thread_data);
-            // Set fuel (or other resource limits) as needed.
-            let _ = store.set_fuel(2_000_000);
-            let mut linker: Linker<ProcessData> = Linker::new(&engine);
-            if let Err(e) = wasi_syscalls::register(&mut linker) {
-                error!("Failed to register WASI syscalls: {:?}", e);
-                return;
-            }
-            debug!("WASI syscalls registered");
-
-            let instance = match linker.instantiate(&mut store, &module) {
-                Ok(inst) => inst,
-                Err(e) => {
-                    error!("Failed to instantiate module: {:?}", e);
-                    return;
-                }
-            };
-            debug!("WASM module instantiated");
-
-            // Wait until the scheduler sets the process state to Running.
-            {
-                let mut st = store.data().state.lock().unwrap();
-                while *st != ProcessState::Running {
-                    st = store.data().cond.wait(st).unwrap();
-                }
-            }
-
-            // Call the _start function.
-            let start_func = match instance.get_typed_func::<(), ()>(&mut store, "_start") {
-                Ok(func) => func,
-                Err(e) => {
-                    error!("Missing _start function: {:?}", e);
-                    return;
-                }
-            };
-            if let Err(e) = start_func.call(&mut store, ()) {
-                error!("Error executing wasm: {:?}", e);
-            }
-            // Mark process as Finished.
-            {
-                let mut s = store.data().state.lock().unwrap();
-                *s = ProcessState::Finished;
-            }
-            store.data().cond.notify_all();
-            debug!("Process {} marked as Finished", id);
-        })?;
+    let handle = spawn_guest(id, module, process_data.clone(), None)?;
 
     info!("Started process with id {}", id);
-    Ok(Process { id, thread, data: process_data })
+    Ok(Process { id, handle, data: process_data })
 }
 
 /// Spawns a new process from a WASM module and assigns it a unique ID.
@@ -238,17 +279,17 @@ pub fn start_process(
     args: Vec<String>,
 ) -> Result<Process> {
     debug!("Starting process with path: {:?} and id: {}", wasm_path, id);
-    let mut config = wasmtime::Config::new();
-    config.consume_fuel(true);
-    let engine = Engine::new(&config)?;
-    let module = Module::from_file(&engine, &wasm_path)?;
+    // File-mode guests are metered and trap after FILE_FUEL_LIMIT instructions.
+    let module = module_cache::load_metered(&fs::read(&wasm_path)?)?;
     debug!("WASM module loaded from path: {:?}", wasm_path);
 
-    // Create the sandbox directory in "wasi_sandbox/pid_<ID>"
+    // Create the sandbox in "wasi_sandbox/pid_<ID>"
     let sandbox_base = SANDBOX_ROOT.get().unwrap().clone();
-    let process_root_rel = sandbox_base.join(format!("pid_{}", id));
-    create_dir_all(&process_root_rel)?;
-    let process_root = fs::canonicalize(&process_root_rel)?;
+    let mut process_root = sandbox_base.join(format!("pid_{}", id));
+    let sandbox_fs = sandbox_fs::create(&process_root)?;
+    if process_root.exists() {
+        process_root = fs::canonicalize(&process_root)?;
+    }
     info!("Created sandbox for process {} at: {}", id, process_root.display());
 
     // Initialize process state and FD table
@@ -265,13 +306,14 @@ pub fn start_process(
             is_directory: false,
             is_preopen: false,
             host_path: None,
+            writer: None,
         });
     }
 
     // Optionally preload a directory
     if let Some(src_dir) = &preload_dir {
         if src_dir.exists() {
-            copy_dir_recursive(src_dir, &process_root)?;
+            sandbox_fs.lock().unwrap().preload(src_dir)?;
             info!("Preloaded {:?} into sandbox for process {}", src_dir, id);
         } else {
             error!("Preload directory {:?} does not exist", src_dir);
@@ -287,6 +329,7 @@ pub fn start_process(
             is_directory: true,
             is_preopen: true,
             host_path: Some(process_root.to_string_lossy().into_owned()),
+            writer: None,
         });
     }
 
@@ -298,93 +341,140 @@ pub fn start_process(
         root_path: process_root.clone(),
         max_disk_usage: max_disk_bytes,
         current_disk_usage: Arc::new(Mutex::new(0)),
-        write_buffer: Arc::new(Mutex::new(Vec::new())),
-        max_write_buffer: 1024,
+        sandbox_fs,
+        max_write_buffer: RuntimeConfig::get().write_buffer_size,
         id,
         next_port: Arc::new(Mutex::new(0)),
         network_queue: Arc::new(Mutex::new(Vec::new())),
-        nat_table: Arc::new(Mutex::new(NatTable::new())),
         args,
+        fuel: Arc::new(FuelStats::default()),
+        block_times: Arc::new(BlockTimes::default()),
     };
 
-    let process_data_clone = process_data.clone();
-    let thread = thread::Builder::new()
-        .name(format!("pid{}", id))
-        .spawn(move || {
-            // Catch any panic to ensure we remove the sandbox directory.
-            let result = std::panic::catch_unwind(AssertUnwindSafe(|| {
-                debug!(
-                    "Thread {:?} starting execution for process id: {}",
-                    thread::current().name().unwrap_or("unknown"),
-                    id
-                );
-                let mut store = Store::new(&engine, process_data_clone.clone());
-                let _ = store.set_fuel(2_000_000);
-
-                let mut linker: Linker<ProcessData> = Linker::new(&engine);
-                wasi_syscalls::register(&mut linker).expect("Failed to register WASI syscalls");
-                debug!("WASI syscalls registered for process {}", id);
-
-                // Instantiate the module
-                let instance = linker
-                    .instantiate(&mut store, &module)
-                    .expect("Failed to instantiate module");
-
-                debug!("Process {} instantiated; waiting for state=Running", id);
-                {
-                    let mut st = store.data().state.lock().unwrap();
-                    while *st != ProcessState::Running {
-                        st = store.data().cond.wait(st).unwrap();
-                    }
-                }
+    let handle = spawn_guest(id, module, process_data.clone(), Some(FILE_FUEL_LIMIT))?;
+
+    info!("Started process with id {}", id);
+    Ok(Process { id, handle, data: process_data })
+}
 
-                // Call _start
-                let start_func = instance
-                    .get_typed_func::<(), ()>(&mut store, "_start")
-                    .expect("Missing _start function");
+/// Sets up a Store for `module` and hands it to the configured executor.
+/// The guest does not run `_start` until the scheduler first sets it Running.
+/// With `fuel_limit` the guest traps once it has burnt that much fuel; its
+/// module must then be compiled for `module_cache::metered_engine()`.
+fn spawn_guest(id: u64, module: Module, process_data: ProcessData, fuel_limit: Option<u64>) -> Result<ProcessHandle> {
+    let engine = match fuel_limit {
+        Some(_) => module_cache::metered_engine(),
+        None => module_cache::engine(),
+    };
+    metrics::process_started(id, &process_data.fuel, &process_data.block_times);
+    match RuntimeConfig::get().executor {
+        ExecutorKind::Threads => {
+            let thread = thread::Builder::new()
+                .name(format!("pid{}", id))
+                .spawn(move || {
+                    // Catch any panic (proc_exit unwinds) so the scheduler always sees Finished.
+                    let result = std::panic::catch_unwind(AssertUnwindSafe(|| {
+                        let mut store = Store::new(engine, process_data.clone());
+                        if let Some(limit) = fuel_limit {
+                            if let Err(e) = store.set_fuel(limit) {
+                                error!("Failed to set fuel for process {}: {:?}", id, e);
+                                return;
+                            }
+                            process_data.fuel.budget.store(limit, Ordering::Relaxed);
+                        }
+                        let mut linker: Linker<ProcessData> = Linker::new(engine);
+                        if let Err(e) = wasi_syscalls::register(&mut linker) {
+                            error!("Failed to register WASI syscalls: {:?}", e);
+                            return;
+                        }
+                        debug!("WASI syscalls registered");
+
+                        let instance = match linker.instantiate(&mut store, &module) {
+                            Ok(inst) => inst,
+                            Err(e) => {
+                                error!("Failed to instantiate module: {:?}", e);
+                                return;
+                            }
+                        };
+                        debug!("WASM module instantiated");
+
+                        // Wait until the scheduler sets the process state to Running.
+                        executor::block_on(store.data().resumed());
+
+                        // Call the _start function.
+                        let start_func = match instance.get_typed_func::<(), ()>(&mut store, "_start") {
+                            Ok(func) => func,
+                            Err(e) => {
+                                error!("Missing _start function: {:?}", e);
+                                return;
+                            }
+                        };
+                        if let Err(e) = start_func.call(&mut store, ()) {
+                            error!("Error executing wasm: {:?}", e);
+                        }
+                        if let Ok(remaining) = store.get_fuel() {
+                            process_data.fuel.update(remaining);
+                        }
+                    }));
+
+                    // Mark process as Finished.
+                    {
+                        let mut s = process_data.state.lock().unwrap();
+                        *s = ProcessState::Finished;
+                    }
+                    process_data.cond.notify_all();
+                    debug!("Process {} marked as Finished", id);
 
-                if let Err(e) = start_func.call(&mut store, ()) {
-                    error!("Process {}: error executing _start: {:?}", id, e);
+                    if let Err(panic_payload) = result {
+                        std::panic::resume_unwind(panic_payload);
+                    }
+                })?;
+            Ok(ProcessHandle::Thread(thread))
+        }
+        ExecutorKind::Pooled => {
+            let fuel = process_data.fuel.clone();
+            let mut store = Store::new(engine, process_data);
+            let preempt = RuntimeConfig::get().fuel_preemption();
+            // Without a limit, never run dry; preemption suspends back to the scheduler every quantum.
+            if let Some(limit) = fuel_limit.or(preempt.then_some(u64::MAX)) {
+                store.set_fuel(limit)?;
+                fuel.budget.store(store.get_fuel()?, Ordering::Relaxed);
+            }
+            if preempt {
+                store.fuel_async_yield_interval(Some(RuntimeConfig::get().fuel_quantum))?;
+            }
+            let future = async move {
+                let mut linker: Linker<ProcessData> = Linker::new(engine);
+                if let Err(e) = wasi_syscalls::register(&mut linker) {
+                    error!("Failed to register WASI syscalls: {:?}", e);
+                    return;
                 }
 
-                // Mark finished
-                {
-                    let mut s = store.data().state.lock().unwrap();
-                    *s = ProcessState::Finished;
+                let instance = match linker.instantiate_async(&mut store, &module).await {
+                    Ok(inst) => inst,
+                    Err(e) => {
+                        error!("Failed to instantiate module: {:?}", e);
+                        return;
+                    }
+                };
+                debug!("WASM module instantiated for process {}", id);
+
+                let start_func = match instance.get_typed_func::<(), ()>(&mut store, "_start") {
+                    Ok(func) => func,
+                    Err(e) => {
+                        error!("Missing _start function: {:?}", e);
+                        return;
+                    }
+                };
+                if let Err(e) = start_func.call_async(&mut store, ()).await {
+                    error!("Error executing wasm: {:?}", e);
                 }
-                store.data().cond.notify_all();
-            }));
-
-            if let Err(panic_payload) = result {
-                // On panic, also remove the directory
-                error!("Process {} panicked! Cleaning up sandbox directory...", id);
-                {
-                    // Update process state to Finished so the scheduler knows it's done.
-                    let mut st = process_data_clone.state.lock().unwrap();
-                    *st = ProcessState::Finished;
+                if let Ok(remaining) = store.get_fuel() {
+                    fuel.update(remaining);
                 }
-                process_data_clone.cond.notify_all();
-                std::panic::resume_unwind(panic_payload);
-            }
-        })?;
-
-    info!("Started process with id {}", id);
-    Ok(Process { id, thread, data: process_data })
-}
-
-/// Recursively copy all files & subdirectories from `src` into `dst`.
-fn copy_dir_recursive(src: &Path, dst: &Path) -> std::io::Result<()> {
-    for entry in fs::read_dir(src)? {
-        let entry = entry?;
-        let file_type = entry.file_type()?;
-        let src_path = entry.path();
-        let dst_path = dst.join(entry.file_name());
-        if file_type.is_dir() {
-            fs::create_dir_all(&dst_path)?;
-            copy_dir_recursive(&src_path, &dst_path)?;
-        } else {
-            fs::copy(&src_path, &dst_path)?;
+                debug!("Process {} ran to completion", id);
+            };
+            Ok(ProcessHandle::Task(Arc::new(GuestTask::new(Box::pin(future)))))
         }
     }
-    Ok(())
 }
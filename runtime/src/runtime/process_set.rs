@@ -0,0 +1,73 @@
+use std::collections::HashMap;
+
+use crate::runtime::process::Process;
+
+/// Blocked processes indexed by pid, as handed to the consensus input.
+/// Applying a record marks the pid it touched with `wake`, so the scheduler
+/// only re-checks those processes instead of scanning every blocked one.
+pub struct ProcessSet {
+    procs: HashMap<u64, BlockedProcess>,
+    spawned: Vec<Process>,
+    woken: Vec<u64>,
+}
+
+struct BlockedProcess {
+    /// Order in which the process entered the blocked set; unblocking in
+    /// `seq` order keeps the ready queue in the same order on every replica.
+    seq: u64,
+    proc: Process,
+}
+
+impl ProcessSet {
+    pub fn new() -> Self {
+        ProcessSet {
+            procs: HashMap::new(),
+            spawned: Vec::new(),
+            woken: Vec::new(),
+        }
+    }
+
+    pub fn get(&self, pid: u64) -> Option<&Process> {
+        self.procs.get(&pid).map(|b| &b.proc)
+    }
+
+    /// Marks `pid` as affected by the current batch.
+    pub fn wake(&mut self, pid: u64) {
+        if self.procs.contains_key(&pid) {
+            self.woken.push(pid);
+        }
+    }
+
+    /// Adds a process created by an Init record; it starts out Ready.
+    pub fn spawn(&mut self, proc: Process) {
+        self.spawned.push(proc);
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.procs.is_empty()
+    }
+
+    pub fn len(&self) -> usize {
+        self.procs.len()
+    }
+
+    pub(crate) fn insert(&mut self, seq: u64, proc: Process) {
+        self.procs.insert(proc.id, BlockedProcess { seq, proc });
+    }
+
+    pub(crate) fn remove(&mut self, pid: u64) -> Option<Process> {
+        self.procs.remove(&pid).map(|b| b.proc)
+    }
+
+    pub(crate) fn seq_of(&self, pid: u64) -> Option<u64> {
+        self.procs.get(&pid).map(|b| b.seq)
+    }
+
+    pub(crate) fn take_woken(&mut self) -> Vec<u64> {
+        std::mem::take(&mut self.woken)
+    }
+
+    pub(crate) fn take_spawned(&mut self) -> Vec<Process> {
+        std::mem::take(&mut self.spawned)
+    }
+}
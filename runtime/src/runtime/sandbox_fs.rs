@@ -0,0 +1,194 @@
+use std::collections::HashMap;
+use std::fs::{self, File, OpenOptions};
+use std::io::{self, Write};
+use std::path::{Component, Path, PathBuf};
+use std::sync::{Arc, Mutex};
+
+use log::debug;
+
+use crate::runtime::config::{RuntimeConfig, SandboxFsKind};
+use crate::runtime::disk_index::DiskIndex;
+use crate::runtime::mem_fs::MemFs;
+use crate::runtime::preload;
+
+/// A process's sandbox storage, shared by its syscalls and the scheduler.
+pub type SharedFs = Arc<Mutex<Box<dyn SandboxFs>>>;
+
+/// What the fs syscalls need to know about a sandbox entry.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct FileStat {
+    pub is_dir: bool,
+    /// Content length of a file; 0 for directories.
+    pub len: u64,
+    /// Stable identifier within the sandbox, or 0 if the backend has none.
+    pub ino: u64,
+}
+
+/// Storage behind a process's files. Paths are host-style paths under the
+/// sandbox root, already resolved by `resolve`; the memory backend never
+/// touches them on the host. Every entry remembers what it was charged
+/// against the disk quota so removing it can give that back.
+pub trait SandboxFs: Send {
+    /// Fills the empty sandbox with the contents of the host directory `src`.
+    fn preload(&mut self, src: &Path) -> io::Result<()>;
+    fn stat(&self, path: &Path) -> io::Result<FileStat>;
+    fn read_file(&self, path: &Path) -> io::Result<Vec<u8>>;
+    /// Names of the direct children of a directory, in sorted order.
+    fn list_dir(&self, path: &Path) -> io::Result<Vec<String>>;
+    /// Creates an empty file; fails with `AlreadyExists` if `path` exists.
+    fn create_file(&mut self, path: &Path, charged: u64) -> io::Result<()>;
+    fn create_dir(&mut self, path: &Path, charged: u64) -> io::Result<()>;
+    fn append(&mut self, path: &Path, data: &[u8]) -> io::Result<()>;
+    /// Removes a file and returns what it was charged.
+    fn remove_file(&mut self, path: &Path) -> io::Result<u64>;
+    /// Removes an empty directory and returns what it was charged.
+    fn remove_dir(&mut self, path: &Path) -> io::Result<u64>;
+    /// An FD writing to `path` was closed; anything kept open for it can go.
+    fn release(&mut self, path: &Path);
+    /// Sum of what every entry was charged.
+    fn total_charged(&self) -> u64;
+    /// Frees the whole sandbox once its process has finished.
+    fn destroy(&mut self) -> io::Result<()>;
+}
+
+/// Creates the configured backend for a new sandbox rooted at `root`.
+pub fn create(root: &Path) -> io::Result<SharedFs> {
+    let fs: Box<dyn SandboxFs> = match RuntimeConfig::get().sandbox_fs {
+        SandboxFsKind::Host => Box::new(HostFs::create(root)?),
+        SandboxFsKind::Memory => Box::new(MemFs::new(root)),
+    };
+    Ok(Arc::new(Mutex::new(fs)))
+}
+
+/// Resolves the guest path `path` against the sandbox directory `dir`
+/// without consulting the host. `.` and `..` are applied lexically and a
+/// leading `/` means the sandbox root; a path that would climb above the
+/// root fails with EACCES. Sandboxes never contain symlinks (path_symlink
+/// is unsupported and preloads copy link targets), so this is also where
+/// the path would end up on the host.
+pub fn resolve(root: &Path, dir: &Path, path: &str) -> Result<PathBuf, i32> {
+    let mut rel = match dir.strip_prefix(root) {
+        Ok(rel) => rel.to_path_buf(),
+        Err(_) => return Err(13), // WASI_EACCES
+    };
+    for component in Path::new(path).components() {
+        match component {
+            Component::RootDir => rel = PathBuf::new(),
+            Component::CurDir => {}
+            Component::ParentDir => {
+                if !rel.pop() {
+                    return Err(13); // WASI_EACCES
+                }
+            }
+            Component::Normal(name) => rel.push(name),
+            Component::Prefix(_) => return Err(13),
+        }
+    }
+    Ok(root.join(rel))
+}
+
+/// Keeps each sandbox as a directory on the host, with a `DiskIndex` serving
+/// sizes and listings so those need no host syscalls.
+pub struct HostFs {
+    root: PathBuf,
+    index: DiskIndex,
+    /// Append handles of files with writes in flight, kept until their FD closes.
+    appenders: HashMap<PathBuf, File>,
+}
+
+impl HostFs {
+    pub fn create(root: &Path) -> io::Result<Self> {
+        fs::create_dir_all(root)?;
+        Ok(HostFs {
+            root: root.to_path_buf(),
+            index: DiskIndex::scan(root)?,
+            appenders: HashMap::new(),
+        })
+    }
+}
+
+impl SandboxFs for HostFs {
+    fn preload(&mut self, src: &Path) -> io::Result<()> {
+        preload::preload(src, &self.root)?;
+        // The only walk of the sandbox; the syscalls keep the index current after this.
+        self.index = DiskIndex::scan(&self.root)?;
+        Ok(())
+    }
+
+    fn stat(&self, path: &Path) -> io::Result<FileStat> {
+        if let Some(entry) = self.index.get(path) {
+            return Ok(FileStat { is_dir: entry.is_dir, len: entry.len, ino: 0 });
+        }
+        let metadata = fs::metadata(path)?;
+        Ok(FileStat { is_dir: metadata.is_dir(), len: if metadata.is_dir() { 0 } else { metadata.len() }, ino: 0 })
+    }
+
+    fn read_file(&self, path: &Path) -> io::Result<Vec<u8>> {
+        fs::read(path)
+    }
+
+    fn list_dir(&self, path: &Path) -> io::Result<Vec<String>> {
+        if let Some(names) = self.index.list_dir(path) {
+            return Ok(names);
+        }
+        let mut names = Vec::new();
+        for entry in fs::read_dir(path)? {
+            names.push(entry?.file_name().to_string_lossy().into_owned());
+        }
+        names.sort();
+        Ok(names)
+    }
+
+    fn create_file(&mut self, path: &Path, charged: u64) -> io::Result<()> {
+        OpenOptions::new().write(true).create_new(true).open(path)?;
+        self.index.created(path, false, charged);
+        Ok(())
+    }
+
+    fn create_dir(&mut self, path: &Path, charged: u64) -> io::Result<()> {
+        fs::create_dir(path)?;
+        self.index.created(path, true, charged);
+        Ok(())
+    }
+
+    fn append(&mut self, path: &Path, data: &[u8]) -> io::Result<()> {
+        let file = match self.appenders.get_mut(path) {
+            Some(file) => file,
+            None => {
+                // A preloaded file may still be a link into the shared base layer.
+                preload::make_private(path)?;
+                let file = OpenOptions::new().append(true).open(path)?;
+                self.appenders.entry(path.to_path_buf()).or_insert(file)
+            }
+        };
+        file.write_all(data)?;
+        self.index.appended(path, data.len() as u64);
+        Ok(())
+    }
+
+    fn remove_file(&mut self, path: &Path) -> io::Result<u64> {
+        fs::remove_file(path)?;
+        self.appenders.remove(path);
+        Ok(self.index.remove(path).map_or(0, |entry| entry.charged))
+    }
+
+    fn remove_dir(&mut self, path: &Path) -> io::Result<u64> {
+        // remove_dir only succeeds if the directory is empty
+        fs::remove_dir(path)?;
+        Ok(self.index.remove(path).map_or(0, |entry| entry.charged))
+    }
+
+    fn release(&mut self, path: &Path) {
+        self.appenders.remove(path);
+    }
+
+    fn total_charged(&self) -> u64 {
+        self.index.total_charged()
+    }
+
+    fn destroy(&mut self) -> io::Result<()> {
+        self.appenders.clear();
+        debug!("Removing sandbox {}", self.root.display());
+        fs::remove_dir_all(&self.root)
+    }
+}
@@ -2,15 +2,25 @@ use anyhow::Result;
 use crate::{
     consensus_input:: {process_consensus_file, process_consensus_pipe},
     runtime::{
+        checkpoint,
         clock::GlobalClock,
+        config::RuntimeConfig,
+        executor,
+        metrics::{self, RUNTIME},
         process::{BlockReason, Process, ProcessState},
-    }, wasi_syscalls::fs::flush_write_buffer_for_scheduler,
+        process_set::ProcessSet,
+    }, wasi_syscalls::fs::{flush_file_writers, flush_write_buffer_for_scheduler},
+};
+use std::{
+    cmp::Reverse,
+    collections::{BTreeMap, BinaryHeap, VecDeque},
+    sync::atomic::Ordering,
+    time::Instant,
 };
-use std::{collections::VecDeque, fs};
 use std::io::{Read, Write};
 use log::{debug, error, info};
 use std::thread;
-use crate::wasi_syscalls::net::OutgoingNetworkMessage;
+use crate::wasi_syscalls::net::{self, OutgoingNetworkMessage};
 use crate::runtime::fd_table::FDEntry;
 use std::io::BufReader;
 
@@ -27,205 +37,277 @@ impl BatchCollector {
         }
     }
 
-    fn collect_network_messages(&mut self, processes: &[Process]) {
-        for process in processes {
-            let mut queue = process.data.network_queue.lock().unwrap();
-            while let Some(msg) = queue.pop() {
-                self.outgoing_messages.push(msg);
+    /// Network operations are only queued while a process runs, so collect
+    /// them right after its slice instead of polling every queue per batch.
+    /// A send continuing the process's send from an earlier slice joins it.
+    fn collect_network_messages(&mut self, process: &Process) {
+        let limit = RuntimeConfig::get().send_coalesce_bytes;
+        let mut queue = process.data.network_queue.lock().unwrap();
+        for message in queue.drain(..) {
+            net::queue_coalesced(&mut self.outgoing_messages, message, limit);
+        }
+    }
+}
+
+/// Result of re-checking a blocked process against its block reason.
+enum UnblockCheck {
+    Unblock,
+    /// Still blocked; waits for a record to wake it.
+    Wait,
+    /// Still blocked and must be re-checked next round regardless (WriteIO flush).
+    Retry,
+}
+
+fn check_unblock(proc: &Process) -> UnblockCheck {
+    let reason = proc.data.block_reason.lock().unwrap().clone();
+    let unblocked = match reason {
+        Some(BlockReason::StdinRead) => {
+            let fd_table = proc.data.fd_table.lock().unwrap();
+            fd_table.has_pending_input(0)
+        }
+        Some(BlockReason::WriteIO(fd)) => {
+            match flush_write_buffer_for_scheduler(&proc.data, fd) {
+                Ok(_bytes) => true,  // Flushed successfully: unblock the process.
+                Err(_errno) => return UnblockCheck::Retry, // If flush fails, keep the process blocked.
+            }
+        }
+        Some(BlockReason::FileIO) => {
+            // For FileIO, immediately unblock the process
+            // This is used for simulating I/O wait for large file reads
+            debug!("Unblocking process {} that was waiting for FileIO", proc.id);
+            true
+        }
+        Some(BlockReason::Timeout { resume_after }) => GlobalClock::now() >= resume_after,
+        Some(BlockReason::NetworkIO) => {
+            let fd_table = proc.data.fd_table.lock().unwrap();
+            !fd_table.entries.iter().flatten().any(|entry| {
+                matches!(entry, FDEntry::Socket { state, buffer, .. } if state.blocks(buffer))
+            })
+        }
+        None => false,
+    };
+    if unblocked { UnblockCheck::Unblock } else { UnblockCheck::Wait }
+}
+
+/// Processes waiting on a block reason, plus the bookkeeping that decides
+/// which of them to re-check after a batch.
+struct Blocked {
+    set: ProcessSet,
+    // Timeout blockers keyed on (resume_after, seq, pid); stale entries are skipped.
+    timers: BinaryHeap<Reverse<(u64, u64, u64)>>,
+    // Blocked processes to check next round even without a wakeup, keyed by seq.
+    recheck: BTreeMap<u64, u64>,
+    // When each blocked process blocked, and the index of its reason, keyed by pid.
+    since: BTreeMap<u64, (Instant, usize)>,
+    next_seq: u64,
+}
+
+impl Blocked {
+    fn new() -> Self {
+        Blocked {
+            set: ProcessSet::new(),
+            timers: BinaryHeap::new(),
+            recheck: BTreeMap::new(),
+            since: BTreeMap::new(),
+            next_seq: 0,
+        }
+    }
+
+    fn block(&mut self, proc: Process) {
+        let seq = self.next_seq;
+        self.next_seq += 1;
+        let reason = proc.data.block_reason.lock().unwrap().clone();
+        if let Some(reason) = &reason {
+            self.since.insert(proc.id, (Instant::now(), reason.index()));
+        }
+        match reason {
+            Some(BlockReason::Timeout { resume_after }) => {
+                self.timers.push(Reverse((resume_after, seq, proc.id)));
+            }
+            // Give every other blocker one check after the next batch, since
+            // its condition may already hold (e.g. a send with no waiting flags).
+            _ => {
+                self.recheck.insert(seq, proc.id);
+            }
+        }
+        self.set.insert(seq, proc);
+    }
+
+    /// Moves every process this batch could have unblocked into `ready_queue`,
+    /// in the order they blocked.
+    fn unblock_into(&mut self, ready_queue: &mut VecDeque<Process>) {
+        let mut candidates = std::mem::take(&mut self.recheck);
+        for pid in self.set.take_woken() {
+            if let Some(seq) = self.set.seq_of(pid) {
+                candidates.insert(seq, pid);
+            }
+        }
+        let now = GlobalClock::now();
+        while let Some(&Reverse((resume_after, seq, pid))) = self.timers.peek() {
+            if resume_after > now {
+                break;
+            }
+            self.timers.pop();
+            if self.set.seq_of(pid) == Some(seq) {
+                candidates.insert(seq, pid);
+            }
+        }
+
+        for (seq, pid) in candidates {
+            let check = match self.set.get(pid) {
+                Some(proc) => check_unblock(proc),
+                None => continue,
+            };
+            match check {
+                UnblockCheck::Unblock => {
+                    let proc = self.set.remove(pid).unwrap();
+                    if let Some((since, reason)) = self.since.remove(&pid) {
+                        let blocked_for = since.elapsed();
+                        RUNTIME.block_time[reason].observe_duration(blocked_for);
+                        proc.data.block_times.0[reason].fetch_add(blocked_for.as_micros() as u64, Ordering::Relaxed);
+                    }
+                    {
+                        let mut st = proc.data.state.lock().unwrap();
+                        *st = ProcessState::Ready;
+                    }
+                    {
+                        let mut reason = proc.data.block_reason.lock().unwrap();
+                        *reason = None;
+                    }
+                    proc.data.cond.notify_all();
+                    info!("Process {} unblocked and moved to Ready queue.", proc.id);
+                    ready_queue.push_back(proc);
+                }
+                UnblockCheck::Retry => {
+                    self.recheck.insert(seq, pid);
+                }
+                UnblockCheck::Wait => {}
             }
         }
     }
 }
 
+/// Files a process that just gave up the CPU according to its new state.
+fn settle(
+    proc: Process,
+    ready_queue: &mut VecDeque<Process>,
+    blocked: &mut Blocked,
+    batch_collector: &mut BatchCollector,
+) {
+    batch_collector.collect_network_messages(&proc);
+
+    // Check new state and decide where to enqueue.
+    let current_state = { *proc.data.state.lock().unwrap() };
+    if current_state != ProcessState::Finished {
+        flush_file_writers(&proc.data);
+    }
+    match current_state {
+        ProcessState::Finished => {
+            if let Err(e) = proc.data.sandbox_fs.lock().unwrap().destroy() {
+                error!("Failed to remove sandbox of process {}: {}", proc.id, e);
+            }
+            checkpoint::process_finished(proc.id);
+            metrics::process_finished(proc.id);
+            if RuntimeConfig::get().fuel_preemption() {
+                info!(
+                    "Process {} used {} fuel over {} preemptions",
+                    proc.id,
+                    proc.data.fuel.consumed.load(Ordering::Relaxed),
+                    proc.data.fuel.preemptions.load(Ordering::Relaxed)
+                );
+            }
+            info!("Process {} finished and joined.", proc.id);
+            proc.join();
+        }
+        ProcessState::Ready => {
+            info!("Process {} yielded; moving it to Ready queue.", proc.id);
+            ready_queue.push_back(proc);
+        }
+        ProcessState::Blocked => {
+            info!("Process {} blocked; moving it to Blocked queue.", proc.id);
+            blocked.block(proc);
+        }
+        ProcessState::Running => {
+            error!("Process {} still Running unexpectedly.", proc.id);
+        }
+    }
+}
+
 /// A dynamic scheduler that runs indefinitely and uses a generic consensus function.
-/// The consensus function receives a mutable vector of processes (which may be new or blocked)
-/// and updates their state based on external input.
+/// The consensus function receives the blocked processes (and may spawn new ones),
+/// updates their state from external input and wakes the pids it touched. It is
+/// also told how many processes are still Ready, held back until it returns.
 pub fn run_scheduler_dynamic<F>(processes: Vec<Process>, mut consensus_input: F) -> Result<()>
 where
-    F: FnMut(&mut Vec<Process>, Vec<OutgoingNetworkMessage>) -> Result<bool>,
+    F: FnMut(&mut ProcessSet, Vec<OutgoingNetworkMessage>, usize) -> Result<bool>,
 {
     let mut ready_queue: VecDeque<Process> = processes.into();
-    let mut blocked_queue: VecDeque<Process> = VecDeque::new();
+    let mut blocked = Blocked::new();
     let mut has_more_input = true;
     let mut batch_collector = BatchCollector::new();
+    let parallel = RuntimeConfig::get().parallel;
+    let slices_per_batch = RuntimeConfig::get().slices_per_batch;
 
     debug!(
         "Dynamic scheduler running on thread: {}",
         thread::current().name().unwrap_or("scheduler")
     );
 
-    while has_more_input || !ready_queue.is_empty() || !blocked_queue.is_empty() {
-        // Process all ready processes.
-        while let Some(proc) = ready_queue.pop_front() {
-            {
-                // Set process state to Running and notify.
-                let mut st = proc.data.state.lock().unwrap();
-                *st = ProcessState::Running;
-                proc.data.cond.notify_all();
-                info!(
-                    "Process {} set to Running on thread: {}",
-                    proc.id,
-                    thread::current().name().unwrap_or("scheduler")
-                );
-            }
-
-            // Wait until the process is no longer Running.
-            {
-                let mut st = proc.data.state.lock().unwrap();
-                while *st == ProcessState::Running {
-                    debug!(
-                        "Dynamic scheduler waiting for process {} (state: {:?})",
-                        proc.id, *st
-                    );
-                    st = proc.data.cond.wait(st).unwrap();
+    while has_more_input || !ready_queue.is_empty() || !blocked.set.is_empty() {
+        // Give the Ready processes a bounded number of rounds, so a guest that
+        // keeps getting preempted (or yielding) can't hold back the next batch.
+        let mut rounds = 0;
+        while !ready_queue.is_empty() && rounds < slices_per_batch {
+            rounds += 1;
+            if parallel {
+                // Run every Ready process at once. Sandboxes share no state and only
+                // see consensus input between rounds, so settling them in pid order
+                // makes the outgoing batch independent of which one finished first.
+                let mut round: Vec<Process> = ready_queue.drain(..).collect();
+                debug!("Running {} processes concurrently", round.len());
+                executor::run_slices(&round);
+                round.sort_by_key(|proc| proc.id);
+                for proc in round {
+                    settle(proc, &mut ready_queue, &mut blocked, &mut batch_collector);
                 }
-            }
-
-            // Check new state and decide where to enqueue.
-            let current_state = { *proc.data.state.lock().unwrap() };
-            match current_state {
-                ProcessState::Finished => {
-                    let _ = proc.thread.join();
-                    if let Err(e) = fs::remove_dir_all(&proc.data.root_path) {
-                        error!("Failed to remove dir for process {}: {}", proc.id, e);
-                    }
-                    info!("Process {} finished and joined.", proc.id);
-                }
-                ProcessState::Ready => {
-                    info!("Process {} yielded; moving it to Ready queue.", proc.id);
-                    ready_queue.push_back(proc);
-                }
-                ProcessState::Blocked => {
-                    info!("Process {} blocked; moving it to Blocked queue.", proc.id);
-                    blocked_queue.push_back(proc);
-                }
-                ProcessState::Running => {
-                    error!("Process {} still Running unexpectedly.", proc.id);
+            } else {
+                // One slice for each process that was Ready when the round began.
+                for _ in 0..ready_queue.len() {
+                    let proc = ready_queue.pop_front().unwrap();
+                    info!(
+                        "Process {} set to Running on thread: {}",
+                        proc.id,
+                        thread::current().name().unwrap_or("scheduler")
+                    );
+                    // Run the process until it is no longer Running.
+                    executor::run_slice(&proc);
+                    settle(proc, &mut ready_queue, &mut blocked, &mut batch_collector);
                 }
             }
         }
 
-        // When no process is ready, try to update states via the consensus input.
-        if ready_queue.is_empty() {
-            if blocked_queue.is_empty() {
-                debug!("No processes in queue; waiting for consensus input.");
-                let mut new_processes = Vec::new();
-                batch_collector.collect_network_messages(&new_processes);
-                has_more_input = consensus_input(&mut new_processes, batch_collector.outgoing_messages.drain(..).collect())?;
-                ready_queue.extend(new_processes);
+        RUNTIME.ready.set(ready_queue.len() as i64);
+        RUNTIME.blocked.set(blocked.set.len() as i64);
 
-                if ready_queue.is_empty() && !has_more_input {
-                    info!("All processes finished and no more consensus input. Exiting scheduler.");
-                    break;
-                }
+        // Apply the next batch of consensus input.
+        debug!(
+            "{} processes blocked, {} still ready; waiting for consensus input.",
+            blocked.set.len(),
+            ready_queue.len()
+        );
+        has_more_input = consensus_input(
+            &mut blocked.set,
+            batch_collector.outgoing_messages.drain(..).collect(),
+            ready_queue.len(),
+        )?;
+        ready_queue.extend(blocked.set.take_spawned());
 
-                if ready_queue.is_empty() && has_more_input {
-                    // No sleep - continue immediately to process next batch
-                    continue;
-                }
-            } else {
-                // Combine blocked processes and update their states.
-                let mut all_processes: Vec<Process> = blocked_queue.drain(..).collect();
-                batch_collector.collect_network_messages(&all_processes);
-                has_more_input = consensus_input(&mut all_processes, batch_collector.outgoing_messages.drain(..).collect())?;
-                info!("All processes blocked; consensus input updated process states.");
-
-                // Re-split processes based on new state.
-                for proc in all_processes.into_iter() {
-                    let state = { *proc.data.state.lock().unwrap() };
-                    match state {
-                        ProcessState::Ready => ready_queue.push_back(proc),
-                        ProcessState::Blocked => blocked_queue.push_back(proc),
-                        ProcessState::Finished => {
-                            if let Err(e) = fs::remove_dir_all(&proc.data.root_path) {
-                                if e.kind() != std::io::ErrorKind::NotFound {
-                                    error!("Failed to remove dir for process {}: {}", proc.id, e);
-                                }
-                            }
-                            let _ = proc.thread.join();
-                            info!("Process {} finished and joined.", proc.id);
-                        }
-                        ProcessState::Running => {
-                            error!("Process {} still Running unexpectedly after consensus input.", proc.id);
-                        }
-                    }
-                }
-
-                // Try to unblock processes based on their block reasons.
-                let mut still_blocked = VecDeque::new();
-                while let Some(proc) = blocked_queue.pop_front() {
-                    let unblocked = {
-                        let reason = proc.data.block_reason.lock().unwrap().clone();
-                        match reason {
-                            Some(BlockReason::StdinRead) => {
-                                let fd_has_input = {
-                                    let fd_table = proc.data.fd_table.lock().unwrap();
-                                    fd_table.has_pending_input(0)
-                                };
-                                fd_has_input
-                            }
-                            Some(BlockReason::WriteIO(ref path)) => {
-                                match flush_write_buffer_for_scheduler(&proc.data, path) {
-                                    Ok(_bytes) => true,  // Flushed successfully: unblock the process.
-                                    Err(_errno) => false // If flush fails, keep the process blocked.
-                                }
-                            }
-                            Some(BlockReason::FileIO) => {
-                                // For FileIO, immediately unblock the process 
-                                // This is used for simulating I/O wait for large file reads
-                                debug!("Unblocking process {} that was waiting for FileIO", proc.id);
-                                true
-                            }
-                            Some(BlockReason::Timeout { resume_after }) => GlobalClock::now() >= resume_after,
-                            Some(BlockReason::NetworkIO) => {
-                                let nat_table = proc.data.nat_table.lock().unwrap();
-                                let fd_table = proc.data.fd_table.lock().unwrap();
-                                
-                                let mut should_block = false;
-                                for entry in fd_table.entries.iter() {
-                                    if let Some(FDEntry::Socket { local_port, buffer, is_listener, .. }) = entry {
-                                        if nat_table.is_waiting_for_accept(proc.id, *local_port) || 
-                                           (nat_table.is_waiting_for_recv(proc.id, *local_port) && buffer.is_empty()) ||
-                                           (*is_listener && !nat_table.has_port_mapping(proc.id, *local_port)) {
-                                            should_block = true;
-                                            break;
-                                        }
-                                    }
-                                }
-                                !should_block
-                            },
-                            _ => false,
-                        }
-                    };
-
-                    if unblocked {
-                        {
-                            let mut st = proc.data.state.lock().unwrap();
-                            *st = ProcessState::Ready;
-                        }
-                        {
-                            let mut reason = proc.data.block_reason.lock().unwrap();
-                            *reason = None;
-                        }
-                        proc.data.cond.notify_all();
-                        info!("Process {} unblocked and moved to Ready queue.", proc.id);
-                        ready_queue.push_back(proc);
-                    } else {
-                        still_blocked.push_back(proc);
-                    }
-                }
-                blocked_queue = still_blocked;
+        // Try to unblock the processes this batch could have affected.
+        blocked.unblock_into(&mut ready_queue);
 
-                if ready_queue.is_empty() && blocked_queue.is_empty() && !has_more_input {
-                    info!("All processes finished and no more consensus input. Exiting scheduler.");
-                    break;
-                }
-
-                if ready_queue.is_empty() {
-                    debug!("No processes unblocked; scheduler sleeping briefly.");
-                    //thread::sleep(Duration::from_millis(10));
-                }
-            }
+        if ready_queue.is_empty() && blocked.set.is_empty() && !has_more_input {
+            info!("All processes finished and no more consensus input. Exiting scheduler.");
+            break;
         }
     }
 
@@ -235,7 +317,7 @@ where
 
 
 pub fn run_scheduler_with_file(processes: Vec<Process>, consensus_file: &str) -> Result<()> {
-    run_scheduler_dynamic(processes, |processes, _| {
+    run_scheduler_dynamic(processes, |processes, _, _| {
         // Use the existing process_consensus_file function.
         process_consensus_file(consensus_file, processes)
     })
@@ -244,9 +326,9 @@ pub fn run_scheduler_with_file(processes: Vec<Process>, consensus_file: &str) ->
 // // /// Wrapper for interactive mode using a live consensus pipe/socket.
 pub fn run_scheduler_interactive<R: Read + Write>(processes: Vec<Process>, consensus_pipe: &mut R) -> Result<()> {
     let mut reader = BufReader::new(consensus_pipe);
-    run_scheduler_dynamic(processes, |processes, outgoing_messages| {
+    run_scheduler_dynamic(processes, |processes, outgoing_messages, ready| {
         // Process pipe should keep running indefinitely
-        process_consensus_pipe(&mut reader, processes, outgoing_messages)?;
+        process_consensus_pipe(&mut reader, processes, outgoing_messages, ready)?;
         Ok(true) // Always return true for pipe mode to keep scheduler running
     })
 }
\ No newline at end of file
@@ -0,0 +1,78 @@
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+
+use crate::runtime::config::RuntimeConfig;
+use crate::runtime::metrics;
+
+/// Most batch latencies kept for percentiles; later batches still count
+/// towards the totals.
+const MAX_SAMPLES: usize = 1 << 20;
+
+/// Exact batch latencies for benchmark runs, kept only with
+/// `REPLICODE_STATS=1`; hostcall costs come from `metrics`.
+struct Stats {
+    started: Option<Instant>,
+    batches: u64,
+    records: u64,
+    /// Time spent applying each batch's records, in microseconds.
+    apply_us: Vec<u64>,
+}
+
+static STATS: Mutex<Stats> = Mutex::new(Stats {
+    started: None,
+    batches: 0,
+    records: 0,
+    apply_us: Vec::new(),
+});
+
+pub fn enabled() -> bool {
+    RuntimeConfig::get().stats
+}
+
+/// Records that a batch of `records` records was applied in `elapsed`,
+/// not counting the time spent waiting for it to arrive.
+pub fn batch_applied(records: usize, elapsed: Duration) {
+    if !enabled() {
+        return;
+    }
+    let mut stats = STATS.lock().unwrap();
+    stats.started.get_or_insert_with(|| Instant::now() - elapsed);
+    stats.batches += 1;
+    stats.records += records as u64;
+    if stats.apply_us.len() < MAX_SAMPLES {
+        stats.apply_us.push(elapsed.as_micros() as u64);
+    }
+}
+
+fn percentile(sorted: &[u64], p: f64) -> u64 {
+    if sorted.is_empty() {
+        return 0;
+    }
+    let rank = ((sorted.len() - 1) as f64 * p).round() as usize;
+    sorted[rank]
+}
+
+/// Prints the counters to stderr in a `key value` form the workload
+/// driver can parse. Does nothing unless stats are enabled.
+pub fn report() {
+    if !enabled() {
+        return;
+    }
+    let stats = STATS.lock().unwrap();
+    let elapsed = stats.started.map_or(Duration::ZERO, |t| t.elapsed());
+    let mut apply = stats.apply_us.clone();
+    apply.sort_unstable();
+
+    eprintln!("stats batches {}", stats.batches);
+    eprintln!("stats records {}", stats.records);
+    eprintln!("stats elapsed_ms {:.1}", elapsed.as_secs_f64() * 1e3);
+    if elapsed > Duration::ZERO {
+        eprintln!("stats records_per_sec {:.0}", stats.records as f64 / elapsed.as_secs_f64());
+    }
+    for (label, p) in [("p50", 0.5), ("p90", 0.9), ("p99", 0.99), ("max", 1.0)] {
+        eprintln!("stats apply_us_{} {}", label, percentile(&apply, p));
+    }
+    for (name, calls, total_ns) in metrics::hostcall_totals() {
+        eprintln!("stats hostcall {} calls {} ns_per_call {}", name, calls, total_ns / calls.max(1));
+    }
+}
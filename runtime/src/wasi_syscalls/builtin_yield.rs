@@ -3,7 +3,7 @@ use crate::runtime::process::{ProcessData, ProcessState};
 use log::{info, debug};
 
 #[allow(non_snake_case)]
-pub fn wasi__builtin_rt_yield(caller: Caller<'_, ProcessData>) {
+pub async fn wasi__builtin_rt_yield(caller: Caller<'_, ProcessData>) {
     {
         let mut st = caller.data().state.lock().unwrap();
         if *st == ProcessState::Running {
@@ -17,11 +17,8 @@ pub fn wasi__builtin_rt_yield(caller: Caller<'_, ProcessData>) {
         debug!("wasi__builtin_rt_yield: Notified the scheduler");
     }
 
-    // Now wait until the state changes.
-    let mut state = caller.data().state.lock().unwrap();
-    while *state == ProcessState::Ready {
-        debug!("wasi__builtin_rt_yield: Waiting for state to change from Ready");
-        state = caller.data().cond.wait(state).unwrap();
-    }
-    debug!("wasi__builtin_rt_yield: State changed to {:?}", *state);
+    // Now wait until the scheduler runs us again.
+    debug!("wasi__builtin_rt_yield: Waiting for state to change from Ready");
+    caller.data().resumed().await;
+    debug!("wasi__builtin_rt_yield: Resumed");
 }
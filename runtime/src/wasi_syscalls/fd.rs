@@ -1,5 +1,7 @@
 use wasmtime::{Caller, Extern};
 use std::convert::TryInto;
+use std::ops::Range;
+use std::sync::Arc;
 use crate::runtime::process::{BlockReason, ProcessData, ProcessState};
 use crate::runtime::clock::GlobalClock;
 use crate::runtime::fd_table::FDEntry;
@@ -131,126 +133,97 @@ pub fn wasi_fd_seek(
     0 // Success
 }
 
-pub fn wasi_fd_read(
+/// Reads the guest's iovec array at `iovs` and returns the memory range
+/// each entry describes, checking every range against `mem`.
+pub(crate) fn guest_iovecs(mem: &[u8], iovs: i32, iovs_len: i32) -> Option<Vec<Range<usize>>> {
+    let mut ranges = Vec::with_capacity(iovs_len.max(0) as usize);
+    for i in 0..iovs_len {
+        let iovec_addr = (iovs as usize) + (i as usize) * 8;
+        if iovec_addr + 8 > mem.len() {
+            error!("iovec out of bounds");
+            return None;
+        }
+        let offset_bytes: [u8; 4] = mem[iovec_addr..iovec_addr + 4].try_into().unwrap();
+        let len_bytes: [u8; 4] = mem[iovec_addr + 4..iovec_addr + 8].try_into().unwrap();
+        let offset = u32::from_le_bytes(offset_bytes) as usize;
+        let len = u32::from_le_bytes(len_bytes) as usize;
+        if offset + len > mem.len() {
+            error!("data slice out of bounds");
+            return None;
+        }
+        ranges.push(offset..offset + len);
+    }
+    Some(ranges)
+}
+
+pub async fn wasi_fd_read(
     mut caller: Caller<'_, ProcessData>,
     fd: i32,
     iovs: i32,
     iovs_len: i32,
     nread: i32,
 ) -> i32 {
+    let memory = match caller.get_export("memory") {
+        Some(Extern::Memory(mem)) => mem,
+        _ => {
+            error!("fd_read: Failed to find memory export");
+            return 1;
+        }
+    };
+    let fd_table = Arc::clone(&caller.data().fd_table);
     loop {
-        let (data_to_read, _) = {
-            let process_data = caller.data();
-            let mut table = process_data.fd_table.lock().unwrap();
+        let pending = {
+            let mut table = fd_table.lock().unwrap();
             match table.get_fd_entry_mut(fd) {
-                Some(FDEntry::File { buffer, read_ptr, .. }) => {
-                    if *read_ptr >= buffer.len() {
-                        drop(table);
-                        block_process_for_stdin(&mut caller);
-                        continue;
-                    }
-                    let available_data = &buffer[*read_ptr..];
-                    (available_data.to_vec(), available_data.len())
-                }
+                Some(FDEntry::File { buffer, read_ptr, .. }) => *read_ptr < buffer.len(),
                 _ => {
                     error!("fd_read called with invalid FD: {}", fd);
                     return 1;
                 }
             }
         };
+        if !pending {
+            block_process_for_stdin(&mut caller).await;
+            continue;
+        }
 
-        // At this point, data is available, so proceed to copy it into the WASM memory.
-        let memory = match caller.get_export("memory") {
-            Some(Extern::Memory(mem)) => mem,
-            _ => {
-                error!("fd_read: Failed to find memory export");
-                return 1;
-            }
+        // Data is available: scatter it from the FD buffer straight into the
+        // guest's iovecs, with the table locked so the buffer can't change.
+        let mut table = fd_table.lock().unwrap();
+        let Some(FDEntry::File { buffer, read_ptr, .. }) = table.get_fd_entry_mut(fd) else {
+            return 1;
         };
-
-        let total_read = {
-            // First, determine how many bytes will be read using the iovecs.
-            let mut total = 0;
-            {
-                let data = memory.data(&caller);
-                for i in 0..iovs_len {
-                    let iovec_addr = (iovs as usize) + (i as usize) * 8;
-                    if iovec_addr + 8 > data.len() {
-                        error!("iovec out of bounds");
-                        return 1;
-                    }
-                    let offset_bytes: [u8; 4] = data[iovec_addr..iovec_addr + 4].try_into().unwrap();
-                    let len_bytes: [u8; 4] = data[iovec_addr + 4..iovec_addr + 8].try_into().unwrap();
-                    let offset = u32::from_le_bytes(offset_bytes) as usize;
-                    let len = u32::from_le_bytes(len_bytes) as usize;
-                    if offset + len > data.len() {
-                        error!("data slice out of bounds");
-                        return 1;
-                    }
-                    let to_copy = std::cmp::min(len, data_to_read.len() - total);
-                    if to_copy == 0 {
-                        break;
-                    }
-                    total += to_copy;
-                    if total >= data_to_read.len() {
-                        break;
-                    }
-                }
-            }
-
-            // Now actually write the data into the WASM memory.
-            let data_mut = memory.data_mut(&mut caller);
-            let mut total = 0;
-            for i in 0..iovs_len {
-                let iovec_addr = (iovs as usize) + (i as usize) * 8;
-                if iovec_addr + 8 > data_mut.len() {
-                    error!("iovec out of bounds");
-                    return 1;
-                }
-                let offset_bytes: [u8; 4] = data_mut[iovec_addr..iovec_addr + 4].try_into().unwrap();
-                let len_bytes: [u8; 4] = data_mut[iovec_addr + 4..iovec_addr + 8].try_into().unwrap();
-                let offset = u32::from_le_bytes(offset_bytes) as usize;
-                let len = u32::from_le_bytes(len_bytes) as usize;
-                if offset + len > data_mut.len() {
-                    error!("data slice out of bounds");
-                    return 1;
-                }
-                let to_copy = std::cmp::min(len, data_to_read.len() - total);
-                if to_copy == 0 {
-                    break;
-                }
-                data_mut[offset..offset + to_copy]
-                    .copy_from_slice(&data_to_read[total..total + to_copy]);
-                total += to_copy;
-                if total >= data_to_read.len() {
-                    break;
-                }
-            }
-            // Write the total number of bytes read into memory.
-            let total_read_bytes = (total as u32).to_le_bytes();
-            let nread_ptr = nread as usize;
-            if nread_ptr + 4 > data_mut.len() {
-                error!("nread pointer out of bounds");
-                return 1;
-            }
-            data_mut[nread_ptr..nread_ptr + 4].copy_from_slice(&total_read_bytes);
-            total
+        let data_mut = memory.data_mut(&mut caller);
+        let Some(iovecs) = guest_iovecs(data_mut, iovs, iovs_len) else {
+            return 1;
         };
-
-        // After reading, update the FD's read pointer by the actual bytes read
-        {
-            let process_data = caller.data();
-            let mut table = process_data.fd_table.lock().unwrap();
-            if let Some(FDEntry::File { read_ptr, .. }) = table.get_fd_entry_mut(fd) {
-                *read_ptr += total_read;
+        let mut total = 0;
+        for iov in iovecs {
+            let available = &buffer[*read_ptr + total..];
+            let to_copy = std::cmp::min(iov.len(), available.len());
+            if to_copy == 0 {
+                break;
             }
+            data_mut[iov.start..iov.start + to_copy].copy_from_slice(&available[..to_copy]);
+            total += to_copy;
+        }
+
+        // Write the total number of bytes read into memory.
+        let nread_ptr = nread as usize;
+        if nread_ptr + 4 > data_mut.len() {
+            error!("nread pointer out of bounds");
+            return 1;
         }
+        data_mut[nread_ptr..nread_ptr + 4].copy_from_slice(&(total as u32).to_le_bytes());
+
+        // Advance the FD's read pointer by the bytes actually read
+        *read_ptr += total;
         return 0;
     }
 }
 
 /// Blocks the process, telling the scheduler we're waiting on stdin.
-fn block_process_for_stdin(caller: &mut Caller<'_, ProcessData>) {
+async fn block_process_for_stdin(caller: &mut Caller<'_, ProcessData>) {
     {
         let mut st = caller.data().state.lock().unwrap();
         if *st == ProcessState::Running {
@@ -264,10 +237,7 @@ fn block_process_for_stdin(caller: &mut Caller<'_, ProcessData>) {
     }
 
     // Now wait until the state changes.
-    let mut state = caller.data().state.lock().unwrap();
-    while *state != ProcessState::Running {
-        state = caller.data().cond.wait(state).unwrap();
-    }
+    caller.data().resumed().await;
 }
 
 pub fn wasi_fd_prestat_get(
@@ -358,7 +328,7 @@ pub fn wasi_fd_prestat_dir_name(
 
 
 
-pub fn wasi_poll_oneoff(
+pub async fn wasi_poll_oneoff(
     mut caller: Caller<'_, ProcessData>,
     subscriptions_ptr: i32,
     events_ptr: i32,
@@ -423,12 +393,7 @@ pub fn wasi_poll_oneoff(
     }
 
     // Wait until the scheduler unblocks the process.
-    {
-        let mut state = caller.data().state.lock().unwrap();
-        while *state != ProcessState::Running {
-            state = caller.data().cond.wait(state).unwrap();
-        }
-    } // Lock on state is dropped here.
+    caller.data().resumed().await;
 
     // After unblocking, check which subscriptions have reached their wake time.
     let current_time = GlobalClock::now();
@@ -38,6 +38,11 @@ pub fn wasi_fd_datasync(
         return Ok(8); // WASI_EBADF
     }
     match &table.entries[fd as usize] {
+        // Push buffered writes out to the host file
+        Some(FDEntry::File { writer: Some(writer), .. }) => match writer.lock().unwrap().flush(process_data.sandbox_fs.lock().unwrap().as_mut()) {
+            Ok(_) => Ok(0),
+            Err(_) => Ok(29), // WASI_EIO
+        },
         Some(_) => Ok(0), // Success - no-op since we're working with in-memory files
         None => Ok(8), // WASI_EBADF
     }
@@ -256,6 +261,11 @@ pub fn wasi_fd_sync(
         return Ok(8); // WASI_EBADF
     }
     match &table.entries[fd as usize] {
+        // Push buffered writes out to the host file
+        Some(FDEntry::File { writer: Some(writer), .. }) => match writer.lock().unwrap().flush(process_data.sandbox_fs.lock().unwrap().as_mut()) {
+            Ok(_) => Ok(0),
+            Err(_) => Ok(29), // WASI_EIO
+        },
         Some(_) => Ok(0), // Success - no-op since we're working with in-memory files
         None => Ok(8), // WASI_EBADF
     }
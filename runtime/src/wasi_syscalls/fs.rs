@@ -1,13 +1,16 @@
-use std::fs;
-use std::fs::OpenOptions;
 use std::io;
+use std::ops::Range;
 use std::path::Path;
+use std::sync::{Arc, Mutex};
 use log::{error, debug};
 use wasmtime::{Caller, Extern};
 use std::io::Write;
 
 use crate::runtime::process::{ProcessData, ProcessState, BlockReason};
-use crate::runtime::fd_table::{FDEntry};
+use crate::runtime::fd_table::{FDEntry, FileWriter};
+use crate::runtime::sandbox_fs::resolve;
+use crate::runtime::digest;
+use crate::wasi_syscalls::fd::guest_iovecs;
 const WASI_ERRNO_NOSPC: i32 = 28;  // __WASI_ERRNO_NOSPC
 const WASI_ERRNO_NOSYS: i32 = 52;  // __WASI_ERRNO_NOSYS
 
@@ -23,7 +26,7 @@ fn io_err_to_wasi_errno(e: &io::Error) -> i32 {
 }
 
 /// If you want to block for file I/O
-fn block_process_for_fileio(caller: &mut Caller<'_, ProcessData>) {
+async fn block_process_for_fileio(caller: &mut Caller<'_, ProcessData>) {
     let process_id = caller.data().id;
     {
         let mut state = caller.data().state.lock().unwrap();
@@ -35,13 +38,25 @@ fn block_process_for_fileio(caller: &mut Caller<'_, ProcessData>) {
         *reason = Some(BlockReason::FileIO);
         caller.data().cond.notify_all();
     }
-    let mut state = caller.data().state.lock().unwrap();
-    while *state != ProcessState::Running {
-        state = caller.data().cond.wait(state).unwrap();
-    }
+    caller.data().resumed().await;
     println!("Process {}: Resuming after FileIO block.", process_id);
 }
 
+/// Blocks until the scheduler has flushed the write buffer of `fd`.
+async fn block_process_for_writeio(caller: &mut Caller<'_, ProcessData>, fd: i32) {
+    {
+        let mut state = caller.data().state.lock().unwrap();
+        *state = ProcessState::Blocked;
+    }
+    {
+        let mut reason = caller.data().block_reason.lock().unwrap();
+        // Save the FD in the block reason.
+        *reason = Some(BlockReason::WriteIO(fd));
+    }
+    caller.data().cond.notify_all();
+    caller.data().resumed().await;
+}
+
 // ----------------------------------------------------------------------------
 // Disk-usage tracking support
 // ----------------------------------------------------------------------------
@@ -77,21 +92,9 @@ fn usage_sub(caller: &mut Caller<'_, ProcessData>, bytes: u64) {
     *usage = usage.saturating_sub(bytes);
 }
 
-/// If you remove a directory, or some other operation, and need to figure out how many
-/// bytes were in that directory, you can do a quick naive walk:
-pub fn get_dir_size(path: &Path) -> io::Result<u64> {
-    let mut size = 0;
-    for entry in fs::read_dir(path)? {
-        let entry = entry?;
-        let metadata = entry.metadata()?;
-        if metadata.is_dir() {
-            size += get_dir_size(&entry.path())?;
-        } else {
-            size += metadata.len();
-        }
-    }
-    Ok(size)
-}
+/// Charged for each directory. A constant rather than the host's directory
+/// size, so every replica and both sandbox backends agree on usage.
+const DIR_OVERHEAD: u64 = 4096;
 
 // ----------------------------------------------------------------------------
 // File/directory ops below
@@ -104,11 +107,13 @@ pub fn wasi_fd_filestat_get(
     buf_ptr: u32,
 ) -> anyhow::Result<u32> {
     debug!("wasi_fd_filestat_get: fd={}, buf_ptr={}", fd, buf_ptr);
+    flush_file_writers(caller.data());
     
     // Get FD entry
     let (size, filetype) = {
         let process_data = caller.data();
         let table = process_data.fd_table.lock().unwrap();
+        let sandbox_fs = process_data.sandbox_fs.lock().unwrap();
         debug!("wasi_fd_filestat_get: checking fd {} in table with {} entries", fd, table.entries.len());
         
         if fd as usize >= table.entries.len() {
@@ -127,15 +132,11 @@ pub fn wasi_fd_filestat_get(
                 } else {
                     match host_path {
                         Some(path) => {
-                            debug!("wasi_fd_filestat_get: buffer empty, trying metadata for {}", path);
-                            match std::fs::metadata(path) {
-                                Ok(metadata) => {
-                                    let size = metadata.len();
-                                    debug!("wasi_fd_filestat_get: got metadata size {}", size);
-                                    size
-                                },
+                            debug!("wasi_fd_filestat_get: buffer empty, using sandbox size of {}", path);
+                            match sandbox_fs.stat(Path::new(path)) {
+                                Ok(stat) => stat.len,
                                 Err(e) => {
-                                    debug!("wasi_fd_filestat_get: metadata error: {}", e);
+                                    debug!("wasi_fd_filestat_get: stat error: {}", e);
                                     return Ok(8); // WASI_EBADF
                                 }
                             }
@@ -213,6 +214,7 @@ pub fn wasi_path_unlink_file(
     use wasmtime::Extern;
     use log::error;
 
+    flush_file_writers(caller.data());
     let memory = match caller.get_export("memory") {
         Some(Extern::Memory(mem)) => mem,
         _ => {
@@ -237,48 +239,25 @@ pub fn wasi_path_unlink_file(
     };
 
     let root_path = caller.data().root_path.clone();
-    let joined = root_path.join(path_str.trim_start_matches('/'));
-    
-    // Canonicalize paths for security check
-    let canonical_root = match root_path.canonicalize() {
-        Ok(c) => c,
-        Err(e) => {
-            error!("path_unlink_file: failed to canonicalize root path: {}", e);
-            return io_err_to_wasi_errno(&e);
-        }
-    };
-    
-    let canonical = match joined.canonicalize() {
-        Ok(c) => c,
-        Err(e) => {
-            error!("path_unlink_file: canonicalize error: {}", e);
-            return 2;
-        }
-    };
-    
-    if !canonical.starts_with(&canonical_root) {
-        error!("path_unlink_file: attempt to escape sandbox root!");
-        return 13;
-    }
-
-    // NEW: get the file size before removing
-    let file_size = match fs::metadata(&canonical) {
-        Ok(m) => m.len(),
-        Err(e) => {
-            error!("path_unlink_file: metadata error: {}", e);
-            return io_err_to_wasi_errno(&e);
+    let path = match resolve(&root_path, &root_path, path_str) {
+        Ok(path) => path,
+        Err(errno) => {
+            error!("path_unlink_file: attempt to escape sandbox root!");
+            return errno;
         }
     };
 
     // remove the file
-    match fs::remove_file(&canonical) {
-        Ok(_) => {
-            // Decrement usage
-            usage_sub(&mut caller, file_size);
+    let sandbox_fs = caller.data().sandbox_fs.clone();
+    let removed = sandbox_fs.lock().unwrap().remove_file(&path);
+    match removed {
+        Ok(charged) => {
+            // Give back what it was charged when it was created and written
+            usage_sub(&mut caller, charged);
             0
         }
         Err(e) => {
-            error!("path_unlink_file: failed to unlink: {}", e);
+            error!("path_unlink_file: failed: {}", e);
             io_err_to_wasi_errno(&e)
         }
     }
@@ -317,44 +296,21 @@ pub fn wasi_path_remove_directory(
     };
 
     let root_path = caller.data().root_path.clone();
-    let joined = root_path.join(path_str.trim_start_matches('/'));
-    
-    // Canonicalize paths for security check
-    let canonical_root = match root_path.canonicalize() {
-        Ok(c) => c,
-        Err(e) => {
-            error!("path_remove_directory: failed to canonicalize root path: {}", e);
-            return io_err_to_wasi_errno(&e);
-        }
-    };
-    
-    let canonical = match joined.canonicalize() {
-        Ok(c) => c,
-        Err(e) => {
-            error!("path_remove_directory: canonicalize error: {}", e);
-            return 2;
-        }
-    };
-    
-    if !canonical.starts_with(&canonical_root) {
-        error!("path_remove_directory: attempt to escape sandbox root!");
-        return 13;
-    }
-
-    // NEW: compute how many bytes were in that directory
-    let dir_size = match get_dir_size(&canonical) {
-        Ok(s) => s,
-        Err(e) => {
-            error!("path_remove_directory: cannot compute dir size: {}", e);
-            return io_err_to_wasi_errno(&e);
+    let path = match resolve(&root_path, &root_path, path_str) {
+        Ok(path) => path,
+        Err(errno) => {
+            error!("path_remove_directory: attempt to escape sandbox root!");
+            return errno;
         }
     };
 
-    // remove the directory
-    match fs::remove_dir(&canonical) {
-        Ok(_) => {
-            // Decrement usage
-            usage_sub(&mut caller, dir_size);
+    // remove the directory (only succeeds if it is empty)
+    let sandbox_fs = caller.data().sandbox_fs.clone();
+    let removed = sandbox_fs.lock().unwrap().remove_dir(&path);
+    match removed {
+        Ok(charged) => {
+            // Give back what it was charged when it was created and written
+            usage_sub(&mut caller, charged);
             0
         }
         Err(e) => {
@@ -397,63 +353,24 @@ pub fn wasi_path_create_directory(
     };
 
     let root_path = caller.data().root_path.clone();
-    
-    // Join the requested path to the root path
-    let joined = root_path.join(path_str.trim_start_matches('/'));
-    
-    // For security check, we need to canonicalize existing paths or ensure joined path is valid
-    // First, check if the parent of joined exists and can be canonicalized
-    let parent_path = joined.parent().unwrap_or(&joined);
-    if parent_path.exists() {
-        let canonical_parent = match parent_path.canonicalize() {
-            Ok(c) => c,
-            Err(e) => {
-                error!("path_create_directory: failed to canonicalize parent path: {}", e);
-                return io_err_to_wasi_errno(&e);
-            }
-        };
-        
-        // Canonicalize the root path
-        let canonical_root = match root_path.canonicalize() {
-            Ok(c) => c,
-            Err(e) => {
-                error!("path_create_directory: failed to canonicalize root path: {}", e);
-                return io_err_to_wasi_errno(&e);
-            }
-        };
-        
-        // Check if the parent is within the sandbox
-        if !canonical_parent.starts_with(&canonical_root) {
-            error!("path_create_directory: attempt to escape sandbox root. parent path: {:?}, canonical root: {:?}", canonical_parent, canonical_root);
-            return 13;
+    let path = match resolve(&root_path, &root_path, path_str) {
+        Ok(path) => path,
+        Err(errno) => {
+            error!("path_create_directory: attempt to escape sandbox root");
+            return errno;
         }
-    } else {
-        // If parent doesn't exist, we can just do a simple string-based check
-        // Convert both to string and check if joined starts with root_path
-        let root_str = root_path.to_string_lossy().to_string();
-        let joined_str = joined.to_string_lossy().to_string();
-        
-        if !joined_str.starts_with(&root_str) {
-            error!("path_create_directory: attempt to escape sandbox root with non-existent path");
-            return 13;
-        }
-    }
+    };
 
-    // At this point, we've determined the path is safe to create
-    match fs::create_dir(&joined) {
-        Ok(_) => {
-            // For a directory, you can count a small overhead. 
-            // Or do metadata().len(). Let's do that:
-            let dir_metadata_size = match fs::metadata(&joined) {
-                Ok(md) => md.len(),
-                Err(_) => 4096, // fallback
-            };
-            if let Err(errno) = usage_add(&mut caller, dir_metadata_size) {
-                return errno; // process got killed
-            }
-            0
-        }
+    // Charge the directory first; creation is undone by giving it back.
+    if let Err(errno) = usage_add(&mut caller, DIR_OVERHEAD) {
+        return errno;
+    }
+    let sandbox_fs = caller.data().sandbox_fs.clone();
+    let created = sandbox_fs.lock().unwrap().create_dir(&path, DIR_OVERHEAD);
+    match created {
+        Ok(()) => 0,
         Err(e) => {
+            usage_sub(&mut caller, DIR_OVERHEAD);
             error!("path_create_directory: failed: {}", e);
             io_err_to_wasi_errno(&e)
         }
@@ -485,6 +402,15 @@ pub fn wasi_fd_close(caller: Caller<'_, ProcessData>, fd: i32) -> i32 {
         eprintln!("fd_close: invalid fd {}", fd);
         return 8; // e.g., WASI_EBADF
     }
+    if let Some(Some(FDEntry::File { writer: Some(writer), .. })) = table.entries.get(fd as usize) {
+        let mut writer = writer.lock().unwrap();
+        let mut sandbox_fs = process_data.sandbox_fs.lock().unwrap();
+        if let Err(e) = writer.flush(sandbox_fs.as_mut()) {
+            error!("fd_close: failed to flush fd {}: {}", fd, e);
+            return io_err_to_wasi_errno(&e);
+        }
+        sandbox_fs.release(Path::new(writer.host_path()));
+    }
     table.deallocate_fd(fd);
     0
 }
@@ -494,7 +420,7 @@ pub fn wasi_fd_close(caller: Caller<'_, ProcessData>, fd: i32) -> i32 {
 ///
 /// This version ensures that all file operations are restricted to the
 /// process's `root_path`.
-pub fn wasi_path_open(
+pub async fn wasi_path_open(
     mut caller: Caller<'_, ProcessData>,
     _dirfd: i32,      // not used in this simplified implementation
     _dirflags: i32,   // not used
@@ -510,6 +436,7 @@ pub fn wasi_path_open(
         "path_open: oflags={}, opened_fd_out={}",
         oflags, opened_fd_out
     );
+    flush_file_writers(caller.data());
 
     // 1) Extract path string from WASM memory.
     let memory = match caller.get_export("memory") {
@@ -535,159 +462,89 @@ pub fn wasi_path_open(
     };
     println!("path_open: requested path: '{}'", path_str);
 
-    // 2) Get sandbox (fake root) from ProcessData.
+    // 2) Resolve the path inside the sandbox (fake root) from ProcessData.
     let root_path = caller.data().root_path.clone();
-
-    // 3) Join relative path to fake root.
-    let joined_path = root_path.join(path_str.trim_start_matches('/'));
-    
-    // 4) Security check: ensure the path is inside the fake root.
-    // Canonicalize the root path
-    let canonical_root = match root_path.canonicalize() {
-        Ok(c) => c,
-        Err(e) => {
-            eprintln!("path_open: failed to canonicalize root path: {}", e);
-            return io_err_to_wasi_errno(&e);
+    let path = match resolve(&root_path, &root_path, path_str) {
+        Ok(path) => path,
+        Err(errno) => {
+            eprintln!("path_open: attempt to escape sandbox root!");
+            return errno;
         }
     };
-    
-    // If the path exists, canonicalize it for comparison
-    let canonical = if joined_path.exists() {
-        match joined_path.canonicalize() {
-            Ok(c) => c,
-            Err(e) => {
-                eprintln!("path_open: canonicalize error: {}", e);
-                return io_err_to_wasi_errno(&e);
-            }
-        }
-    } else {
-        // If the path doesn't exist, check its parent
-        let parent = joined_path.parent().unwrap_or(&joined_path);
-        if parent.exists() {
-            let parent_canonical = match parent.canonicalize() {
-                Ok(c) => c,
+
+    // 3) Let's assume that O_CREAT is indicated by bit 0x1.
+    let o_creat = (oflags & 1) != 0;
+    let is_readable = (oflags & 0x1) == 0; // O_RDONLY or O_RDWR
+    let _is_writable = (oflags & 0x2) != 0; // O_WRONLY or O_RDWR
+
+    // 4) Directories open with their listing as the FD's buffer, files with
+    //    their content if readable; a missing file is created if O_CREAT is set.
+    let sandbox_fs = caller.data().sandbox_fs.clone();
+    let stat = sandbox_fs.lock().unwrap().stat(&path);
+    let (is_dir, file_data) = match stat {
+        Ok(stat) if stat.is_dir => {
+            let names = match sandbox_fs.lock().unwrap().list_dir(&path) {
+                Ok(names) => names,
                 Err(e) => {
-                    eprintln!("path_open: failed to canonicalize parent: {}", e);
+                    eprintln!("path_open: read_dir error: {}", e);
                     return io_err_to_wasi_errno(&e);
                 }
             };
-            
-            // Check if parent is inside sandbox
-            if !parent_canonical.starts_with(&canonical_root) {
-                eprintln!("path_open: attempt to escape sandbox root!");
-                return 13;
-            }
-            
-            // Use the joined path for further operations
-            joined_path.clone()
-        } else {
-            // If even parent doesn't exist, do simple string check
-            let root_str = root_path.to_string_lossy().to_string();
-            let joined_str = joined_path.to_string_lossy().to_string();
-            
-            if !joined_str.starts_with(&root_str) {
-                eprintln!("path_open: attempt to escape sandbox root with non-existent path");
-                return 13;
+            let mut buf = Vec::new();
+            for name in names {
+                buf.extend_from_slice(name.as_bytes());
+                buf.push(b'\n');
             }
-            
-            joined_path.clone()
+            (true, buf)
         }
-    };
-    
-    // If we have a canonicalized path, check it
-    if canonical.exists() && !canonical.starts_with(&canonical_root) {
-        eprintln!("path_open: attempt to escape sandbox root!");
-        return 13;
-    }
-
-    // 5) Get metadata or create file if it does not exist and O_CREAT is set.
-    // Let's assume that O_CREAT is indicated by bit 0x1.
-    let o_creat = (oflags & 1) != 0;
-    let is_readable = (oflags & 0x1) == 0; // O_RDONLY or O_RDWR
-    let _is_writable = (oflags & 0x2) != 0; // O_WRONLY or O_RDWR
-
-    let (is_dir, file_data) = match fs::metadata(&canonical) {
-        Ok(md) => {
-            if md.is_dir() {
-                // It's a directory: read directory entries.
-                let mut buf = Vec::new();
-                match fs::read_dir(&canonical) {
-                    Ok(entries) => {
-                        for entry_res in entries {
-                            if let Ok(dirent) = entry_res {
-                                let name = dirent.file_name();
-                                let name_str = name.to_string_lossy().into_owned();
-                                buf.extend_from_slice(name_str.as_bytes());
-                                buf.push(b'\n');
-                            }
+        Ok(_) => {
+            // 5) It's a file: read file content if readable
+            let file_data = if is_readable {
+                let read = sandbox_fs.lock().unwrap().read_file(&path);
+                match read {
+                    Ok(data) => {
+                        debug!("DEBUG: file_data.len() = {}", data.len());
+                        debug!("DEBUG: host_path = {:?}", path);
+                        if data.len() > 1_000_000 {
+                            debug!("path_open: File is large => blocking to simulate I/O wait");
+                            block_process_for_fileio(&mut caller).await;
                         }
-                    }
+                        data
+                    },
                     Err(e) => {
-                        eprintln!("path_open: read_dir error: {}", e);
+                        eprintln!("path_open: Failed to read file: {}", e);
                         return io_err_to_wasi_errno(&e);
                     }
                 }
-                (true, buf)
             } else {
-                // It's a file: read file content if readable
-                let file_data = if is_readable {
-                    match fs::read(&canonical) {
-                        Ok(data) => {
-                            debug!("DEBUG: file_data.len() = {}", data.len());
-                            debug!("DEBUG: host_path = {:?}", canonical);
-                            if data.len() > 1_000_000 {
-                                debug!("path_open: File is large => blocking to simulate I/O wait");
-                                block_process_for_fileio(&mut caller);
-                            }
-                            data
-                        },
-                        Err(e) => {
-                            eprintln!("path_open: Failed to read file: {}", e);
-                            return io_err_to_wasi_errno(&e);
-                        }
-                    }
-                } else {
-                    Vec::new()
-                };
-                (false, file_data)
-            }
+                Vec::new()
+            };
+            (false, file_data)
         }
-        Err(e) => {
-            if o_creat {
-                // File doesn't exist, and O_CREAT is set: create it.
-                // First, check if creating this file would exceed disk quota
-                let metadata_size: u64 = 4096; // Default metadata size for a new file
-                if let Err(errno) = usage_add(&mut caller, metadata_size) {
-                    eprintln!("path_open: Creating file would exceed disk quota");
-                    return errno;
-                }
-                
-                match OpenOptions::new()
-                    .write(true)
-                    .create(true)
-                    .open(&canonical)
-                {
-                    Ok(_f) => {
-                        // File is now created (empty).
-                        let file_data = if is_readable {
-                            fs::read(&canonical).unwrap_or_default()
-                        } else {
-                            Vec::new()
-                        };
-                        (false, file_data)
-                    }
-                    Err(e) => {
-                        // Creation failed, so subtract the metadata size we added
-                        usage_sub(&mut caller, metadata_size);
-                        eprintln!("path_open: Failed to create file: {}", e);
-                        return io_err_to_wasi_errno(&e);
-                    }
+        Err(e) if e.kind() == io::ErrorKind::NotFound && o_creat => {
+            // File doesn't exist, and O_CREAT is set: create it.
+            // First, check if creating this file would exceed disk quota
+            let metadata_size: u64 = 4096; // Default metadata size for a new file
+            if let Err(errno) = usage_add(&mut caller, metadata_size) {
+                eprintln!("path_open: Creating file would exceed disk quota");
+                return errno;
+            }
+            let created = sandbox_fs.lock().unwrap().create_file(&path, metadata_size);
+            match created {
+                // File is now created (empty).
+                Ok(()) => (false, Vec::new()),
+                Err(e) => {
+                    // Creation failed, so subtract the metadata size we added
+                    usage_sub(&mut caller, metadata_size);
+                    eprintln!("path_open: Failed to create file: {}", e);
+                    return io_err_to_wasi_errno(&e);
                 }
-            } else {
-                eprintln!("path_open: metadata error: {}", e);
-                return io_err_to_wasi_errno(&e);
             }
         }
+        Err(e) => {
+            eprintln!("path_open: metadata error: {}", e);
+            return io_err_to_wasi_errno(&e);
+        }
     };
 
     // 6) Allocate a new FD and store the buffer.
@@ -704,7 +561,8 @@ pub fn wasi_path_open(
             read_ptr: 0,
             is_directory: is_dir,
             is_preopen: false,
-            host_path: Some(canonical.to_string_lossy().into_owned()),
+            host_path: Some(path.to_string_lossy().into_owned()),
+            writer: None,
         });
         fd
     };
@@ -804,7 +662,7 @@ pub fn wasi_fd_readdir(
 }
 
 
-pub fn wasi_fd_write(
+pub async fn wasi_fd_write(
     mut caller: wasmtime::Caller<'_, ProcessData>,
     fd: i32,
     iovs: i32,
@@ -812,8 +670,6 @@ pub fn wasi_fd_write(
     nwritten: i32,
 ) -> i32 {
     use std::cmp::min;
-    use std::convert::TryInto;
-    use std::io::Write;
     
     let memory = match caller.get_export("memory") {
         Some(wasmtime::Extern::Memory(mem)) => mem,
@@ -823,131 +679,74 @@ pub fn wasi_fd_write(
         }
     };
     
-    // Gather data to write.
-    let data_to_write = {
+    // Resolve the iovecs; the data is copied straight out of guest memory.
+    let iovecs = {
         let data = memory.data(&caller);
-        let mut buf = Vec::new();
-        for i in 0..iovs_len {
-            let iovec_addr = (iovs as usize) + (i as usize) * 8;
-            if iovec_addr + 8 > data.len() {
+        match guest_iovecs(data, iovs, iovs_len) {
+            Some(iovecs) => iovecs,
+            None => {
                 error!("fd_write: iovec out of bounds");
                 return 1;
             }
-            let offset_bytes: [u8; 4] = data[iovec_addr..iovec_addr + 4].try_into().unwrap();
-            let len_bytes: [u8; 4] = data[iovec_addr + 4..iovec_addr + 8].try_into().unwrap();
-            let offset = u32::from_le_bytes(offset_bytes) as usize;
-            let len = u32::from_le_bytes(len_bytes) as usize;
-            if offset + len > data.len() {
-                error!("fd_write: data slice out of bounds");
-                return 1;
-            }
-            buf.extend_from_slice(&data[offset..offset + len]);
         }
-        buf
     };
+    let total: usize = iovecs.iter().map(|iov| iov.len()).sum();
+    digest::fd_write(caller.data().id, fd, memory.data(&caller), &iovecs);
     
-    let total_written = if fd == 1 {
-        // Handle stdout.
-        io::stdout()
-            .write_all(&data_to_write)
-            .map(|_| data_to_write.len())
-            .map_err(|e| io_err_to_wasi_errno(&e))
-    } else if fd == 2 {
-        // Handle stderr.
-        io::stderr()
-            .write_all(&data_to_write)
-            .map(|_| data_to_write.len())
-            .map_err(|e| io_err_to_wasi_errno(&e))
+    let total_written = if fd == 1 || fd == 2 {
+        // Handle stdout and stderr.
+        let data = memory.data(&caller);
+        let result = if fd == 1 {
+            write_iovecs(&mut io::stdout().lock(), data, &iovecs)
+        } else {
+            write_iovecs(&mut io::stderr().lock(), data, &iovecs)
+        };
+        result.map(|_| total).map_err(|e| io_err_to_wasi_errno(&e))
     } else {
-        // For sandbox file writes, look up the host path.
-        let host_path_opt = {
+        // For sandbox file writes, find the FD's write buffer.
+        let writer_opt = {
             let pd = caller.data();
-            let table = pd.fd_table.lock().unwrap();
-            match table.entries.get(fd as usize) {
-                Some(Some(FDEntry::File { host_path, is_directory, .. })) if host_path.is_some() && !is_directory => {
-                    host_path.clone()
+            let mut table = pd.fd_table.lock().unwrap();
+            match table.get_fd_entry_mut(fd) {
+                Some(FDEntry::File { host_path: Some(host_path), is_directory: false, writer, .. }) => {
+                    let writer = writer.get_or_insert_with(|| Arc::new(Mutex::new(FileWriter::new(host_path.clone()))));
+                    Some(Arc::clone(writer))
                 }
                 _ => None,
             }
         };
     
-        if let Some(host_path) = host_path_opt {
+        if let Some(writer) = writer_opt {
             // Account for the total bytes.
-            if let Err(errno) = usage_add(&mut caller, data_to_write.len() as u64) {
+            // The file's own size grows as the buffer is flushed.
+            if let Err(errno) = usage_add(&mut caller, total as u64) {
                 return errno;
             }
-            let total = data_to_write.len();
-            let mut offset = 0;
-            while offset < total {
+            let max_write_buffer = caller.data().max_write_buffer;
+            let mut remaining = iovecs.into_iter().filter(|iov| !iov.is_empty());
+            let mut current = remaining.next();
+            while let Some(iov) = current.clone() {
                 // Check free capacity.
-                let available = {
-                    let write_buf = caller.data().write_buffer.lock().unwrap();
-                    caller.data().max_write_buffer.saturating_sub(write_buf.len())
-                };
-    
+                let available = max_write_buffer.saturating_sub(writer.lock().unwrap().pending_len());
                 if available == 0 {
                     // Buffer is full and there is still data to write.
-                    {
-                        let mut state = caller.data().state.lock().unwrap();
-                        *state = ProcessState::Blocked;
-                    }
-                    {
-                        let mut reason = caller.data().block_reason.lock().unwrap();
-                        // Save the host path in the block reason.
-                        *reason = Some(BlockReason::WriteIO(host_path.clone()));
-                    }
-                    caller.data().cond.notify_all();
-                    {
-                        let mut state = caller.data().state.lock().unwrap();
-                        while *state != ProcessState::Running {
-                            state = caller.data().cond.wait(state).unwrap();
-                        }
-                    }
+                    block_process_for_writeio(&mut caller, fd).await;
                     // Once unblocked (scheduler should flush), continue the loop.
                     continue;
-                } else {
-                    let chunk = min(available, total - offset);
-                    {
-                        let mut write_buf = caller.data().write_buffer.lock().unwrap();
-                        write_buf.extend_from_slice(&data_to_write[offset..offset + chunk]);
-                    }
-                    offset += chunk;
-                    // After appending, if the buffer is full:
-                    let current_size = { caller.data().write_buffer.lock().unwrap().len() };
-                    if current_size == caller.data().max_write_buffer {
-                        if offset < total {
-                            // Buffer full with more data pending: block.
-                            {
-                                let mut state = caller.data().state.lock().unwrap();
-                                *state = ProcessState::Blocked;
-                            }
-                            {
-                                let mut reason = caller.data().block_reason.lock().unwrap();
-                                *reason = Some(BlockReason::WriteIO(host_path.clone()));
-                            }
-                            caller.data().cond.notify_all();
-                            {
-                                let mut state = caller.data().state.lock().unwrap();
-                                while *state != ProcessState::Running {
-                                    state = caller.data().cond.wait(state).unwrap();
-                                }
-                            }
-                            continue;
-                        } else {
-                            // Buffer full but no data remains: flush immediately.
-                            if let Err(errno) = flush_write_buffer(&mut caller, &host_path) {
-                                return errno;
-                            }
-                        }
-                    }
-                }
-            }
-            // Flush any remaining data.
-            if !caller.data().write_buffer.lock().unwrap().is_empty() {
-                if let Err(errno) = flush_write_buffer(&mut caller, &host_path) {
-                    return errno;
                 }
+                let chunk = min(available, iov.len());
+                // Guest memory is re-resolved on every pass: it may have
+                // grown while the process was blocked.
+                let data = memory.data(&caller);
+                writer.lock().unwrap().push(&data[iov.start..iov.start + chunk]);
+                current = if chunk < iov.len() {
+                    Some(iov.start + chunk..iov.end)
+                } else {
+                    remaining.next()
+                };
             }
+            // The rest stays buffered until the buffer fills, the FD is
+            // closed or the process's slice ends.
             Ok(total)
         } else {
             error!("fd_write: unsupported fd: {}", fd);
@@ -975,60 +774,42 @@ pub fn wasi_fd_write(
 }
 
 
-/// Flush the process write buffer to the file at `host_path`.
-/// This writes out the entire buffer and then clears it.
-fn flush_write_buffer(
-    caller: &mut Caller<'_, ProcessData>,
-    host_path: &str,
-) -> Result<usize, i32> {
-    let mut buf = caller.data().write_buffer.lock().unwrap();
-    if buf.is_empty() {
-        return Ok(0);
-    }
-    match OpenOptions::new().append(true).open(host_path) {
-        Ok(mut file) => {
-            if let Err(e) = file.write_all(&buf) {
-                error!("flush_write_buffer: failed to write to file {}: {}", host_path, e);
-                return Err(io_err_to_wasi_errno(&e));
-            }
-            let bytes = buf.len();
-            buf.clear();
-            Ok(bytes)
-        }
-        Err(e) => {
-            error!("flush_write_buffer: failed to open file {}: {}", host_path, e);
-            Err(io_err_to_wasi_errno(&e))
-        }
+/// Writes the guest memory ranges in `iovecs` to `out` without gathering
+/// them into one buffer first.
+fn write_iovecs(out: &mut impl Write, mem: &[u8], iovecs: &[Range<usize>]) -> io::Result<()> {
+    for iov in iovecs {
+        out.write_all(&mem[iov.clone()])?;
     }
+    out.flush()
 }
 
-
-/// flush_write_buffer_for_scheduler flushes all data currently stored in
-/// the process's write buffer (data is stored in an Arc<Mutex<Vec<u8>>> within ProcessData)
-/// by appending it to the file at the given host_path. It then clears the buffer.
+/// Flushes the write buffer of `fd` for a process blocked in WriteIO.
 /// Returns the number of bytes flushed, or an errno on failure.
 pub fn flush_write_buffer_for_scheduler(
     data: &ProcessData,
-    host_path: &str,
+    fd: i32,
 ) -> Result<usize, i32> {
-    let mut buf = data.write_buffer.lock().unwrap();
-    if buf.is_empty() {
-        return Ok(0);
-    }
-    match OpenOptions::new().append(true).open(host_path) {
-        Ok(mut file) => {
-            if let Err(e) = file.write_all(&buf) {
-                error!("flush_write_buffer_for_scheduler: failed to write to file {}: {}", host_path, e);
-                return Err(io_err_to_wasi_errno(&e));
-            }
-            let bytes = buf.len();
-            buf.clear();
-            Ok(bytes)
-        }
-        Err(e) => {
-            error!("flush_write_buffer_for_scheduler: failed to open file {}: {}", host_path, e);
-            Err(io_err_to_wasi_errno(&e))
+    let writer = {
+        let mut table = data.fd_table.lock().unwrap();
+        match table.get_fd_entry_mut(fd) {
+            Some(FDEntry::File { writer: Some(writer), .. }) => Arc::clone(writer),
+            _ => return Ok(0),
         }
+    };
+    let mut writer = writer.lock().unwrap();
+    writer.flush(data.sandbox_fs.lock().unwrap().as_mut()).map_err(|e| {
+        error!("flush_write_buffer_for_scheduler: failed to write to file {}: {}", writer.host_path(), e);
+        io_err_to_wasi_errno(&e)
+    })
+}
+
+/// Flushes every file FD of a process. The scheduler calls this when a
+/// slice ends, so writes made during one slice reach the sandbox together;
+/// syscalls that look at sandbox files call it first so they see those writes.
+pub fn flush_file_writers(data: &ProcessData) {
+    let table = data.fd_table.lock().unwrap();
+    if let Err(e) = table.flush_writers(data.sandbox_fs.lock().unwrap().as_mut()) {
+        error!("Failed to flush file writes of process {}: {}", data.id, e);
     }
 }
 
@@ -1064,41 +845,19 @@ pub fn wasi_file_create(
 
     // Build the full path inside the sandbox.
     let root_path = caller.data().root_path.clone();
-    let joined_path = root_path.join(path_str.trim_start_matches('/'));
-
-    // Security check: ensure the parent directory is inside the sandbox.
-    let parent = joined_path.parent().unwrap_or(&joined_path);
-    let canonical_parent = match parent.canonicalize() {
-        Ok(c) => c,
-        Err(e) => {
-            error!("file_create: failed to canonicalize parent: {}", e);
-            return io_err_to_wasi_errno(&e);
-        }
-    };
-    let canonical_root = match root_path.canonicalize() {
-        Ok(c) => c,
-        Err(e) => {
-            error!("file_create: failed to canonicalize root: {}", e);
-            return io_err_to_wasi_errno(&e);
+    let joined_path = match resolve(&root_path, &root_path, path_str) {
+        Ok(path) => path,
+        Err(errno) => {
+            error!("file_create: attempt to escape sandbox root");
+            return errno;
         }
     };
-    if !canonical_parent.starts_with(&canonical_root) {
-        error!("file_create: attempt to escape sandbox root");
-        return 13;
-    }
 
-    // Create the new file; use create_new(true) to fail if the file exists.
-    match OpenOptions::new().write(true).create_new(true).open(&joined_path) {
-        Ok(_file) => {
-            // Retrieve metadata size (or use a fallback overhead, e.g. 4096 bytes).
-            let metadata_size = match fs::metadata(&joined_path) {
-                Ok(md) => md.len(),
-                Err(_) => 4096,
-            };
-            // Update disk usage with the metadata overhead.
-            if let Err(errno) = usage_add(&mut caller, metadata_size) {
-                return errno;
-            }
+    // Create the new file; fails if the file exists. It is empty, so
+    // nothing is charged until it is written.
+    let created = caller.data().sandbox_fs.lock().unwrap().create_file(&joined_path, 0);
+    match created {
+        Ok(()) => {
             // Allocate a new FD.
             let fd = {
                 let pd = caller.data();
@@ -1114,6 +873,7 @@ pub fn wasi_file_create(
                     is_directory: false,
                     is_preopen: false,
                     host_path: Some(joined_path.to_string_lossy().into_owned()),
+                    writer: None,
                 });
                 fd
             };
@@ -1,5 +1,8 @@
 use anyhow::Result;
-use wasmtime::Linker;
+use wasmtime::{Caller, Linker};
+use crate::runtime::config::{ExecutorKind, RuntimeConfig};
+use crate::runtime::executor;
+use crate::runtime::metrics;
 use crate::runtime::process::ProcessData;
 
 pub mod fd;
@@ -12,6 +15,41 @@ pub mod process;
 pub mod fd_ops;
 pub mod path_ops;
 
+/// Registers a hostcall that may block the process. `$func` is an `async fn`
+/// taking the Caller and the listed arguments: the pooled executor links it
+/// as an async host function, thread mode drives it on the guest thread.
+macro_rules! wrap_blocking {
+    ($linker:expr, $module:expr, $name:expr, $func:path, ($($arg:ident: $ty:ty),*)) => {
+        let latency = metrics::hostcall($name);
+        match (RuntimeConfig::get().executor, metrics::enabled()) {
+            (ExecutorKind::Pooled, timed) => {
+                $linker.func_wrap_async($module, $name, move |caller: Caller<'_, ProcessData>, ($($arg,)*): ($($ty,)*)| {
+                    // Blocking calls end most slices, so this keeps the fuel count current.
+                    if let Ok(remaining) = caller.get_fuel() {
+                        caller.data().fuel.update(remaining);
+                    }
+                    if timed {
+                        Box::new(metrics::timed(latency, $func(caller, $($arg),*)))
+                            as Box<dyn std::future::Future<Output = _> + Send + '_>
+                    } else {
+                        Box::new($func(caller, $($arg),*))
+                    }
+                })?;
+            }
+            (ExecutorKind::Threads, true) => {
+                $linker.func_wrap($module, $name, move |caller: Caller<'_, ProcessData>, $($arg: $ty),*| {
+                    executor::block_on(metrics::timed(latency, $func(caller, $($arg),*)))
+                })?;
+            }
+            (ExecutorKind::Threads, false) => {
+                $linker.func_wrap($module, $name, |caller: Caller<'_, ProcessData>, $($arg: $ty),*| {
+                    executor::block_on($func(caller, $($arg),*))
+                })?;
+            }
+        }
+    };
+}
+
 pub fn register(linker: &mut Linker<ProcessData>) -> Result<()> {
     // Arguments and Environment
     linker.func_wrap("wasi_snapshot_preview1", "args_get", args::wasi_args_get)?;
@@ -53,13 +91,15 @@ pub fn register(linker: &mut Linker<ProcessData>) -> Result<()> {
     // Existing registrations
     linker.func_wrap("wasi_snapshot_preview1", "fd_fdstat_get", fd::wasi_fd_fdstat_get)?;
     linker.func_wrap("wasi_snapshot_preview1", "fd_seek", fd::wasi_fd_seek)?;
-    linker.func_wrap("wasi_snapshot_preview1", "fd_read", fd::wasi_fd_read)?;
-    linker.func_wrap("wasi_snapshot_preview1", "poll_oneoff", fd::wasi_poll_oneoff)?;
+    wrap_blocking!(linker, "wasi_snapshot_preview1", "fd_read", fd::wasi_fd_read, (fd: i32, iovs: i32, iovs_len: i32, nread: i32));
+    wrap_blocking!(linker, "wasi_snapshot_preview1", "poll_oneoff", fd::wasi_poll_oneoff, (subs: i32, events: i32, nsubs: i32, nevents: i32));
     linker.func_wrap("wasi_snapshot_preview1", "proc_exit", fd::wasi_proc_exit)?;
 
-    linker.func_wrap("env","__builtin_rt_yield",builtin_yield::wasi__builtin_rt_yield)?;
+    wrap_blocking!(linker, "env", "__builtin_rt_yield", builtin_yield::wasi__builtin_rt_yield, ());
 
-    linker.func_wrap("wasi_snapshot_preview1", "path_open", fs::wasi_path_open)?;
+    wrap_blocking!(linker, "wasi_snapshot_preview1", "path_open", fs::wasi_path_open,
+        (dirfd: i32, dirflags: i32, path_ptr: i32, path_len: i32, oflags: i32,
+         rights_base: i64, rights_inheriting: i64, fdflags: i32, fd_out: i32));
     linker.func_wrap("wasi_snapshot_preview1", "fd_readdir", fs::wasi_fd_readdir)?;
     linker.func_wrap("wasi_snapshot_preview1", "fd_close", fs::wasi_fd_close)?;
     linker.func_wrap("wasi_snapshot_preview1", "fd_prestat_get", fd::wasi_fd_prestat_get)?;
@@ -68,18 +108,20 @@ pub fn register(linker: &mut Linker<ProcessData>) -> Result<()> {
     linker.func_wrap("wasi_snapshot_preview1", "path_remove_directory", fs::wasi_path_remove_directory)?;
     linker.func_wrap("wasi_snapshot_preview1", "path_unlink_file", fs::wasi_path_unlink_file)?;
     linker.func_wrap("wasi_snapshot_preview1", "path_symlink", fs::wasi_path_symlink)?;
-    linker.func_wrap("wasi_snapshot_preview1", "fd_write", fs::wasi_fd_write)?;
+    wrap_blocking!(linker, "wasi_snapshot_preview1", "fd_write", fs::wasi_fd_write, (fd: i32, iovs: i32, iovs_len: i32, nwritten: i32));
     linker.func_wrap("env", "file_create", fs::wasi_file_create)?;
 
     // Socket Operations
     linker.func_wrap("wasi_snapshot_preview1", "sock_open", net::wasi_sock_open)?;
-    linker.func_wrap("wasi_snapshot_preview1", "sock_connect", net::wasi_sock_connect)?;
-    linker.func_wrap("wasi_snapshot_preview1", "sock_listen", net::wasi_sock_listen)?;
-    linker.func_wrap("wasi_snapshot_preview1", "sock_accept", net::wasi_sock_accept)?;
-    linker.func_wrap("wasi_snapshot_preview1", "sock_recv", net::wasi_sock_recv)?;
-    linker.func_wrap("wasi_snapshot_preview1", "sock_send", net::wasi_sock_send)?;
-    linker.func_wrap("wasi_snapshot_preview1", "sock_shutdown", net::wasi_sock_shutdown)?;
-    linker.func_wrap("wasi_snapshot_preview1", "sock_close", net::wasi_sock_close)?;
+    wrap_blocking!(linker, "wasi_snapshot_preview1", "sock_connect", net::wasi_sock_connect, (fd: i32, addr: i32, addr_len: i32));
+    wrap_blocking!(linker, "wasi_snapshot_preview1", "sock_listen", net::wasi_sock_listen, (fd: i32, backlog: i32));
+    wrap_blocking!(linker, "wasi_snapshot_preview1", "sock_accept", net::wasi_sock_accept, (fd: i32, flags: i32, fd_out: i32));
+    wrap_blocking!(linker, "wasi_snapshot_preview1", "sock_recv", net::wasi_sock_recv,
+        (fd: u32, ri_data: u32, ri_data_len: u32, ri_flags: u32, ro_datalen: u32, ro_flags: u32));
+    wrap_blocking!(linker, "wasi_snapshot_preview1", "sock_send", net::wasi_sock_send,
+        (fd: i32, si_data: i32, si_data_len: i32, si_flags: i32, ret_data_len: i32));
+    wrap_blocking!(linker, "wasi_snapshot_preview1", "sock_shutdown", net::wasi_sock_shutdown, (fd: u32, how: u32));
+    wrap_blocking!(linker, "wasi_snapshot_preview1", "sock_close", net::wasi_sock_close, (fd: i32));
 
     Ok(())
 }
\ No newline at end of file
@@ -1,8 +1,14 @@
-use wasmtime::Caller;
+use std::sync::Arc;
+use wasmtime::{Caller, Memory};
+use crate::runtime::config::RuntimeConfig;
+use crate::runtime::fd_table::{FDEntry, PendingOp, RecvBuffer, SocketState};
+use crate::runtime::metrics::RUNTIME;
 use crate::runtime::process::{BlockReason, ProcessData, ProcessState};
 use consensus::commands::NetworkOperation;
 use anyhow::Result;
-use log::{info, error, debug};
+use log::{info, error, debug, trace};
+
+const WASI_ERRNO_PIPE: i32 = 64;  // __WASI_ERRNO_PIPE
 
 #[derive(Debug, Clone)]
 pub struct OutgoingNetworkMessage {
@@ -10,6 +16,27 @@ pub struct OutgoingNetworkMessage {
     pub operation: NetworkOperation,
 }
 
+/// Appends `message` to `queue`. A Send directly following a Send of the
+/// same process on the same socket, still under `limit` bytes, is merged
+/// into it so small writes cost one NetworkOut record. Returns the size of
+/// the Send the data ended up in, or 0 for other operations.
+pub fn queue_coalesced(queue: &mut Vec<OutgoingNetworkMessage>, message: OutgoingNetworkMessage, limit: usize) -> usize {
+    if let NetworkOperation::Send { src_port, data } = &message.operation {
+        let previous = queue.iter_mut().rev().find(|m| m.pid == message.pid);
+        if let Some(OutgoingNetworkMessage { operation: NetworkOperation::Send { src_port: port, data: pending }, .. }) = previous {
+            if port == src_port && pending.len() < limit {
+                pending.extend_from_slice(data);
+                return pending.len();
+            }
+        }
+        let len = data.len();
+        queue.push(message);
+        return len;
+    }
+    queue.push(message);
+    0
+}
+
 
 pub fn wasi_sock_open(
     mut caller: Caller<'_, ProcessData>,
@@ -54,12 +81,7 @@ pub fn wasi_sock_open(
             error!("wasi_sock_open: no free file descriptors available");
             return 76; // EMFILE
         }
-        table.entries[fd as usize] = Some(crate::runtime::fd_table::FDEntry::Socket {
-            local_port: src_port,
-            connected: false,
-            is_listener: false,  // New sockets start as non-listeners
-            buffer: Vec::new(),
-        });
+        table.entries[fd as usize] = Some(FDEntry::new_socket(src_port));
         info!("Created socket FD {} for process {}:{}", fd, pid, src_port);
     }
     
@@ -82,7 +104,18 @@ pub fn wasi_sock_open(
     0 // Success
 }
 
-pub fn wasi_sock_send(
+/// Whether consensus reported a failed operation on the socket at `fd`.
+fn socket_failed(process_data: &ProcessData, fd: i32) -> bool {
+    let table = process_data.fd_table.lock().unwrap();
+    matches!(table.entries.get(fd as usize), Some(Some(FDEntry::Socket { state, .. })) if state.has(SocketState::FAILED))
+}
+
+/// Queues data for a socket. Sends smaller than `send_coalesce_bytes`
+/// succeed as soon as they are queued, before consensus has written them,
+/// so a failure on the connection is reported by the next send on it
+/// (as `EPIPE`); a send that fills the coalescing limit waits for
+/// consensus and reports its own failure.
+pub async fn wasi_sock_send(
     mut caller: Caller<'_, ProcessData>,
     fd: i32,
     si_data: i32,
@@ -96,6 +129,8 @@ pub fn wasi_sock_send(
     let pid;
     let src_port;
     let data;
+    let len;
+    let must_block;
     
     // First get the memory data
     {
@@ -108,7 +143,8 @@ pub fn wasi_sock_send(
         };
         let mem = memory.data(&caller);
         data = mem[si_data as usize..(si_data + si_data_len) as usize].to_vec();
-        debug!("Read {} bytes from memory for send operation", data.len());
+        len = data.len();
+        debug!("Read {} bytes from memory for send operation", len);
     }
 
     // Then handle process data
@@ -119,31 +155,42 @@ pub fn wasi_sock_send(
         // Get socket FD entry
         src_port = {
             let table = process_data.fd_table.lock().unwrap();
-            if let Some(Some(crate::runtime::fd_table::FDEntry::Socket { local_port, .. })) = table.entries.get(fd as usize) {
-                *local_port
-            } else {
-                error!("Invalid socket FD {} for process {}", fd, pid);
-                return 1; // Invalid FD
+            match table.entries.get(fd as usize) {
+                Some(Some(FDEntry::Socket { state, .. })) if state.has(SocketState::FAILED) => {
+                    debug!("Send on failed socket FD {} of process {}", fd, pid);
+                    return WASI_ERRNO_PIPE;
+                }
+                Some(Some(FDEntry::Socket { local_port, .. })) => *local_port,
+                _ => {
+                    error!("Invalid socket FD {} for process {}", fd, pid);
+                    return 1; // Invalid FD
+                }
             }
         };
         
-        // Queue the send operation
-        let op = NetworkOperation::Send {
-            src_port,
-            data: data.clone(),
-        };
-        
-        process_data.network_queue.lock().unwrap().push(OutgoingNetworkMessage {
-            pid,
-            operation: op,
-        });
-        info!("Runtime queued send operation for process {}:{} ({} bytes) in {:?}", 
-             pid, src_port, data.len(), start_time.elapsed());
+        // Queue the send operation, joining the previous one on this socket
+        let op = NetworkOperation::Send { src_port, data };
+        let limit = RuntimeConfig::get().send_coalesce_bytes;
+        let queued = queue_coalesced(
+            &mut process_data.network_queue.lock().unwrap(),
+            OutgoingNetworkMessage { pid, operation: op },
+            limit,
+        );
+        RUNTIME.socket_sends.inc();
+        must_block = queued >= limit;
+        trace!("Runtime queued send operation for process {}:{} ({} bytes, {} pending) in {:?}",
+             pid, src_port, len, queued, start_time.elapsed());
     }
     
-    // Block until consensus processes this
-    debug!("Blocking process {} for network operation", pid);
-    block_process_for_network(&mut caller);
+    // Only a full Send waits for consensus; smaller ones let the guest keep
+    // writing into it
+    if must_block {
+        debug!("Blocking process {} for network operation", pid);
+        block_process_for_network(&mut caller).await;
+        if socket_failed(caller.data(), fd) {
+            return WASI_ERRNO_PIPE;
+        }
+    }
 
     // Write the number of bytes sent back to memory
     {
@@ -155,14 +202,14 @@ pub fn wasi_sock_send(
             }
         };
         let mem_mut = memory.data_mut(&mut caller);
-        let ret_data_len_bytes = (data.len() as u32).to_le_bytes();
+        let ret_data_len_bytes = (len as u32).to_le_bytes();
         mem_mut[ret_data_len as usize..(ret_data_len + 4) as usize].copy_from_slice(&ret_data_len_bytes);
-        debug!("Wrote return value {} to memory at offset {}", data.len(), ret_data_len);
+        debug!("Wrote return value {} to memory at offset {}", len, ret_data_len);
     }
     0
 }
 
-pub fn wasi_sock_close(
+pub async fn wasi_sock_close(
     mut caller: Caller<'_, ProcessData>,
     fd: i32,
 ) -> i32 {
@@ -173,7 +220,7 @@ pub fn wasi_sock_close(
     // Get socket FD entry and deallocate it
     let src_port = {
         let mut table = process_data.fd_table.lock().unwrap();
-        if let Some(Some(crate::runtime::fd_table::FDEntry::Socket { local_port, .. })) = table.entries.get(fd as usize) {
+        if let Some(Some(FDEntry::Socket { local_port, .. })) = table.entries.get(fd as usize) {
             let port = *local_port;
             // Deallocate the FD immediately
             table.deallocate_fd(fd);
@@ -197,13 +244,13 @@ pub fn wasi_sock_close(
     
     // Block until consensus processes this
     debug!("Blocking process {} for network operation", pid);
-    block_process_for_network(&mut caller);
+    block_process_for_network(&mut caller).await;
     
     // Return success since we've already deallocated the FD
     0
 }
 
-pub fn wasi_sock_listen(
+pub async fn wasi_sock_listen(
     mut caller: Caller<'_, ProcessData>,
     fd: i32,
     backlog: i32,
@@ -218,9 +265,10 @@ pub fn wasi_sock_listen(
         pid = process_data.id;
         debug!("Processing listen request for process {}", pid);
         let mut table = process_data.fd_table.lock().unwrap();
-        if let Some(Some(crate::runtime::fd_table::FDEntry::Socket { local_port, is_listener, .. })) = table.entries.get_mut(fd as usize) {
+        if let Some(Some(FDEntry::Socket { local_port, state, .. })) = table.entries.get_mut(fd as usize) {
             src_port = *local_port;
-            *is_listener = true;
+            state.set(SocketState::LISTENER, true);
+            state.pending = PendingOp::Listen;
             debug!("Found socket FD {} for process {}:{} and marked as listener", fd, pid, src_port);
         } else {
             error!("Invalid socket FD {} for process {}", fd, pid);
@@ -245,26 +293,22 @@ pub fn wasi_sock_listen(
     
     // Block until consensus processes this
     debug!("Blocking process {} for network operation", pid);
-    block_process_for_network(&mut caller);
+    block_process_for_network(&mut caller).await;
 
-    // Check if the listen operation succeeded by verifying the NAT mapping exists
+    // Check if the listen operation succeeded by verifying consensus bound the port
     let listen_succeeded = {
-        let process_data = caller.data();
         debug!("Checking if listen operation succeeded for process {}:{}", pid, src_port);
-        process_data.nat_table.lock().unwrap().has_port_mapping(pid, src_port)
+        let mut table = caller.data().fd_table.lock().unwrap();
+        match table.entries.get_mut(fd as usize) {
+            Some(Some(FDEntry::Socket { state, .. })) => {
+                state.pending = PendingOp::None;
+                state.has(SocketState::MAPPED)
+            }
+            _ => false,
+        }
     };
 
     if listen_succeeded {
-        // Mark the socket as a listener
-        {
-            let process_data = caller.data();
-            debug!("Marking socket {} as listener for process {}:{}", fd, pid, src_port);
-            let mut table = process_data.fd_table.lock().unwrap();
-            if let Some(Some(crate::runtime::fd_table::FDEntry::Socket { is_listener, .. })) = table.entries.get_mut(fd as usize) {
-                *is_listener = true;
-                debug!("Socket {} marked as listener", fd);
-            }
-        }
         info!("Listen operation succeeded for process {}:{}", pid, src_port);
         0 // Success
     } else {
@@ -273,7 +317,7 @@ pub fn wasi_sock_listen(
     }
 }
 
-pub fn wasi_sock_accept(
+pub async fn wasi_sock_accept(
     mut caller: Caller<'_, ProcessData>,
     fd: i32,
     flags: i32,
@@ -283,26 +327,19 @@ pub fn wasi_sock_accept(
     let pid;
     let src_port;
     
-    // Get socket FD entry
-    {
+    // Get socket FD entry and preallocate FD and port for the accepted connection
+    let (new_fd, new_port) = {
         let process_data = caller.data();
         pid = process_data.id;
         debug!("Processing accept request for process {}", pid);
-        let table = process_data.fd_table.lock().unwrap();
-        if let Some(Some(crate::runtime::fd_table::FDEntry::Socket { local_port, .. })) = table.entries.get(fd as usize) {
+        let mut table = process_data.fd_table.lock().unwrap();
+        if let Some(Some(FDEntry::Socket { local_port, .. })) = table.entries.get(fd as usize) {
             src_port = *local_port;
             debug!("Found socket FD {} for process {}:{}", fd, pid, src_port);
         } else {
             error!("Invalid socket FD {} for process {}", fd, pid);
             return 1; // Invalid FD
         }
-    }
-    
-    // Preallocate FD and port for the accepted connection
-    let (new_fd, new_port) = {
-        let process_data = caller.data();
-        debug!("Preallocating resources for accepted connection");
-        let mut table = process_data.fd_table.lock().unwrap();
         let new_fd = table.allocate_fd();
         if new_fd < 0 {
             error!("No free file descriptors available for accepted connection");
@@ -314,12 +351,11 @@ pub fn wasi_sock_accept(
             *port
         };
         debug!("Allocated new FD {} and port {} for accepted connection", new_fd, new_port);
-        table.entries[new_fd as usize] = Some(crate::runtime::fd_table::FDEntry::Socket {
-            local_port: new_port,
-            connected: false,  // Start as not connected, will be set to true when connection is established
-            is_listener: false,  // Accepted connections are never listeners
-            buffer: Vec::new(),
-        });
+        // Not connected until consensus reports the accept
+        table.entries[new_fd as usize] = Some(FDEntry::new_socket(new_port));
+        if let Some(Some(FDEntry::Socket { state, .. })) = table.entries.get_mut(fd as usize) {
+            state.pending = PendingOp::Accept;
+        }
         (new_fd, new_port)
     };
     
@@ -341,25 +377,27 @@ pub fn wasi_sock_accept(
     
     // Block until consensus processes this
     debug!("Blocking process {} for network operation", pid);
-    block_process_for_network(&mut caller);
+    block_process_for_network(&mut caller).await;
     
-    // Check if we got a connection
+    // Check if we got a connection, releasing the preallocated FD and port if not
     let has_connection = {
         let process_data = caller.data();
         debug!("Checking if connection was established for process {}:{}", pid, new_port);
-        let nat_table = process_data.nat_table.lock().unwrap();
-        let fd_table = process_data.fd_table.lock().unwrap();
-        
-        // Check both NAT table and FD table
-        let nat_connected = nat_table.has_connection(pid, new_port);
-        let fd_connected = if let Some(Some(crate::runtime::fd_table::FDEntry::Socket { connected, .. })) = fd_table.entries.get(new_fd as usize) {
-            *connected
-        } else {
-            false
-        };
-        
-        debug!("Connection status - NAT: {}, FD: {}", nat_connected, fd_connected);
-        nat_connected || fd_connected
+        let mut table = process_data.fd_table.lock().unwrap();
+        if let Some(Some(FDEntry::Socket { state, .. })) = table.entries.get_mut(fd as usize) {
+            state.pending = PendingOp::None;
+        }
+        let connected = matches!(
+            table.entries.get(new_fd as usize),
+            Some(Some(FDEntry::Socket { state, .. })) if state.has(SocketState::CONNECTED)
+        );
+        if !connected {
+            debug!("Reverting resource allocation for failed accept");
+            table.entries[new_fd as usize] = None;  // Free the FD
+            let mut port = process_data.next_port.lock().unwrap();
+            *port -= 1;  // Revert the port counter
+        }
+        connected
     };
 
     if has_connection {
@@ -380,42 +418,15 @@ pub fn wasi_sock_accept(
         mem_mut[out_ptr..out_ptr+4].copy_from_slice(&(new_fd as u32).to_le_bytes());
         debug!("Wrote new FD {} to memory at offset {}", new_fd, out_ptr);
 
-        // Mark the socket as connected
-        {
-            let process_data = caller.data();
-            debug!("Marking socket {} as connected for process {}:{}", new_fd, pid, new_port);
-            let mut table = process_data.fd_table.lock().unwrap();
-            if let Some(Some(crate::runtime::fd_table::FDEntry::Socket { connected, .. })) = table.entries.get_mut(new_fd as usize) {
-                *connected = true;
-                debug!("Socket {} marked as connected", new_fd);
-            }
-        }
-
-        // Clear the pending accept
-        {
-            let process_data = caller.data();
-            debug!("Clearing pending accept for process {}:{}", pid, src_port);
-            process_data.nat_table.lock().unwrap().clear_waiting_accept(pid, src_port);
-        }
-
         info!("Created new socket FD {} for accepted connection on process {}:{} -> {}", new_fd, pid, src_port, new_port);
         0 // Success
     } else {
-        // Revert the port allocation and FD
-        {
-            let process_data = caller.data();
-            debug!("Reverting resource allocation for failed accept");
-            let mut table = process_data.fd_table.lock().unwrap();
-            table.entries[new_fd as usize] = None;  // Free the FD
-            let mut port = process_data.next_port.lock().unwrap();
-            *port -= 1;  // Revert the port counter
-        }
         debug!("No connection available yet for process {}:{}, will retry", pid, src_port);
         11 // EAGAIN - Resource temporarily unavailable
     }
 }
 
-pub fn wasi_sock_recv(
+pub async fn wasi_sock_recv(
     mut caller: Caller<'_, ProcessData>,
     fd: u32,
     ri_data_ptr: u32,
@@ -427,91 +438,67 @@ pub fn wasi_sock_recv(
     let start_time = std::time::Instant::now();
     debug!("wasi_sock_recv: fd={}, ri_data_ptr={}, ri_data_len={}, ri_flags={}, ro_datalen_ptr={}, ro_flags_ptr={}", 
         fd, ri_data_ptr, ri_data_len, ri_flags, ro_datalen_ptr, ro_flags_ptr);
-    let pid;
-    let src_port;
-    let mut data = Vec::new();
-    let mut has_data = false;
-    {
-        let process_data = caller.data();
-        pid = process_data.id;
-        let mut table = process_data.fd_table.lock().unwrap();
-        if let Some(Some(crate::runtime::fd_table::FDEntry::Socket { local_port, buffer, .. })) = table.entries.get_mut(fd as usize) {
-            src_port = *local_port;
-            if !buffer.is_empty() {
-                // Only take what we need from the buffer
-                let to_take = buffer.len().min(ri_data_len as usize);
-                data = buffer.drain(..to_take).collect::<Vec<u8>>();
-                has_data = true;
-                info!("Runtime read {} bytes from buffer for process {}:{} in {:?}", 
-                     to_take, pid, src_port, start_time.elapsed());
-            }
+    // Get the memory to write data to
+    let memory = match caller.get_export("memory") {
+        Some(wasmtime::Extern::Memory(mem)) => mem,
+        _ => {
+            error!("sock_recv: no memory export found");
+            return 1; // EINVAL
+        }
+    };
+    let pid = caller.data().id;
+    let src_port = {
+        let table = caller.data().fd_table.lock().unwrap();
+        if let Some(Some(FDEntry::Socket { local_port, .. })) = table.entries.get(fd as usize) {
+            *local_port
         } else {
             error!("Invalid socket FD {} for process {}", fd, pid);
             return 1; // EINVAL
         }
-    }
+    };
+    let out_ptr = ri_data_ptr as usize;
+    let max_len = ri_data_len as usize;
 
-    if !has_data {
-        // Queue a Recv operation and block until data is available
-        debug!("No data available for socket {}:{}, queuing Recv operation and blocking", pid, src_port);
-        {
-            let process_data = caller.data();
-            let op = NetworkOperation::Recv { src_port };
-            process_data.network_queue.lock().unwrap().push(OutgoingNetworkMessage {
-                pid,
-                operation: op,
-            });
-            // Set waiting state for recv
-            process_data.nat_table.lock().unwrap().set_waiting_recv(pid, src_port);
-            info!("Runtime queued recv operation for process {}:{} in {:?}", 
-                 pid, src_port, start_time.elapsed());
+    let data_len = match recv_into_guest(&mut caller, &memory, fd, out_ptr, max_len, true) {
+        Err(errno) => return errno,
+        Ok(Some(n)) => {
+            debug!("Runtime read {} bytes from buffer for process {}:{} in {:?}", 
+                 n, pid, src_port, start_time.elapsed());
+            n
         }
-        debug!("Blocking process {} for network recv operation", pid);
-        block_process_for_network(&mut caller);
-        
-        // After waking up, check buffer again
-        let mut data2 = Vec::new();
-        let mut has_data2 = false;
-        {
-            let process_data = caller.data();
-            let mut table = process_data.fd_table.lock().unwrap();
-            if let Some(Some(crate::runtime::fd_table::FDEntry::Socket { buffer, .. })) = table.entries.get_mut(fd as usize) {
-                if !buffer.is_empty() {
-                    let to_take = buffer.len().min(ri_data_len as usize);
-                    data2 = buffer.drain(..to_take).collect::<Vec<u8>>();
-                    has_data2 = true;
-                    info!("Runtime received {} bytes after blocking for process {}:{} in {:?}", 
-                         to_take, pid, src_port, start_time.elapsed());
-                }
+        Ok(None) => {
+            // Queue a Recv operation and block until data is available
+            debug!("No data available for socket {}:{}, queuing Recv operation and blocking", pid, src_port);
+            {
+                let process_data = caller.data();
+                let op = NetworkOperation::Recv { src_port };
+                process_data.network_queue.lock().unwrap().push(OutgoingNetworkMessage {
+                    pid,
+                    operation: op,
+                });
+                debug!("Runtime queued recv operation for process {}:{} in {:?}", 
+                     pid, src_port, start_time.elapsed());
             }
-        }
-        
-        if !has_data2 {
-            debug!("No data available for socket {}:{} after blocking, returning EAGAIN", pid, src_port);
-            return 11; // EAGAIN
-        }
-        data = data2;
-    }
+            debug!("Blocking process {} for network recv operation", pid);
+            block_process_for_network(&mut caller).await;
 
-    // Get the memory to write data to
-    let memory = match caller.get_export("memory") {
-        Some(wasmtime::Extern::Memory(mem)) => mem,
-        _ => {
-            error!("sock_recv: no memory export found");
-            return 1; // EINVAL
+            // After waking up, check buffer again
+            match recv_into_guest(&mut caller, &memory, fd, out_ptr, max_len, false) {
+                Err(errno) => return errno,
+                Ok(Some(n)) => {
+                    debug!("Runtime received {} bytes after blocking for process {}:{} in {:?}", 
+                         n, pid, src_port, start_time.elapsed());
+                    n
+                }
+                Ok(None) => {
+                    debug!("No data available for socket {}:{} after blocking, returning EAGAIN", pid, src_port);
+                    return 11; // EAGAIN
+                }
+            }
         }
     };
     let mem_mut = memory.data_mut(&mut caller);
 
-    // Write data to memory
-    let data_len = data.len().min(ri_data_len as usize);
-    let out_ptr = ri_data_ptr as usize;
-    if out_ptr + data_len > mem_mut.len() {
-        error!("sock_recv: data pointer out of bounds");
-        return 1; // EINVAL
-    }
-    mem_mut[out_ptr..out_ptr + data_len].copy_from_slice(&data[..data_len]);
-
     // Write data length back to memory
     let len_ptr = ro_datalen_ptr as usize;
     if len_ptr + 4 > mem_mut.len() {
@@ -528,17 +515,47 @@ pub fn wasi_sock_recv(
     }
     mem_mut[flags_ptr..flags_ptr + 4].copy_from_slice(&0u32.to_le_bytes());
 
-    // Clear the waiting state since we successfully read data
-    {
-        let process_data = caller.data();
-        process_data.nat_table.lock().unwrap().clear_waiting_recv(pid, src_port);
-    }
-
-    info!("Read {} bytes from socket {}:{}", data_len, pid, src_port);
+    debug!("Read {} bytes from socket {}:{}", data_len, pid, src_port);
     0 // Success
 }
 
-pub fn wasi_sock_shutdown(
+/// Copies up to `max_len` buffered bytes of socket `fd` straight from its
+/// receive buffer into guest memory at `out_ptr`. Returns `None` when
+/// nothing is buffered, after marking a recv pending if `wait_if_empty`,
+/// so the check and the mark happen under one lock.
+fn recv_into_guest(
+    caller: &mut Caller<'_, ProcessData>,
+    memory: &Memory,
+    fd: u32,
+    out_ptr: usize,
+    max_len: usize,
+    wait_if_empty: bool,
+) -> Result<Option<usize>, i32> {
+    let fd_table = Arc::clone(&caller.data().fd_table);
+    let mut table = fd_table.lock().unwrap();
+    let (state, buffer): (&mut SocketState, &mut RecvBuffer) = match table.entries.get_mut(fd as usize) {
+        Some(Some(FDEntry::Socket { state, buffer, .. })) => (state, buffer),
+        _ => return Ok(None),
+    };
+    if buffer.is_empty() {
+        if wait_if_empty {
+            state.pending = PendingOp::Recv;
+        }
+        return Ok(None);
+    }
+    state.pending = PendingOp::None;
+    let n = buffer.len().min(max_len);
+    let mem_mut = memory.data_mut(&mut *caller);
+    if out_ptr + n > mem_mut.len() {
+        error!("sock_recv: data pointer out of bounds");
+        return Err(1); // EINVAL
+    }
+    mem_mut[out_ptr..out_ptr + n].copy_from_slice(&buffer.as_slice()[..n]);
+    buffer.consume(n);
+    Ok(Some(n))
+}
+
+pub async fn wasi_sock_shutdown(
     mut caller: Caller<'_, ProcessData>,
     fd: u32,
     how: u32,
@@ -552,7 +569,7 @@ pub fn wasi_sock_shutdown(
         let process_data = caller.data();
         pid = process_data.id;
         let table = process_data.fd_table.lock().unwrap();
-        if let Some(Some(crate::runtime::fd_table::FDEntry::Socket { local_port, .. })) = table.entries.get(fd as usize) {
+        if let Some(Some(FDEntry::Socket { local_port, .. })) = table.entries.get(fd as usize) {
             src_port = *local_port;
         } else {
             error!("Invalid socket FD {} for process {}", fd, pid);
@@ -576,12 +593,12 @@ pub fn wasi_sock_shutdown(
     
     // Block until consensus processes this
     debug!("Blocking process {} for network operation", pid);
-    block_process_for_network(&mut caller);
+    block_process_for_network(&mut caller).await;
     
     Ok(0)
 }
 
-pub fn wasi_sock_connect(
+pub async fn wasi_sock_connect(
     mut caller: Caller<'_, ProcessData>,
     fd: i32,
     addr: i32,
@@ -640,7 +657,7 @@ pub fn wasi_sock_connect(
         // Get socket FD entry
         src_port = {
             let table = process_data.fd_table.lock().unwrap();
-            if let Some(Some(crate::runtime::fd_table::FDEntry::Socket { local_port, .. })) = table.entries.get(fd as usize) {
+            if let Some(Some(FDEntry::Socket { local_port, .. })) = table.entries.get(fd as usize) {
                 *local_port
             } else {
                 error!("Invalid socket FD {} for process {}", fd, pid);
@@ -664,11 +681,11 @@ pub fn wasi_sock_connect(
     
     // Block until consensus processes this
     debug!("Blocking process {} for network operation", pid);
-    block_process_for_network(&mut caller);
+    block_process_for_network(&mut caller).await;
     0 // Success
 }
 
-fn block_process_for_network(caller: &mut Caller<'_, ProcessData>) {
+async fn block_process_for_network(caller: &mut Caller<'_, ProcessData>) {
     {
         let mut state = caller.data().state.lock().unwrap();
         if *state == ProcessState::Running {
@@ -680,10 +697,7 @@ fn block_process_for_network(caller: &mut Caller<'_, ProcessData>) {
         caller.data().cond.notify_all();
     }
 
-    let mut state = caller.data().state.lock().unwrap();
-    while *state != ProcessState::Running {
-        debug!("Process waiting for network operation to complete");
-        state = caller.data().cond.wait(state).unwrap();
-    }
+    debug!("Process waiting for network operation to complete");
+    caller.data().resumed().await;
     debug!("Process resumed after network operation");
 }
@@ -2,9 +2,10 @@ use anyhow::Result;
 use wasmtime::Caller;
 use crate::runtime::process::ProcessData;
 use crate::runtime::fd_table::FDEntry;
+use crate::runtime::sandbox_fs::resolve;
+use crate::wasi_syscalls::fs::flush_file_writers;
 use log::info;
-use std::fs;
-use std::os::unix::fs::MetadataExt;
+use std::path::Path;
 
 pub fn wasi_path_filestat_get(
     mut caller: Caller<ProcessData>,
@@ -15,6 +16,7 @@ pub fn wasi_path_filestat_get(
     buf_ptr: u32,
 ) -> anyhow::Result<u32> {
     info!("wasi_path_filestat_get: fd={}, path_ptr={}, path_len={}, buf_ptr={}", fd, path_ptr, path_len, buf_ptr);
+    flush_file_writers(caller.data());
     // Get the base directory from fd
     let dir_path = {
         let process_data = caller.data();
@@ -39,21 +41,23 @@ pub fn wasi_path_filestat_get(
         Ok(s) => s,
         Err(_) => return Ok(28), // WASI_EILSEQ (invalid unicode)
     };
-    let full_path = std::path::Path::new(&dir_path).join(rel_path.trim_start_matches('/'));
-    let meta = match fs::metadata(&full_path) {
-        Ok(m) => m,
+    let root_path = caller.data().root_path.clone();
+    let full_path = match resolve(&root_path, Path::new(&dir_path), rel_path) {
+        Ok(path) => path,
+        Err(errno) => return Ok(errno as u32),
+    };
+    let stat = match caller.data().sandbox_fs.lock().unwrap().stat(&full_path) {
+        Ok(stat) => stat,
         Err(_) => return Ok(2), // WASI_ENOENT
     };
-    let filetype = if meta.is_dir() { 3u8 } else { 4u8 }; // 3=directory, 4=regular file
+    let filetype = if stat.is_dir { 3u8 } else { 4u8 }; // 3=directory, 4=regular file
+    // Device and timestamps stay 0, as in fd_filestat_get: host values
+    // would differ between replicas.
     let mut buf = [0u8; 56];
-    buf[0..8].copy_from_slice(&meta.dev().to_le_bytes());
-    buf[8..16].copy_from_slice(&meta.ino().to_le_bytes());
+    buf[8..16].copy_from_slice(&stat.ino.to_le_bytes());
     buf[16] = filetype;
-    buf[20..24].copy_from_slice(&(meta.nlink() as u32).to_le_bytes());
-    buf[24..32].copy_from_slice(&meta.size().to_le_bytes());
-    buf[32..40].copy_from_slice(&meta.atime().to_le_bytes());
-    buf[40..48].copy_from_slice(&meta.mtime().to_le_bytes());
-    buf[48..56].copy_from_slice(&meta.ctime().to_le_bytes());
+    buf[20..24].copy_from_slice(&1u32.to_le_bytes());
+    buf[24..32].copy_from_slice(&stat.len.to_le_bytes());
     let mem_mut = memory.data_mut(&mut caller);
     let ptr = buf_ptr as usize;
     if ptr + 56 > mem_mut.len() {
@@ -0,0 +1,38 @@
+// bench_sink.c
+// Workload guest for `consensus workload`: reads stdin until it has seen the
+// number of bytes given as its first argument, appending every chunk to
+// sink.out so each message costs one fd_read and one fd_write, then exits.
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+int main(int argc, char **argv) {
+    long expected = argc > 1 ? atol(argv[1]) : 0;
+    int out = open("sink.out", O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (out < 0) {
+        perror("bench_sink: open");
+        return 1;
+    }
+
+    char buffer[65536];
+    long total = 0;
+    while (total < expected) {
+        ssize_t n = read(0, buffer, sizeof(buffer));
+        if (n < 0) {
+            perror("bench_sink: read");
+            return 1;
+        }
+        if (n == 0) {
+            continue;
+        }
+        if (write(out, buffer, n) != n) {
+            perror("bench_sink: write");
+            return 1;
+        }
+        total += n;
+    }
+    close(out);
+    printf("bench_sink: received %ld bytes\n", total);
+    return 0;
+}
@@ -2,11 +2,80 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <strings.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <errno.h>
 
+// Built with -DKV_NATIVE (see `make native`), the same server runs on host
+// BSD sockets on port KV_PORT, as a baseline for the WASM build.
+#ifdef KV_NATIVE
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define KV_PORT 7002
+
+static int sock_open(int domain, int socktype, int protocol, int* sock_fd_out) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return errno;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    *sock_fd_out = fd;
+    return 0;
+}
+
+static int sock_listen(int sock_fd, int backlog) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(KV_PORT);
+    if (bind(sock_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) return errno;
+    if (listen(sock_fd, backlog) < 0) return errno;
+    return 0;
+}
+
+static int sock_accept(int sock_fd, int flags, int* sock_fd_out) {
+    int fd = accept(sock_fd, NULL, NULL);
+    if (fd < 0) return errno;
+    *sock_fd_out = fd;
+    return 0;
+}
+
+static int sock_recv(int sock_fd, void* ri_data, int ri_data_len, int ri_flags, int* ro_datalen, int* ro_flags) {
+    ssize_t n = recv(sock_fd, ri_data, ri_data_len, 0);
+    if (n < 0) return errno;
+    *ro_datalen = (int)n;
+    if (ro_flags) *ro_flags = 0;
+    return 0;
+}
+
+static int sock_send(int sock_fd, const void* si_data, int si_data_len, int si_flags, int* ret_data_len) {
+    int sent = 0;
+    while (sent < si_data_len) {
+        ssize_t n = send(sock_fd, (const char*)si_data + sent, si_data_len - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        sent += (int)n;
+    }
+    *ret_data_len = sent;
+    return 0;
+}
+
+static int sock_shutdown(int sock_fd, int how) {
+    return shutdown(sock_fd, SHUT_WR) < 0 ? errno : 0;
+}
+
+static int sock_close(int sock_fd) {
+    return close(sock_fd) < 0 ? errno : 0;
+}
+#else
+#define KV_PORT 7000  // mapped by the runtime's NAT
+
 // WASI socket functions
 __attribute__((import_module("wasi_snapshot_preview1")))
 __attribute__((import_name("sock_open")))
@@ -35,358 +104,447 @@ int sock_shutdown(int sock_fd, int how);
 __attribute__((import_module("wasi_snapshot_preview1")))
 __attribute__((import_name("sock_close")))
 int sock_close(int sock_fd);
+#endif
+
+#define IN_BUF_SIZE (64 * 1024)   // longest request line, and most read per recv
+#define OUT_BUF_SIZE (64 * 1024)  // responses are sent once this fills or the input is parsed
+#define ARENA_BLOCK (256 * 1024)
+#define INITIAL_SLOTS 1024
+#define COMPACT_MIN_RECORDS 1024  // log records before compaction is considered
+
+// Open-addressing hash table with linear probing. Keys and values live
+// together in an arena: `data` holds the key, then `cap` bytes for the value.
+typedef struct {
+    uint32_t hash;   // 0 = empty, 1 = deleted, else the key's hash
+    uint32_t klen;
+    uint32_t vlen;
+    uint32_t cap;
+    char* data;
+} Slot;
+
+#define SLOT_EMPTY 0
+#define SLOT_DELETED 1
+
+typedef struct Block {
+    struct Block* next;
+    size_t used;
+    size_t size;
+    char bytes[];
+} Block;
 
-#define BUF_SIZE 4096
-#define MAX_KEY 128
-#define MAX_VAL 1024
-#define MAX_CMD_SIZE 1024
-#define KV_DIR "/tmp/"
-
-// Simple in-memory key-value store (fixed size)
-#define MAX_ENTRIES 100
-char keys[MAX_ENTRIES][MAX_KEY];
-char values[MAX_ENTRIES][MAX_VAL];
-int num_entries = 0;
-
-// Helper function to trim whitespace and newlines from the end of a string
-void trim_end(char *str) {
-    int len = strlen(str);
-    while (len > 0 && (str[len-1] == ' ' || str[len-1] == '\n' || str[len-1] == '\r')) {
-        str[len-1] = '\0';
-        len--;
+static Slot* slots;
+static uint32_t num_slots;      // always a power of two
+static uint32_t num_entries;
+static uint32_t num_deleted;
+static Block* arena;
+static size_t arena_live;       // bytes held by live entries
+static size_t arena_used;       // bytes handed out, live or not
+
+// Append log; NULL without --persist
+static FILE* log_file;
+static const char* log_path;
+static uint32_t log_records;
+
+static uint32_t hash_key(const char* key, uint32_t len) {
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
     }
+    return h < 2 ? h + 2 : h;
 }
 
-// In-memory implementation
-int set_key(const char* key, const char* value) {
-    printf("[SERVER] Setting key '%s' to value '%s'\n", key, value);
-    fflush(stdout);
-    
-    // Check if key already exists
-    for (int i = 0; i < num_entries; i++) {
-        if (strcmp(keys[i], key) == 0) {
-            // Update existing value
-            strncpy(values[i], value, MAX_VAL-1);
-            values[i][MAX_VAL-1] = '\0';
-            printf("[SERVER] Updated existing key '%s'\n", key);
-            fflush(stdout);
-            return 0;
-        }
+static char* arena_alloc(size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (arena == NULL || arena->size - arena->used < size) {
+        size_t block_size = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        Block* block = malloc(sizeof(Block) + block_size);
+        if (block == NULL) return NULL;
+        block->next = arena;
+        block->used = 0;
+        block->size = block_size;
+        arena = block;
     }
-    
-    // Add new key if space available
-    if (num_entries < MAX_ENTRIES) {
-        strncpy(keys[num_entries], key, MAX_KEY-1);
-        keys[num_entries][MAX_KEY-1] = '\0';
-        
-        strncpy(values[num_entries], value, MAX_VAL-1);
-        values[num_entries][MAX_VAL-1] = '\0';
-        
-        num_entries++;
-        printf("[SERVER] Added new key '%s', total entries: %d\n", key, num_entries);
-        fflush(stdout);
-        return 0;
+    char* p = arena->bytes + arena->used;
+    arena->used += size;
+    arena_used += size;
+    return p;
+}
+
+static void arena_free_all(Block* block) {
+    while (block != NULL) {
+        Block* next = block->next;
+        free(block);
+        block = next;
     }
-    
-    printf("[SERVER] No space for new key (limit: %d entries)\n", MAX_ENTRIES);
-    fflush(stdout);
-    return -1;
 }
 
-int get_key(const char* key, char* value_out, int maxlen) {
-    printf("[SERVER] Getting value for key '%s'\n", key);
-    fflush(stdout);
-    
-    for (int i = 0; i < num_entries; i++) {
-        if (strcmp(keys[i], key) == 0) {
-            strncpy(value_out, values[i], maxlen-1);
-            value_out[maxlen-1] = '\0';
-            printf("[SERVER] Found key '%s', value: '%s'\n", key, value_out);
-            fflush(stdout);
-            return 0;
+// Slot holding `key`, or the slot to insert it into (a deleted one if seen).
+static Slot* find_slot(const char* key, uint32_t klen, uint32_t hash) {
+    uint32_t mask = num_slots - 1;
+    Slot* reuse = NULL;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        Slot* slot = &slots[i];
+        if (slot->hash == SLOT_EMPTY) return reuse ? reuse : slot;
+        if (slot->hash == SLOT_DELETED) {
+            if (reuse == NULL) reuse = slot;
+        } else if (slot->hash == hash && slot->klen == klen && memcmp(slot->data, key, klen) == 0) {
+            return slot;
         }
     }
-    
-    printf("[SERVER] Key '%s' not found\n", key);
-    fflush(stdout);
-    return -1;
 }
 
-int del_key(const char* key) {
-    printf("[SERVER] Deleting key '%s'\n", key);
-    fflush(stdout);
-    
-    for (int i = 0; i < num_entries; i++) {
-        if (strcmp(keys[i], key) == 0) {
-            // Move last entry to this position (if not the last one)
-            if (i < num_entries - 1) {
-                strcpy(keys[i], keys[num_entries-1]);
-                strcpy(values[i], values[num_entries-1]);
-            }
-            num_entries--;
-            printf("[SERVER] Deleted key '%s', remaining entries: %d\n", key, num_entries);
-            fflush(stdout);
-            return 0;
+// Rebuilds the table with `new_slots` slots, copying live entries into a
+// fresh arena so space of overwritten and deleted values is reclaimed.
+static int rebuild(uint32_t new_slots) {
+    Slot* old_slots = slots;
+    uint32_t old_count = num_slots;
+    Block* old_arena = arena;
+
+    Slot* fresh = calloc(new_slots, sizeof(Slot));
+    if (fresh == NULL) return -1;
+    slots = fresh;
+    num_slots = new_slots;
+    num_deleted = 0;
+    arena = NULL;
+    arena_used = 0;
+    for (uint32_t i = 0; i < old_count; i++) {
+        Slot* old = &old_slots[i];
+        if (old->hash < 2) continue;
+        Slot* slot = find_slot(old->data, old->klen, old->hash);
+        char* data = arena_alloc(old->klen + old->vlen);
+        if (data == NULL) {
+            // Keep the old table rather than lose entries
+            arena_free_all(arena);
+            free(fresh);
+            slots = old_slots;
+            num_slots = old_count;
+            arena = old_arena;
+            return -1;
         }
+        memcpy(data, old->data, old->klen + old->vlen);
+        *slot = *old;
+        slot->data = data;
+        slot->cap = old->vlen;
     }
-    
-    printf("[SERVER] Key '%s' not found for deletion\n", key);
-    fflush(stdout);
-    return -1;
+    arena_live = arena_used;
+    free(old_slots);
+    arena_free_all(old_arena);
+    return 0;
 }
 
-void handle_client(int client_fd) {
-    char cmd_buf[MAX_CMD_SIZE];
-    int bytes_received;
-    int bytes_sent;
-    int ret;
-    
-    printf("[SERVER] New client connection on fd %d\n", client_fd);
-    fflush(stdout);
-    
-    // Receive command - character by character until we hit a newline
-    int total_received = 0;
-    while (total_received < MAX_CMD_SIZE - 1) {
-        ret = sock_recv(client_fd, cmd_buf + total_received, 1, 0, &bytes_received, NULL);
-        if (ret != 0 || bytes_received == 0) {
-            printf("[SERVER] Failed to receive command or client disconnected (ret=%d, bytes=%d)\n", ret, bytes_received);
-            fflush(stdout);
-            sock_close(client_fd);
-            return;
-        }
-        
-        total_received += bytes_received;
-        
-        // Stop at newline
-        if (cmd_buf[total_received - 1] == '\n' || total_received >= MAX_CMD_SIZE - 1) {
-            break;
-        }
+static int kv_init(void) {
+    slots = calloc(INITIAL_SLOTS, sizeof(Slot));
+    if (slots == NULL) return -1;
+    num_slots = INITIAL_SLOTS;
+    return 0;
+}
+
+static int set_key(const char* key, uint32_t klen, const char* value, uint32_t vlen) {
+    // Keep live plus deleted slots under 70% so probes stay short
+    if ((num_entries + num_deleted + 1) * 10 > num_slots * 7) {
+        uint32_t target = (num_entries + 1) * 10 > num_slots * 5 ? num_slots * 2 : num_slots;
+        if (rebuild(target) != 0) return -1;
     }
-    
-    // Null terminate the command
-    cmd_buf[total_received] = '\0';
-    printf("[SERVER] Received command (%d bytes): %s", total_received, cmd_buf);
-    fflush(stdout);
+    uint32_t hash = hash_key(key, klen);
+    Slot* slot = find_slot(key, klen, hash);
+    if (slot->hash >= 2 && vlen <= slot->cap) {
+        memcpy(slot->data + klen, value, vlen);
+        arena_live += vlen;
+        arena_live -= slot->vlen;
+        slot->vlen = vlen;
+        return 0;
+    }
+    char* data = arena_alloc(klen + vlen);
+    if (data == NULL) return -1;
+    memcpy(data, key, klen);
+    memcpy(data + klen, value, vlen);
+    if (slot->hash >= 2) {
+        arena_live -= slot->klen + slot->cap;
+    } else {
+        if (slot->hash == SLOT_DELETED) num_deleted--;
+        num_entries++;
+    }
+    slot->hash = hash;
+    slot->klen = klen;
+    slot->vlen = vlen;
+    slot->cap = vlen;
+    slot->data = data;
+    arena_live += klen + vlen;
+    // Repack once most of the arena is dead space
+    if (arena_used > ARENA_BLOCK && arena_live * 2 < arena_used) {
+        rebuild(num_slots);
+    }
+    return 0;
+}
 
-    // Process the command using strtok like image_server
-    char* cmd = strtok(cmd_buf, " ");
-    if (cmd == NULL) {
-        printf("[SERVER] Invalid command format - no command found\n");
-        fflush(stdout);
-        sock_close(client_fd);
+static Slot* get_key(const char* key, uint32_t klen) {
+    Slot* slot = find_slot(key, klen, hash_key(key, klen));
+    return slot->hash >= 2 ? slot : NULL;
+}
+
+static int del_key(const char* key, uint32_t klen) {
+    Slot* slot = get_key(key, klen);
+    if (slot == NULL) return -1;
+    arena_live -= slot->klen + slot->cap;
+    slot->hash = SLOT_DELETED;
+    num_entries--;
+    num_deleted++;
+    return 0;
+}
+
+// Rewrites the log as one SET per live key, then switches to the new file.
+static void compact_log(void) {
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", log_path);
+    FILE* tmp = fopen(tmp_path, "w");
+    if (tmp == NULL) {
+        printf("[SERVER] Could not write %s for compaction (errno=%d)\n", tmp_path, errno);
         return;
     }
+    for (uint32_t i = 0; i < num_slots; i++) {
+        Slot* slot = &slots[i];
+        if (slot->hash < 2) continue;
+        fprintf(tmp, "SET %.*s %.*s\n", (int)slot->klen, slot->data, (int)slot->vlen, slot->data + slot->klen);
+    }
+    fclose(tmp);
+    fclose(log_file);
+    if (rename(tmp_path, log_path) != 0) {
+        printf("[SERVER] Could not replace %s (errno=%d)\n", log_path, errno);
+    } else {
+        log_records = num_entries;
+    }
+    log_file = fopen(log_path, "a");
+    printf("[SERVER] Compacted log to %u records\n", log_records);
+    fflush(stdout);
+}
 
-    if (strcasecmp(cmd, "SET") == 0) {
-        char* key = strtok(NULL, " ");
-        if (key == NULL) {
-            printf("[SERVER] Missing key for SET command\n");
-            fflush(stdout);
-            const char* response = "ERR: Missing key\n";
-            sock_send(client_fd, response, strlen(response), 0, &bytes_sent);
-            sock_shutdown(client_fd, 1);
-            sock_close(client_fd);
-            return;
-        }
-        
-        char* value = strtok(NULL, "\n");
-        if (value == NULL) {
-            printf("[SERVER] Missing value for SET command\n");
-            fflush(stdout);
-            const char* response = "ERR: Missing value\n";
-            sock_send(client_fd, response, strlen(response), 0, &bytes_sent);
-            sock_shutdown(client_fd, 1);
-            sock_close(client_fd);
-            return;
-        }
-        
-        // Trim whitespace
-        trim_end(key);
-        // Skip leading whitespace in value
-        while (*value == ' ') value++;
-        trim_end(value);
-        
-        printf("[SERVER] Processing SET request for key: '%s' value: '%s'\n", key, value);
-        fflush(stdout);
-        
-        int result = set_key(key, value);
-        
-        if (result == 0) {
-            const char* response = "OK\n";
-            ret = sock_send(client_fd, response, strlen(response), 0, &bytes_sent);
-            if (ret != 0 || bytes_sent != strlen(response)) {
-                printf("[SERVER] Failed to send response (ret=%d, bytes=%d)\n", ret, bytes_sent);
-                fflush(stdout);
-            }
-        } else {
-            const char* response = "ERR 1\n";
-            ret = sock_send(client_fd, response, strlen(response), 0, &bytes_sent);
-            if (ret != 0 || bytes_sent != strlen(response)) {
-                printf("[SERVER] Failed to send response (ret=%d, bytes=%d)\n", ret, bytes_sent);
-                fflush(stdout);
-            }
-        }
-    } 
-    else if (strcasecmp(cmd, "GET") == 0) {
-        char* key = strtok(NULL, "\n");
-        if (key == NULL) {
-            printf("[SERVER] Missing key for GET command\n");
-            fflush(stdout);
-            const char* response = "ERR: Missing key\n";
-            sock_send(client_fd, response, strlen(response), 0, &bytes_sent);
-            sock_shutdown(client_fd, 1);
-            sock_close(client_fd);
-            return;
-        }
-        
-        trim_end(key);
-        char value[MAX_VAL];
-        
-        printf("[SERVER] Processing GET request for key: '%s'\n", key);
-        fflush(stdout);
-        
-        if (get_key(key, value, MAX_VAL) == 0) {
-            char response[MAX_VAL + 8];
-            snprintf(response, sizeof(response), "VALUE %s\n", value);
-            ret = sock_send(client_fd, response, strlen(response), 0, &bytes_sent);
-            if (ret != 0 || bytes_sent != strlen(response)) {
-                printf("[SERVER] Failed to send response (ret=%d, bytes=%d)\n", ret, bytes_sent);
-                fflush(stdout);
-            }
-        } else {
-            const char* response = "ERR: Key not found\n";
-            ret = sock_send(client_fd, response, strlen(response), 0, &bytes_sent);
-            if (ret != 0 || bytes_sent != strlen(response)) {
-                printf("[SERVER] Failed to send response (ret=%d, bytes=%d)\n", ret, bytes_sent);
-                fflush(stdout);
-            }
-        }
-    } 
-    else if (strcasecmp(cmd, "DEL") == 0) {
-        char* key = strtok(NULL, "\n");
-        if (key == NULL) {
-            printf("[SERVER] Missing key for DEL command\n");
+static void log_write(const char* line, size_t len) {
+    if (log_file == NULL) return;
+    fwrite(line, 1, len, log_file);
+    fputc('\n', log_file);
+    log_records++;
+}
+
+// Writes the records logged for one recv and compacts once the log holds
+// more than twice as many records as there are keys.
+static void log_flush(void) {
+    if (log_file == NULL) return;
+    fflush(log_file);
+    if (log_records > COMPACT_MIN_RECORDS && log_records > 2 * num_entries) {
+        compact_log();
+    }
+}
+
+// Pending responses of one connection.
+typedef struct {
+    int fd;
+    size_t len;
+    char buf[OUT_BUF_SIZE];
+} Output;
+
+static int out_flush(Output* out) {
+    size_t off = 0;
+    while (off < out->len) {
+        int sent = 0;
+        int ret = sock_send(out->fd, out->buf + off, (int)(out->len - off), 0, &sent);
+        if (ret != 0 || sent <= 0) {
+            printf("[SERVER] Failed to send response (ret=%d, bytes=%d)\n", ret, sent);
             fflush(stdout);
-            const char* response = "ERR: Missing key\n";
-            sock_send(client_fd, response, strlen(response), 0, &bytes_sent);
-            sock_shutdown(client_fd, 1);
-            sock_close(client_fd);
-            return;
+            return -1;
         }
-        
-        trim_end(key);
-        
-        printf("[SERVER] Processing DEL request for key: '%s'\n", key);
-        fflush(stdout);
-        
-        if (del_key(key) == 0) {
-            const char* response = "OK\n";
-            ret = sock_send(client_fd, response, strlen(response), 0, &bytes_sent);
-            if (ret != 0 || bytes_sent != strlen(response)) {
-                printf("[SERVER] Failed to send response (ret=%d, bytes=%d)\n", ret, bytes_sent);
-                fflush(stdout);
-            }
-        } else {
-            const char* response = "ERR: Failed to delete\n";
-            ret = sock_send(client_fd, response, strlen(response), 0, &bytes_sent);
-            if (ret != 0 || bytes_sent != strlen(response)) {
-                printf("[SERVER] Failed to send response (ret=%d, bytes=%d)\n", ret, bytes_sent);
-                fflush(stdout);
-            }
+        off += sent;
+    }
+    out->len = 0;
+    return 0;
+}
+
+static int out_put(Output* out, const char* data, size_t len) {
+    while (len > 0) {
+        if (out->len == OUT_BUF_SIZE && out_flush(out) != 0) return -1;
+        size_t n = OUT_BUF_SIZE - out->len;
+        if (n > len) n = len;
+        memcpy(out->buf + out->len, data, n);
+        out->len += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int out_str(Output* out, const char* s) {
+    return out_put(out, s, strlen(s));
+}
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Splits off the next space-separated word of [*p, end).
+static const char* next_word(const char** p, const char* end, uint32_t* len) {
+    const char* s = *p;
+    while (s < end && is_space(*s)) s++;
+    const char* e = s;
+    while (e < end && !is_space(*e)) e++;
+    *p = e;
+    *len = (uint32_t)(e - s);
+    return s;
+}
+
+enum { KEEP_OPEN, CLOSE };
+
+// Runs one request line (without its newline). `out` is NULL while the log
+// is replayed at startup.
+static int execute(const char* line, size_t len, Output* out) {
+    const char* end = line + len;
+    while (end > line && is_space(end[-1])) end--;
+    const char* p = line;
+    uint32_t cmd_len, klen;
+    const char* cmd = next_word(&p, end, &cmd_len);
+    if (cmd_len == 0) return KEEP_OPEN;
+    const char* key = next_word(&p, end, &klen);
+
+    if (cmd_len == 3 && strncasecmp(cmd, "SET", 3) == 0) {
+        if (klen == 0) return out ? out_str(out, "ERR: Missing key\n") : KEEP_OPEN;
+        while (p < end && is_space(*p)) p++;
+        if (p == end) return out ? out_str(out, "ERR: Missing value\n") : KEEP_OPEN;
+        if (set_key(key, klen, p, (uint32_t)(end - p)) != 0) {
+            return out ? out_str(out, "ERR: Out of memory\n") : KEEP_OPEN;
         }
-    } 
-    else if (strcasecmp(cmd, "QUIT") == 0) {
-        const char* response = "BYE\n";
-        ret = sock_send(client_fd, response, strlen(response), 0, &bytes_sent);
-        if (ret != 0 || bytes_sent != strlen(response)) {
-            printf("[SERVER] Failed to send response (ret=%d, bytes=%d)\n", ret, bytes_sent);
-            fflush(stdout);
+        if (out == NULL) return KEEP_OPEN;
+        log_write(line, end - line);
+        return out_str(out, "OK\n");
+    }
+    if (cmd_len == 3 && strncasecmp(cmd, "GET", 3) == 0) {
+        if (out == NULL) return KEEP_OPEN;
+        if (klen == 0) return out_str(out, "ERR: Missing key\n");
+        Slot* slot = get_key(key, klen);
+        if (slot == NULL) return out_str(out, "ERR: Key not found\n");
+        if (out_str(out, "VALUE ") != 0 || out_put(out, slot->data + slot->klen, slot->vlen) != 0) return -1;
+        return out_str(out, "\n");
+    }
+    if (cmd_len == 3 && strncasecmp(cmd, "DEL", 3) == 0) {
+        if (klen == 0) return out ? out_str(out, "ERR: Missing key\n") : KEEP_OPEN;
+        if (del_key(key, klen) != 0) return out ? out_str(out, "ERR: Failed to delete\n") : KEEP_OPEN;
+        if (out == NULL) return KEEP_OPEN;
+        log_write(line, end - line);
+        return out_str(out, "OK\n");
+    }
+    if (out == NULL) return KEEP_OPEN;
+    if (cmd_len == 4 && strncasecmp(cmd, "QUIT", 4) == 0) {
+        out_str(out, "BYE\n");
+        return CLOSE;
+    }
+    return out_str(out, "ERR: Unknown command\n");
+}
+
+// Restores the table from the log at `path`, then appends to it.
+static void persist_open(const char* path) {
+    log_path = path;
+    FILE* in = fopen(path, "r");
+    if (in != NULL) {
+        char* line = NULL;
+        size_t cap = 0;
+        ssize_t n;
+        while ((n = getline(&line, &cap, in)) > 0) {
+            if (line[n - 1] == '\n') n--;
+            execute(line, n, NULL);
+            log_records++;
         }
-    } 
-    else {
-        printf("[SERVER] Unknown command: %s\n", cmd);
+        free(line);
+        fclose(in);
+        printf("[SERVER] Restored %u keys from %u log records in %s\n", num_entries, log_records, path);
         fflush(stdout);
-        const char* response = "ERR: Unknown command\n";
-        ret = sock_send(client_fd, response, strlen(response), 0, &bytes_sent);
-        if (ret != 0 || bytes_sent != strlen(response)) {
-            printf("[SERVER] Failed to send response (ret=%d, bytes=%d)\n", ret, bytes_sent);
-            fflush(stdout);
-        }
     }
-    
-    // Always properly shutdown and close client connection after sending response
-    printf("[SERVER] Shutting down and closing client connection (fd=%d)\n", client_fd);
-    fflush(stdout);
-    
-    ret = sock_shutdown(client_fd, 1);  // SHUT_WR
-    if (ret != 0) {
-        printf("[SERVER] Failed to shutdown socket write side (ret=%d)\n", ret);
+    log_file = fopen(path, "a");
+    if (log_file == NULL) {
+        printf("[SERVER] WARNING: Could not open log %s (errno=%d), not persisting\n", path, errno);
         fflush(stdout);
     }
-    
-    ret = sock_close(client_fd);
-    if (ret != 0) {
-        printf("[SERVER] Failed to close socket (ret=%d)\n", ret);
-        fflush(stdout);
+}
+
+// Serves requests on one connection until the client closes it or sends
+// QUIT. Every complete line received is run, so a client may pipeline many
+// commands; their responses go out together.
+static void handle_client(int client_fd) {
+    static char in[IN_BUF_SIZE];
+    static Output out;
+    size_t have = 0;
+    int state = KEEP_OPEN;
+    out.fd = client_fd;
+    out.len = 0;
+
+    while (state == KEEP_OPEN) {
+        int received = 0;
+        int flags = 0;
+        int ret = sock_recv(client_fd, in + have, (int)(IN_BUF_SIZE - have), 0, &received, &flags);
+        // A single zero byte is how the runtime reports that the peer closed
+        if (ret != 0 || received <= 0 || (received == 1 && in[have] == '\0')) break;
+        have += received;
+
+        char* start = in;
+        char* end = in + have;
+        char* nl;
+        while (state == KEEP_OPEN && (nl = memchr(start, '\n', end - start)) != NULL) {
+            state = execute(start, nl - start, &out);
+            start = nl + 1;
+        }
+        if (state < 0) break;
+        have = end - start;
+        if (have == IN_BUF_SIZE) {
+            out_str(&out, "ERR: Line too long\n");
+            state = CLOSE;
+        } else if (have > 0 && start != in) {
+            memmove(in, start, have);
+        }
+        // Persist before acknowledging
+        log_flush();
+        if (out_flush(&out) != 0) break;
     }
+
+    sock_shutdown(client_fd, 1);  // SHUT_WR
+    sock_close(client_fd);
 }
 
-int main() {
+int main(int argc, char** argv) {
     int server_fd, client_fd, ret;
-    
-    printf("[SERVER] Starting KV server (in-memory version)...\n");
-    fflush(stdout);
-    
-    // Initialize with some test data
-    set_key("test1", "value1");
-    set_key("test2", "value2");
-    printf("[SERVER] Initialized with %d test entries\n", num_entries);
+
+    if (kv_init() != 0) {
+        printf("[SERVER] Out of memory\n");
+        return 1;
+    }
+    // Arguments may or may not include the program name
+    for (int i = 0; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--persist") == 0) {
+            persist_open(argv[i + 1]);
+        }
+    }
+    printf("[SERVER] Starting KV server (%s)...\n", log_file ? "persistent" : "in-memory");
     fflush(stdout);
-    
-    // Create a test file in /tmp to ensure file operations work
-    char test_filename[256];
-    snprintf(test_filename, sizeof(test_filename), "%s/kv_test.txt", KV_DIR);
-    FILE* test_file = fopen(test_filename, "w");
-    if (test_file == NULL) {
-        printf("[SERVER] WARNING: Could not create test file at %s (errno=%d)\n", 
-               test_filename, errno);
-        fflush(stdout);
-    } else {
-        fprintf(test_file, "KV Server Test\n");
-        fclose(test_file);
-        printf("[SERVER] Successfully created test file at %s\n", test_filename);
-        fflush(stdout);
+
+    if (num_entries == 0) {
+        set_key("test1", 5, "value1", 6);
+        set_key("test2", 5, "value2", 6);
     }
-    
+
     ret = sock_open(2, 1, 0, &server_fd); // AF_INET=2, SOCK_STREAM=1
     if (ret != 0) {
         printf("[SERVER] Failed to open socket (ret=%d)\n", ret);
         return 1;
     }
-    printf("[SERVER] Server socket opened with fd: %d\n", server_fd);
-    fflush(stdout);
-    
     ret = sock_listen(server_fd, 5);
     if (ret != 0) {
         printf("[SERVER] Failed to listen on socket (ret=%d)\n", ret);
         return 1;
     }
-    printf("[SERVER] KV server listening on port 7000\n");
+    printf("[SERVER] KV server listening on port %d with %u keys\n", KV_PORT, num_entries);
     fflush(stdout);
-    
+
     while (1) {
         ret = sock_accept(server_fd, 0, &client_fd);
         if (ret != 0) {
-            printf("[SERVER] Failed to accept connection (error: %d)\n", ret);
             continue;
         }
-        printf("[SERVER] Accepted connection with client fd: %d\n", client_fd);
-        fflush(stdout);
-        
         handle_client(client_fd);
-        
-        printf("[SERVER] Client connection handled, ready for next connection\n");
-        fflush(stdout);
     }
     return 0;
-} 
\ No newline at end of file
+}